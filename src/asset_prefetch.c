@@ -0,0 +1,502 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Asset Prefetch
+ *
+ * Copyright (c) 2023, Hannes Winkler <hanneswinkler2000@web.de>
+ */
+
+#define _GNU_SOURCE
+#include "asset_prefetch.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "filesystem_layout.h"
+#include "util/collection.h"
+#include "util/logging.h"
+
+static int prefetch_file(int dirfd, const char *path, bool wait) {
+    struct stat s;
+    int ok, fd;
+
+    fd = openat(dirfd, path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return errno;
+    }
+
+    ok = fstat(fd, &s);
+    if (ok < 0) {
+        ok = errno;
+        goto fail_close;
+    }
+
+    if (wait) {
+        // This initiates readahead of the whole file into the page cache. The kernel may return
+        // before all of it is read, but it usually submits the I/O synchronously, which
+        // POSIX_FADV_WILLNEED doesn't. We run on a worker thread anyway.
+        ok = readahead(fd, 0, s.st_size);
+        if (ok < 0) {
+            ok = errno;
+            goto fail_close;
+        }
+    } else {
+        ok = posix_fadvise(fd, 0, s.st_size, POSIX_FADV_WILLNEED);
+        if (ok != 0) {
+            goto fail_close;
+        }
+    }
+
+    close(fd);
+    return 0;
+
+fail_close:
+    close(fd);
+    return ok;
+}
+
+static void prefetch_manifest(const char *app_bundle_path) {
+    char *manifest_path, *line;
+    size_t line_capacity;
+    ssize_t length;
+    FILE *manifest;
+    int ok, n_files, bundle_fd;
+
+    ok = asprintf(&manifest_path, "%s/%s", app_bundle_path, ASSET_PREFETCH_MANIFEST_NAME);
+    if (ok < 0) {
+        return;
+    }
+
+    manifest = fopen(manifest_path, "re");
+    if (manifest == NULL) {
+        // No manifest recorded yet.
+        free(manifest_path);
+        return;
+    }
+
+    // relative paths in the manifest are relative to the app bundle.
+    bundle_fd = open(app_bundle_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (bundle_fd < 0) {
+        fclose(manifest);
+        free(manifest_path);
+        return;
+    }
+
+    line = NULL;
+    line_capacity = 0;
+    n_files = 0;
+    while ((length = getline(&line, &line_capacity, manifest)) > 0) {
+        if (line[length - 1] == '\n') {
+            line[length - 1] = '\0';
+        }
+
+        if (line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+
+        // The engine only loads the assets once the app requests them,
+        // so just queue the reads instead of waiting for them.
+        // The manifest lists them in the order they were first opened, so the
+        // reads are queued in the order they're going to be needed.
+        ok = prefetch_file(bundle_fd, line, false);
+        if (ok == 0) {
+            n_files++;
+        }
+    }
+
+    LOG_DEBUG("Prefetched %d files listed in \"%s\".\n", n_files, manifest_path);
+
+    free(line);
+    close(bundle_fd);
+    fclose(manifest);
+    free(manifest_path);
+}
+
+int asset_prefetch_run(const struct flutter_paths *paths, enum flutter_runtime_mode runtime_mode) {
+    const char *snapshot_path;
+    int ok;
+
+    // The snapshot is what the engine needs first, and it's by far the biggest file.
+    snapshot_path = FLUTTER_RUNTIME_MODE_IS_AOT(runtime_mode) ? paths->app_elf_path : paths->kernel_blob_path;
+
+    ok = prefetch_file(AT_FDCWD, snapshot_path, true);
+    if (ok != 0) {
+        LOG_DEBUG("Couldn't prefetch \"%s\". %s\n", snapshot_path, strerror(ok));
+        return ok;
+    }
+
+    ok = prefetch_file(AT_FDCWD, paths->icudtl_path, true);
+    if (ok != 0) {
+        LOG_DEBUG("Couldn't prefetch \"%s\". %s\n", paths->icudtl_path, strerror(ok));
+        return ok;
+    }
+
+    prefetch_manifest(paths->app_bundle_path);
+
+    return 0;
+}
+
+struct watched_dir {
+    int wd;
+    char *path;
+};
+
+struct asset_access_recorder {
+    int inotify_fd;
+    char *app_bundle_path;
+    char *icudtl_path;
+
+    size_t n_dirs, dirs_capacity;
+    struct watched_dir *dirs;
+
+    size_t n_files, files_capacity;
+    char **files;
+};
+
+static int watch_dir(struct asset_access_recorder *recorder, const char *path) {
+    struct watched_dir *dirs;
+    char *path_duped;
+    int wd;
+
+    wd = inotify_add_watch(recorder->inotify_fd, path, IN_OPEN | IN_ONLYDIR);
+    if (wd < 0) {
+        return errno;
+    }
+
+    // inotify returns the same watch descriptor if the directory is already watched.
+    for (size_t i = 0; i < recorder->n_dirs; i++) {
+        if (recorder->dirs[i].wd == wd) {
+            return 0;
+        }
+    }
+
+    if (recorder->n_dirs == recorder->dirs_capacity) {
+        dirs = realloc(recorder->dirs, (recorder->dirs_capacity ? recorder->dirs_capacity * 2 : 16) * sizeof *dirs);
+        if (dirs == NULL) {
+            goto fail_rm_watch;
+        }
+
+        recorder->dirs = dirs;
+        recorder->dirs_capacity = recorder->dirs_capacity ? recorder->dirs_capacity * 2 : 16;
+    }
+
+    path_duped = strdup(path);
+    if (path_duped == NULL) {
+        goto fail_rm_watch;
+    }
+
+    recorder->dirs[recorder->n_dirs].wd = wd;
+    recorder->dirs[recorder->n_dirs].path = path_duped;
+    recorder->n_dirs++;
+    return 0;
+
+fail_rm_watch:
+    inotify_rm_watch(recorder->inotify_fd, wd);
+    return ENOMEM;
+}
+
+static int watch_dir_recursive(struct asset_access_recorder *recorder, const char *path) {
+    struct dirent *entry;
+    struct stat s;
+    char *subpath;
+    DIR *dir;
+    int ok;
+
+    ok = watch_dir(recorder, path);
+    if (ok != 0) {
+        return ok;
+    }
+
+    dir = opendir(path);
+    if (dir == NULL) {
+        return errno;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (streq(entry->d_name, ".") || streq(entry->d_name, "..")) {
+            continue;
+        }
+
+        ok = asprintf(&subpath, "%s/%s", path, entry->d_name);
+        if (ok < 0) {
+            ok = ENOMEM;
+            goto fail_close_dir;
+        }
+
+        if (entry->d_type == DT_UNKNOWN) {
+            ok = lstat(subpath, &s);
+            if (ok == 0 && S_ISDIR(s.st_mode)) {
+                entry->d_type = DT_DIR;
+            }
+        }
+
+        if (entry->d_type == DT_DIR) {
+            ok = watch_dir_recursive(recorder, subpath);
+            if (ok != 0) {
+                free(subpath);
+                goto fail_close_dir;
+            }
+        }
+
+        free(subpath);
+    }
+
+    closedir(dir);
+    return 0;
+
+fail_close_dir:
+    closedir(dir);
+    return ok;
+}
+
+struct asset_access_recorder *asset_access_recorder_new(const struct flutter_paths *paths) {
+    struct asset_access_recorder *recorder;
+    char *icudtl_dir;
+    int ok;
+
+    recorder = malloc(sizeof *recorder);
+    if (recorder == NULL) {
+        return NULL;
+    }
+
+    recorder->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (recorder->inotify_fd < 0) {
+        LOG_ERROR("Couldn't create inotify instance for recording asset accesses. inotify_init1: %s\n", strerror(errno));
+        goto fail_free_recorder;
+    }
+
+    recorder->app_bundle_path = strdup(paths->app_bundle_path);
+    if (recorder->app_bundle_path == NULL) {
+        goto fail_close_inotify_fd;
+    }
+
+    recorder->icudtl_path = strdup(paths->icudtl_path);
+    if (recorder->icudtl_path == NULL) {
+        goto fail_free_app_bundle_path;
+    }
+
+    recorder->n_dirs = 0;
+    recorder->dirs_capacity = 0;
+    recorder->dirs = NULL;
+    recorder->n_files = 0;
+    recorder->files_capacity = 0;
+    recorder->files = NULL;
+
+    // The asset bundle is either the app bundle itself, or a subdirectory of it.
+    ok = watch_dir_recursive(recorder, paths->app_bundle_path);
+    if (ok != 0) {
+        LOG_ERROR("Couldn't watch the app bundle for asset accesses. inotify_add_watch: %s\n", strerror(ok));
+        goto fail_destroy_recorder;
+    }
+
+    // dirname modifies its argument.
+    icudtl_dir = strdup(paths->icudtl_path);
+    if (icudtl_dir == NULL) {
+        goto fail_destroy_recorder;
+    }
+
+    ok = watch_dir(recorder, dirname(icudtl_dir));
+    free(icudtl_dir);
+    if (ok != 0) {
+        LOG_ERROR("Couldn't watch the ICU data directory for accesses. inotify_add_watch: %s\n", strerror(ok));
+        goto fail_destroy_recorder;
+    }
+
+    return recorder;
+
+fail_destroy_recorder:
+    asset_access_recorder_destroy(recorder);
+    return NULL;
+
+fail_free_app_bundle_path:
+    free(recorder->app_bundle_path);
+
+fail_close_inotify_fd:
+    close(recorder->inotify_fd);
+
+fail_free_recorder:
+    free(recorder);
+    return NULL;
+}
+
+void asset_access_recorder_destroy(struct asset_access_recorder *recorder) {
+    for (size_t i = 0; i < recorder->n_files; i++) {
+        free(recorder->files[i]);
+    }
+    for (size_t i = 0; i < recorder->n_dirs; i++) {
+        free(recorder->dirs[i].path);
+    }
+    free(recorder->files);
+    free(recorder->dirs);
+    free(recorder->icudtl_path);
+    free(recorder->app_bundle_path);
+    close(recorder->inotify_fd);
+    free(recorder);
+}
+
+int asset_access_recorder_get_fd(struct asset_access_recorder *recorder) {
+    return recorder->inotify_fd;
+}
+
+static const char *get_watched_dir_path(struct asset_access_recorder *recorder, int wd) {
+    for (size_t i = 0; i < recorder->n_dirs; i++) {
+        if (recorder->dirs[i].wd == wd) {
+            return recorder->dirs[i].path;
+        }
+    }
+    return NULL;
+}
+
+static void record_access(struct asset_access_recorder *recorder, char *path) {
+    size_t app_bundle_path_len;
+    char **files;
+
+    // The ICU data directory is watched too, but we're only interested in the ICU data file there.
+    app_bundle_path_len = strlen(recorder->app_bundle_path);
+    if (!(strncmp(path, recorder->app_bundle_path, app_bundle_path_len) == 0 && path[app_bundle_path_len] == '/') &&
+        !streq(path, recorder->icudtl_path)) {
+        free(path);
+        return;
+    }
+
+    // Only the first access is interesting.
+    for (size_t i = 0; i < recorder->n_files; i++) {
+        if (streq(recorder->files[i], path)) {
+            free(path);
+            return;
+        }
+    }
+
+    if (recorder->n_files == recorder->files_capacity) {
+        files = realloc(recorder->files, (recorder->files_capacity ? recorder->files_capacity * 2 : 64) * sizeof *files);
+        if (files == NULL) {
+            free(path);
+            return;
+        }
+
+        recorder->files = files;
+        recorder->files_capacity = recorder->files_capacity ? recorder->files_capacity * 2 : 64;
+    }
+
+    recorder->files[recorder->n_files++] = path;
+}
+
+void asset_access_recorder_on_fd_ready(struct asset_access_recorder *recorder) {
+    const struct inotify_event *event;
+    const char *dir_path;
+    ssize_t length;
+    char *path;
+    int ok;
+
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (1) {
+        length = read(recorder->inotify_fd, buffer, sizeof(buffer));
+        if (length < 0 && errno == EINTR) {
+            continue;
+        } else if (length <= 0) {
+            // EAGAIN, no more events.
+            return;
+        }
+
+        for (char *cursor = buffer; cursor < buffer + length; cursor += sizeof(struct inotify_event) + event->len) {
+            event = (const struct inotify_event *) cursor;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                LOG_ERROR("Some asset accesses were lost while recording. The prefetch manifest will be incomplete.\n");
+                continue;
+            }
+
+            if ((event->mask & IN_OPEN) == 0 || (event->mask & IN_ISDIR) || event->len == 0) {
+                continue;
+            }
+
+            dir_path = get_watched_dir_path(recorder, event->wd);
+            if (dir_path == NULL) {
+                continue;
+            }
+
+            ok = asprintf(&path, "%s/%s", dir_path, event->name);
+            if (ok < 0) {
+                continue;
+            }
+
+            record_access(recorder, path);
+        }
+    }
+}
+
+int asset_access_recorder_write_manifest(struct asset_access_recorder *recorder) {
+    char *manifest_path, *temp_path;
+    size_t app_bundle_path_len;
+    const char *path;
+    FILE *manifest;
+    int ok;
+
+    ok = asprintf(&manifest_path, "%s/%s", recorder->app_bundle_path, ASSET_PREFETCH_MANIFEST_NAME);
+    if (ok < 0) {
+        return ENOMEM;
+    }
+
+    // write to a temporary file first and then atomically rename it, so a concurrently
+    // starting flutter-pi never prefetches from a half-written manifest.
+    ok = asprintf(&temp_path, "%s.%d.tmp", manifest_path, (int) getpid());
+    if (ok < 0) {
+        ok = ENOMEM;
+        goto fail_free_manifest_path;
+    }
+
+    manifest = fopen(temp_path, "we");
+    if (manifest == NULL) {
+        ok = errno;
+        goto fail_free_temp_path;
+    }
+
+    fprintf(manifest, "# flutter-pi prefetch manifest. Recorded using --record-asset-access.\n");
+
+    // Paths inside the app bundle are written relative to it, so the bundle can be moved.
+    app_bundle_path_len = strlen(recorder->app_bundle_path);
+    for (size_t i = 0; i < recorder->n_files; i++) {
+        path = recorder->files[i];
+        if (strncmp(path, recorder->app_bundle_path, app_bundle_path_len) == 0 && path[app_bundle_path_len] == '/') {
+            path += app_bundle_path_len + 1;
+        }
+
+        fprintf(manifest, "%s\n", path);
+    }
+
+    ok = fclose(manifest);
+    if (ok != 0) {
+        ok = errno;
+        unlink(temp_path);
+        goto fail_free_temp_path;
+    }
+
+    ok = rename(temp_path, manifest_path);
+    if (ok < 0) {
+        ok = errno;
+        unlink(temp_path);
+        goto fail_free_temp_path;
+    }
+
+    LOG_DEBUG("Wrote %zu recorded asset accesses to \"%s\".\n", recorder->n_files, manifest_path);
+
+    free(temp_path);
+    free(manifest_path);
+    return 0;
+
+fail_free_temp_path:
+    free(temp_path);
+
+fail_free_manifest_path:
+    free(manifest_path);
+    return ok;
+}
@@ -0,0 +1,65 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Asset Prefetch
+ *
+ * - reads the AOT snapshot / kernel blob, the ICU data and the assets listed in the
+ *   prefetch manifest of the app bundle into the page cache, so the engine doesn't
+ *   have to wait for the (possibly slow) storage when it first touches them.
+ *
+ * Copyright (c) 2023, Hannes Winkler <hanneswinkler2000@web.de>
+ */
+
+#ifndef _FLUTTERPI_SRC_ASSET_PREFETCH_H
+#define _FLUTTERPI_SRC_ASSET_PREFETCH_H
+
+#include "flutter-pi.h"
+
+struct flutter_paths;
+
+/**
+ * @brief Name of the prefetch manifest inside the app bundle directory.
+ *
+ * The manifest lists one file path per line, in the order the files should be read.
+ * Relative paths are relative to the app bundle directory. Lines starting with # are ignored.
+ */
+#define ASSET_PREFETCH_MANIFEST_NAME ".flutter-pi-prefetch"
+
+/**
+ * @brief Initiates readahead of the engine artifacts in @param paths (the AOT snapshot or the
+ * kernel blob, depending on @param runtime_mode) into the page cache, and queues reads for all
+ * the files listed in the prefetch manifest.
+ *
+ * May block while the readahead is submitted, so this should be run on a worker thread.
+ * Files that don't exist are skipped.
+ *
+ * @returns 0 on success, or an errno-style error code if the engine artifacts couldn't be read.
+ */
+int asset_prefetch_run(const struct flutter_paths *paths, enum flutter_runtime_mode runtime_mode);
+
+struct asset_access_recorder;
+
+/**
+ * @brief Starts recording which files in the app bundle (and the ICU data file) are opened,
+ * using inotify.
+ *
+ * The accesses are only picked up when @ref asset_access_recorder_on_fd_ready is called,
+ * so the fd returned by @ref asset_access_recorder_get_fd should be added to the event loop.
+ */
+struct asset_access_recorder *asset_access_recorder_new(const struct flutter_paths *paths);
+
+void asset_access_recorder_destroy(struct asset_access_recorder *recorder);
+
+int asset_access_recorder_get_fd(struct asset_access_recorder *recorder);
+
+/**
+ * @brief Records all the pending file accesses.
+ */
+void asset_access_recorder_on_fd_ready(struct asset_access_recorder *recorder);
+
+/**
+ * @brief Writes all accesses recorded so far, in the order the files were first opened,
+ * to the prefetch manifest of the app bundle.
+ */
+int asset_access_recorder_write_manifest(struct asset_access_recorder *recorder);
+
+#endif  // _FLUTTERPI_SRC_ASSET_PREFETCH_H
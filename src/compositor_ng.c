@@ -20,7 +20,6 @@
 #include <semaphore.h>
 
 #include <flutter_embedder.h>
-#include <systemd/sd-event.h>
 
 #include "cursor.h"
 #include "dummy_render_surface.h"
@@ -207,6 +206,16 @@ ATTR_PURE double compositor_get_refresh_rate(struct compositor *compositor) {
     return window_get_refresh_rate(compositor->main_window);
 }
 
+int compositor_set_color_transform(struct compositor *compositor, const double *gamma_lut, size_t n_gamma_lut_entries, const double *ctm) {
+    ASSERT_NOT_NULL(compositor);
+    return window_set_color_transform(compositor->main_window, gamma_lut, n_gamma_lut_entries, ctm);
+}
+
+int compositor_capture(struct compositor *compositor, window_capture_cb_t callback, void *userdata) {
+    ASSERT_NOT_NULL(compositor);
+    return window_capture(compositor->main_window, callback, userdata);
+}
+
 int compositor_get_next_vblank(struct compositor *compositor, uint64_t *next_vblank_ns_out) {
     ASSERT_NOT_NULL(compositor);
     ASSERT_NOT_NULL(next_vblank_ns_out);
@@ -229,11 +238,11 @@ static void fill_platform_view_layer_props(
     const FlutterSize *size,
     const FlutterPlatformViewMutation **mutations,
     size_t n_mutations,
-    const struct mat3f *display_to_view_transform,
-    const struct mat3f *view_to_display_transform,
+    const struct mat3f *render_to_view_transform,
+    const struct mat3f *view_to_render_transform,
     double device_pixel_ratio
 ) {
-    (void) view_to_display_transform;
+    (void) view_to_render_transform;
 
     /**
 	 * inversion for
@@ -244,7 +253,7 @@ static void fill_platform_view_layer_props(
 	 */
 
     struct quad quad = transform_aa_rect(
-        FLUTTER_TRANSFORM_AS_MAT3F(*display_to_view_transform),
+        FLUTTER_TRANSFORM_AS_MAT3F(*render_to_view_transform),
         (struct aa_rect){ .offset.x = offset->x, .offset.y = offset->y, .size.x = size->width, .size.y = size->height }
     );
 
@@ -369,8 +378,8 @@ static int compositor_push_fl_layers(struct compositor *compositor, size_t n_fl_
                 &fl_layer->size,
                 fl_layer->platform_view->mutations,
                 fl_layer->platform_view->mutations_count,
-                &geometry.display_to_view_transform,
-                &geometry.view_to_display_transform,
+                &geometry.render_to_view_transform,
+                &geometry.view_to_render_transform,
                 geometry.device_pixel_ratio
             );
         }
@@ -194,6 +194,16 @@ void compositor_set_cursor(
     struct vec2f delta
 );
 
+int compositor_set_color_transform(struct compositor *compositor, const double *gamma_lut, size_t n_gamma_lut_entries, const double *ctm);
+
+struct window_capture;
+
+int compositor_capture(
+    struct compositor *compositor,
+    void (*callback)(const struct window_capture *capture, int status, void *userdata),
+    void *userdata
+);
+
 struct fl_layer_composition;
 
 struct fl_layer_composition *fl_layer_composition_new(size_t n_layers);
@@ -39,8 +39,14 @@
 #include <stdatomic.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <unistd.h>
+
+#include <linux/dma-buf.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 
 #include "compositor_ng.h"
+#include "fbdev.h"
 #include "surface.h"
 #include "surface_private.h"
 #include "texture_registry.h"
@@ -62,7 +68,7 @@ struct refcounted_dmabuf {
 void refcounted_dmabuf_destroy(struct refcounted_dmabuf *dmabuf) {
     dmabuf->release_callback(&dmabuf->buf);
     if (DRM_ID_IS_VALID(dmabuf->drm_fb_id)) {
-        drmdev_rm_fb(dmabuf->drmdev, dmabuf->drm_fb_id);
+        drmdev_release_cached_fb(dmabuf->drmdev, dmabuf->drm_fb_id);
     }
     drmdev_unref(dmabuf->drmdev);
     free(dmabuf);
@@ -83,6 +89,9 @@ struct dmabuf_surface {
 
     struct texture *texture;
     struct refcounted_dmabuf *next_buf;
+
+    /// The KMS device the dmabufs were last presented on, which caches their framebuffers.
+    struct drmdev *drmdev;
 };
 
 COMPILE_ASSERT(offsetof(struct dmabuf_surface, surface) == 0);
@@ -136,10 +145,14 @@ int dmabuf_surface_init(struct dmabuf_surface *s, struct tracer *tracer, struct
 
     s->texture = texture;
     s->next_buf = NULL;
+    s->drmdev = NULL;
     return 0;
 }
 
 static void dmabuf_surface_deinit(struct surface *s) {
+    if (CAST_THIS_UNCHECKED(s)->drmdev != NULL) {
+        drmdev_unref(CAST_THIS_UNCHECKED(s)->drmdev);
+    }
     texture_destroy(CAST_THIS_UNCHECKED(s)->texture);
     surface_deinit(s);
 }
@@ -246,10 +259,48 @@ ATTR_PURE int64_t dmabuf_surface_get_texture_id(struct dmabuf_surface *s) {
     return texture_get_id(s->texture);
 }
 
+/**
+ * @brief Export the fences of everyone still writing into the dmabuf (e.g. the video decoder)
+ * as a sync_file, so we can pass it to KMS as the in fence of the plane.
+ *
+ * @returns The sync_file fd, or -1 if the kernel doesn't support exporting dmabuf fences.
+ */
+static int export_dmabuf_write_fence(int dmabuf_fd) {
+#ifdef DMA_BUF_IOCTL_EXPORT_SYNC_FILE
+    static atomic_bool unsupported = false;
+    struct dma_buf_export_sync_file export;
+    int ok;
+
+    if (atomic_load(&unsupported)) {
+        return -1;
+    }
+
+    export.flags = DMA_BUF_SYNC_READ;
+    export.fd = -1;
+
+    ok = ioctl(dmabuf_fd, DMA_BUF_IOCTL_EXPORT_SYNC_FILE, &export);
+    if (ok < 0) {
+        ok = errno;
+        if (ok == ENOTTY || ok == EINVAL) {
+            // Kernels older than 6.0 don't support this. KMS will use implicit fencing then.
+            atomic_store(&unsupported, true);
+        } else {
+            LOG_ERROR("Couldn't export dmabuf fence. ioctl: %s\n", strerror(ok));
+        }
+        return -1;
+    }
+
+    return export.fd;
+#else
+    (void) dmabuf_fd;
+    return -1;
+#endif
+}
+
 static int dmabuf_surface_present_kms(struct surface *_s, const struct fl_layer_props *props, struct kms_req_builder *builder) {
     struct dmabuf_surface *s;
     uint32_t fb_id;
-    int ok;
+    int in_fence_fd, ok;
 
     ASSERT_MSG(props->is_aa_rect, "Only axis-aligned rectangles supported right now.");
     s = CAST_THIS(_s);
@@ -265,16 +316,18 @@ static int dmabuf_surface_present_kms(struct surface *_s, const struct fl_layer_
         ASSERT_EQUALS_MSG(s->next_buf->drmdev, kms_req_builder_get_drmdev(builder), "Only 1 KMS instance per dmabuf supported right now.");
         fb_id = s->next_buf->drm_fb_id;
     } else {
-        fb_id = drmdev_add_fb_from_dmabuf(
+        // Decoders usually recycle their buffers, so use the fb cache of the drmdev instead of
+        // adding (and later removing) a new fb for every frame.
+        fb_id = drmdev_add_cached_fb_from_dmabuf(
             kms_req_builder_get_drmdev(builder),
             s->next_buf->buf.width,
             s->next_buf->buf.height,
             s->next_buf->buf.format,
-            s->next_buf->buf.fds[0],
-            s->next_buf->buf.strides[0],
-            s->next_buf->buf.offsets[0],
+            (const int[4]){ s->next_buf->buf.fds[0], -1, -1, -1 },
+            (const uint32_t[4]){ s->next_buf->buf.strides[0], 0 },
+            (const uint32_t[4]){ s->next_buf->buf.offsets[0], 0 },
             s->next_buf->buf.has_modifiers,
-            s->next_buf->buf.modifiers[0]
+            (const uint64_t[4]){ s->next_buf->buf.modifiers[0], 0 }
         );
         if (!DRM_ID_IS_VALID(fb_id)) {
             LOG_ERROR("Couldn't add dmabuf as framebuffer.\n");
@@ -282,8 +335,17 @@ static int dmabuf_surface_present_kms(struct surface *_s, const struct fl_layer_
 
         s->next_buf->drm_fb_id = fb_id;
         s->next_buf->drmdev = drmdev_ref(kms_req_builder_get_drmdev(builder));
+
+        if (s->drmdev != s->next_buf->drmdev) {
+            if (s->drmdev != NULL) {
+                drmdev_unref(s->drmdev);
+            }
+            s->drmdev = drmdev_ref(s->next_buf->drmdev);
+        }
     }
 
+    in_fence_fd = export_dmabuf_write_fence(s->next_buf->buf.fds[0]);
+
     ok = kms_req_builder_push_fb_layer(
         builder,
         &(struct kms_fb_layer){
@@ -305,8 +367,8 @@ static int dmabuf_surface_present_kms(struct surface *_s, const struct fl_layer_
 
             .has_rotation = false,
             .rotation = PLANE_TRANSFORM_ROTATE_0,
-            .has_in_fence_fd = false,
-            .in_fence_fd = 0,
+            .has_in_fence_fd = in_fence_fd >= 0,
+            .in_fence_fd = in_fence_fd,
         },
         refcounted_dmabuf_unref_void,
         NULL,
@@ -315,6 +377,9 @@ static int dmabuf_surface_present_kms(struct surface *_s, const struct fl_layer_
     );
     if (ok != 0) {
         LOG_ERROR("Couldn't push KMS fb layer. kms_req_builder_push_fb_layer: %s\n", strerror(ok));
+        if (in_fence_fd >= 0) {
+            close(in_fence_fd);
+        }
         refcounted_dmabuf_unref(s->next_buf);
         surface_unlock(_s);
         return ok;
@@ -325,14 +390,81 @@ static int dmabuf_surface_present_kms(struct surface *_s, const struct fl_layer_
     return 0;
 }
 
+void dmabuf_surface_evict_cached_fbs(struct dmabuf_surface *s) {
+    struct drmdev *drmdev;
+
+    ASSERT_NOT_NULL(s);
+
+    surface_lock(CAST_SURFACE_UNCHECKED(s));
+    drmdev = s->drmdev != NULL ? drmdev_ref(s->drmdev) : NULL;
+    surface_unlock(CAST_SURFACE_UNCHECKED(s));
+
+    if (drmdev != NULL) {
+        drmdev_evict_cached_fbs(drmdev);
+        drmdev_unref(drmdev);
+    }
+}
+
 static int dmabuf_surface_present_fbdev(struct surface *_s, const struct fl_layer_props *props, struct fbdev_commit_builder *builder) {
     struct dmabuf_surface *s;
+    struct dmabuf *buf;
+    size_t map_size;
+    void *vaddr;
+    int ok;
 
+    ASSERT_MSG(props->is_aa_rect, "Only axis-aligned rectangles supported right now.");
     s = CAST_THIS(_s);
-    (void) s;
-    (void) props;
-    (void) builder;
-    UNIMPLEMENTED();
 
+    surface_lock(_s);
+
+    ASSERT_NOT_NULL_MSG(s->next_buf, "dmabuf_surface_present_fbdev was called, but no dmabuf is queued to be presented.");
+
+    buf = &s->next_buf->buf;
+
+    // We can only read the dmabuf contents with the CPU if they're laid out linearly.
+    if (buf->has_modifiers && buf->modifiers[0] != DRM_FORMAT_MOD_LINEAR) {
+        LOG_ERROR("Only linear dmabufs can be presented on a framebuffer device.\n");
+        ok = EINVAL;
+        goto fail_unlock;
+    }
+
+    map_size = (size_t) buf->offsets[0] + (size_t) buf->strides[0] * (size_t) buf->height;
+
+    vaddr = mmap(NULL, map_size, PROT_READ, MAP_SHARED, buf->fds[0], 0);
+    if (vaddr == MAP_FAILED) {
+        ok = errno;
+        LOG_ERROR("Couldn't map dmabuf for copying it into the framebuffer. mmap: %s\n", strerror(ok));
+        goto fail_unlock;
+    }
+
+    ioctl(buf->fds[0], DMA_BUF_IOCTL_SYNC, &(struct dma_buf_sync){ .flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ });
+
+    ok = fbdev_commit_builder_push_layer(
+        builder,
+        &(const struct fbdev_layer){
+            .vaddr = (const uint8_t *) vaddr + buf->offsets[0],
+            .format = buf->format,
+            .width = buf->width,
+            .height = buf->height,
+            .pitch = buf->strides[0],
+            .dst_x = (int) props->aa_rect.offset.x,
+            .dst_y = (int) props->aa_rect.offset.y,
+        }
+    );
+
+    ioctl(buf->fds[0], DMA_BUF_IOCTL_SYNC, &(struct dma_buf_sync){ .flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ });
+
+    munmap(vaddr, map_size);
+
+    if (ok != 0) {
+        LOG_ERROR("Couldn't copy dmabuf into the framebuffer. fbdev_commit_builder_push_layer: %s\n", strerror(ok));
+        goto fail_unlock;
+    }
+
+    surface_unlock(_s);
     return 0;
+
+fail_unlock:
+    surface_unlock(_s);
+    return ok;
 }
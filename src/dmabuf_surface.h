@@ -42,6 +42,15 @@ MUST_CHECK struct dmabuf_surface *dmabuf_surface_new(struct tracer *tracer, stru
 
 int dmabuf_surface_push_dmabuf(struct dmabuf_surface *s, const struct dmabuf *buf, dmabuf_release_cb_t release_cb);
 
+/**
+ * @brief Frees the KMS framebuffers cached for dmabufs that are not on screen anymore.
+ *
+ * Framebuffers are cached so a buffer that's pushed again (because the video decoder recycles it)
+ * doesn't need a new one every frame. The cache keeps the dmabuf memory alive though, so call this when
+ * the decoder frees its buffer pool. This also evicts the unused framebuffers of other dmabuf surfaces.
+ */
+void dmabuf_surface_evict_cached_fbs(struct dmabuf_surface *s);
+
 ATTR_PURE int64_t dmabuf_surface_get_texture_id(struct dmabuf_surface *s);
 
 #endif  // _FLUTTERPI_SRC_DMABUF_SURFACE_H
@@ -12,8 +12,10 @@
 
 #include <errno.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "egl.h"
+#include "fbdev.h"
 #include "gl_renderer.h"
 #include "gles.h"
 #include "modesetting.h"
@@ -26,6 +28,12 @@
 #include "util/logging.h"
 #include "util/refcounting.h"
 
+// With these, we can export a sync_file fd for the rendering of a frame, and pass that to KMS
+// as the IN_FENCE_FD of the plane.
+#if defined(EGL_KHR_fence_sync) && defined(EGL_ANDROID_native_fence_sync)
+    #define HAVE_EGL_NATIVE_FENCE_SYNC
+#endif
+
 struct egl_gbm_render_surface;
 
 struct locked_fb {
@@ -33,6 +41,9 @@ struct locked_fb {
     struct egl_gbm_render_surface *surface;
     struct gbm_bo *bo;
     refcount_t n_refs;
+
+    /// sync_file fd that signals when the rendering into @ref bo is done, or -1.
+    int render_fence_fd;
 };
 
 struct egl_gbm_render_surface {
@@ -54,6 +65,13 @@ struct egl_gbm_render_surface {
     EGLConfig egl_config;
     struct gl_renderer *renderer;
 
+#ifdef HAVE_EGL_NATIVE_FENCE_SYNC
+    bool supports_native_fences;
+    PFNEGLCREATESYNCKHRPROC egl_create_sync;
+    PFNEGLDESTROYSYNCKHRPROC egl_destroy_sync;
+    PFNEGLDUPNATIVEFENCEFDANDROIDPROC egl_dup_native_fence_fd;
+#endif
+
     // Internally mesa supports 4 GBM BOs per surface, so we don't need
     // more than 4 here either.
     struct locked_fb locked_fbs[4];
@@ -79,6 +97,10 @@ static void locked_fb_destroy(struct locked_fb *fb) {
 
     s = fb->surface;
     fb->surface = NULL;
+    if (fb->render_fence_fd >= 0) {
+        close(fb->render_fence_fd);
+        fb->render_fence_fd = -1;
+    }
     gbm_surface_release_buffer(s->gbm_surface, fb->bo);
 #ifdef DEBUG
     atomic_fetch_sub(&s->n_locked_fbs, 1);
@@ -240,8 +262,20 @@ static int egl_gbm_render_surface_init(
     s->egl_surface = egl_surface;
     s->egl_config = egl_config;
     s->renderer = gl_renderer_ref(renderer);
+#ifdef HAVE_EGL_NATIVE_FENCE_SYNC
+    s->supports_native_fences = false;
+    if (gl_renderer_supports_egl_extension(renderer, "EGL_ANDROID_native_fence_sync")) {
+        s->egl_create_sync = (PFNEGLCREATESYNCKHRPROC) gl_renderer_get_proc_address(renderer, "eglCreateSyncKHR");
+        s->egl_destroy_sync = (PFNEGLDESTROYSYNCKHRPROC) gl_renderer_get_proc_address(renderer, "eglDestroySyncKHR");
+        s->egl_dup_native_fence_fd =
+            (PFNEGLDUPNATIVEFENCEFDANDROIDPROC) gl_renderer_get_proc_address(renderer, "eglDupNativeFenceFDANDROID");
+
+        s->supports_native_fences = s->egl_create_sync != NULL && s->egl_destroy_sync != NULL && s->egl_dup_native_fence_fd != NULL;
+    }
+#endif
     for (int i = 0; i < ARRAY_SIZE(s->locked_fbs); i++) {
         s->locked_fbs[i].is_locked = (atomic_flag) ATOMIC_FLAG_INIT;
+        s->locked_fbs[i].render_fence_fd = -1;
     }
     s->locked_front_fb = NULL;
 #ifdef DEBUG
@@ -387,7 +421,7 @@ static int egl_gbm_render_surface_present_kms(struct surface *s, const struct fl
     struct gbm_bo *bo;
     enum pixfmt pixel_format;
     uint32_t fb_id, opaque_fb_id;
-    int ok;
+    int in_fence_fd, ok;
 
     egl_surface = CAST_THIS(s);
 
@@ -514,6 +548,16 @@ static int egl_gbm_render_surface_present_kms(struct surface *s, const struct fl
         }
     }
 
+    // The same front fb can be presented more than once, and the KMS request takes ownership of
+    // the in fence, so give it a duplicate.
+    in_fence_fd = -1;
+    if (egl_surface->locked_front_fb->render_fence_fd >= 0) {
+        in_fence_fd = dup(egl_surface->locked_front_fb->render_fence_fd);
+        if (in_fence_fd < 0) {
+            LOG_ERROR("Couldn't duplicate render fence fd. dup: %s\n", strerror(errno));
+        }
+    }
+
     TRACER_BEGIN(egl_surface->surface.tracer, "kms_req_builder_push_fb_layer");
     ok = kms_req_builder_push_fb_layer(
         builder,
@@ -540,8 +584,8 @@ static int egl_gbm_render_surface_present_kms(struct surface *s, const struct fl
             .has_rotation = true,
             .rotation = PLANE_TRANSFORM_ROTATE_0,
 
-            .has_in_fence_fd = false,
-            .in_fence_fd = 0,
+            .has_in_fence_fd = in_fence_fd >= 0,
+            .in_fence_fd = in_fence_fd,
         },
         on_release_layer,
         NULL,
@@ -557,6 +601,9 @@ static int egl_gbm_render_surface_present_kms(struct surface *s, const struct fl
     return ok;
 
 fail_unref_locked_fb:
+    if (in_fence_fd >= 0) {
+        close(in_fence_fd);
+    }
     locked_fb_unref(egl_surface->locked_front_fb);
     goto fail_unlock;
 
@@ -574,18 +621,65 @@ fail_unlock:
 static int
 egl_gbm_render_surface_present_fbdev(struct surface *s, const struct fl_layer_props *props, struct fbdev_commit_builder *builder) {
     struct egl_gbm_render_surface *egl_surface;
-
-    /// TODO: Implement by mmapping the current front bo, copy it into the fbdev
-    /// TODO: Print a warning here if we're not using explicit linear tiling and use glReadPixels instead of gbm_bo_map in that case
+    struct gbm_bo *bo;
+    uint32_t stride;
+    void *map_data, *vaddr;
+    int ok;
 
     egl_surface = CAST_THIS(s);
-    (void) egl_surface;
-    (void) props;
-    (void) builder;
 
-    UNIMPLEMENTED();
+    /// TODO: Implement non axis-aligned fl_layer_props
+    ASSERT_MSG(props->is_aa_rect, "only axis aligned view geometry is supported right now");
+
+    surface_lock(s);
+
+    ASSERT_NOT_NULL_MSG(
+        egl_surface->locked_front_fb,
+        "There's no framebuffer available for scanout right now. Make sure you called render_surface_queue_present() before presenting."
+    );
+
+    bo = egl_surface->locked_front_fb->bo;
+
+    // If the BO is tiled, mesa will detile it into a staging buffer for us.
+    // That still works, but it's slower, so fbdev windows ask for linear BOs.
+    map_data = NULL;
+    TRACER_BEGIN(egl_surface->surface.tracer, "gbm_bo_map");
+    vaddr = gbm_bo_map(bo, 0, 0, gbm_bo_get_width(bo), gbm_bo_get_height(bo), GBM_BO_TRANSFER_READ, &stride, &map_data);
+    TRACER_END(egl_surface->surface.tracer, "gbm_bo_map");
+    if (vaddr == NULL) {
+        ok = EIO;
+        LOG_ERROR("Couldn't map GBM buffer for copying it into the framebuffer.\n");
+        goto fail_unlock;
+    }
+
+    TRACER_BEGIN(egl_surface->surface.tracer, "fbdev_commit_builder_push_layer");
+    ok = fbdev_commit_builder_push_layer(
+        builder,
+        &(const struct fbdev_layer){
+            .vaddr = vaddr,
+            .format = egl_surface->pixel_format,
+            .width = (int) gbm_bo_get_width(bo),
+            .height = (int) gbm_bo_get_height(bo),
+            .pitch = (int) stride,
+            .dst_x = (int) props->aa_rect.offset.x,
+            .dst_y = (int) props->aa_rect.offset.y,
+        }
+    );
+    TRACER_END(egl_surface->surface.tracer, "fbdev_commit_builder_push_layer");
+
+    gbm_bo_unmap(bo, map_data);
+
+    if (ok != 0) {
+        LOG_ERROR("Couldn't copy GBM buffer into the framebuffer.\n");
+        goto fail_unlock;
+    }
 
+    surface_unlock(s);
     return 0;
+
+fail_unlock:
+    surface_unlock(s);
+    return ok;
 }
 
 static int egl_gbm_render_surface_fill(struct render_surface *s, FlutterBackingStore *fl_store) {
@@ -612,7 +706,11 @@ static int egl_gbm_render_surface_queue_present(struct render_surface *s, const
     UNUSED struct egl_gbm_render_surface *egl_surface;
     struct gbm_bo *bo;
     UNUSED EGLBoolean egl_ok;
+    int render_fence_fd;
     int i, ok;
+#ifdef HAVE_EGL_NATIVE_FENCE_SYNC
+    EGLSyncKHR render_fence;
+#endif
 
     egl_surface = CAST_THIS(s);
     (void) fl_store;
@@ -628,14 +726,43 @@ static int egl_gbm_render_surface_queue_present(struct render_surface *s, const
 
     assert(gbm_surface_has_free_buffers(egl_surface->gbm_surface));
 
-    // create the in fence here
+    // Insert a native fence after the rendering commands of this frame. It gets its sync_file fd
+    // once the commands are flushed, which eglSwapBuffers does for us.
+#ifdef HAVE_EGL_NATIVE_FENCE_SYNC
+    render_fence = EGL_NO_SYNC_KHR;
+    if (egl_surface->supports_native_fences) {
+        static const EGLint fence_attribs[] = { EGL_SYNC_NATIVE_FENCE_FD_ANDROID, EGL_NO_NATIVE_FENCE_FD_ANDROID, EGL_NONE };
+
+        render_fence = egl_surface->egl_create_sync(egl_surface->egl_display, EGL_SYNC_NATIVE_FENCE_ANDROID, fence_attribs);
+        if (render_fence == EGL_NO_SYNC_KHR) {
+            LOG_EGL_ERROR(eglGetError(), "Couldn't create render fence. eglCreateSyncKHR");
+        }
+    }
+#endif
+
     TRACER_BEGIN(s->surface.tracer, "eglSwapBuffers");
     egl_ok = eglSwapBuffers(egl_surface->egl_display, egl_surface->egl_surface);
     TRACER_END(s->surface.tracer, "eglSwapBuffers");
 
+    render_fence_fd = -1;
+#ifdef HAVE_EGL_NATIVE_FENCE_SYNC
+    if (render_fence != EGL_NO_SYNC_KHR) {
+        if (egl_ok == EGL_TRUE) {
+            render_fence_fd = egl_surface->egl_dup_native_fence_fd(egl_surface->egl_display, render_fence);
+            if (render_fence_fd == EGL_NO_NATIVE_FENCE_FD_ANDROID) {
+                LOG_EGL_ERROR(eglGetError(), "Couldn't export render fence. eglDupNativeFenceFDANDROID");
+                render_fence_fd = -1;
+            }
+        }
+
+        egl_surface->egl_destroy_sync(egl_surface->egl_display, render_fence);
+    }
+#endif
+
     if (egl_ok != EGL_TRUE) {
         LOG_EGL_ERROR(eglGetError(), "Couldn't flush rendering. eglSwapBuffers");
-        return EIO;
+        ok = EIO;
+        goto fail_unlock;
     }
 
     TRACER_BEGIN(s->surface.tracer, "gbm_surface_lock_front_buffer");
@@ -667,7 +794,7 @@ static int egl_gbm_render_surface_queue_present(struct render_surface *s, const
     if (bo == NULL) {
         ok = errno;
         LOG_ERROR("Couldn't lock GBM front buffer. gbm_surface_lock_front_buffer: %s\n", strerror(ok));
-        goto fail_unlock;
+        goto fail_close_render_fence;
     }
 
     // Try to find & lock a locked_fb we can use.
@@ -746,6 +873,7 @@ locked:
     egl_surface->locked_fbs[i].bo = bo;
     egl_surface->locked_fbs[i].surface = CAST_THIS(surface_ref(CAST_SURFACE(s)));
     egl_surface->locked_fbs[i].n_refs = REFCOUNT_INIT_1;
+    egl_surface->locked_fbs[i].render_fence_fd = render_fence_fd;
     egl_surface->locked_front_fb = egl_surface->locked_fbs + i;
     surface_unlock(CAST_SURFACE(s));
     return 0;
@@ -753,6 +881,11 @@ locked:
 fail_release_bo:
     gbm_surface_release_buffer(egl_surface->gbm_surface, bo);
 
+fail_close_render_fence:
+    if (render_fence_fd >= 0) {
+        close(render_fence_fd);
+    }
+
 fail_unlock:
     surface_unlock(CAST_SURFACE(s));
     return ok;
@@ -1,456 +1,979 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Event Loop
+ *
+ * Copyright (c) 2023, Hannes Winkler <hanneswinkler2000@web.de>
+ */
+
+#define _GNU_SOURCE
 #include "event_loop.h"
 
+#include <errno.h>
+#include <pthread.h>
 #include <semaphore.h>
-#include <sys/select.h>
-#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+#include <sys/epoll.h>
 #include <sys/eventfd.h>
-#include <sys/time.h>
-#include <systemd/sd-event.h>
+#include <sys/timerfd.h>
 
+#include "config.h"
+#include "util/asserts.h"
 #include "util/collection.h"
+#include "util/list.h"
+#include "util/lock_ops.h"
+#include "util/logging.h"
 #include "util/refcounting.h"
 
+#ifdef HAVE_LIBURING
+    #include <liburing.h>
+#endif
+
+/**
+ * @brief How many ready fds we fetch from epoll per wakeup.
+ */
+#define MAX_EVENTS_PER_WAKEUP 64
+
+/**
+ * @brief How many executed tasks we keep around for reuse, so posting a task
+ * usually doesn't need to allocate.
+ */
+#define MAX_CACHED_TASKS 64
+
+/**
+ * @brief Size of the io_uring submission queue. The completion queue is twice as big.
+ */
+#define URING_ENTRIES 64
+
+struct evloop_task {
+    struct list_head entry;
+    void_callback_t callback;
+    void *userdata;
+    uint64_t target_time_usec;
+};
+
+struct evsrc {
+    struct list_head entry;
+    struct evloop *loop;
+    int fd;
+    uint32_t events;
+    bool destroyed;
+    bool low_priority;
+    evloop_io_handler_t callback;
+    void *userdata;
+
+#ifdef HAVE_LIBURING
+    /// io_uring only: Entry in @ref evloop::srcs_to_arm, if @ref arm_queued is true.
+    struct list_head arm_entry;
+    bool arm_queued;
+
+    /// io_uring only: Whether there's a poll request for this source in the ring
+    /// whose completion we haven't handled yet.
+    bool armed;
+#endif
+};
+
 struct evloop {
     refcount_t n_refs;
-    pthread_mutex_t mutex;
-    sd_event *sdloop;
+
+    int epoll_fd;
     int wakeup_fd;
-    pthread_t owning_thread;
+    int timer_fd;
+
+#ifdef HAVE_LIBURING
+    /// Whether we use io_uring instead of epoll & the timerfd.
+    bool uses_uring;
+    struct io_uring ring;
+    uint64_t wakeup_value;
+
+    /// Sources added by @ref evloop_add_io that the loop thread still needs to submit a poll request for.
+    struct list_head srcs_to_arm;
+
+    /// Destroyed sources whose poll request is being cancelled.
+    struct list_head cancelled_srcs;
+#endif
+
+    pthread_mutex_t mutex;
+
+    /// Tasks ready to run, in the order they were posted.
+    struct list_head tasks;
+
+    /// Delayed tasks, sorted by target time.
+    struct list_head delayed_tasks;
+
+    /// Executed tasks, for reuse.
+    struct list_head cached_tasks;
+    int n_cached_tasks;
+
+    /// The time the timerfd is armed for (or the time the io_uring loop should wake up at),
+    /// or UINT64_MAX if there are no delayed tasks.
+    uint64_t timer_target_usec;
+
+    /// Whether the loop thread is (about to be) blocked waiting for events.
+    /// If it's not, posting a task doesn't need to wake it up.
+    bool sleeping;
+    bool wakeup_pending;
+    bool exit_scheduled;
+
+    /// Only accessed on the loop thread.
+    bool dispatching_io;
+    struct list_head destroyed_srcs;
+
+    /// Ready low priority sources of the current wakeup, dispatched after the tasks.
+    /// Only accessed on the loop thread.
+    struct low_priority_event {
+        struct evsrc *src;
+        uint32_t revents;
+    } low_priority_events[MAX_EVENTS_PER_WAKEUP];
+    int n_low_priority_events;
+
+    /// All sources that weren't destroyed yet. They're owned by the loop,
+    /// so the ones still alive when the loop is destroyed are freed with it.
+    struct list_head srcs;
 };
 
 DEFINE_STATIC_LOCK_OPS(evloop, mutex)
 
-static int on_wakeup_event_loop(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
-    uint8_t buffer[8];
+static int epoll_backend_init(struct evloop *loop) {
+    struct epoll_event event;
     int ok;
 
-    (void) s;
-    (void) revents;
-    (void) userdata;
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
+        ok = errno;
+        LOG_ERROR("Couldn't create epoll instance for event loop. epoll_create1: %s\n", strerror(ok));
+        return ok;
+    }
+
+    loop->wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (loop->wakeup_fd < 0) {
+        ok = errno;
+        LOG_ERROR("Couldn't create fd for waking up the event loop. eventfd: %s\n", strerror(ok));
+        goto fail_close_epoll_fd;
+    }
+
+    loop->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (loop->timer_fd < 0) {
+        ok = errno;
+        LOG_ERROR("Couldn't create timer fd for the event loop. timerfd_create: %s\n", strerror(ok));
+        goto fail_close_wakeup_fd;
+    }
 
-    ok = read(fd, buffer, 8);
+    // We identify the wakeup & timer fd events using the address of the fd inside the loop,
+    // since all other events have the evsrc as their userdata.
+    event.events = EPOLLIN;
+    event.data.ptr = &loop->wakeup_fd;
+    ok = epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wakeup_fd, &event);
     if (ok < 0) {
         ok = errno;
-        LOG_ERROR("Could not read eventloop wakeup userdata. read: %s\n", strerror(ok));
-        return ok;
+        LOG_ERROR("Couldn't listen for event loop wakeups. epoll_ctl: %s\n", strerror(ok));
+        goto fail_close_timer_fd;
+    }
+
+    event.events = EPOLLIN;
+    event.data.ptr = &loop->timer_fd;
+    ok = epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->timer_fd, &event);
+    if (ok < 0) {
+        ok = errno;
+        LOG_ERROR("Couldn't listen for event loop timer expirations. epoll_ctl: %s\n", strerror(ok));
+        goto fail_close_timer_fd;
+    }
+
+    return 0;
+
+fail_close_timer_fd:
+    close(loop->timer_fd);
+
+fail_close_wakeup_fd:
+    close(loop->wakeup_fd);
+
+fail_close_epoll_fd:
+    close(loop->epoll_fd);
+    return ok;
+}
+
+static void epoll_backend_deinit(struct evloop *loop) {
+    close(loop->timer_fd);
+    close(loop->wakeup_fd);
+    close(loop->epoll_fd);
+}
+
+#ifdef HAVE_LIBURING
+static struct io_uring_sqe *uring_get_sqe(struct evloop *loop) {
+    struct io_uring_sqe *sqe;
+    int ok;
+
+    sqe = io_uring_get_sqe(&loop->ring);
+    if (sqe == NULL) {
+        // The submission queue is full, submit what we have to make room.
+        ok = io_uring_submit(&loop->ring);
+        if (ok < 0) {
+            LOG_ERROR("Couldn't submit event loop io_uring requests. io_uring_submit: %s\n", strerror(-ok));
+        }
+
+        sqe = io_uring_get_sqe(&loop->ring);
+    }
+
+    return sqe;
+}
+
+static void uring_queue_wakeup_read(struct evloop *loop) {
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_get_sqe(loop);
+    if (sqe == NULL) {
+        LOG_ERROR("Couldn't listen for event loop wakeups, the io_uring submission queue is full.\n");
+        return;
     }
 
+    // Instead of polling the eventfd and reading it afterwards, let the ring do the read.
+    io_uring_prep_read(sqe, loop->wakeup_fd, &loop->wakeup_value, sizeof loop->wakeup_value, 0);
+    io_uring_sqe_set_data(sqe, &loop->wakeup_fd);
+}
+
+static void uring_arm_src(struct evloop *loop, struct evsrc *src) {
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_get_sqe(loop);
+    if (sqe == NULL) {
+        LOG_ERROR("Couldn't listen for fd %d, the io_uring submission queue is full.\n", src->fd);
+        return;
+    }
+
+    // A single-shot poll is level-triggered like epoll: it completes right away if the fd is still
+    // ready when it's re-armed. Multishot polls only complete on new wakeups of the fd, which would
+    // break handlers that don't drain their fd in one go (sd-event, for example).
+    // Re-arming only costs an SQE, which is submitted together with the next wait anyway.
+    io_uring_prep_poll_add(sqe, src->fd, src->events);
+    io_uring_sqe_set_data(sqe, src);
+    src->armed = true;
+}
+
+static int uring_backend_init(struct evloop *loop) {
+    struct io_uring_params params;
+    int ok;
+
+    memset(&params, 0, sizeof params);
+
+    ok = io_uring_queue_init_params(URING_ENTRIES, &loop->ring, &params);
+    if (ok < 0) {
+        LOG_DEBUG("Couldn't create io_uring for the event loop, falling back to epoll. io_uring_queue_init_params: %s\n", strerror(-ok));
+        return -ok;
+    }
+
+    // We need to wait with a timeout without submitting a timeout request. (Linux 5.11)
+    if (!(params.features & IORING_FEAT_EXT_ARG)) {
+        LOG_DEBUG("Kernel io_uring doesn't support waiting with a timeout, falling back to epoll.\n");
+        ok = ENOTSUP;
+        goto fail_exit_queue;
+    }
+
+    // io_uring would complete reads on a non-blocking eventfd with EAGAIN instead of waiting.
+    loop->wakeup_fd = eventfd(0, EFD_CLOEXEC);
+    if (loop->wakeup_fd < 0) {
+        ok = errno;
+        LOG_ERROR("Couldn't create fd for waking up the event loop. eventfd: %s\n", strerror(ok));
+        goto fail_exit_queue;
+    }
+
+    loop->uses_uring = true;
+    loop->epoll_fd = -1;
+    loop->timer_fd = -1;
+    list_inithead(&loop->srcs_to_arm);
+    list_inithead(&loop->cancelled_srcs);
+
+    uring_queue_wakeup_read(loop);
     return 0;
+
+fail_exit_queue:
+    io_uring_queue_exit(&loop->ring);
+    return ok;
 }
 
-struct evloop *evloop_new() {
+static void uring_backend_deinit(struct evloop *loop) {
+    // This cancels all pending requests.
+    io_uring_queue_exit(&loop->ring);
+    close(loop->wakeup_fd);
+
+    list_for_each_entry_safe(struct evsrc, src, &loop->cancelled_srcs, entry) {
+        list_del(&src->entry);
+        free(src);
+    }
+}
+#endif
+
+struct evloop *evloop_new(void) {
     struct evloop *loop;
-    sd_event *sdloop;
-    int ok, wakeup_fd;
+    int ok;
 
     loop = malloc(sizeof *loop);
     if (loop == NULL) {
         return NULL;
     }
 
-    ok = sd_event_new(&sdloop);
-    if (ok != 0) {
-        LOG_ERROR("Couldn't create libsystemd event loop. sd_event_new: %s\n", strerror(-ok));
-        goto fail_free_loop;
-    }
+#ifdef HAVE_LIBURING
+    loop->uses_uring = false;
 
-    wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
-    if (wakeup_fd < 0) {
-        LOG_ERROR("Could not create fd for waking up the main loop. eventfd: %s\n", strerror(errno));
-        goto fail_unref_sdloop;
+    ok = uring_backend_init(loop);
+    if (ok != 0) {
+        ok = epoll_backend_init(loop);
     }
-
-    ok = sd_event_add_io(sdloop, NULL, wakeup_fd, EPOLLIN, on_wakeup_event_loop, NULL);
-    if (ok < 0) {
-        LOG_ERROR("Error adding wakeup callback to main loop. sd_event_add_io: %s\n", strerror(-ok));
-        goto fail_unref_sdloop;
+#else
+    ok = epoll_backend_init(loop);
+#endif
+    if (ok != 0) {
+        free(loop);
+        return NULL;
     }
 
     loop->n_refs = REFCOUNT_INIT_1;
     pthread_mutex_init(&loop->mutex, get_default_mutex_attrs());
-    loop->sdloop = sdloop;
-    loop->wakeup_fd = wakeup_fd;
-    loop->owning_thread = pthread_self();
+    list_inithead(&loop->tasks);
+    list_inithead(&loop->delayed_tasks);
+    list_inithead(&loop->cached_tasks);
+    loop->n_cached_tasks = 0;
+    loop->timer_target_usec = UINT64_MAX;
+    loop->sleeping = false;
+    loop->wakeup_pending = false;
+    loop->exit_scheduled = false;
+    loop->dispatching_io = false;
+    list_inithead(&loop->destroyed_srcs);
+    loop->n_low_priority_events = 0;
+    list_inithead(&loop->srcs);
     return loop;
+}
 
-fail_unref_sdloop:
-    sd_event_unref(sdloop);
-
-fail_free_loop:
-    free(loop);
-    return NULL;
+static void free_task_list(struct list_head *list) {
+    list_for_each_entry_safe(struct evloop_task, task, list, entry) {
+        list_del(&task->entry);
+        free(task);
+    }
 }
 
 void evloop_destroy(struct evloop *loop) {
-    sd_event_unref(loop->sdloop);
-    close(loop->wakeup_fd);
+    assert(list_is_empty(&loop->destroyed_srcs));
+
+#ifdef HAVE_LIBURING
+    if (loop->uses_uring) {
+        uring_backend_deinit(loop);
+    } else {
+        epoll_backend_deinit(loop);
+    }
+#else
+    epoll_backend_deinit(loop);
+#endif
+
+    list_for_each_entry_safe(struct evsrc, src, &loop->srcs, entry) {
+        list_del(&src->entry);
+        free(src);
+    }
+
+    free_task_list(&loop->tasks);
+    free_task_list(&loop->delayed_tasks);
+    free_task_list(&loop->cached_tasks);
     pthread_mutex_destroy(&loop->mutex);
     free(loop);
 }
 
 DEFINE_REF_OPS(evloop, n_refs)
 
-int evloop_get_fd_locked(struct evloop *loop) {
-    ASSERT_NOT_NULL(loop);
+static void wakeup_locked(struct evloop *loop) {
+    int ok;
+
     ASSERT_MUTEX_LOCKED(loop->mutex);
-    return sd_event_get_fd(loop->sdloop);
+
+    // If the loop is not sleeping, it'll check for new tasks before going to sleep anyway.
+    // If it's sleeping, one wakeup is enough.
+    if (!loop->sleeping || loop->wakeup_pending) {
+        return;
+    }
+
+    ok = write(loop->wakeup_fd, (uint64_t[1]){ 1 }, sizeof(uint64_t));
+    if (ok < 0) {
+        LOG_ERROR("Error waking up event loop. write: %s\n", strerror(errno));
+        return;
+    }
+
+    loop->wakeup_pending = true;
 }
 
-int evloop_get_fd(struct evloop *loop) {
-    int result;
+static void arm_timer_locked(struct evloop *loop, uint64_t target_time_usec) {
+    struct itimerspec spec;
+    int ok;
 
-    ASSERT_NOT_NULL(loop);
+    ASSERT_MUTEX_LOCKED(loop->mutex);
 
-    evloop_lock(loop);
-    result = evloop_get_fd_locked(loop);
-    evloop_unlock(loop);
+    if (target_time_usec == loop->timer_target_usec) {
+        return;
+    }
+
+#ifdef HAVE_LIBURING
+    if (loop->uses_uring) {
+        // The loop computes the wait timeout from the target time before it goes to sleep.
+        // If it's already sleeping and the target time is now earlier, it needs to start waiting again.
+        if (target_time_usec < loop->timer_target_usec) {
+            wakeup_locked(loop);
+        }
+
+        loop->timer_target_usec = target_time_usec;
+        return;
+    }
+#endif
+
+    memset(&spec, 0, sizeof spec);
+    if (target_time_usec != UINT64_MAX) {
+        // An all-zero it_value disarms the timer, so make sure we never pass zero.
+        spec.it_value.tv_sec = target_time_usec / 1000000;
+        spec.it_value.tv_nsec = (target_time_usec % 1000000) * 1000;
+        if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) {
+            spec.it_value.tv_nsec = 1;
+        }
+    }
+
+    ok = timerfd_settime(loop->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+    if (ok < 0) {
+        LOG_ERROR("Couldn't arm event loop timer. timerfd_settime: %s\n", strerror(errno));
+        return;
+    }
 
-    return result;
+    loop->timer_target_usec = target_time_usec;
 }
 
-int evloop_run(struct evloop *loop) {
-    int evloop_fd;
-    int ok;
+static struct evloop_task *alloc_task_locked(struct evloop *loop) {
+    struct evloop_task *task;
 
-    ASSERT_NOT_NULL(loop);
+    ASSERT_MUTEX_LOCKED(loop->mutex);
 
-    evloop_fd = evloop_get_fd(loop);
+    if (!list_is_empty(&loop->cached_tasks)) {
+        task = list_first_entry(&loop->cached_tasks, struct evloop_task, entry);
+        list_del(&task->entry);
+        loop->n_cached_tasks--;
+        return task;
+    }
 
-    {
-        fd_set rfds, wfds, xfds;
-        int state;
-        FD_ZERO(&rfds);
-        FD_ZERO(&wfds);
-        FD_ZERO(&xfds);
-        FD_SET(evloop_fd, &rfds);
-        FD_SET(evloop_fd, &wfds);
-        FD_SET(evloop_fd, &xfds);
+    return malloc(sizeof(struct evloop_task));
+}
 
-        const fd_set const_fds = rfds;
+/**
+ * @brief Collects all tasks that should be run now into @param batch and re-arms the timer.
+ */
+static void collect_batch_locked(struct evloop *loop, struct list_head *batch) {
+    uint64_t now_usec;
 
-        evloop_lock(loop);
+    ASSERT_MUTEX_LOCKED(loop->mutex);
 
-        do {
-            state = sd_event_get_state(loop->sdloop);
-            switch (state) {
-                case SD_EVENT_INITIAL:
-                    ok = sd_event_prepare(loop->sdloop);
-                    if (ok < 0) {
-                        ok = -ok;
-                        LOG_ERROR("Could not prepare event loop. sd_event_prepare: %s\n", strerror(ok));
-                        goto fail_unlock;
-                    }
-
-                    break;
-                case SD_EVENT_ARMED:
-                    evloop_unlock(loop);
-
-                    do {
-                        rfds = const_fds;
-                        wfds = const_fds;
-                        xfds = const_fds;
-                        ok = select(evloop_fd + 1, &rfds, &wfds, &xfds, NULL);
-                        if ((ok < 0) && (errno != EINTR)) {
-                            ok = errno;
-                            LOG_ERROR("Could not wait for event loop events. select: %s\n", strerror(ok));
-                            goto fail;
-                        }
-                    } while ((ok < 0) && (errno == EINTR));
-
-                    evloop_lock(loop);
-
-                    ok = sd_event_wait(loop->sdloop, 0);
-                    if (ok < 0) {
-                        ok = -ok;
-                        LOG_ERROR("Could not check for event loop events. sd_event_wait: %s\n", strerror(ok));
-                        goto fail_unlock;
-                    }
-
-                    break;
-                case SD_EVENT_PENDING:
-                    ok = sd_event_dispatch(loop->sdloop);
-                    if (ok < 0) {
-                        ok = -ok;
-                        LOG_ERROR("Could not dispatch event loop events. sd_event_dispatch: %s\n", strerror(ok));
-                        goto fail_unlock;
-                    }
-
-                    break;
-                case SD_EVENT_FINISHED: break;
-                default: UNREACHABLE();
-            }
-        } while (state != SD_EVENT_FINISHED);
+    list_splicetail(&loop->tasks, batch);
+    list_inithead(&loop->tasks);
 
-        evloop_unlock(loop);
+    if (list_is_empty(&loop->delayed_tasks)) {
+        arm_timer_locked(loop, UINT64_MAX);
+        return;
     }
 
-    return 0;
+    now_usec = get_monotonic_time() / 1000;
 
-fail_unlock:
-    evloop_unlock(loop);
+    list_for_each_entry_safe(struct evloop_task, task, &loop->delayed_tasks, entry) {
+        if (task->target_time_usec > now_usec) {
+            break;
+        }
 
-fail:
-    return ok;
+        list_del(&task->entry);
+        list_addtail(&task->entry, batch);
+    }
+
+    if (list_is_empty(&loop->delayed_tasks)) {
+        arm_timer_locked(loop, UINT64_MAX);
+    } else {
+        arm_timer_locked(loop, list_first_entry(&loop->delayed_tasks, struct evloop_task, entry)->target_time_usec);
+    }
 }
 
-static int wakeup_sdloop(struct evloop *loop) {
-    int ok;
+static void run_batch(struct evloop *loop, struct list_head *batch) {
+    list_for_each_entry(struct evloop_task, task, batch, entry) {
+        task->callback(task->userdata);
+    }
 
-    ok = write(loop->wakeup_fd, (uint8_t[8]){ 0, 0, 0, 0, 0, 0, 0, 1 }, 8);
-    if (ok < 0) {
-        ok = errno;
-        LOG_ERROR("Error waking up event loop. write: %s\n", strerror(ok));
-        return ok;
+    evloop_lock(loop);
+    list_for_each_entry_safe(struct evloop_task, task, batch, entry) {
+        list_del(&task->entry);
+        if (loop->n_cached_tasks < MAX_CACHED_TASKS) {
+            list_add(&task->entry, &loop->cached_tasks);
+            loop->n_cached_tasks++;
+        } else {
+            free(task);
+        }
     }
+    evloop_unlock(loop);
+}
 
-    return 0;
+static void free_destroyed_srcs(struct evloop *loop) {
+    list_for_each_entry_safe(struct evsrc, src, &loop->destroyed_srcs, entry) {
+        list_del(&src->entry);
+        free(src);
+    }
 }
 
-int evloop_schedule_exit_locked(struct evloop *loop) {
-    int ok;
+static void dispatch_src(struct evloop *loop, struct evsrc *src, uint32_t revents) {
+    enum event_handler_return handler_return;
 
-    ASSERT_NOT_NULL(loop);
-    ASSERT_MUTEX_LOCKED(loop->mutex);
+    handler_return = src->callback(src->fd, revents, src->userdata);
+    if (handler_return == kRemoveSrc_EventHandlerReturn) {
+        evsrc_destroy(src);
+        return;
+    }
 
-    ok = sd_event_exit(loop->sdloop, 0);
-    if (ok != 0) {
-        LOG_ERROR("Couldn't schedule event loop exit. sd_event_exit: %s\n", strerror(-ok));
-        return -ok;
+#ifdef HAVE_LIBURING
+    // io_uring polls are oneshot. The handler might've destroyed the source too.
+    if (loop->uses_uring && !src->destroyed) {
+        uring_arm_src(loop, src);
     }
+#else
+    (void) loop;
+#endif
+}
 
-    return 0;
+static void dispatch_or_defer_src(struct evloop *loop, struct evsrc *src, uint32_t revents) {
+    struct low_priority_event *event;
+
+    if (!src->low_priority || loop->n_low_priority_events >= MAX_EVENTS_PER_WAKEUP) {
+        dispatch_src(loop, src, revents);
+        return;
+    }
+
+    event = loop->low_priority_events + loop->n_low_priority_events++;
+    event->src = src;
+    event->revents = revents;
 }
 
-int evloop_schedule_exit(struct evloop *loop) {
-    int ok;
+static void dispatch_low_priority_srcs(struct evloop *loop) {
+    for (int i = 0; i < loop->n_low_priority_events; i++) {
+        struct low_priority_event *event = loop->low_priority_events + i;
 
-    ASSERT_NOT_NULL(loop);
+        // The source might've been destroyed by a handler or task earlier in this wakeup.
+        if (!event->src->destroyed) {
+            dispatch_src(loop, event->src, event->revents);
+        }
+    }
 
+    loop->n_low_priority_events = 0;
+}
+
+static void on_woken_up(struct evloop *loop) {
     evloop_lock(loop);
-    ok = evloop_schedule_exit_locked(loop);
+    loop->sleeping = false;
+    loop->wakeup_pending = false;
     evloop_unlock(loop);
+}
 
-    wakeup_sdloop(loop);
+static int epoll_wait_and_dispatch(struct evloop *loop, bool nonblocking) {
+    struct epoll_event events[MAX_EVENTS_PER_WAKEUP];
+    struct evsrc *src;
+    uint64_t value;
+    int n_events, ok;
 
-    return ok;
-}
+    do {
+        n_events = epoll_wait(loop->epoll_fd, events, MAX_EVENTS_PER_WAKEUP, nonblocking ? 0 : -1);
+    } while (n_events < 0 && errno == EINTR);
 
-struct task {
-    void_callback_t callback;
-    void *userdata;
-};
+    if (n_events < 0) {
+        ok = errno;
+        LOG_ERROR("Could not wait for event loop events. epoll_wait: %s\n", strerror(ok));
+        return ok;
+    }
 
-static int on_execute_task(sd_event_source *s, void *userdata) {
-    struct task *task;
-    int ok;
+    on_woken_up(loop);
 
-    ASSERT_NOT_NULL(userdata);
-    task = userdata;
+    loop->dispatching_io = true;
+
+    for (int i = 0; i < n_events; i++) {
+        if (events[i].data.ptr == &loop->wakeup_fd) {
+            ok = read(loop->wakeup_fd, &value, sizeof value);
+            if (ok < 0 && errno != EAGAIN) {
+                LOG_ERROR("Could not read event loop wakeup value. read: %s\n", strerror(errno));
+            }
+            continue;
+        } else if (events[i].data.ptr == &loop->timer_fd) {
+            // The expired delayed tasks are collected together with the other tasks.
+            ok = read(loop->timer_fd, &value, sizeof value);
+            if (ok < 0 && errno != EAGAIN) {
+                LOG_ERROR("Could not read event loop timer expirations. read: %s\n", strerror(errno));
+            }
+            continue;
+        }
 
-    task->callback(task->userdata);
-    free(task);
+        src = events[i].data.ptr;
+
+        // The source might've been destroyed by a handler earlier in this batch.
+        if (src->destroyed) {
+            continue;
+        }
+
+        dispatch_or_defer_src(loop, src, events[i].events);
+    }
 
-    sd_event_source_set_enabled(s, SD_EVENT_OFF);
-    sd_event_source_unref(s);
     return 0;
 }
 
-int evloop_post_task_locked(struct evloop *loop, void_callback_t callback, void *userdata) {
-    sd_event_source *src;
-    struct task *task;
-    int ok;
+#ifdef HAVE_LIBURING
+static void uring_dispatch_cqe(struct evloop *loop, struct io_uring_cqe *cqe) {
+    struct evsrc *src;
+    void *data;
+
+    data = io_uring_cqe_get_data(cqe);
+    if (data == NULL) {
+        // completion of a poll removal, nothing to do.
+        return;
+    } else if (data == &loop->wakeup_fd) {
+        if (cqe->res < 0) {
+            LOG_ERROR("Could not read event loop wakeup value. read: %s\n", strerror(-cqe->res));
+        }
+        uring_queue_wakeup_read(loop);
+        return;
+    }
 
-    ASSERT_NOT_NULL(loop);
-    ASSERT_NOT_NULL(callback);
-    ASSERT_MUTEX_LOCKED(loop->mutex);
+    src = data;
+    src->armed = false;
 
-    task = malloc(sizeof *task);
-    if (task == NULL) {
-        return ENOMEM;
+    if (src->destroyed) {
+        // This was the last completion for a cancelled source, we can free it now.
+        list_del(&src->entry);
+        free(src);
+        return;
     }
 
-    task->callback = callback;
-    task->userdata = userdata;
+    if (cqe->res < 0) {
+        LOG_ERROR("Could not wait for fd %d to become ready. IORING_OP_POLL_ADD: %s\n", src->fd, strerror(-cqe->res));
+        return;
+    }
 
-    ok = sd_event_add_defer(loop->sdloop, &src, on_execute_task, task);
-    if (ok < 0) {
-        LOG_ERROR("Error adding task to event loop. sd_event_add_defer: %s\n", strerror(-ok));
-        ok = -ok;
-        goto fail_free_task;
+    dispatch_or_defer_src(loop, src, (uint32_t) cqe->res);
+}
+
+static int uring_wait_and_dispatch(struct evloop *loop, bool nonblocking, uint64_t target_time_usec) {
+    struct __kernel_timespec timeout;
+    struct io_uring_cqe *cqe;
+    uint64_t now_usec, timeout_usec;
+    unsigned head, n_cqes;
+    int ok;
+
+    // Submitting all queued poll requests and waiting for completions is a single syscall.
+    if (nonblocking) {
+        ok = io_uring_submit(&loop->ring);
+    } else if (target_time_usec == UINT64_MAX) {
+        ok = io_uring_submit_and_wait(&loop->ring, 1);
+    } else {
+        now_usec = get_monotonic_time() / 1000;
+        timeout_usec = target_time_usec > now_usec ? target_time_usec - now_usec : 0;
+
+        timeout.tv_sec = timeout_usec / 1000000;
+        timeout.tv_nsec = (timeout_usec % 1000000) * 1000;
+
+        ok = io_uring_submit_and_wait_timeout(&loop->ring, &cqe, 1, &timeout, NULL);
     }
 
-    return 0;
+    if (ok < 0 && ok != -ETIME && ok != -EINTR && ok != -EBUSY) {
+        LOG_ERROR("Could not wait for event loop events. io_uring_submit_and_wait: %s\n", strerror(-ok));
+        return -ok;
+    }
 
-fail_remove_src:
-    sd_event_source_disable_unref(src);
+    on_woken_up(loop);
 
-fail_free_task:
-    free(task);
-    return ok;
+    loop->dispatching_io = true;
+
+    n_cqes = 0;
+    io_uring_for_each_cqe(&loop->ring, head, cqe) {
+        uring_dispatch_cqe(loop, cqe);
+        n_cqes++;
+    }
+    io_uring_cq_advance(&loop->ring, n_cqes);
+
+    return 0;
 }
+#endif
 
-int evloop_post_task(struct evloop *loop, void_callback_t callback, void *userdata) {
+int evloop_run(struct evloop *loop) {
+    struct list_head batch;
+    uint64_t target_time_usec;
+    bool nonblocking;
     int ok;
 
     ASSERT_NOT_NULL(loop);
-    ASSERT_NOT_NULL(callback);
+
+    list_inithead(&batch);
 
     evloop_lock(loop);
-    ok = evloop_post_task_locked(loop, callback, userdata);
-    evloop_unlock(loop);
+    for (;;) {
+        // Don't sleep if there are tasks ready or we should exit. Tasks posted after this point
+        // will see we're sleeping and wake us up.
+        nonblocking = !list_is_empty(&loop->tasks) || loop->exit_scheduled;
+        loop->sleeping = !nonblocking;
+        target_time_usec = loop->timer_target_usec;
+
+#ifdef HAVE_LIBURING
+        if (loop->uses_uring) {
+            list_for_each_entry_safe(struct evsrc, src, &loop->srcs_to_arm, arm_entry) {
+                list_del(&src->arm_entry);
+                src->arm_queued = false;
+                uring_arm_src(loop, src);
+            }
+        }
+#endif
 
-    wakeup_sdloop(loop);
+        evloop_unlock(loop);
 
-    return ok;
-}
+#ifdef HAVE_LIBURING
+        if (loop->uses_uring) {
+            ok = uring_wait_and_dispatch(loop, nonblocking, target_time_usec);
+        } else {
+            ok = epoll_wait_and_dispatch(loop, nonblocking);
+        }
+#else
+        (void) target_time_usec;
+        ok = epoll_wait_and_dispatch(loop, nonblocking);
+#endif
+        if (ok != 0) {
+            return ok;
+        }
 
-static int on_execute_delayed_task(sd_event_source *s, uint64_t usec, void *userdata) {
-    struct task *task;
+        evloop_lock(loop);
+        collect_batch_locked(loop, &batch);
+        evloop_unlock(loop);
 
-    ASSERT_NOT_NULL(userdata);
-    task = userdata;
-    (void) usec;
+        run_batch(loop, &batch);
+        list_inithead(&batch);
 
-    task->callback(task->userdata);
-    free(task);
+        // Sources destroyed by the tasks are still freed only after this, because
+        // there might be a low priority event for them.
+        dispatch_low_priority_srcs(loop);
+
+        loop->dispatching_io = false;
+        free_destroyed_srcs(loop);
+
+        evloop_lock(loop);
+        if (loop->exit_scheduled) {
+            break;
+        }
+    }
+
+    loop->exit_scheduled = false;
+    evloop_unlock(loop);
 
-    sd_event_source_disable_unref(s);
     return 0;
 }
 
-int evloop_post_delayed_task_locked(struct evloop *loop, void_callback_t callback, void *userdata, uint64_t target_time_usec) {
-    sd_event_source *src;
-    struct task *task;
-    int ok;
+int evloop_schedule_exit(struct evloop *loop) {
+    ASSERT_NOT_NULL(loop);
+
+    evloop_lock(loop);
+    loop->exit_scheduled = true;
+    wakeup_locked(loop);
+    evloop_unlock(loop);
+
+    return 0;
+}
+
+int evloop_post_task(struct evloop *loop, void_callback_t callback, void *userdata) {
+    struct evloop_task *task;
 
     ASSERT_NOT_NULL(loop);
     ASSERT_NOT_NULL(callback);
-    ASSERT_MUTEX_LOCKED(loop->mutex);
 
-    task = malloc(sizeof *task);
+    evloop_lock(loop);
+
+    task = alloc_task_locked(loop);
     if (task == NULL) {
+        evloop_unlock(loop);
         return ENOMEM;
     }
 
     task->callback = callback;
     task->userdata = userdata;
+    task->target_time_usec = 0;
+    list_addtail(&task->entry, &loop->tasks);
 
-    ok = sd_event_add_time(loop->sdloop, &src, CLOCK_MONOTONIC, target_time_usec, 1, on_execute_delayed_task, task);
-    if (ok < 0) {
-        LOG_ERROR("Error posting platform task to main loop. sd_event_add_time: %s\n", strerror(-ok));
-        ok = -ok;
-        goto fail_free_task;
-    }
+    wakeup_locked(loop);
 
+    evloop_unlock(loop);
     return 0;
-
-fail_remove_src:
-    sd_event_source_disable_unref(src);
-
-fail_free_task:
-    free(task);
-    return ok;
 }
 
 int evloop_post_delayed_task(struct evloop *loop, void_callback_t callback, void *userdata, uint64_t target_time_usec) {
-    int ok;
+    struct evloop_task *task;
+    struct list_head *insert_before;
 
     ASSERT_NOT_NULL(loop);
     ASSERT_NOT_NULL(callback);
 
     evloop_lock(loop);
-    ok = evloop_post_delayed_task_locked(loop, callback, userdata, target_time_usec);
-    evloop_unlock(loop);
 
-    wakeup_sdloop(loop);
+    task = alloc_task_locked(loop);
+    if (task == NULL) {
+        evloop_unlock(loop);
+        return ENOMEM;
+    }
 
-    return ok;
+    task->callback = callback;
+    task->userdata = userdata;
+    task->target_time_usec = target_time_usec;
+
+    // Keep the list sorted by target time, and tasks with the same target time in posting order.
+    // Most delayed tasks are posted in order, so search from the back.
+    insert_before = &loop->delayed_tasks;
+    list_for_each_entry_rev(struct evloop_task, other, &loop->delayed_tasks, entry) {
+        if (other->target_time_usec <= target_time_usec) {
+            break;
+        }
+        insert_before = &other->entry;
+    }
+    list_addtail(&task->entry, insert_before);
+
+    // With epoll, the timerfd wakes up the loop by itself. With io_uring,
+    // arm_timer_locked wakes up the loop if it's sleeping with a later timeout.
+    if (target_time_usec < loop->timer_target_usec) {
+        arm_timer_locked(loop, target_time_usec);
+    }
+
+    evloop_unlock(loop);
+    return 0;
 }
 
-struct evsrc {
-    struct evloop *loop;
-    sd_event_source *sdsrc;
+struct evsrc *evloop_add_io(struct evloop *loop, int fd, uint32_t events, evloop_io_handler_t callback, void *userdata) {
+    struct epoll_event event;
+    struct evsrc *src;
+    int ok;
 
-    evloop_io_handler_t io_callback;
-    void *userdata;
-};
+    ASSERT_NOT_NULL(loop);
+    ASSERT_NOT_NULL(callback);
 
-void evsrc_destroy_locked(struct evsrc *src) {
-    ASSERT_MUTEX_LOCKED(src->loop->mutex);
-    sd_event_source_disable_unref(src->sdsrc);
-    evloop_unref(src->loop);
-    free(src);
-}
+    src = malloc(sizeof *src);
+    if (src == NULL) {
+        return NULL;
+    }
 
-void evsrc_destroy(struct evsrc *src) {
-    evloop_lock(src->loop);
-    sd_event_source_disable_unref(src->sdsrc);
-    evloop_unlock(src->loop);
+    src->loop = loop;
+    src->fd = fd;
+    src->events = events;
+    src->destroyed = false;
+    src->low_priority = false;
+    src->callback = callback;
+    src->userdata = userdata;
 
-    evloop_unref(src->loop);
-    free(src);
-}
+    evloop_lock(loop);
 
-int on_io_src_ready(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
-    enum event_handler_return handler_return;
-    struct evsrc *evsrc;
+#ifdef HAVE_LIBURING
+    if (loop->uses_uring) {
+        // Only the loop thread may touch the submission queue, so let it submit the poll request.
+        src->arm_queued = true;
+        src->armed = false;
+        list_addtail(&src->arm_entry, &loop->srcs_to_arm);
+        list_addtail(&src->entry, &loop->srcs);
+        wakeup_locked(loop);
+        evloop_unlock(loop);
+        return src;
+    }
+#endif
 
-    ASSERT_NOT_NULL(s);
-    ASSERT_NOT_NULL(userdata);
-    evsrc = userdata;
+    event.events = events;
+    event.data.ptr = src;
 
-    handler_return = evsrc->io_callback(fd, revents, evsrc->userdata);
-    if (handler_return == kRemoveSrc_EventHandlerReturn) {
-        evsrc_destroy_locked(evsrc);
-        return -1;
+    // epoll_ctl is thread-safe and immediately affects a concurrent epoll_wait,
+    // so there's no need to wake up the loop here.
+    ok = epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+    if (ok < 0) {
+        LOG_ERROR("Could not add IO callback to event loop. epoll_ctl: %s\n", strerror(errno));
+        evloop_unlock(loop);
+        free(src);
+        return NULL;
     }
 
-    return 0;
+    list_addtail(&src->entry, &loop->srcs);
+
+    evloop_unlock(loop);
+    return src;
 }
 
-struct evsrc *evloop_add_io_locked(struct evloop *loop, int fd, uint32_t events, evloop_io_handler_t callback, void *userdata) {
-    sd_event_source *src;
-    struct evsrc *evsrc;
-    int ok;
+#ifdef HAVE_LIBURING
+/**
+ * @brief Removes the io_uring poll request for @param src.
+ *
+ * @returns true if @param src was armed and will be freed once its poll request completes.
+ */
+static bool uring_disarm_src(struct evloop *loop, struct evsrc *src) {
+    struct io_uring_sqe *sqe;
 
-    evsrc = malloc(sizeof *evsrc);
-    if (evsrc == NULL) {
-        return NULL;
+    evloop_lock(loop);
+    if (src->arm_queued) {
+        list_del(&src->arm_entry);
+        src->arm_queued = false;
     }
+    evloop_unlock(loop);
 
-    ASSERT_NOT_NULL(loop);
-    ASSERT_MUTEX_LOCKED(loop->mutex);
-
-    evsrc->io_callback = callback;
-    evsrc->userdata = userdata;
+    if (!src->armed) {
+        return false;
+    }
 
-    ok = sd_event_add_io(loop->sdloop, &src, fd, events, on_io_src_ready, evsrc);
-    if (ok < 0) {
-        LOG_ERROR("Could not add IO callback to event loop. sd_event_add_io: %s\n", strerror(-ok));
-        free(evsrc);
-        return NULL;
+    sqe = uring_get_sqe(loop);
+    if (sqe != NULL) {
+        io_uring_prep_poll_remove(sqe, (uint64_t) (uintptr_t) src);
+        io_uring_sqe_set_data(sqe, NULL);
+    } else {
+        LOG_ERROR("Couldn't cancel polling fd %d, the io_uring submission queue is full.\n", src->fd);
     }
 
-    evsrc->loop = evloop_ref(loop);
-    evsrc->sdsrc = sd_event_source_ref(src);
-    return evsrc;
+    // Even if we couldn't cancel it, the poll request will complete at some point.
+    src->destroyed = true;
+    list_addtail(&src->entry, &loop->cancelled_srcs);
+    return true;
 }
+#endif
 
-struct evsrc *evloop_add_io(struct evloop *loop, int fd, uint32_t events, evloop_io_handler_t callback, void *userdata) {
-    struct evsrc *src;
+void evsrc_destroy(struct evsrc *src) {
+    struct evloop *loop;
+    int ok;
 
-    ASSERT_NOT_NULL(loop);
-    ASSERT_NOT_NULL(callback);
+    ASSERT_NOT_NULL(src);
+    assert(!src->destroyed);
+
+    loop = src->loop;
 
     evloop_lock(loop);
-    src = evloop_add_io_locked(loop, fd, events, callback, userdata);
+    list_del(&src->entry);
     evloop_unlock(loop);
 
-    wakeup_sdloop(loop);
+#ifdef HAVE_LIBURING
+    if (loop->uses_uring) {
+        if (uring_disarm_src(loop, src)) {
+            return;
+        }
+    } else {
+        ok = epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, src->fd, NULL);
+        if (ok < 0) {
+            LOG_ERROR("Could not remove IO callback from event loop. epoll_ctl: %s\n", strerror(errno));
+        }
+    }
+#else
+    ok = epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, src->fd, NULL);
+    if (ok < 0) {
+        LOG_ERROR("Could not remove IO callback from event loop. epoll_ctl: %s\n", strerror(errno));
+    }
+#endif
+
+    if (loop->dispatching_io) {
+        // There might be another event for this source in the current batch (or a deferred
+        // low priority event), so free it only once the batch is dispatched.
+        src->destroyed = true;
+        list_addtail(&src->entry, &loop->destroyed_srcs);
+        return;
+    }
 
-    return src;
+    free(src);
+}
+
+void evsrc_set_low_priority(struct evsrc *src, bool low_priority) {
+    ASSERT_NOT_NULL(src);
+    src->low_priority = low_priority;
 }
 
 struct evthread {
@@ -459,114 +982,75 @@ struct evthread {
 };
 
 struct evthread_startup_args {
-    struct evthread *evthread;
+    struct evloop *loop;
     sem_t initialization_done;
-    bool initialization_success;
 };
 
 static void *evthread_entry(void *userdata) {
-    struct evthread *evthread;
-    struct evloop *evloop;
-    int ok;
-
-    // initialization.
-    {
-        struct evthread_startup_args *args;
-        ASSERT_NOT_NULL(userdata);
-        args = userdata;
-
-        evthread = malloc(sizeof *evthread);
-        if (evthread == NULL) {
-            goto fail_post_semaphore;
-        }
-
-        evloop = evloop_new();
-        if (evloop == NULL) {
-            goto fail_free_evthread;
-        }
-
-        evthread->loop = evloop;
-        evthread->thread = pthread_self();
+    struct evthread_startup_args *args;
+    struct evloop *loop;
 
-        args->initialization_success = true;
-        sem_post(&args->initialization_done);
-        goto init_done;
+    ASSERT_NOT_NULL(userdata);
+    args = userdata;
 
-// error handling
-fail_free_evthread:
-        free(evthread);
+    // args is freed by evthread_start as soon as we post the semaphore.
+    loop = evloop_new();
+    args->loop = loop;
+    sem_post(&args->initialization_done);
 
-fail_post_semaphore:
-        args->initialization_success = false;
-        sem_post(&args->initialization_done);
+    if (loop == NULL) {
         return NULL;
     }
 
-init_done:
-    evloop_run(evloop);
-    sd_event_unrefp(&evthread->loop);
+    evloop_run(loop);
+    evloop_unref(loop);
     return NULL;
 }
 
-struct evthread *evthread_start() {
-    struct evthread_startup_args *args;
+struct evthread *evthread_start(void) {
+    struct evthread_startup_args args;
     struct evthread *evthread;
-    pthread_t tid;
     int ok;
 
-    args = malloc(sizeof *args);
-    if (args == NULL) {
+    evthread = malloc(sizeof *evthread);
+    if (evthread == NULL) {
         return NULL;
     }
 
-    args->evthread = NULL;
-    args->initialization_success = false;
+    args.loop = NULL;
 
-    ok = sem_init(&args->initialization_done, 0, 0);
+    ok = sem_init(&args.initialization_done, 0, 0);
     if (ok != 0) {
-        goto fail_free_args;
+        goto fail_free_evthread;
     }
 
-    ok = pthread_create(&tid, NULL, evthread_entry, args);
+    ok = pthread_create(&evthread->thread, NULL, evthread_entry, &args);
     if (ok != 0) {
-        LOG_ERROR("Could not create new event thread. pthread_create: %s\n", strerror(-ok));
-        goto fail_deinit_semaphore;
+        LOG_ERROR("Could not create new event thread. pthread_create: %s\n", strerror(ok));
+        goto fail_destroy_semaphore;
     }
 
-    ok = sem_wait(&args->initialization_done);
-    if (ok != 0) {
-        LOG_ERROR("Couldn't wait for event thread initialization finish. sem_wait: %s\n", strerror(-ok));
-        goto fail_cancel_thread;
+    while (sem_wait(&args.initialization_done) != 0) {
+        ASSERT_EQUALS(errno, EINTR);
     }
 
-    if (!args->initialization_success) {
-        ok = pthread_join(tid, NULL);
-        if (ok != 0) {
-            LOG_ERROR("Couldn't wait for event thread to finish. pthread_join: %s\n", strerror(-ok));
-            goto fail_cancel_thread;
-        }
+    sem_destroy(&args.initialization_done);
 
-        sem_destroy(&args->initialization_done);
-        free(args);
+    if (args.loop == NULL) {
+        pthread_join(evthread->thread, NULL);
+        free(evthread);
         return NULL;
     }
 
-    sem_destroy(&args->initialization_done);
-
-    ASSERT_NOT_NULL(args->evthread);
-    evthread = args->evthread;
-    free(args);
-
+    // the thread holds its own reference until it exits.
+    evthread->loop = evloop_ref(args.loop);
     return evthread;
 
-fail_cancel_thread:
-    pthread_cancel(tid);
-
-fail_deinit_semaphore:
-    sem_destroy(&args->initialization_done);
+fail_destroy_semaphore:
+    sem_destroy(&args.initialization_done);
 
-fail_free_args:
-    free(args);
+fail_free_evthread:
+    free(evthread);
     return NULL;
 }
 
@@ -574,8 +1058,20 @@ struct evloop *evthread_get_evloop(struct evthread *thread) {
     return thread->loop;
 }
 
-void evthread_stop(struct evthread *thread) {
-    evloop_schedule_exit(thread->loop);
+static void on_exit_task(void *userdata) {
+    evloop_schedule_exit(userdata);
+}
+
+void evthread_join(struct evthread *thread) {
+    int ok;
+
+    // Posting the exit as a task makes sure all tasks posted before it are run first.
+    ok = evloop_post_task(thread->loop, on_exit_task, thread->loop);
+    if (ok != 0) {
+        evloop_schedule_exit(thread->loop);
+    }
+
     pthread_join(thread->thread, NULL);
+    evloop_unref(thread->loop);
     free(thread);
 }
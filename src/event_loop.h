@@ -2,7 +2,11 @@
 /*
  * Event Loop
  *
- * - multithreaded event loop
+ * - io_uring based event loop if liburing is available and the kernel supports it,
+ *   epoll based otherwise (with a timerfd for delayed tasks)
+ * - tasks can be posted from any thread, the loop is only woken up (using an eventfd)
+ *   if it's actually sleeping
+ * - all ready fds, tasks and expired delayed tasks are dispatched in one batch per wakeup
  *
  * Copyright (c) 2023, Hannes Winkler <hanneswinkler2000@web.de>
  */
@@ -10,52 +14,96 @@
 #ifndef _FLUTTERPI_SRC_EVENT_LOOP_H
 #define _FLUTTERPI_SRC_EVENT_LOOP_H
 
+#include <stdint.h>
+
+#include "util/collection.h"
 #include "util/refcounting.h"
 
 struct evloop;
 
-struct evloop *evloop_new();
+struct evloop *evloop_new(void);
 
 void evloop_destroy(struct evloop *loop);
 
 DECLARE_REF_OPS(evloop)
 
-int evloop_get_fd_locked(struct evloop *loop);
-
-int evloop_get_fd(struct evloop *loop);
-
+/**
+ * @brief Runs the event loop on the calling thread until @ref evloop_schedule_exit is called.
+ *
+ * Returns once the batch of events & tasks that's being dispatched when the exit is scheduled
+ * is finished (or the next batch, if the loop was sleeping). Tasks that are still queued at that
+ * point are kept and run by the next call to evloop_run. To run all tasks posted so far before
+ * exiting, post a task that calls @ref evloop_schedule_exit instead.
+ */
 int evloop_run(struct evloop *loop);
 
-int evloop_schedule_exit_locked(struct evloop *loop);
-
+/**
+ * @brief Makes @ref evloop_run return after the current batch of events is dispatched.
+ *
+ * Can be called from any thread.
+ */
 int evloop_schedule_exit(struct evloop *loop);
 
-int evloop_post_task_locked(struct evloop *loop, void_callback_t callback, void *userdata);
-
+/**
+ * @brief Runs @param callback on the loop thread as soon as possible.
+ *
+ * Can be called from any thread. Tasks are executed in the order they were posted.
+ */
 int evloop_post_task(struct evloop *loop, void_callback_t callback, void *userdata);
 
-int evloop_post_delayed_task_locked(struct evloop *loop, void_callback_t callback, void *userdata, uint64_t target_time_usec);
-
+/**
+ * @brief Runs @param callback on the loop thread at (or shortly after) @param target_time_usec,
+ * in the CLOCK_MONOTONIC timebase.
+ *
+ * Can be called from any thread.
+ */
 int evloop_post_delayed_task(struct evloop *loop, void_callback_t callback, void *userdata, uint64_t target_time_usec);
 
 struct evsrc;
-void evsrc_destroy_locked(struct evsrc *src);
-void evsrc_destroy(struct evsrc *src);
 
 enum event_handler_return { kNoAction_EventHandlerReturn, kRemoveSrc_EventHandlerReturn };
 
 typedef enum event_handler_return (*evloop_io_handler_t)(int fd, uint32_t revents, void *userdata);
 
-struct evsrc *evloop_add_io_locked(struct evloop *loop, int fd, uint32_t events, evloop_io_handler_t callback, void *userdata);
-
+/**
+ * @brief Calls @param callback on the loop thread every time @param fd is ready for any of @param events
+ * (EPOLLIN, EPOLLOUT, ...).
+ *
+ * Can be called from any thread. The source is owned by the loop, if it's not destroyed
+ * explicitly it's destroyed together with the loop.
+ */
 struct evsrc *evloop_add_io(struct evloop *loop, int fd, uint32_t events, evloop_io_handler_t callback, void *userdata);
 
+/**
+ * @brief Stops listening for the fd of @param src.
+ *
+ * Must be called on the loop thread (or while the loop is not running).
+ * It's safe to call this from inside any event handler of the loop.
+ */
+void evsrc_destroy(struct evsrc *src);
+
+/**
+ * @brief Makes the handler of @param src run only after all other ready sources and
+ * all tasks of the same wakeup are handled.
+ *
+ * Must be called on the loop thread (or while the loop is not running).
+ */
+void evsrc_set_low_priority(struct evsrc *src, bool low_priority);
+
 struct evthread;
 
-struct evthread *evthread_start();
+/**
+ * @brief Starts a new thread that runs an event loop.
+ */
+struct evthread *evthread_start(void);
 
 struct evloop *evthread_get_evloop(struct evthread *thread);
 
+/**
+ * @brief Makes the event loop of @param thread exit, waits for the thread to finish and frees it.
+ *
+ * Tasks posted to the loop before this call are still executed.
+ */
 void evthread_join(struct evthread *thread);
 
 #endif  // _FLUTTERPI_SRC_EVENT_LOOP_H
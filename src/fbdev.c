@@ -0,0 +1,527 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Linux Framebuffer Device
+ *
+ * - output on /dev/fbX devices
+ * - see fbdev.h for details
+ *
+ * Copyright (c) 2023, Hannes Winkler <hanneswinkler2000@web.de>
+ */
+
+#include "fbdev.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <linux/fb.h>
+
+#include "pixel_format.h"
+#include "pixel_format_conversion.h"
+#include "util/collection.h"
+#include "util/lock_ops.h"
+#include "util/logging.h"
+#include "util/refcounting.h"
+
+#include "config.h"
+
+struct fbdev {
+    refcount_t n_refs;
+    pthread_mutex_t mutex;
+
+    int fd;
+    struct fb_var_screeninfo var_info;
+    struct fb_fix_screeninfo fix_info;
+    enum pixfmt format;
+
+    /**
+     * @brief The variable screeninfo the framebuffer had before we opened it,
+     * restored on destroy if we changed the virtual size (or panned the display).
+     */
+    struct fb_var_screeninfo original_var_info;
+    bool resized_virtual;
+
+    /**
+     * @brief The mmapped framebuffer memory. Contains @ref n_buffers buffers of
+     * `var_info.yres` rows each, stacked vertically.
+     */
+    uint8_t *vmem;
+    size_t vmem_size;
+
+    int n_buffers;
+    int front_buffer;
+
+    bool supports_waitforvsync;
+};
+
+struct fbdev_commit_builder {
+    refcount_t n_refs;
+    struct fbdev *fbdev;
+
+    int buffer_index;
+    uint8_t *vaddr;
+    int n_layers;
+
+    /**
+     * @brief Two rows of ARGB8888 pixels, for converting and blending
+     * layers that don't have the framebuffer pixel format.
+     */
+    uint32_t *scratch;
+};
+
+DEFINE_STATIC_LOCK_OPS(fbdev, mutex)
+DEFINE_REF_OPS(fbdev, n_refs)
+DEFINE_REF_OPS(fbdev_commit_builder, n_refs)
+
+static bool fb_bitfield_equals(const struct fb_bitfield *a, const struct fb_bitfield *b) {
+    if (a->length != b->length) {
+        return false;
+    }
+
+    // offset doesn't matter for channels that aren't there.
+    return a->length == 0 || (a->offset == b->offset && a->msb_right == b->msb_right);
+}
+
+static bool get_pixfmt_for_var_screeninfo(const struct fb_var_screeninfo *var, enum pixfmt *format_out) {
+    for (enum pixfmt format = 0; format < PIXFMT_COUNT; format++) {
+        const struct pixfmt_info *info = get_pixfmt_info(format);
+
+        if (info->bits_per_pixel != (int) var->bits_per_pixel) {
+            continue;
+        }
+
+        if (fb_bitfield_equals(&info->fbdev_format.r, &var->red) && fb_bitfield_equals(&info->fbdev_format.g, &var->green) &&
+            fb_bitfield_equals(&info->fbdev_format.b, &var->blue) && fb_bitfield_equals(&info->fbdev_format.a, &var->transp)) {
+            *format_out = format;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static double calculate_refresh_rate(const struct fb_var_screeninfo *var) {
+    uint64_t htotal, vtotal;
+    double refresh_rate;
+
+    if (var->pixclock == 0) {
+        return 60.0;
+    }
+
+    htotal = (uint64_t) var->left_margin + var->xres + var->right_margin + var->hsync_len;
+    vtotal = (uint64_t) var->upper_margin + var->yres + var->lower_margin + var->vsync_len;
+    if (htotal == 0 || vtotal == 0) {
+        return 60.0;
+    }
+
+    // pixclock is the length of one pixel in picoseconds.
+    refresh_rate = 1e12 / ((double) var->pixclock * htotal * vtotal);
+    if (refresh_rate < 1.0 || refresh_rate > 1000.0) {
+        return 60.0;
+    }
+
+    return refresh_rate;
+}
+
+static void restore_var_screeninfo(int fd, const struct fb_var_screeninfo *original) {
+    struct fb_var_screeninfo var_info;
+    int ok;
+
+    var_info = *original;
+    var_info.activate = FB_ACTIVATE_NOW;
+
+    ok = ioctl(fd, FBIOPUT_VSCREENINFO, &var_info);
+    if (ok < 0) {
+        LOG_ERROR("Couldn't restore the original framebuffer configuration. ioctl(FBIOPUT_VSCREENINFO): %s\n", strerror(errno));
+    }
+}
+
+struct fbdev *fbdev_new_from_path(const char *path) {
+    struct fb_var_screeninfo var_info, original_var_info;
+    struct fb_fix_screeninfo fix_info;
+    struct fbdev *fbdev;
+    enum pixfmt format;
+    size_t buffer_size;
+    bool resized_virtual;
+    void *vmem;
+    int ok, fd, n_buffers;
+
+    ASSERT_NOT_NULL(path);
+
+    fbdev = malloc(sizeof *fbdev);
+    if (fbdev == NULL) {
+        return NULL;
+    }
+
+    fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        LOG_ERROR("Couldn't open framebuffer device \"%s\". open: %s\n", path, strerror(errno));
+        goto fail_free_fbdev;
+    }
+
+    ok = ioctl(fd, FBIOGET_FSCREENINFO, &fix_info);
+    if (ok < 0) {
+        LOG_ERROR("Couldn't query fixed framebuffer info. ioctl(FBIOGET_FSCREENINFO): %s\n", strerror(errno));
+        goto fail_close_fd;
+    }
+
+    ok = ioctl(fd, FBIOGET_VSCREENINFO, &var_info);
+    if (ok < 0) {
+        LOG_ERROR("Couldn't query variable framebuffer info. ioctl(FBIOGET_VSCREENINFO): %s\n", strerror(errno));
+        goto fail_close_fd;
+    }
+
+    if (fix_info.type != FB_TYPE_PACKED_PIXELS || fix_info.visual != FB_VISUAL_TRUECOLOR) {
+        LOG_ERROR("Framebuffer device \"%s\" doesn't use a packed, truecolor pixel layout. Only those are supported.\n", path);
+        goto fail_close_fd;
+    }
+
+    original_var_info = var_info;
+    resized_virtual = false;
+
+    // Try to make the virtual framebuffer twice as high as the visible one, so we can
+    // render into the off-screen half and then pan to it.
+    if (var_info.yres_virtual < var_info.yres * 2) {
+        struct fb_var_screeninfo wanted = var_info;
+
+        wanted.xres_virtual = var_info.xres;
+        wanted.yres_virtual = var_info.yres * 2;
+        wanted.xoffset = 0;
+        wanted.yoffset = 0;
+        wanted.activate = FB_ACTIVATE_NOW;
+
+        ok = ioctl(fd, FBIOPUT_VSCREENINFO, &wanted);
+        if (ok < 0) {
+            LOG_DEBUG("Couldn't enlarge virtual framebuffer for double-buffering. ioctl(FBIOPUT_VSCREENINFO): %s\n", strerror(errno));
+        } else {
+            resized_virtual = true;
+
+            ok = ioctl(fd, FBIOGET_VSCREENINFO, &var_info);
+            if (ok == 0) {
+                ok = ioctl(fd, FBIOGET_FSCREENINFO, &fix_info);
+            }
+            if (ok < 0) {
+                LOG_ERROR("Couldn't re-query framebuffer info. ioctl: %s\n", strerror(errno));
+                goto fail_restore_var_info;
+            }
+        }
+    }
+
+    ok = get_pixfmt_for_var_screeninfo(&var_info, &format);
+    if (!ok) {
+        LOG_ERROR(
+            "Framebuffer device \"%s\" has an unsupported pixel format. (bpp: %" PRIu32 ", r: %" PRIu32 "@%" PRIu32 ", g: %" PRIu32
+            "@%" PRIu32 ", b: %" PRIu32 "@%" PRIu32 ", a: %" PRIu32 "@%" PRIu32 ")\n",
+            path,
+            var_info.bits_per_pixel,
+            var_info.red.length,
+            var_info.red.offset,
+            var_info.green.length,
+            var_info.green.offset,
+            var_info.blue.length,
+            var_info.blue.offset,
+            var_info.transp.length,
+            var_info.transp.offset
+        );
+        goto fail_restore_var_info;
+    }
+
+    buffer_size = (size_t) fix_info.line_length * var_info.yres;
+
+    // ypanstep is zero if the driver doesn't support panning.
+    if (var_info.yres_virtual >= var_info.yres * 2 && fix_info.ypanstep != 0 && fix_info.smem_len >= buffer_size * 2) {
+        n_buffers = 2;
+    } else {
+        n_buffers = 1;
+    }
+
+    vmem = mmap(NULL, fix_info.smem_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (vmem == MAP_FAILED) {
+        LOG_ERROR("Couldn't map framebuffer memory. mmap: %s\n", strerror(errno));
+        goto fail_restore_var_info;
+    }
+
+    // If the display was blanked by the console, unblank it.
+    // Not all drivers support this, so ignore errors.
+    ioctl(fd, FBIOBLANK, FB_BLANK_UNBLANK);
+
+    LOG_DEBUG(
+        "Opened framebuffer device \"%s\" (%s): %" PRIu32 "x%" PRIu32 ", %s, %s\n",
+        path,
+        fix_info.id,
+        var_info.xres,
+        var_info.yres,
+        get_pixfmt_info(format)->name,
+        n_buffers == 2 ? "double-buffered" : "single-buffered"
+    );
+
+    pthread_mutex_init(&fbdev->mutex, get_default_mutex_attrs());
+    fbdev->n_refs = REFCOUNT_INIT_1;
+    fbdev->fd = fd;
+    fbdev->var_info = var_info;
+    fbdev->fix_info = fix_info;
+    fbdev->format = format;
+    fbdev->original_var_info = original_var_info;
+    fbdev->resized_virtual = resized_virtual;
+    fbdev->vmem = vmem;
+    fbdev->vmem_size = fix_info.smem_len;
+    fbdev->n_buffers = n_buffers;
+    fbdev->front_buffer = n_buffers == 2 && var_info.yoffset >= var_info.yres ? 1 : 0;
+    fbdev->supports_waitforvsync = true;
+    return fbdev;
+
+fail_restore_var_info:
+    if (resized_virtual) {
+        restore_var_screeninfo(fd, &original_var_info);
+    }
+
+fail_close_fd:
+    close(fd);
+
+fail_free_fbdev:
+    free(fbdev);
+    return NULL;
+}
+
+void fbdev_destroy(struct fbdev *fbdev) {
+    // Leave the framebuffer the way we found it, so the console (or whatever runs next) shows up again.
+    if (fbdev->resized_virtual || fbdev->var_info.yoffset != fbdev->original_var_info.yoffset) {
+        restore_var_screeninfo(fbdev->fd, &fbdev->original_var_info);
+    }
+
+    munmap(fbdev->vmem, fbdev->vmem_size);
+    close(fbdev->fd);
+    pthread_mutex_destroy(&fbdev->mutex);
+    free(fbdev);
+}
+
+struct vec2i fbdev_get_size(struct fbdev *fbdev) {
+    ASSERT_NOT_NULL(fbdev);
+    return VEC2I((int) fbdev->var_info.xres, (int) fbdev->var_info.yres);
+}
+
+enum pixfmt fbdev_get_pixel_format(struct fbdev *fbdev) {
+    ASSERT_NOT_NULL(fbdev);
+    return fbdev->format;
+}
+
+bool fbdev_get_physical_dimensions(struct fbdev *fbdev, int *width_mm_out, int *height_mm_out) {
+    ASSERT_NOT_NULL(fbdev);
+    ASSERT_NOT_NULL(width_mm_out);
+    ASSERT_NOT_NULL(height_mm_out);
+
+    // Drivers that don't know the dimensions report either 0 or -1.
+    if (fbdev->var_info.width == 0 || fbdev->var_info.height == 0 || fbdev->var_info.width == UINT32_MAX ||
+        fbdev->var_info.height == UINT32_MAX) {
+        return false;
+    }
+
+    *width_mm_out = (int) fbdev->var_info.width;
+    *height_mm_out = (int) fbdev->var_info.height;
+    return true;
+}
+
+double fbdev_get_refresh_rate(struct fbdev *fbdev) {
+    ASSERT_NOT_NULL(fbdev);
+    return calculate_refresh_rate(&fbdev->var_info);
+}
+
+bool fbdev_is_double_buffered(struct fbdev *fbdev) {
+    ASSERT_NOT_NULL(fbdev);
+    return fbdev->n_buffers > 1;
+}
+
+/**
+ * @brief Blends a row of premultiplied pixels on top of a framebuffer row, via ARGB8888.
+ *
+ * @param scratch must have room for 2 * @param n pixels.
+ */
+static void blend_row(void *dst, enum pixfmt dst_format, const void *src, enum pixfmt src_format, uint32_t *scratch, int n) {
+    const uint32_t *src_argb;
+    uint32_t *dst_argb;
+
+    if (src_format == PIXFMT_ARGB8888) {
+        src_argb = src;
+    } else {
+        pixfmt_convert_row(scratch, PIXFMT_ARGB8888, src, src_format, n);
+        src_argb = scratch;
+    }
+
+    // Note: Reading from framebuffer memory can be slow since it's usually mapped uncached.
+    // Only the layers above the bottom-most one are blended though.
+    if (dst_format == PIXFMT_ARGB8888 || dst_format == PIXFMT_XRGB8888) {
+        // Blend in-place, no need to go via the scratch buffer.
+        pixfmt_blend_row(dst, src_argb, n);
+    } else {
+        dst_argb = scratch + n;
+
+        pixfmt_convert_row(dst_argb, PIXFMT_ARGB8888, dst, dst_format, n);
+        pixfmt_blend_row(dst_argb, src_argb, n);
+        pixfmt_convert_row(dst, dst_format, dst_argb, PIXFMT_ARGB8888, n);
+    }
+}
+
+struct fbdev_commit_builder *fbdev_create_commit_builder(struct fbdev *fbdev) {
+    struct fbdev_commit_builder *builder;
+    size_t buffer_size;
+    int buffer_index;
+
+    ASSERT_NOT_NULL(fbdev);
+
+    builder = malloc(sizeof *builder);
+    if (builder == NULL) {
+        return NULL;
+    }
+
+    builder->scratch = malloc(2 * fbdev->var_info.xres * sizeof(uint32_t));
+    if (builder->scratch == NULL) {
+        free(builder);
+        return NULL;
+    }
+
+    fbdev_lock(fbdev);
+
+    // render into the off-screen buffer if we have one.
+    if (fbdev->n_buffers > 1) {
+        buffer_index = fbdev->front_buffer ^ 1;
+    } else {
+        buffer_index = fbdev->front_buffer;
+    }
+
+    fbdev_unlock(fbdev);
+
+    buffer_size = (size_t) fbdev->fix_info.line_length * fbdev->var_info.yres;
+
+    builder->n_refs = REFCOUNT_INIT_1;
+    builder->fbdev = fbdev_ref(fbdev);
+    builder->buffer_index = buffer_index;
+    builder->vaddr = fbdev->vmem + buffer_index * buffer_size;
+    builder->n_layers = 0;
+    return builder;
+}
+
+void fbdev_commit_builder_destroy(struct fbdev_commit_builder *builder) {
+    fbdev_unref(builder->fbdev);
+    free(builder->scratch);
+    free(builder);
+}
+
+struct fbdev *fbdev_commit_builder_get_fbdev(struct fbdev_commit_builder *builder) {
+    ASSERT_NOT_NULL(builder);
+    return builder->fbdev;
+}
+
+int fbdev_commit_builder_push_layer(struct fbdev_commit_builder *builder, const struct fbdev_layer *layer) {
+    const struct pixfmt_info *src_info, *dst_info;
+    struct fbdev *fbdev;
+    const uint8_t *src;
+    uint8_t *dst;
+    bool blend;
+    int x0, y0, x1, y1, width, dst_pitch;
+
+    ASSERT_NOT_NULL(builder);
+    ASSERT_NOT_NULL(layer);
+    ASSERT_NOT_NULL(layer->vaddr);
+    ASSERT_PIXFMT_VALID(layer->format);
+
+    fbdev = builder->fbdev;
+    src_info = get_pixfmt_info(layer->format);
+    dst_info = get_pixfmt_info(fbdev->format);
+    dst_pitch = fbdev->fix_info.line_length;
+
+    // clip the layer to the visible framebuffer.
+    x0 = MAX2(layer->dst_x, 0);
+    y0 = MAX2(layer->dst_y, 0);
+    x1 = MIN2(layer->dst_x + layer->width, (int) fbdev->var_info.xres);
+    y1 = MIN2(layer->dst_y + layer->height, (int) fbdev->var_info.yres);
+
+    if (builder->n_layers == 0 && (x0 != 0 || y0 != 0 || x1 != (int) fbdev->var_info.xres || y1 != (int) fbdev->var_info.yres)) {
+        // The bottom-most layer doesn't cover the whole screen. Make sure we don't show
+        // stale contents from an earlier frame around it.
+        memset(builder->vaddr, 0, (size_t) dst_pitch * fbdev->var_info.yres);
+    }
+
+    blend = builder->n_layers > 0 && !src_info->is_opaque;
+    builder->n_layers++;
+
+    if (x1 <= x0 || y1 <= y0) {
+        return 0;
+    }
+
+    width = x1 - x0;
+    src = (const uint8_t *) layer->vaddr + (size_t) (y0 - layer->dst_y) * layer->pitch +
+          (size_t) (x0 - layer->dst_x) * src_info->bits_per_pixel / 8;
+    dst = builder->vaddr + (size_t) y0 * dst_pitch + (size_t) x0 * dst_info->bits_per_pixel / 8;
+
+    for (int y = y0; y < y1; y++) {
+        if (blend) {
+            blend_row(dst, fbdev->format, src, layer->format, builder->scratch, width);
+        } else {
+            pixfmt_convert_row(dst, fbdev->format, src, layer->format, width);
+        }
+
+        src += layer->pitch;
+        dst += dst_pitch;
+    }
+
+    return 0;
+}
+
+int fbdev_commit_builder_commit(struct fbdev_commit_builder *builder) {
+    struct fb_var_screeninfo var_info;
+    struct fbdev *fbdev;
+    int ok;
+
+    ASSERT_NOT_NULL(builder);
+
+    fbdev = builder->fbdev;
+
+    fbdev_lock(fbdev);
+
+    if (fbdev->n_buffers > 1) {
+        var_info = fbdev->var_info;
+        var_info.xoffset = 0;
+        var_info.yoffset = builder->buffer_index * var_info.yres;
+        var_info.activate = FB_ACTIVATE_VBL;
+
+        ok = ioctl(fbdev->fd, FBIOPAN_DISPLAY, &var_info);
+        if (ok < 0) {
+            ok = errno;
+            LOG_ERROR("Couldn't flip framebuffer. ioctl(FBIOPAN_DISPLAY): %s\n", strerror(ok));
+            goto fail_unlock;
+        }
+
+        fbdev->var_info.yoffset = var_info.yoffset;
+        fbdev->front_buffer = builder->buffer_index;
+    }
+
+    // Wait for the flip to actually happen, so the next frame can safely
+    // render into the now off-screen buffer.
+    if (fbdev->supports_waitforvsync) {
+        uint32_t crtc = 0;
+
+        ok = ioctl(fbdev->fd, FBIO_WAITFORVSYNC, &crtc);
+        if (ok < 0) {
+            if (errno == ENOTTY || errno == EINVAL || errno == EOPNOTSUPP) {
+                LOG_DEBUG("Framebuffer driver doesn't support waiting for vsync. Frames may tear.\n");
+                fbdev->supports_waitforvsync = false;
+            } else {
+                LOG_ERROR("Couldn't wait for vsync. ioctl(FBIO_WAITFORVSYNC): %s\n", strerror(errno));
+            }
+        }
+    }
+
+    fbdev_unlock(fbdev);
+    return 0;
+
+fail_unlock:
+    fbdev_unlock(fbdev);
+    return ok;
+}
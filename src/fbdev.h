@@ -0,0 +1,135 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Linux Framebuffer Device
+ *
+ * - implements output on legacy linux framebuffer devices (/dev/fbX)
+ * - double-buffers using FBIOPAN_DISPLAY if the driver supports a virtual
+ *   framebuffer that's at least twice the height of the visible one
+ * - copies (and, if necessary, format-converts) rendered buffers into the
+ *   mmapped framebuffer memory
+ *
+ * Copyright (c) 2023, Hannes Winkler <hanneswinkler2000@web.de>
+ */
+
+#ifndef _FLUTTERPI_SRC_FBDEV_H
+#define _FLUTTERPI_SRC_FBDEV_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "pixel_format.h"
+#include "util/collection.h"
+#include "util/geometry.h"
+#include "util/refcounting.h"
+
+struct fbdev;
+struct fbdev_commit_builder;
+
+/**
+ * @brief Opens the framebuffer device at @param path, maps the framebuffer memory
+ * and tries to enable double-buffering.
+ *
+ * @param path The path to the framebuffer device, for example `/dev/fb0`.
+ * @return struct fbdev* The new fbdev instance, or NULL on error.
+ */
+MUST_CHECK struct fbdev *fbdev_new_from_path(const char *path);
+
+void fbdev_destroy(struct fbdev *fbdev);
+
+DECLARE_REF_OPS(fbdev)
+
+/**
+ * @brief The size of the visible framebuffer, in pixels.
+ */
+ATTR_PURE struct vec2i fbdev_get_size(struct fbdev *fbdev);
+
+/**
+ * @brief The pixel format of the framebuffer memory.
+ */
+ATTR_PURE enum pixfmt fbdev_get_pixel_format(struct fbdev *fbdev);
+
+/**
+ * @brief Returns true and stores the physical dimensions of the display in
+ * @param width_mm_out, @param height_mm_out if the driver reports them.
+ */
+bool fbdev_get_physical_dimensions(struct fbdev *fbdev, int *width_mm_out, int *height_mm_out);
+
+/**
+ * @brief The refresh rate of the display, calculated from the pixel clock and timings.
+ *
+ * Defaults to 60Hz if the driver doesn't report a pixel clock.
+ */
+ATTR_PURE double fbdev_get_refresh_rate(struct fbdev *fbdev);
+
+/**
+ * @brief True if the framebuffer memory is big enough to hold two frames and the
+ * driver supports panning, so we can render into an off-screen buffer.
+ */
+ATTR_PURE bool fbdev_is_double_buffered(struct fbdev *fbdev);
+
+/**
+ * @brief A layer that should be copied into the framebuffer.
+ *
+ * Layers are composited bottom-to-top in the order they're pushed. The first
+ * layer of a commit is copied as-is, all layers above it are blended on top
+ * (source-over, premultiplied alpha) if their pixel format has an alpha channel.
+ */
+struct fbdev_layer {
+    /**
+     * @brief CPU-accessible pointer to the first pixel of the source buffer.
+     */
+    const void *vaddr;
+
+    /**
+     * @brief Pixel format, dimensions and row pitch (in bytes) of the source buffer.
+     */
+    enum pixfmt format;
+    int width, height;
+    int pitch;
+
+    /**
+     * @brief Where the top-left corner of the source buffer should be placed inside
+     * the framebuffer. The layer is clipped to the framebuffer bounds.
+     *
+     * Scaling is not supported, the layer is always copied 1:1.
+     */
+    int dst_x, dst_y;
+};
+
+/**
+ * @brief Starts building a new frame.
+ *
+ * If the fbdev is double-buffered, all layers pushed into the builder are copied into the
+ * off-screen buffer, which is only made visible on @ref fbdev_commit_builder_commit.
+ * Otherwise, layers are copied directly into the visible framebuffer.
+ */
+MUST_CHECK struct fbdev_commit_builder *fbdev_create_commit_builder(struct fbdev *fbdev);
+
+void fbdev_commit_builder_destroy(struct fbdev_commit_builder *builder);
+
+DECLARE_REF_OPS(fbdev_commit_builder)
+
+struct fbdev *fbdev_commit_builder_get_fbdev(struct fbdev_commit_builder *builder);
+
+/**
+ * @brief Copies the layer contents into the framebuffer, converting the pixel format if necessary.
+ *
+ * The source buffer is not referenced anymore when this function returns, so it can be unmapped
+ * or released right afterwards.
+ *
+ * @param builder The commit builder.
+ * @param layer The layer to copy.
+ * @return int Zero on success, errno-code otherwise.
+ */
+int fbdev_commit_builder_push_layer(struct fbdev_commit_builder *builder, const struct fbdev_layer *layer);
+
+/**
+ * @brief Makes the frame visible by panning the display to the buffer the layers were copied into,
+ * and waits for the next vblank if the driver supports it.
+ *
+ * @param builder The commit builder.
+ * @return int Zero on success, errno-code otherwise.
+ */
+int fbdev_commit_builder_commit(struct fbdev_commit_builder *builder);
+
+#endif  // _FLUTTERPI_SRC_FBDEV_H
@@ -35,12 +35,14 @@
 #include <libinput.h>
 #include <libudev.h>
 #include <linux/input.h>
-#include <sys/eventfd.h>
-#include <systemd/sd-event.h>
+#include <sys/epoll.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
+#include "asset_prefetch.h"
 #include "compositor_ng.h"
+#include "event_loop.h"
+#include "fbdev.h"
 #include "filesystem_layout.h"
 #include "frame_scheduler.h"
 #include "keyboard.h"
@@ -51,7 +53,9 @@
 #include "pluginregistry.h"
 #include "plugins/raw_keyboard.h"
 #include "plugins/text_input.h"
+#include "startup.h"
 #include "texture_registry.h"
+#include "thread_pool.h"
 #include "tracer.h"
 #include "user_input.h"
 #include "util/list.h"
@@ -136,6 +140,21 @@ OPTIONS:\n\
   --videomode widthxheight@hz  Uses an output videomode that satisfies the argument.\n\
                              If no hz value is given, the highest possible refreshrate\n\
                              will be used.\n\
+\n\
+  --vrr                      Use variable refresh rate, if the display supports it.\n\
+                             Frames are shown as soon as they're rendered, instead\n\
+                             of at the next fixed vblank. Smoother animations when\n\
+                             the app can't keep up with the refresh rate of the\n\
+                             display, and less power usage when it's mostly idle.\n\
+\n\
+  --mirror                   Show the same content on all other connected displays\n\
+                             that support the resolution of the main display.\n\
+\n\
+  --render-scale <factor>    Render at the display resolution multiplied by\n\
+                             <factor> (greater than 0, at most 1) and let the\n\
+                             display controller upscale the frames. For example,\n\
+                             0.5 renders at 1920x1080 on a 4K display.\n\
+                             Ignored when using legacy modesetting.\n\
 \n\
   --dummy-display            Simulate a display. Useful for running apps\n\
                              without a display attached.\n\
@@ -143,6 +162,52 @@ OPTIONS:\n\
                              in pixels.\n\
 \n\
   --drm-fd                   An opened and valid DRM file descriptor\n\
+\n\
+  --fbdev <path>             Output to the legacy linux framebuffer device at\n\
+                             <path> (for example /dev/fb0) instead of using KMS.\n\
+                             flutter-pi will still render using the GPU and then\n\
+                             copy the rendered frames into the framebuffer.\n\
+                             If no usable KMS device is found, /dev/fb0 is used\n\
+                             automatically.\n\
+\n\
+  --input-coalescing         Send pointer events to flutter only once per frame,\n\
+                             merging all moves of a pointer since the last frame\n\
+                             into one. Reduces the load of high-rate touchscreens\n\
+                             and mice.\n\
+  --input-resampling         Like --input-coalescing, but additionally resample\n\
+                             pointer positions to the frame time. Gives smoother\n\
+                             scrolling and dragging.\n\
+\n\
+  --keyevents <mode>         Which key events to send to flutter. Valid values:\n\
+                               legacy: JSON key events on the flutter/keyevent\n\
+                                 channel, for the RawKeyboard API. (default)\n\
+                               embedder: Only send key events using the embedder\n\
+                                 API, for the HardwareKeyboard API. Cheaper for\n\
+                                 apps that don't use RawKeyboard anymore.\n\
+                               both: Send both kinds of key events.\n\
+\n\
+  --barcode-scanner <device> Treat the keyboard <device> as a barcode scanner.\n\
+                             <device> is either a USB vendor & product id in hex\n\
+                             (for example 05e0:1200), or the input device name.\n\
+                             Every scan is sent to flutter as one string on the\n\
+                             flutter-pi/barcode_scanner event channel, instead of\n\
+                             as individual key events. Can be given multiple times.\n\
+\n\
+  --prefetch-assets          Read the app snapshot & ICU data into memory in the\n\
+                             background while the display is being set up, and\n\
+                             queue reads for the files listed in the\n\
+                             .flutter-pi-prefetch manifest of the app bundle.\n\
+                             Speeds up startup when running from slow storage,\n\
+                             like SD cards.\n\
+\n\
+  --record-asset-access <seconds>\n\
+                             Record which files of the app bundle are opened\n\
+                             during the first <seconds> seconds after starting\n\
+                             the engine, and write them to the\n\
+                             .flutter-pi-prefetch manifest for --prefetch-assets.\n\
+\n\
+  --startup-trace            Print a timeline of the startup steps, and which of\n\
+                             them ran concurrently, once the engine is running.\n\
 \n\
   -h, --help                 Show this help and exit.\n\
 \n\
@@ -175,6 +240,18 @@ struct flutterpi {
 	 */
     struct drmdev *drmdev;
 
+    /**
+	 * @brief The framebuffer device, if we're outputting to a legacy fbdev instead of KMS.
+	 *
+	 */
+    struct fbdev *fbdev;
+
+    /**
+	 * @brief The GBM device we're rendering with.
+	 *
+	 */
+    struct gbm_device *gbm_device;
+
     /**
 	 * @brief The flutter event tracing interface.
 	 *
@@ -207,6 +284,59 @@ struct flutterpi {
 	 */
     // sd_event_source *user_input_event_source;
 
+    /**
+	 * @brief Whether pointer events are batched and sent to flutter once per vblank.
+	 *
+	 */
+    bool batch_input;
+
+    /**
+	 * @brief Whether the batched pointer events will be flushed at the next vblank.
+	 *
+	 */
+    bool input_flush_scheduled;
+    uint64_t input_flush_time_usec;
+
+    /**
+	 * @brief Whether a timer is armed to deliver timed-out barcode scans.
+	 *
+	 */
+    bool barcode_flush_scheduled;
+
+#ifdef BUILD_RAW_KEYBOARD_PLUGIN
+    /**
+	 * @brief Translates key events to flutter (HardwareKeyboard) key events.
+	 *
+	 * NULL if only legacy key events are sent.
+	 */
+    struct rawkb *rawkb;
+#endif
+
+    /**
+	 * @brief The startup context, until the engine is running.
+	 *
+	 */
+    struct startup *startup;
+
+    /**
+	 * @brief The asset prefetch task, if --prefetch-assets was given and it wasn't joined yet.
+	 *
+	 */
+    struct startup_task *prefetch_task;
+
+    /**
+	 * @brief How long to record asset accesses for the prefetch manifest, or 0 if they shouldn't be recorded.
+	 *
+	 */
+    int record_asset_access_secs;
+
+    /**
+	 * @brief The asset access recorder and its event source, while recording.
+	 *
+	 */
+    struct asset_access_recorder *asset_recorder;
+    struct evsrc *asset_recorder_source;
+
     /**
 	 * @brief The locales instance. Provides the system locales to flutter.
 	 *
@@ -238,18 +368,27 @@ struct flutterpi {
 
     /// main event loop
     pthread_t event_loop_thread;
-    pthread_mutex_t event_loop_mutex;
-    sd_event *event_loop;
-    int wakeup_event_loop_fd;
-
     struct evloop *evloop;
 
+#ifdef HAVE_LIBSYSTEMD
+    /// sd-event loop for the plugins that still use sd-event.
+    /// It's dispatched by the main event loop, @ref event_loop_mutex must be held when using it.
+    pthread_mutex_t event_loop_mutex;
+    sd_event *sd_event_loop;
+#endif
+
     /**
      * @brief Manages all plugins.
      *
      */
     struct plugin_registry *plugin_registry;
 
+    /**
+     * @brief Worker threads for plugin work that shouldn't block the platform thread.
+     *
+     */
+    struct thread_pool *thread_pool;
+
     /**
      * @brief Manages all external textures registered to the flutter engine.
      *
@@ -584,13 +723,11 @@ UNUSED static FlutterTransformation on_get_transformation(void *userdata) {
 
     compositor_get_view_geometry(flutterpi->compositor, &geometry);
 
-    return MAT3F_AS_FLUTTER_TRANSFORM(geometry.view_to_display_transform);
+    return MAT3F_AS_FLUTTER_TRANSFORM(geometry.view_to_render_transform);
 }
 
-atomic_int_least64_t platform_task_counter = 0;
-
 /// platform tasks
-static int on_execute_platform_task(sd_event_source *s, void *userdata) {
+static void on_execute_platform_task(void *userdata) {
     struct platform_task *task;
     int ok;
 
@@ -601,16 +738,10 @@ static int on_execute_platform_task(sd_event_source *s, void *userdata) {
     }
 
     free(task);
-
-    sd_event_source_set_enabled(s, SD_EVENT_OFF);
-    sd_event_source_unrefp(&s);
-
-    return 0;
 }
 
 int flutterpi_post_platform_task(int (*callback)(void *userdata), void *userdata) {
     struct platform_task *task;
-    sd_event_source *src;
     int ok;
 
     task = malloc(sizeof *task);
@@ -621,67 +752,18 @@ int flutterpi_post_platform_task(int (*callback)(void *userdata), void *userdata
     task->callback = callback;
     task->userdata = userdata;
 
-    if (pthread_self() != flutterpi->event_loop_thread) {
-        pthread_mutex_lock(&flutterpi->event_loop_mutex);
-    }
-
-    ok = sd_event_add_defer(flutterpi->event_loop, &src, on_execute_platform_task, task);
-    if (ok < 0) {
-        LOG_ERROR("Error posting platform task to main loop. sd_event_add_defer: %s\n", strerror(-ok));
-        ok = -ok;
-        goto fail_unlock_event_loop;
-    }
-
-    // Higher values mean lower priority. So later platform tasks are handled later too.
-    sd_event_source_set_priority(src, atomic_fetch_add(&platform_task_counter, 1));
-
-    if (pthread_self() != flutterpi->event_loop_thread) {
-        ok = write(flutterpi->wakeup_event_loop_fd, (uint8_t[8]){ 0, 0, 0, 0, 0, 0, 0, 1 }, 8);
-        if (ok < 0) {
-            ok = errno;
-            LOG_ERROR("Error arming main loop for platform task. write: %s\n", strerror(ok));
-            goto fail_unlock_event_loop;
-        }
-    }
-
-    if (pthread_self() != flutterpi->event_loop_thread) {
-        pthread_mutex_unlock(&flutterpi->event_loop_mutex);
-    }
-
-    return 0;
-
-fail_unlock_event_loop:
-    if (pthread_self() != flutterpi->event_loop_thread) {
-        pthread_mutex_unlock(&flutterpi->event_loop_mutex);
-    }
-
-    return ok;
-}
-
-/// timed platform tasks
-static int on_execute_platform_task_with_time(sd_event_source *s, uint64_t usec, void *userdata) {
-    struct platform_task *task;
-    int ok;
-
-    (void) usec;
-
-    task = userdata;
-    ok = task->callback(task->userdata);
+    ok = evloop_post_task(flutterpi->evloop, on_execute_platform_task, task);
     if (ok != 0) {
-        LOG_ERROR("Error executing timed platform task: %s\n", strerror(ok));
+        LOG_ERROR("Error posting platform task to main loop. evloop_post_task: %s\n", strerror(ok));
+        free(task);
+        return ok;
     }
 
-    free(task);
-
-    sd_event_source_set_enabled(s, SD_EVENT_OFF);
-    sd_event_source_unrefp(&s);
-
     return 0;
 }
 
 int flutterpi_post_platform_task_with_time(int (*callback)(void *userdata), void *userdata, uint64_t target_time_usec) {
     struct platform_task *task;
-    //sd_event_source *source;
     int ok;
 
     task = malloc(sizeof *task);
@@ -692,74 +774,55 @@ int flutterpi_post_platform_task_with_time(int (*callback)(void *userdata), void
     task->callback = callback;
     task->userdata = userdata;
 
-    if (pthread_self() != flutterpi->event_loop_thread) {
-        pthread_mutex_lock(&flutterpi->event_loop_mutex);
-    }
-
-    ok = sd_event_add_time(flutterpi->event_loop, NULL, CLOCK_MONOTONIC, target_time_usec, 1, on_execute_platform_task_with_time, task);
-    if (ok < 0) {
-        LOG_ERROR("Error posting platform task to main loop. sd_event_add_time: %s\n", strerror(-ok));
-        ok = -ok;
-        goto fail_unlock_event_loop;
-    }
-
-    if (pthread_self() != flutterpi->event_loop_thread) {
-        ok = write(flutterpi->wakeup_event_loop_fd, (uint8_t[8]){ 0, 0, 0, 0, 0, 0, 0, 1 }, 8);
-        if (ok < 0) {
-            perror("[flutter-pi] Error arming main loop for platform task. write");
-            ok = errno;
-            goto fail_unlock_event_loop;
-        }
-    }
-
-    if (pthread_self() != flutterpi->event_loop_thread) {
-        pthread_mutex_unlock(&flutterpi->event_loop_mutex);
+    ok = evloop_post_delayed_task(flutterpi->evloop, on_execute_platform_task, task, target_time_usec);
+    if (ok != 0) {
+        LOG_ERROR("Error posting platform task to main loop. evloop_post_delayed_task: %s\n", strerror(ok));
+        free(task);
+        return ok;
     }
 
     return 0;
-
-fail_unlock_event_loop:
-    if (pthread_self() != flutterpi->event_loop_thread) {
-        pthread_mutex_unlock(&flutterpi->event_loop_mutex);
-    }
-    free(task);
-    return ok;
 }
 
+#ifdef HAVE_LIBSYSTEMD
 int flutterpi_sd_event_add_io(sd_event_source **source_out, int fd, uint32_t events, sd_event_io_handler_t callback, void *userdata) {
     int ok;
 
-    if (pthread_self() != flutterpi->event_loop_thread) {
-        pthread_mutex_lock(&flutterpi->event_loop_mutex);
-    }
+    // The main event loop listens on the epoll fd of the sd-event loop, so it'll notice
+    // the new source without being woken up.
+    pthread_mutex_lock(&flutterpi->event_loop_mutex);
 
-    ok = sd_event_add_io(flutterpi->event_loop, source_out, fd, events, callback, userdata);
+    ok = sd_event_add_io(flutterpi->sd_event_loop, source_out, fd, events, callback, userdata);
     if (ok < 0) {
         LOG_ERROR("Could not add IO callback to event loop. sd_event_add_io: %s\n", strerror(-ok));
+        pthread_mutex_unlock(&flutterpi->event_loop_mutex);
         return -ok;
     }
 
-    if (pthread_self() != flutterpi->event_loop_thread) {
-        ok = write(flutterpi->wakeup_event_loop_fd, (uint8_t[8]){ 0, 0, 0, 0, 0, 0, 0, 1 }, 8);
-        if (ok < 0) {
-            perror("[flutter-pi] Error arming main loop for io callback. write");
-            ok = errno;
-            goto fail_unlock_event_loop;
-        }
-    }
+    pthread_mutex_unlock(&flutterpi->event_loop_mutex);
+    return 0;
+}
 
-    if (pthread_self() != flutterpi->event_loop_thread) {
-        pthread_mutex_unlock(&flutterpi->event_loop_mutex);
-    }
+static enum event_handler_return on_sd_event_ready(int fd, uint32_t revents, void *userdata) {
+    struct flutterpi *fpi;
+    int ok;
 
-    return 0;
+    (void) fd;
+    (void) revents;
 
-fail_unlock_event_loop:
-    if (pthread_self() != flutterpi->event_loop_thread) {
-        pthread_mutex_unlock(&flutterpi->event_loop_mutex);
+    fpi = userdata;
+
+    pthread_mutex_lock(&fpi->event_loop_mutex);
+
+    ok = sd_event_run(fpi->sd_event_loop, 0);
+    if (ok < 0) {
+        LOG_ERROR("Could not dispatch sd-event loop. sd_event_run: %s\n", strerror(-ok));
     }
-    return ok;
+
+    pthread_mutex_unlock(&fpi->event_loop_mutex);
+    return kNoAction_EventHandlerReturn;
 }
+#endif
 
 /// flutter tasks
 static int on_execute_flutter_task(void *userdata) {
@@ -969,6 +1032,12 @@ struct plugin_registry *flutterpi_get_plugin_registry(struct flutterpi *flutterp
     return flutterpi->plugin_registry;
 }
 
+struct thread_pool *flutterpi_get_thread_pool(struct flutterpi *flutterpi) {
+    ASSERT_NOT_NULL(flutterpi);
+    ASSERT_NOT_NULL(flutterpi->thread_pool);
+    return flutterpi->thread_pool;
+}
+
 FlutterPlatformMessageResponseHandle *
 flutterpi_create_platform_message_response_handle(struct flutterpi *flutterpi, FlutterDataCallback data_callback, void *userdata) {
     FlutterPlatformMessageResponseHandle *handle;
@@ -1028,7 +1097,7 @@ const char *flutterpi_get_asset_bundle_path(struct flutterpi *flutterpi) {
 
 /// TODO: Make this refcounted if we're gonna use it from multiple threads.
 struct gbm_device *flutterpi_get_gbm_device(struct flutterpi *flutterpi) {
-    return drmdev_get_gbm_device(flutterpi->drmdev);
+    return flutterpi->gbm_device;
 }
 
 bool flutterpi_has_gl_renderer(struct flutterpi *flutterpi) {
@@ -1045,6 +1114,16 @@ void flutterpi_set_pointer_kind(struct flutterpi *flutterpi, enum pointer_kind k
     return compositor_set_cursor(flutterpi->compositor, false, false, true, kind, false, VEC2F(0, 0));
 }
 
+int flutterpi_set_color_transform(struct flutterpi *flutterpi, const double *gamma_lut, size_t n_gamma_lut_entries, const double *ctm) {
+    ASSERT_NOT_NULL(flutterpi);
+    return compositor_set_color_transform(flutterpi->compositor, gamma_lut, n_gamma_lut_entries, ctm);
+}
+
+int flutterpi_capture(struct flutterpi *flutterpi, window_capture_cb_t callback, void *userdata) {
+    ASSERT_NOT_NULL(flutterpi);
+    return compositor_capture(flutterpi->compositor, callback, userdata);
+}
+
 void flutterpi_trace_event_instant(struct flutterpi *flutterpi, const char *name) {
     flutterpi->flutter.procs.TraceEventInstant(name);
 }
@@ -1061,38 +1140,25 @@ static bool runs_platform_tasks_on_current_thread(void *userdata) {
     return flutterpi_runs_platform_tasks_on_current_thread(userdata);
 }
 
-static int on_wakeup_main_loop(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
-    uint8_t buffer[8];
-    int ok;
-
-    (void) s;
-    (void) revents;
-    (void) userdata;
-
-    ok = read(fd, buffer, 8);
-    if (ok < 0) {
-        perror("[flutter-pi] Could not read mainloop wakeup userdata. read");
-        return errno;
-    }
-
-    return 0;
-}
-
 /**************************
  * DISPLAY INITIALIZATION *
  **************************/
-static int on_drmdev_ready(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+static enum event_handler_return on_drmdev_ready(int fd, uint32_t revents, void *userdata) {
     struct drmdev *drmdev;
+    int ok;
 
-    (void) s;
     (void) fd;
     (void) revents;
-    (void) userdata;
 
     ASSERT_NOT_NULL(userdata);
     drmdev = userdata;
 
-    return drmdev_on_event_fd_ready(drmdev);
+    ok = drmdev_on_event_fd_ready(drmdev);
+    if (ok != 0) {
+        LOG_ERROR("Couldn't handle DRM events. drmdev_on_event_fd_ready: %s\n", strerror(ok));
+    }
+
+    return kNoAction_EventHandlerReturn;
 }
 
 static const FlutterLocale *on_compute_platform_resolved_locales(const FlutterLocale **locales, size_t n_locales) {
@@ -1375,81 +1441,79 @@ static FlutterEngine create_flutter_engine(
     return engine;
 }
 
-static int flutterpi_run(struct flutterpi *flutterpi) {
-    FlutterEngineProcTable *procs;
-    struct view_geometry geometry;
-    FlutterEngineResult engine_result;
-    FlutterEngine engine;
-    int ok, evloop_fd;
+static enum event_handler_return on_asset_recorder_fd_ready(int fd, uint32_t revents, void *userdata) {
+    struct flutterpi *fpi;
 
-    procs = &flutterpi->flutter.procs;
+    (void) fd;
+    (void) revents;
 
-    if (flutterpi->libseat != NULL) {
-#ifdef HAVE_LIBSEAT
-        ok = libseat_dispatch(flutterpi->libseat, 0);
-        if (ok < 0) {
-            LOG_ERROR("initial libseat dispatch failed. libseat_dispatch: %s\n", strerror(errno));
-        }
-#else
-        UNREACHABLE();
-#endif
-    }
+    fpi = userdata;
 
-    ok = plugin_registry_ensure_plugins_initialized(flutterpi->plugin_registry);
+    asset_access_recorder_on_fd_ready(fpi->asset_recorder);
+    return kNoAction_EventHandlerReturn;
+}
+
+static void stop_asset_access_recording(struct flutterpi *fpi) {
+    evsrc_destroy(fpi->asset_recorder_source);
+    asset_access_recorder_destroy(fpi->asset_recorder);
+    fpi->asset_recorder_source = NULL;
+    fpi->asset_recorder = NULL;
+}
+
+static void on_asset_recording_done(void *userdata) {
+    struct flutterpi *fpi;
+    int ok;
+
+    fpi = userdata;
+
+    // pick up the accesses that happened since the fd was last dispatched.
+    asset_access_recorder_on_fd_ready(fpi->asset_recorder);
+
+    ok = asset_access_recorder_write_manifest(fpi->asset_recorder);
     if (ok != 0) {
-        LOG_ERROR("Could not initialize plugins.\n");
-        return EINVAL;
+        LOG_ERROR("Couldn't write the asset prefetch manifest. asset_access_recorder_write_manifest: %s\n", strerror(ok));
     }
 
-    engine = create_flutter_engine(
-        flutterpi->vk_renderer,
-        flutterpi->flutter.paths,
-        flutterpi->flutter.engine_argc,
-        flutterpi->flutter.engine_argv,
-        flutterpi->compositor,
-        flutterpi->flutter.aot_data,
-        &flutterpi->flutter.procs
-    );
-    if (engine == NULL) {
-        return EINVAL;
-    }
+    stop_asset_access_recording(fpi);
+}
 
-    flutterpi->flutter.engine = engine;
+static void start_asset_access_recording(struct flutterpi *fpi) {
+    uint64_t deadline_us;
+    int ok;
 
-    engine_result = procs->RunInitialized(engine);
-    if (engine_result != kSuccess) {
-        LOG_ERROR("Could not run the flutter engine. FlutterEngineRunInitialized: %s\n", FLUTTER_RESULT_TO_STRING(engine_result));
-        ok = EIO;
-        goto fail_deinitialize_engine;
+    fpi->asset_recorder = asset_access_recorder_new(fpi->flutter.paths);
+    if (fpi->asset_recorder == NULL) {
+        LOG_ERROR("Couldn't start recording asset accesses.\n");
+        return;
     }
 
-    ok = locales_add_to_fl_engine(flutterpi->locales, engine, procs->UpdateLocales);
-    if (ok != 0) {
-        goto fail_shutdown_engine;
+    fpi->asset_recorder_source =
+        evloop_add_io(fpi->evloop, asset_access_recorder_get_fd(fpi->asset_recorder), EPOLLIN, on_asset_recorder_fd_ready, fpi);
+    if (fpi->asset_recorder_source == NULL) {
+        LOG_ERROR("Couldn't listen for asset accesses.\n");
+        asset_access_recorder_destroy(fpi->asset_recorder);
+        fpi->asset_recorder = NULL;
+        return;
     }
 
-    FlutterEngineDisplay display;
-    memset(&display, 0, sizeof(display));
-
-    display.struct_size = sizeof(FlutterEngineDisplay);
-    display.display_id = 0;
-    display.single_display = true;
-    display.refresh_rate = compositor_get_refresh_rate(flutterpi->compositor);
+    deadline_us = get_monotonic_time() / 1000 + (uint64_t) fpi->record_asset_access_secs * 1000000;
 
-    engine_result = procs->NotifyDisplayUpdate(engine, kFlutterEngineDisplaysUpdateTypeStartup, &display, 1);
-    if (engine_result != kSuccess) {
-        ok = EINVAL;
-        LOG_ERROR(
-            "Could not send display update to flutter engine. FlutterEngineNotifyDisplayUpdate: %s\n",
-            FLUTTER_RESULT_TO_STRING(engine_result)
-        );
-        goto fail_shutdown_engine;
+    ok = evloop_post_delayed_task(fpi->evloop, on_asset_recording_done, fpi, deadline_us);
+    if (ok != 0) {
+        LOG_ERROR("Couldn't schedule the end of asset access recording. evloop_post_delayed_task: %s\n", strerror(ok));
+        stop_asset_access_recording(fpi);
+        return;
     }
+}
+
+static int send_window_metrics(struct flutterpi *flutterpi) {
+    FlutterWindowMetricsEvent window_metrics_event;
+    FlutterEngineResult engine_result;
+    struct view_geometry geometry;
 
     compositor_get_view_geometry(flutterpi->compositor, &geometry);
 
     // just so we get an error if the window metrics event was expanded without us noticing
-    FlutterWindowMetricsEvent window_metrics_event;
     memset(&window_metrics_event, 0, sizeof(window_metrics_event));
 
     window_metrics_event.struct_size = sizeof(FlutterWindowMetricsEvent);
@@ -1463,96 +1527,174 @@ static int flutterpi_run(struct flutterpi *flutterpi) {
     window_metrics_event.physical_view_inset_bottom = 0;
     window_metrics_event.physical_view_inset_left = 0;
 
-    // update window size
-    engine_result = procs->SendWindowMetricsEvent(engine, &window_metrics_event);
+    engine_result = flutterpi->flutter.procs.SendWindowMetricsEvent(flutterpi->flutter.engine, &window_metrics_event);
     if (engine_result != kSuccess) {
         LOG_ERROR(
             "Could not send window metrics to flutter engine. FlutterEngineSendWindowMetricsEvent: %s\n",
             FLUTTER_RESULT_TO_STRING(engine_result)
         );
-        goto fail_shutdown_engine;
+        return EINVAL;
     }
 
-    pthread_mutex_lock(&flutterpi->event_loop_mutex);
+    return 0;
+}
 
-    ok = sd_event_get_fd(flutterpi->event_loop);
-    if (ok < 0) {
-        ok = -ok;
-        LOG_ERROR("Could not get fd for main event loop. sd_event_get_fd: %s\n", strerror(ok));
-        pthread_mutex_unlock(&flutterpi->event_loop_mutex);
-        goto fail_shutdown_engine;
+/// Called on the platform thread when another display was connected.
+static int on_update_view_geometry(void *userdata) {
+    struct view_geometry geometry;
+    struct flutterpi *flutterpi;
+
+    ASSERT_NOT_NULL(userdata);
+    flutterpi = userdata;
+
+    compositor_get_view_geometry(flutterpi->compositor, &geometry);
+
+    if (flutterpi->user_input != NULL) {
+        user_input_set_transform(
+            flutterpi->user_input,
+            &geometry.display_to_view_transform,
+            &geometry.view_to_display_transform,
+            geometry.display_size.x,
+            geometry.display_size.y
+        );
     }
 
-    pthread_mutex_unlock(&flutterpi->event_loop_mutex);
+    // If the engine isn't running yet, it'll get the new metrics when it's started.
+    if (flutterpi->flutter.engine != NULL) {
+        send_window_metrics(flutterpi);
+    }
 
-    evloop_fd = ok;
-
-    {
-        fd_set rfds, wfds, xfds;
-        int state;
-        FD_ZERO(&rfds);
-        FD_ZERO(&wfds);
-        FD_ZERO(&xfds);
-        FD_SET(evloop_fd, &rfds);
-        FD_SET(evloop_fd, &wfds);
-        FD_SET(evloop_fd, &xfds);
-
-        const fd_set const_fds = rfds;
-
-        pthread_mutex_lock(&flutterpi->event_loop_mutex);
-
-        do {
-            state = sd_event_get_state(flutterpi->event_loop);
-            switch (state) {
-                case SD_EVENT_INITIAL:
-                    ok = sd_event_prepare(flutterpi->event_loop);
-                    if (ok < 0) {
-                        ok = -ok;
-                        LOG_ERROR("Could not prepare event loop. sd_event_prepare: %s\n", strerror(ok));
-                        goto fail_shutdown_engine;
-                    }
+    return 0;
+}
 
-                    break;
-                case SD_EVENT_ARMED:
-                    pthread_mutex_unlock(&flutterpi->event_loop_mutex);
-
-                    do {
-                        rfds = const_fds;
-                        wfds = const_fds;
-                        xfds = const_fds;
-                        ok = select(evloop_fd + 1, &rfds, &wfds, &xfds, NULL);
-                        if ((ok < 0) && (errno != EINTR)) {
-                            ok = errno;
-                            LOG_ERROR("Could not wait for event loop events. select: %s\n", strerror(ok));
-                            goto fail_shutdown_engine;
-                        }
-                    } while ((ok < 0) && (errno == EINTR));
-
-                    pthread_mutex_lock(&flutterpi->event_loop_mutex);
-
-                    ok = sd_event_wait(flutterpi->event_loop, 0);
-                    if (ok < 0) {
-                        ok = -ok;
-                        LOG_ERROR("Could not check for event loop events. sd_event_wait: %s\n", strerror(ok));
-                        goto fail_shutdown_engine;
-                    }
+static enum listener_return on_window_geometry_changed(void *arg, void *userdata) {
+    struct flutterpi *flutterpi;
+    int ok;
 
-                    break;
-                case SD_EVENT_PENDING:
-                    ok = sd_event_dispatch(flutterpi->event_loop);
-                    if (ok < 0) {
-                        ok = -ok;
-                        LOG_ERROR("Could not dispatch event loop events. sd_event_dispatch: %s\n", strerror(ok));
-                        goto fail_shutdown_engine;
-                    }
+    ASSERT_NOT_NULL(userdata);
+    flutterpi = userdata;
 
-                    break;
-                case SD_EVENT_FINISHED: break;
-                default: UNREACHABLE();
-            }
-        } while (state != SD_EVENT_FINISHED);
+    // Called with the initial (NULL) state when registering, the geometry didn't change then.
+    if (arg == NULL) {
+        return kNoAction;
+    }
 
-        pthread_mutex_unlock(&flutterpi->event_loop_mutex);
+    // The window can also change its geometry while presenting a frame on the raster thread
+    // (when it has to disable the render scale).
+    if (flutterpi_runs_platform_tasks_on_current_thread(flutterpi)) {
+        on_update_view_geometry(flutterpi);
+    } else {
+        ok = flutterpi_post_platform_task(on_update_view_geometry, flutterpi);
+        if (ok != 0) {
+            LOG_ERROR("Couldn't defer updating the view geometry.\n");
+        }
+    }
+
+    return kNoAction;
+}
+
+static int flutterpi_run(struct flutterpi *flutterpi) {
+    FlutterEngineProcTable *procs;
+    FlutterEngineResult engine_result;
+    FlutterEngine engine;
+    int ok, step;
+
+    procs = &flutterpi->flutter.procs;
+
+    if (flutterpi->libseat != NULL) {
+#ifdef HAVE_LIBSEAT
+        ok = libseat_dispatch(flutterpi->libseat, 0);
+        if (ok < 0) {
+            LOG_ERROR("initial libseat dispatch failed. libseat_dispatch: %s\n", strerror(errno));
+        }
+#else
+        UNREACHABLE();
+#endif
+    }
+
+    step = startup_begin_step(flutterpi->startup, "plugins init");
+    ok = plugin_registry_ensure_plugins_initialized(flutterpi->plugin_registry);
+    startup_end_step(flutterpi->startup, step);
+    if (ok != 0) {
+        LOG_ERROR("Could not initialize plugins.\n");
+        return EINVAL;
+    }
+
+    if (flutterpi->prefetch_task != NULL) {
+        // The engine reads the snapshot & ICU data right away when initializing, so there's
+        // no point in letting it race the prefetcher for them.
+        startup_join_task(flutterpi->startup, flutterpi->prefetch_task);
+        flutterpi->prefetch_task = NULL;
+    }
+
+    if (flutterpi->record_asset_access_secs > 0) {
+        // Start recording only after the prefetcher is done, so we don't record its accesses.
+        start_asset_access_recording(flutterpi);
+    }
+
+    step = startup_begin_step(flutterpi->startup, "engine initialize");
+    engine = create_flutter_engine(
+        flutterpi->vk_renderer,
+        flutterpi->flutter.paths,
+        flutterpi->flutter.engine_argc,
+        flutterpi->flutter.engine_argv,
+        flutterpi->compositor,
+        flutterpi->flutter.aot_data,
+        &flutterpi->flutter.procs
+    );
+    startup_end_step(flutterpi->startup, step);
+    if (engine == NULL) {
+        return EINVAL;
+    }
+
+    flutterpi->flutter.engine = engine;
+
+    step = startup_begin_step(flutterpi->startup, "engine run");
+    engine_result = procs->RunInitialized(engine);
+    startup_end_step(flutterpi->startup, step);
+    if (engine_result != kSuccess) {
+        LOG_ERROR("Could not run the flutter engine. FlutterEngineRunInitialized: %s\n", FLUTTER_RESULT_TO_STRING(engine_result));
+        ok = EIO;
+        goto fail_deinitialize_engine;
+    }
+
+    ok = locales_add_to_fl_engine(flutterpi->locales, engine, procs->UpdateLocales);
+    if (ok != 0) {
+        goto fail_shutdown_engine;
+    }
+
+    FlutterEngineDisplay display;
+    memset(&display, 0, sizeof(display));
+
+    display.struct_size = sizeof(FlutterEngineDisplay);
+    display.display_id = 0;
+    display.single_display = true;
+    display.refresh_rate = compositor_get_refresh_rate(flutterpi->compositor);
+
+    engine_result = procs->NotifyDisplayUpdate(engine, kFlutterEngineDisplaysUpdateTypeStartup, &display, 1);
+    if (engine_result != kSuccess) {
+        ok = EINVAL;
+        LOG_ERROR(
+            "Could not send display update to flutter engine. FlutterEngineNotifyDisplayUpdate: %s\n",
+            FLUTTER_RESULT_TO_STRING(engine_result)
+        );
+        goto fail_shutdown_engine;
+    }
+
+    // update window size
+    ok = send_window_metrics(flutterpi);
+    if (ok != 0) {
+        goto fail_shutdown_engine;
+    }
+
+    // startup is complete at this point.
+    startup_print_trace(flutterpi->startup);
+    startup_destroy(flutterpi->startup);
+    flutterpi->startup = NULL;
+
+    ok = evloop_run(flutterpi->evloop);
+    if (ok != 0) {
+        goto fail_shutdown_engine;
     }
 
     // We deinitialize the plugins here so plugins don't attempt to use the
@@ -1575,12 +1717,6 @@ fail_deinitialize_engine:
 }
 
 void flutterpi_schedule_exit(struct flutterpi *flutterpi) {
-    int ok;
-
-    if (pthread_self() != flutterpi->event_loop_thread) {
-        pthread_mutex_lock(&flutterpi->event_loop_mutex);
-    }
-
     // There's a race condition here:
     //
     // Other threads can always call flutterpi_post_platform_task(). We can only
@@ -1597,20 +1733,7 @@ void flutterpi_schedule_exit(struct flutterpi *flutterpi) {
     //    leaks.
     //
     // There's not really a nice solution here, but we use the 2nd option here.
-    ok = sd_event_exit(flutterpi->event_loop, 0);
-    if (ok < 0) {
-        LOG_ERROR("Could not schedule application exit. sd_event_exit: %s\n", strerror(-ok));
-        if (pthread_self() != flutterpi->event_loop_thread) {
-            pthread_mutex_unlock(&flutterpi->event_loop_mutex);
-        }
-        return;
-    }
-
-    if (pthread_self() != flutterpi->event_loop_thread) {
-        pthread_mutex_unlock(&flutterpi->event_loop_mutex);
-    }
-
-    return;
+    evloop_schedule_exit(flutterpi->evloop);
 }
 
 /**************
@@ -1686,6 +1809,79 @@ on_gtk_keyevent(void *userdata, uint32_t unicode_scalar_values, uint32_t key_cod
 #endif
 }
 
+static void on_key_event(
+    // clang-format off
+    void *userdata,
+    uint64_t timestamp_us,
+    xkb_keycode_t xkb_keycode,
+    xkb_keysym_t xkb_keysym,
+    uint32_t plain_codepoint,
+    key_modifiers_t modifiers,
+    const char *text,
+    bool is_down,
+    bool is_repeat
+    // clang-format on
+) {
+    struct flutterpi *flutterpi;
+    int ok;
+
+#ifdef BUILD_RAW_KEYBOARD_PLUGIN
+    flutterpi = userdata;
+    if (flutterpi->rawkb == NULL) {
+        return;
+    }
+
+    ok = rawkb_on_key_event(flutterpi->rawkb, timestamp_us, xkb_keycode, xkb_keysym, plain_codepoint, modifiers, text, is_down, is_repeat);
+    if (ok != 0) {
+        LOG_ERROR("Error handling keyboard event. rawkb_on_key_event: %s\n", strerror(ok));
+    }
+#else
+    (void) userdata;
+    (void) flutterpi;
+    (void) timestamp_us;
+    (void) xkb_keycode;
+    (void) xkb_keysym;
+    (void) plain_codepoint;
+    (void) modifiers;
+    (void) text;
+    (void) is_down;
+    (void) is_repeat;
+    (void) ok;
+#endif
+}
+
+#ifdef BUILD_RAW_KEYBOARD_PLUGIN
+static void on_send_key_event(void *userdata, const FlutterKeyEvent *event) {
+    struct flutterpi *flutterpi;
+    FlutterEngineResult engine_result;
+
+    flutterpi = userdata;
+
+    engine_result = flutterpi->flutter.procs.SendKeyEvent(flutterpi->flutter.engine, event, NULL, NULL);
+    if (engine_result != kSuccess) {
+        LOG_ERROR("Error sending key event to flutter. FlutterEngineSendKeyEvent: %s\n", FLUTTER_RESULT_TO_STRING(engine_result));
+    }
+}
+#endif
+
+static void on_barcode_scan(void *userdata, const char *device_name, const char *text) {
+    int ok;
+
+    // barcode scans are sent on the global raw keyboard channel, no flutterpi state needed.
+    (void) userdata;
+
+#ifdef BUILD_RAW_KEYBOARD_PLUGIN
+    ok = rawkb_send_barcode_scan(device_name, text);
+    if (ok != 0) {
+        LOG_ERROR("Error sending barcode scan to flutter. rawkb_send_barcode_scan: %s\n", strerror(ok));
+    }
+#else
+    (void) device_name;
+    (void) text;
+    (void) ok;
+#endif
+}
+
 static void on_switch_vt(void *userdata, int vt) {
     struct flutterpi *flutterpi;
 
@@ -1821,16 +2017,83 @@ static void on_user_input_close(int fd, void *userdata) {
     }
 }
 
-static int on_user_input_fd_ready(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
-    struct user_input *input;
+static void on_flush_pointer_events(void *userdata) {
+    struct flutterpi *fpi;
+
+    fpi = userdata;
+    fpi->input_flush_scheduled = false;
+
+    // the vblank we scheduled this for, so the frame time.
+    user_input_flush_pointer_events(fpi->user_input, fpi->input_flush_time_usec);
+}
+
+static void on_flush_barcode_scans(void *userdata);
+
+static void maybe_schedule_barcode_flush(struct flutterpi *fpi) {
+    uint64_t deadline_us;
+    int ok;
+
+    if (fpi->barcode_flush_scheduled || !user_input_get_barcode_flush_deadline(fpi->user_input, &deadline_us)) {
+        return;
+    }
+
+    ok = evloop_post_delayed_task(fpi->evloop, on_flush_barcode_scans, fpi, deadline_us);
+    if (ok != 0) {
+        LOG_ERROR("Couldn't schedule barcode scan flush. evloop_post_delayed_task: %s\n", strerror(ok));
+        return;
+    }
+
+    fpi->barcode_flush_scheduled = true;
+}
+
+static void on_flush_barcode_scans(void *userdata) {
+    struct flutterpi *fpi;
+
+    fpi = userdata;
+    fpi->barcode_flush_scheduled = false;
+
+    user_input_flush_barcode_scans(fpi->user_input, get_monotonic_time() / 1000);
+
+    // another scanner might still be in the middle of a scan.
+    maybe_schedule_barcode_flush(fpi);
+}
+
+static enum event_handler_return on_user_input_fd_ready(int fd, uint32_t revents, void *userdata) {
+    struct flutterpi *fpi;
+    uint64_t next_vblank_ns;
+    int ok;
 
-    (void) s;
     (void) fd;
     (void) revents;
 
-    input = userdata;
+    fpi = userdata;
+
+    ok = user_input_on_fd_ready(fpi->user_input);
+    if (ok != 0) {
+        LOG_ERROR("Couldn't handle user input events. user_input_on_fd_ready: %s\n", strerror(ok));
+        return kNoAction_EventHandlerReturn;
+    }
 
-    return user_input_on_fd_ready(input);
+    maybe_schedule_barcode_flush(fpi);
+
+    if (fpi->batch_input && !fpi->input_flush_scheduled && user_input_has_pending_pointer_events(fpi->user_input)) {
+        ok = compositor_get_next_vblank(fpi->compositor, &next_vblank_ns);
+        if (ok != 0) {
+            next_vblank_ns = get_monotonic_time();
+        }
+
+        ok = evloop_post_delayed_task(fpi->evloop, on_flush_pointer_events, fpi, next_vblank_ns / 1000);
+        if (ok != 0) {
+            LOG_ERROR("Couldn't schedule pointer event flush. evloop_post_delayed_task: %s\n", strerror(ok));
+            user_input_flush_pointer_events(fpi->user_input, next_vblank_ns / 1000);
+            return kNoAction_EventHandlerReturn;
+        }
+
+        fpi->input_flush_scheduled = true;
+        fpi->input_flush_time_usec = next_vblank_ns / 1000;
+    }
+
+    return kNoAction_EventHandlerReturn;
 }
 
 static struct flutter_paths *setup_paths(enum flutter_runtime_mode runtime_mode, const char *app_bundle_path) {
@@ -1860,6 +2123,12 @@ bool flutterpi_parse_cmdline_args(int argc, char **argv, struct flutterpi_cmdlin
     int runtime_mode_int = FLUTTER_RUNTIME_MODE_DEBUG;
     int vulkan_int = false;
     int dummy_display_int = 0;
+    int vrr_int = 0;
+    int mirror_int = 0;
+    int coalesce_input_int = 0;
+    int resample_input_int = 0;
+    int startup_trace_int = 0;
+    int prefetch_assets_int = 0;
     int longopt_index = 0;
     int opt, ok;
 
@@ -1876,9 +2145,20 @@ bool flutterpi_parse_cmdline_args(int argc, char **argv, struct flutterpi_cmdlin
         { "pixelformat", required_argument, NULL, 'p' },
         { "vulkan", no_argument, &vulkan_int, true },
         { "videomode", required_argument, NULL, 'v' },
+        { "vrr", no_argument, &vrr_int, 1 },
+        { "mirror", no_argument, &mirror_int, 1 },
+        { "render-scale", required_argument, NULL, 'g' },
         { "dummy-display", no_argument, &dummy_display_int, 1 },
         { "dummy-display-size", required_argument, NULL, 's' },
         { "drm-fd", required_argument, NULL, 'f' },
+        { "fbdev", required_argument, NULL, 'b' },
+        { "input-coalescing", no_argument, &coalesce_input_int, 1 },
+        { "input-resampling", no_argument, &resample_input_int, 1 },
+        { "keyevents", required_argument, NULL, 'k' },
+        { "barcode-scanner", required_argument, NULL, 'c' },
+        { "startup-trace", no_argument, &startup_trace_int, 1 },
+        { "prefetch-assets", no_argument, &prefetch_assets_int, 1 },
+        { "record-asset-access", required_argument, NULL, 'a' },
         { 0, 0, 0, 0 },
     };
     memset(result_out, 0, sizeof *result_out);
@@ -1893,6 +2173,9 @@ bool flutterpi_parse_cmdline_args(int argc, char **argv, struct flutterpi_cmdlin
     result_out->engine_argc = 0;
     result_out->engine_argv = NULL;
     result_out->drm_fd = -1;
+    result_out->fbdev_path = NULL;
+    result_out->keyevent_mode = kKeyeventModeLegacy;
+    result_out->render_scale = 1.0;
 
     finished_parsing_options = false;
     while (!finished_parsing_options) {
@@ -2001,6 +2284,17 @@ valid_format:
 
                 break;
 
+            case 'g':;  // --render-scale
+                char *scale_end;
+                double scale = strtod(optarg, &scale_end);
+                if (scale_end == optarg || *scale_end != '\0' || !(scale > 0.0 && scale <= 1.0)) {
+                    LOG_ERROR("ERROR: Invalid argument for --render-scale passed. Must be a number greater than 0 and at most 1.\n");
+                    return false;
+                }
+
+                result_out->render_scale = scale;
+                break;
+
             case 'f':;  // --drm-fd
                 char *drm_fd = strdup(optarg);
                 int fd = atoi(drm_fd);
@@ -2012,6 +2306,51 @@ valid_format:
                 result_out->drm_fd = fd;
                 break;
 
+            case 'b':;  // --fbdev
+                result_out->fbdev_path = strdup(optarg);
+                if (result_out->fbdev_path == NULL) {
+                    return false;
+                }
+                break;
+
+            case 'k':  // --keyevents
+                if (streq(optarg, "legacy")) {
+                    result_out->keyevent_mode = kKeyeventModeLegacy;
+                } else if (streq(optarg, "embedder")) {
+                    result_out->keyevent_mode = kKeyeventModeEmbedder;
+                } else if (streq(optarg, "both")) {
+                    result_out->keyevent_mode = kKeyeventModeBoth;
+                } else {
+                    LOG_ERROR(
+                        "ERROR: Invalid argument for --keyevents passed.\n"
+                        "Valid values are \"legacy\", \"embedder\", \"both\".\n"
+                        "%s",
+                        usage
+                    );
+                    return false;
+                }
+                break;
+
+            case 'c':  // --barcode-scanner
+                if (result_out->n_barcode_scanners >= FLUTTERPI_MAX_BARCODE_SCANNERS) {
+                    LOG_ERROR("ERROR: --barcode-scanner can be specified at most %d times.\n", FLUTTERPI_MAX_BARCODE_SCANNERS);
+                    return false;
+                }
+
+                result_out->barcode_scanners[result_out->n_barcode_scanners++] = optarg;
+                break;
+
+            case 'a':;  // --record-asset-access
+                char *end;
+                long secs = strtol(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || secs <= 0 || secs > 3600) {
+                    LOG_ERROR("ERROR: Invalid argument for --record-asset-access passed. Must be a number of seconds between 1 and 3600.\n");
+                    return false;
+                }
+
+                result_out->record_asset_access_secs = secs;
+                break;
+
             case 'h': printf("%s", usage); return false;
 
             case '?':
@@ -2039,8 +2378,18 @@ valid_format:
 
     result_out->use_vulkan = vulkan_int;
 
+    result_out->vrr = !!vrr_int;
+
+    result_out->mirror = !!mirror_int;
+
     result_out->dummy_display = !!dummy_display_int;
 
+    result_out->coalesce_input = coalesce_input_int || resample_input_int;
+    result_out->resample_input = !!resample_input_int;
+
+    result_out->startup_trace = !!startup_trace_int;
+    result_out->prefetch_assets = !!prefetch_assets_int;
+
     return true;
 }
 
@@ -2151,7 +2500,8 @@ static struct drmdev *find_drmdev(struct libseat *libseat) {
         }
 
         for_each_connector_in_drmdev(drmdev, connector) {
-            if (connector->variable_state.connection_state == kConnected_DrmConnectionState) {
+            if (connector->variable_state.connection_state == kConnected_DrmConnectionState
+                && connector->type != kWRITEBACK_DrmConnectorType) {
                 goto found_connected_connector;
             }
         }
@@ -2235,6 +2585,14 @@ static struct gbm_device *open_rendernode_as_gbm_device() {
     return gbm;
 }
 
+static void destroy_rendernode_gbm_device(struct gbm_device *gbm) {
+    int fd;
+
+    fd = gbm_device_get_fd(gbm);
+    gbm_device_destroy(gbm);
+    close(fd);
+}
+
 #ifdef HAVE_LIBSEAT
 static void on_session_enable(struct libseat *seat, void *userdata) {
     struct flutterpi *fpi;
@@ -2290,14 +2648,12 @@ static void on_session_disable(struct libseat *seat, void *userdata) {
     fpi->session_active = false;
 }
 
-static int on_libseat_fd_ready(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+static enum event_handler_return on_libseat_fd_ready(int fd, uint32_t revents, void *userdata) {
     struct flutterpi *fpi;
     int ok;
 
-    ASSERT_NOT_NULL(s);
     ASSERT_NOT_NULL(userdata);
     fpi = userdata;
-    (void) s;
     (void) fd;
     (void) revents;
 
@@ -2306,6 +2662,116 @@ static int on_libseat_fd_ready(sd_event_source *s, int fd, uint32_t revents, voi
         LOG_ERROR("Couldn't dispatch libseat events. libseat_dispatch: %s\n", strerror(errno));
     }
 
+    return kNoAction_EventHandlerReturn;
+}
+#endif
+
+struct engine_load_task {
+    struct flutter_paths *paths;
+    enum flutter_runtime_mode runtime_mode;
+
+    void *engine_handle;
+    FlutterEngineProcTable procs;
+    FlutterEngineAOTData aot_data;
+};
+
+/**
+ * @brief Loads the engine library, resolves the engine procs and loads the AOT data (if any).
+ *
+ * This is independent of the display & input setup, so it runs on a startup worker thread.
+ */
+static int load_engine_task(void *userdata) {
+    struct engine_load_task *task;
+    FlutterEngineResult engine_result;
+    bool engine_is_aot;
+    int ok;
+
+    task = userdata;
+    task->aot_data = NULL;
+
+    task->engine_handle = load_flutter_engine_lib(task->paths);
+    if (task->engine_handle == NULL) {
+        return EINVAL;
+    }
+
+    ok = get_flutter_engine_procs(task->engine_handle, &task->procs);
+    if (ok != 0) {
+        goto fail_unload_engine;
+    }
+
+    engine_is_aot = task->procs.RunsAOTCompiledDartCode();
+    if (engine_is_aot == true && !FLUTTER_RUNTIME_MODE_IS_AOT(task->runtime_mode)) {
+        LOG_ERROR(
+            "The flutter engine was built for release or profile (AOT) mode, but flutter-pi was not started up in release or profile "
+            "mode.\n"
+            "Either you swap out the libflutter_engine.so with one that was built for debug mode, or you start"
+            "flutter-pi with the --release or --profile flag and make sure a valid \"app.so\" is located inside the asset bundle "
+            "directory.\n"
+        );
+        ok = EINVAL;
+        goto fail_unload_engine;
+    } else if (engine_is_aot == false && FLUTTER_RUNTIME_MODE_IS_AOT(task->runtime_mode)) {
+        LOG_ERROR(
+            "The flutter engine was built for debug mode, but flutter-pi was started up in release mode.\n"
+            "Either you swap out the libflutter_engine.so with one that was built for release mode,"
+            "or you start flutter-pi without the --release flag.\n"
+        );
+        ok = EINVAL;
+        goto fail_unload_engine;
+    }
+
+    if (FLUTTER_RUNTIME_MODE_IS_AOT(task->runtime_mode)) {
+        FlutterEngineAOTDataSource aot_source = { .elf_path = task->paths->app_elf_path, .type = kFlutterEngineAOTDataSourceTypeElfPath };
+
+        engine_result = task->procs.CreateAOTData(&aot_source, &task->aot_data);
+        if (engine_result != kSuccess) {
+            LOG_ERROR("Could not load AOT data. FlutterEngineCreateAOTData: %s\n", FLUTTER_RESULT_TO_STRING(engine_result));
+            ok = EIO;
+            goto fail_unload_engine;
+        }
+    }
+
+    return 0;
+
+fail_unload_engine:
+    unload_flutter_engine_lib(task->engine_handle);
+    task->engine_handle = NULL;
+    return ok;
+}
+
+static int prefetch_assets_task(void *userdata) {
+    struct flutterpi *fpi;
+
+    fpi = userdata;
+    return asset_prefetch_run(fpi->flutter.paths, fpi->flutter.runtime_mode);
+}
+
+struct kbdcfg_load_task {
+    /// The LC_CTYPE locale, queried on the platform thread because setlocale is not thread-safe.
+    /// Freed by the task.
+    char *locale;
+
+    struct keyboard_config *kbdcfg;
+};
+
+#ifdef BUILD_TEXT_INPUT_PLUGIN
+/**
+ * @brief Compiles the xkb keymap & compose table. Runs on a startup worker thread.
+ */
+static int load_keyboard_config_task(void *userdata) {
+    struct kbdcfg_load_task *task;
+
+    task = userdata;
+
+    task->kbdcfg = keyboard_config_new(task->locale);
+    free(task->locale);
+    task->locale = NULL;
+
+    if (task->kbdcfg == NULL) {
+        LOG_ERROR("Couldn't load keyboard configuration. flutter-pi will run without text & raw keyboard input.\n");
+        return EINVAL;
+    }
+
     return 0;
 }
 #endif
@@ -2315,27 +2781,36 @@ struct flutterpi *flutterpi_new_from_args(int argc, char **argv) {
     enum renderer_type renderer_type;
     struct texture_registry *texture_registry;
     struct plugin_registry *plugin_registry;
+    struct thread_pool *thread_pool;
     struct frame_scheduler *scheduler;
     struct flutter_paths *paths;
     struct view_geometry geometry;
+    struct engine_load_task engine_load;
+    struct startup_task *engine_load_task, *kbdcfg_task, *prefetch_task;
+    struct kbdcfg_load_task kbdcfg_load;
+    struct keyboard_config *kbdcfg;
+    struct startup *startup;
     FlutterEngineAOTData aot_data;
-    FlutterEngineResult engine_result;
     struct gl_renderer *gl_renderer;
     struct vk_renderer *vk_renderer;
     struct gbm_device *gbm_device;
     struct user_input *input;
     struct compositor *compositor;
     struct flutterpi *fpi;
-    struct sd_event *event_loop;
+    struct evloop *evloop;
+#ifdef HAVE_LIBSYSTEMD
+    sd_event *sd_event_loop;
+#endif
     struct flutterpi_cmdline_args cmd_args;
     struct libseat *libseat;
     struct locales *locales;
     struct drmdev *drmdev;
+    struct fbdev *fbdev;
     struct tracer *tracer;
     struct window *window;
     void *engine_handle;
     char *bundle_path, **engine_argv, *desired_videomode;
-    int ok, engine_argc, wakeup_fd;
+    int ok, engine_argc, step;
 
     fpi = malloc(sizeof *fpi);
     if (fpi == NULL) {
@@ -2386,24 +2861,81 @@ struct flutterpi *flutterpi_new_from_args(int argc, char **argv) {
         goto fail_free_cmd_args;
     }
 
-    wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
-    if (wakeup_fd < 0) {
-        LOG_ERROR("Could not create fd for waking up the main loop. eventfd: %s\n", strerror(errno));
+    startup = startup_new(cmd_args.startup_trace);
+    if (startup == NULL) {
         goto fail_free_paths;
     }
 
-    ok = sd_event_new(&event_loop);
+    // Loading the engine & AOT data and compiling the keymap don't depend on the display or input setup,
+    // so run them concurrently and only wait for them once we actually need them.
+    engine_load.paths = paths;
+    engine_load.runtime_mode = runtime_mode;
+    kbdcfg_task = NULL;
+    kbdcfg = NULL;
+    prefetch_task = NULL;
+
+#ifdef BUILD_TEXT_INPUT_PLUGIN
+    // setlocale is not thread-safe, so query the locale here, before any startup worker thread is running.
+    setlocale(LC_ALL, "");
+    kbdcfg_load.locale = strdup(setlocale(LC_CTYPE, NULL));
+    kbdcfg_load.kbdcfg = NULL;
+    if (kbdcfg_load.locale == NULL) {
+        goto fail_destroy_startup;
+    }
+#endif
+
+    engine_load_task = startup_start_task(startup, "load engine", load_engine_task, &engine_load);
+    if (engine_load_task == NULL) {
+#ifdef BUILD_TEXT_INPUT_PLUGIN
+        free(kbdcfg_load.locale);
+#endif
+        goto fail_destroy_startup;
+    }
+
+#ifdef BUILD_TEXT_INPUT_PLUGIN
+    kbdcfg_task = startup_start_task(startup, "keyboard config", load_keyboard_config_task, &kbdcfg_load);
+    if (kbdcfg_task == NULL) {
+        free(kbdcfg_load.locale);
+        goto fail_join_startup_tasks;
+    }
+#endif
+
+    if (cmd_args.prefetch_assets) {
+        // The prefetch task can outlive this function, so it reads these from fpi.
+        fpi->flutter.paths = paths;
+        fpi->flutter.runtime_mode = runtime_mode;
+
+        prefetch_task = startup_start_task(startup, "prefetch assets", prefetch_assets_task, fpi);
+        if (prefetch_task == NULL) {
+            goto fail_join_startup_tasks;
+        }
+    }
+
+    evloop = evloop_new();
+    if (evloop == NULL) {
+        LOG_ERROR("Could not create main event loop.\n");
+        goto fail_join_startup_tasks;
+    }
+
+#ifdef HAVE_LIBSYSTEMD
+    ok = sd_event_new(&sd_event_loop);
     if (ok < 0) {
-        LOG_ERROR("Could not create main event loop. sd_event_new: %s\n", strerror(-ok));
-        goto fail_close_wakeup_fd;
+        LOG_ERROR("Could not create sd-event loop. sd_event_new: %s\n", strerror(-ok));
+        goto fail_unref_evloop;
     }
 
-    ok = sd_event_add_io(event_loop, NULL, wakeup_fd, EPOLLIN, on_wakeup_main_loop, NULL);
+    ok = sd_event_get_fd(sd_event_loop);
     if (ok < 0) {
-        LOG_ERROR("Error adding wakeup callback to main loop. sd_event_add_io: %s\n", strerror(-ok));
-        goto fail_unref_event_loop;
+        LOG_ERROR("Could not get fd for sd-event loop. sd_event_get_fd: %s\n", strerror(-ok));
+        goto fail_unref_sd_event_loop;
     }
 
+    if (evloop_add_io(evloop, ok, EPOLLIN, on_sd_event_ready, fpi) == NULL) {
+        LOG_ERROR("Could not dispatch sd-event loop in the main event loop.\n");
+        goto fail_unref_sd_event_loop;
+    }
+#endif
+
 #ifdef HAVE_LIBSEAT
     static const struct libseat_seat_listener libseat_interface = { .enable_seat = on_session_enable, .disable_seat = on_session_disable };
 
@@ -2425,12 +2957,8 @@ struct flutterpi *flutterpi_new_from_args(int argc, char **argv) {
     }
 
     if (libseat != NULL) {
-        ok = sd_event_add_io(event_loop, NULL, ok, EPOLLIN, on_libseat_fd_ready, fpi);
-        if (ok < 0) {
-            LOG_ERROR(
-                "Couldn't listen for libseat events. Flutter-pi will run without session switching support. sd_event_add_io: %s\n",
-                strerror(-ok)
-            );
+        if (evloop_add_io(evloop, ok, EPOLLIN, on_libseat_fd_ready, fpi) == NULL) {
+            LOG_ERROR("Couldn't listen for libseat events. Flutter-pi will run without session switching support.\n");
             libseat_close_seat(libseat);
             libseat = NULL;
         }
@@ -2443,7 +2971,9 @@ struct flutterpi *flutterpi_new_from_args(int argc, char **argv) {
     libseat = NULL;
 #endif
 
+    step = startup_begin_step(startup, "locales");
     locales = locales_new();
+    startup_end_step(startup, step);
     if (locales == NULL) {
         LOG_ERROR("Couldn't setup locales.\n");
         goto fail_destroy_libseat;
@@ -2451,6 +2981,9 @@ struct flutterpi *flutterpi_new_from_args(int argc, char **argv) {
 
     locales_print(locales);
 
+    step = startup_begin_step(startup, "display probe");
+
+    fbdev = NULL;
     if (cmd_args.dummy_display) {
         drmdev = NULL;
 
@@ -2463,36 +2996,63 @@ struct flutterpi *flutterpi_new_from_args(int argc, char **argv) {
             goto fail_destroy_locales;
         }
     } else {
-        if(cmd_args.has_drm_fd){
+        if (cmd_args.fbdev_path != NULL) {
+            drmdev = NULL;
+        } else if(cmd_args.has_drm_fd){
             /* --drm-fd is passed, we don't want flutter-pi to handle the DRM choice */
             drmdev = drmdev_new_from_interface_fd(cmd_args.drm_fd, NULL, &drmdev_interface, libseat);
+            if (drmdev == NULL) {
+                goto fail_destroy_locales;
+            }
         }
         else{
             drmdev = find_drmdev(libseat);
-        }
-        if (drmdev == NULL) {
-            goto fail_destroy_locales;
+            if (drmdev == NULL) {
+                // Some (mostly older) displays are only exposed as a legacy framebuffer device.
+                LOG_DEBUG("Couldn't find a usable KMS device. Trying to use the framebuffer device /dev/fb0 instead.\n");
+                cmd_args.fbdev_path = strdup("/dev/fb0");
+                if (cmd_args.fbdev_path == NULL) {
+                    goto fail_destroy_locales;
+                }
+            }
         }
 
-        gbm_device = drmdev_get_gbm_device(drmdev);
-        if (gbm_device == NULL) {
-            LOG_ERROR("Couldn't create GBM device.\n");
-            goto fail_destroy_drmdev;
+        if (drmdev != NULL) {
+            gbm_device = drmdev_get_gbm_device(drmdev);
+            if (gbm_device == NULL) {
+                LOG_ERROR("Couldn't create GBM device.\n");
+                goto fail_destroy_drmdev;
+            }
+        } else {
+            fbdev = fbdev_new_from_path(cmd_args.fbdev_path);
+            if (fbdev == NULL) {
+                LOG_ERROR("Couldn't open framebuffer device \"%s\".\n", cmd_args.fbdev_path);
+                goto fail_destroy_locales;
+            }
+
+            // We still render using the GPU, so we need a render node to allocate our buffers on.
+            gbm_device = open_rendernode_as_gbm_device();
+            if (gbm_device == NULL) {
+                goto fail_destroy_drmdev;
+            }
         }
     }
 
+    startup_end_step(startup, step);
+
     tracer = tracer_new_with_stubs();
     if (tracer == NULL) {
         LOG_ERROR("Couldn't create event tracer.\n");
         goto fail_destroy_drmdev;
     }
 
-    scheduler = frame_scheduler_new(false, kDoubleBufferedVsync_PresentMode, NULL, NULL);
+    scheduler = frame_scheduler_new(false, cmd_args.vrr ? kVariableRefreshRate_PresentMode : kDoubleBufferedVsync_PresentMode, NULL, NULL);
     if (scheduler == NULL) {
         LOG_ERROR("Couldn't create frame scheduler.\n");
         goto fail_unref_tracer;
     }
 
+    step = startup_begin_step(startup, "renderer");
     if (renderer_type == kVulkan_RendererType) {
 #ifdef HAVE_VULKAN
         gl_renderer = NULL;
@@ -2535,7 +3095,9 @@ struct flutterpi *flutterpi_new_from_args(int argc, char **argv) {
         UNREACHABLE();
         goto fail_unref_scheduler;
     }
+    startup_end_step(startup, step);
 
+    step = startup_begin_step(startup, "window");
     if (cmd_args.dummy_display) {
         window = dummy_window_new(
             tracer,
@@ -2549,6 +3111,31 @@ struct flutterpi *flutterpi_new_from_args(int argc, char **argv) {
             cmd_args.physical_dimensions.y,
             60.0
         );
+    } else if (fbdev != NULL) {
+        window = fbdev_window_new(
+            // clang-format off
+            tracer,
+            scheduler,
+            renderer_type,
+            gl_renderer,
+            vk_renderer,
+            cmd_args.has_rotation,
+            cmd_args.rotation == 0   ? PLANE_TRANSFORM_ROTATE_0   :
+                cmd_args.rotation == 90  ? PLANE_TRANSFORM_ROTATE_90  :
+                cmd_args.rotation == 180 ? PLANE_TRANSFORM_ROTATE_180 :
+                cmd_args.rotation == 270 ? PLANE_TRANSFORM_ROTATE_270 :
+                (assert(0 && "invalid rotation"), PLANE_TRANSFORM_ROTATE_0),
+            cmd_args.has_orientation, cmd_args.orientation,
+            cmd_args.has_physical_dimensions, cmd_args.physical_dimensions.x, cmd_args.physical_dimensions.y,
+            cmd_args.has_pixel_format, cmd_args.pixel_format,
+            fbdev,
+            gbm_device
+            // clang-format on
+        );
+        if (window == NULL) {
+            LOG_ERROR("Couldn't create fbdev window.\n");
+            goto fail_unref_renderer;
+        }
     } else {
         window = kms_window_new(
             // clang-format off
@@ -2567,7 +3154,9 @@ struct flutterpi *flutterpi_new_from_args(int argc, char **argv) {
             cmd_args.has_physical_dimensions, cmd_args.physical_dimensions.x, cmd_args.physical_dimensions.y,
             cmd_args.has_pixel_format, cmd_args.pixel_format,
             drmdev,
-            desired_videomode
+            desired_videomode,
+            cmd_args.mirror,
+            cmd_args.render_scale
             // clang-format on
         );
         if (window == NULL) {
@@ -2576,6 +3165,8 @@ struct flutterpi *flutterpi_new_from_args(int argc, char **argv) {
         }
     }
 
+    startup_end_step(startup, step);
+
     compositor = compositor_new(tracer, window);
     if (compositor == NULL) {
         LOG_ERROR("Couldn't create compositor.\n");
@@ -2584,73 +3175,85 @@ struct flutterpi *flutterpi_new_from_args(int argc, char **argv) {
 
     /// TODO: Do we really need the window after this?
     if (drmdev != NULL) {
-        ok = sd_event_add_io(event_loop, NULL, drmdev_get_event_fd(drmdev), EPOLLIN | EPOLLHUP | EPOLLPRI, on_drmdev_ready, drmdev);
-        if (ok < 0) {
-            LOG_ERROR("Could not add DRM pageflip event listener. sd_event_add_io: %s\n", strerror(-ok));
+        if (evloop_add_io(evloop, drmdev_get_event_fd(drmdev), EPOLLIN | EPOLLHUP | EPOLLPRI, on_drmdev_ready, drmdev) == NULL) {
+            LOG_ERROR("Could not add DRM pageflip event listener.\n");
             goto fail_unref_compositor;
         }
     }
 
     compositor_get_view_geometry(compositor, &geometry);
 
-    static const struct user_input_interface user_input_interface = {
+    struct user_input_interface user_input_interface = {
         .on_flutter_pointer_event = on_flutter_pointer_event,
         .on_utf8_character = on_utf8_character,
         .on_xkb_keysym = on_xkb_keysym,
-        .on_gtk_keyevent = on_gtk_keyevent,
+        .on_gtk_keyevent = cmd_args.keyevent_mode != kKeyeventModeEmbedder ? on_gtk_keyevent : NULL,
         .on_set_cursor_enabled = on_set_cursor_enabled,
         .on_move_cursor = on_move_cursor,
         .open = on_user_input_open,
         .close = on_user_input_close,
         .on_switch_vt = on_switch_vt,
-        .on_key_event = NULL,
+        .on_key_event = cmd_args.keyevent_mode != kKeyeventModeLegacy ? on_key_event : NULL,
+        .on_barcode_scan = on_barcode_scan,
     };
 
     fpi->libseat = libseat;
     list_inithead(&fpi->fd_for_device_id);
 
+    if (kbdcfg_task != NULL) {
+        // If loading the keyboard config failed, kbdcfg is NULL and we just run without text & raw keyboard input.
+        startup_join_task(startup, kbdcfg_task);
+        kbdcfg_task = NULL;
+        kbdcfg = kbdcfg_load.kbdcfg;
+    }
+
+    step = startup_begin_step(startup, "user input");
     input = user_input_new(
         &user_input_interface,
         fpi,
         &geometry.display_to_view_transform,
         &geometry.view_to_display_transform,
         geometry.display_size.x,
-        geometry.display_size.y
+        geometry.display_size.y,
+        kbdcfg
     );
+    startup_end_step(startup, step);
     if (input == NULL) {
         LOG_ERROR("Couldn't initialize user input. flutter-pi will run without user input.\n");
     } else {
-        sd_event_source *user_input_event_source;
-
-        ok = sd_event_add_io(
-            event_loop,
-            &user_input_event_source,
-            user_input_get_fd(input),
-            EPOLLIN | EPOLLRDHUP | EPOLLPRI,
-            on_user_input_fd_ready,
-            input
-        );
-        if (ok < 0) {
-            LOG_ERROR("Couldn't listen for user input. flutter-pi will run without user input. sd_event_add_io: %s\n", strerror(-ok));
+        struct evsrc *input_src;
+
+        input_src = evloop_add_io(evloop, user_input_get_fd(input), EPOLLIN | EPOLLRDHUP | EPOLLPRI, on_user_input_fd_ready, fpi);
+        if (input_src == NULL) {
+            LOG_ERROR("Couldn't listen for user input. flutter-pi will run without user input.\n");
             user_input_destroy(input);
             input = NULL;
+        } else {
+            // Handle vblanks & platform tasks first when there's a lot going on.
+            evsrc_set_low_priority(input_src, true);
         }
+    }
 
-        sd_event_source_set_priority(user_input_event_source, SD_EVENT_PRIORITY_IDLE - 10);
+    if (input != NULL) {
+        user_input_set_pointer_event_batching(input, cmd_args.coalesce_input, cmd_args.resample_input);
 
-        sd_event_source_set_floating(user_input_event_source, true);
-        sd_event_source_unref(user_input_event_source);
+        for (int i = 0; i < cmd_args.n_barcode_scanners; i++) {
+            ok = user_input_add_barcode_scanner(input, cmd_args.barcode_scanners[i]);
+            if (ok != 0) {
+                LOG_ERROR("Couldn't add barcode scanner \"%s\". user_input_add_barcode_scanner: %s\n", cmd_args.barcode_scanners[i], strerror(ok));
+            }
+        }
     }
 
-    engine_handle = load_flutter_engine_lib(paths);
-    if (engine_handle == NULL) {
+    ok = startup_join_task(startup, engine_load_task);
+    engine_load_task = NULL;
+    if (ok != 0) {
         goto fail_destroy_user_input;
     }
 
-    ok = get_flutter_engine_procs(engine_handle, &fpi->flutter.procs);
-    if (ok != 0) {
-        goto fail_unload_engine;
-    }
+    engine_handle = engine_load.engine_handle;
+    aot_data = engine_load.aot_data;
+    fpi->flutter.procs = engine_load.procs;
 
     tracer_set_cbs(
         tracer,
@@ -2659,10 +3262,17 @@ struct flutterpi *flutterpi_new_from_args(int argc, char **argv) {
         fpi->flutter.procs.TraceEventInstant
     );
 
+    // Plugins can already submit work in their init functions, so this is created before the plugin registry.
+    thread_pool = thread_pool_new(0);
+    if (thread_pool == NULL) {
+        LOG_ERROR("Could not create thread pool.\n");
+        goto fail_unload_engine;
+    }
+
     plugin_registry = plugin_registry_new(fpi);
     if (plugin_registry == NULL) {
         LOG_ERROR("Could not create plugin registry.\n");
-        goto fail_unload_engine;
+        goto fail_destroy_thread_pool;
     }
 
     ok = plugin_registry_add_plugins_from_static_registry(plugin_registry);
@@ -2683,50 +3293,36 @@ struct flutterpi *flutterpi_new_from_args(int argc, char **argv) {
         goto fail_destroy_plugin_registry;
     }
 
-    bool engine_is_aot = fpi->flutter.procs.RunsAOTCompiledDartCode();
-    if (engine_is_aot == true && !FLUTTER_RUNTIME_MODE_IS_AOT(runtime_mode)) {
-        LOG_ERROR(
-            "The flutter engine was built for release or profile (AOT) mode, but flutter-pi was not started up in release or profile "
-            "mode.\n"
-            "Either you swap out the libflutter_engine.so with one that was built for debug mode, or you start"
-            "flutter-pi with the --release or --profile flag and make sure a valid \"app.so\" is located inside the asset bundle "
-            "directory.\n"
-        );
-        goto fail_destroy_texture_registry;
-    } else if (engine_is_aot == false && FLUTTER_RUNTIME_MODE_IS_AOT(runtime_mode)) {
-        LOG_ERROR(
-            "The flutter engine was built for debug mode, but flutter-pi was started up in release mode.\n"
-            "Either you swap out the libflutter_engine.so with one that was built for release mode,"
-            "or you start flutter-pi without the --release flag.\n"
-        );
-        goto fail_destroy_texture_registry;
-    }
-
-    aot_data = NULL;
-    if (FLUTTER_RUNTIME_MODE_IS_AOT(runtime_mode)) {
-        FlutterEngineAOTDataSource aot_source = { .elf_path = paths->app_elf_path, .type = kFlutterEngineAOTDataSourceTypeElfPath };
-
-        engine_result = fpi->flutter.procs.CreateAOTData(&aot_source, &aot_data);
-        if (engine_result != kSuccess) {
-            LOG_ERROR("Could not load AOT data. FlutterEngineCreateAOTData: %s\n", FLUTTER_RESULT_TO_STRING(engine_result));
-            goto fail_destroy_texture_registry;
-        }
-    }
-
-    // We don't need these anymore.
-    frame_scheduler_unref(scheduler);
-    window_unref(window);
-
-    pthread_mutex_init(&fpi->event_loop_mutex, get_default_mutex_attrs());
     fpi->event_loop_thread = pthread_self();
-    fpi->wakeup_event_loop_fd = wakeup_fd;
-    fpi->event_loop = event_loop;
+    fpi->evloop = evloop;
+#ifdef HAVE_LIBSYSTEMD
+    pthread_mutex_init(&fpi->event_loop_mutex, get_default_mutex_attrs());
+    fpi->sd_event_loop = sd_event_loop;
+#endif
     fpi->locales = locales;
     fpi->tracer = tracer;
     fpi->compositor = compositor;
     fpi->gl_renderer = gl_renderer;
     fpi->vk_renderer = vk_renderer;
     fpi->user_input = input;
+    fpi->batch_input = input != NULL && cmd_args.coalesce_input;
+    fpi->input_flush_scheduled = false;
+    fpi->input_flush_time_usec = 0;
+    fpi->barcode_flush_scheduled = false;
+#ifdef BUILD_RAW_KEYBOARD_PLUGIN
+    if (cmd_args.keyevent_mode != kKeyeventModeLegacy) {
+        static const struct key_event_interface key_event_interface = {
+            .send_key_event = on_send_key_event,
+        };
+
+        fpi->rawkb = rawkb_new(&key_event_interface, fpi);
+        if (fpi->rawkb == NULL) {
+            LOG_ERROR("Couldn't create raw keyboard. flutter-pi will not send flutter key events.\n");
+        }
+    } else {
+        fpi->rawkb = NULL;
+    }
+#endif
     fpi->flutter.runtime_mode = runtime_mode;
     fpi->flutter.bundle_path = realpath(bundle_path, NULL);
     fpi->flutter.engine_argc = engine_argc;
@@ -2734,23 +3330,49 @@ struct flutterpi *flutterpi_new_from_args(int argc, char **argv) {
     fpi->flutter.paths = paths;
     fpi->flutter.engine_handle = engine_handle;
     fpi->flutter.aot_data = aot_data;
+    fpi->flutter.engine = NULL;
     fpi->drmdev = drmdev;
+    fpi->fbdev = fbdev;
+    fpi->gbm_device = gbm_device;
     fpi->plugin_registry = plugin_registry;
+    fpi->thread_pool = thread_pool;
     fpi->texture_registry = texture_registry;
     fpi->libseat = libseat;
-    return fpi;
+    fpi->startup = startup;
+    fpi->prefetch_task = prefetch_task;
+    fpi->record_asset_access_secs = cmd_args.record_asset_access_secs;
+    fpi->asset_recorder = NULL;
+    fpi->asset_recorder_source = NULL;
 
-fail_destroy_texture_registry:
-    texture_registry_destroy(texture_registry);
+    // The listener is called right away, so only register it once fpi is initialized.
+    // The compositor keeps the window alive, and the listener is destroyed together with it.
+    if (window_add_geometry_listener(window, on_window_geometry_changed, fpi) == NULL) {
+        LOG_ERROR("Couldn't listen for window geometry changes. flutter-pi will not adapt to other displays being connected.\n");
+    }
+
+    // We don't need these anymore.
+    frame_scheduler_unref(scheduler);
+    window_unref(window);
+
+    free(cmd_args.fbdev_path);
+    return fpi;
 
 fail_destroy_plugin_registry:
     plugin_registry_destroy(plugin_registry);
 
+fail_destroy_thread_pool:
+    thread_pool_destroy(thread_pool);
+
 fail_unload_engine:
+    if (aot_data != NULL) {
+        fpi->flutter.procs.CollectAOTData(aot_data);
+    }
     unload_flutter_engine_lib(engine_handle);
 
 fail_destroy_user_input:
-    user_input_destroy(input);
+    if (input != NULL) {
+        user_input_destroy(input);
+    }
 
 fail_unref_compositor:
     compositor_unref(compositor);
@@ -2781,7 +3403,15 @@ fail_unref_tracer:
     tracer_unref(tracer);
 
 fail_destroy_drmdev:
-    drmdev_unref(drmdev);
+    if (drmdev != NULL) {
+        drmdev_unref(drmdev);
+    } else if (gbm_device != NULL) {
+        // without a drmdev, the gbm device was opened on a render node by us.
+        destroy_rendernode_gbm_device(gbm_device);
+    }
+    if (fbdev != NULL) {
+        fbdev_unref(fbdev);
+    }
 
 fail_destroy_locales:
     locales_destroy(locales);
@@ -2795,17 +3425,43 @@ fail_destroy_libseat:
 #endif
     }
 
-fail_unref_event_loop:
-    sd_event_unrefp(&event_loop);
+#ifdef HAVE_LIBSYSTEMD
+fail_unref_sd_event_loop:
+    sd_event_unrefp(&sd_event_loop);
+
+fail_unref_evloop:
+#endif
+    evloop_unref(evloop);
+
+fail_join_startup_tasks:
+    if (prefetch_task != NULL) {
+        startup_join_task(startup, prefetch_task);
+    }
+    if (kbdcfg_task != NULL) {
+        startup_join_task(startup, kbdcfg_task);
+        if (kbdcfg_load.kbdcfg != NULL) {
+            keyboard_config_destroy(kbdcfg_load.kbdcfg);
+        }
+    }
+    if (engine_load_task != NULL) {
+        ok = startup_join_task(startup, engine_load_task);
+        if (ok == 0) {
+            if (engine_load.aot_data != NULL) {
+                engine_load.procs.CollectAOTData(engine_load.aot_data);
+            }
+            unload_flutter_engine_lib(engine_load.engine_handle);
+        }
+    }
 
-fail_close_wakeup_fd:
-    close(wakeup_fd);
+fail_destroy_startup:
+    startup_destroy(startup);
 
 fail_free_paths:
     flutter_paths_free(paths);
 
 fail_free_cmd_args:
     free(cmd_args.bundle_path);
+    free(cmd_args.fbdev_path);
 
 fail_free_fpi:
     free(fpi);
@@ -2817,11 +3473,26 @@ void flutterpi_destroy(struct flutterpi *flutterpi) {
     (void) flutterpi;
     LOG_DEBUG("deinit\n");
 
-    pthread_mutex_destroy(&flutterpi->event_loop_mutex);
+    if (flutterpi->prefetch_task != NULL) {
+        startup_join_task(flutterpi->startup, flutterpi->prefetch_task);
+    }
+    if (flutterpi->asset_recorder != NULL) {
+        stop_asset_access_recording(flutterpi);
+    }
+    if (flutterpi->startup != NULL) {
+        startup_destroy(flutterpi->startup);
+    }
+    // Let the jobs plugins submitted finish before their plugins are deinitialized.
+    thread_pool_destroy(flutterpi->thread_pool);
     texture_registry_destroy(flutterpi->texture_registry);
     plugin_registry_destroy(flutterpi->plugin_registry);
     unload_flutter_engine_lib(flutterpi->flutter.engine_handle);
     user_input_destroy(flutterpi->user_input);
+#ifdef BUILD_RAW_KEYBOARD_PLUGIN
+    if (flutterpi->rawkb != NULL) {
+        rawkb_destroy(flutterpi->rawkb);
+    }
+#endif
     compositor_unref(flutterpi->compositor);
     if (flutterpi->gl_renderer) {
 #ifdef HAVE_EGL_GLES2
@@ -2838,7 +3509,14 @@ void flutterpi_destroy(struct flutterpi *flutterpi) {
 #endif
     }
     tracer_unref(flutterpi->tracer);
-    drmdev_unref(flutterpi->drmdev);
+    if (flutterpi->drmdev != NULL) {
+        drmdev_unref(flutterpi->drmdev);
+    } else if (flutterpi->gbm_device != NULL) {
+        destroy_rendernode_gbm_device(flutterpi->gbm_device);
+    }
+    if (flutterpi->fbdev != NULL) {
+        fbdev_unref(flutterpi->fbdev);
+    }
     locales_destroy(flutterpi->locales);
     if (flutterpi->libseat != NULL) {
 #ifdef HAVE_LIBSEAT
@@ -2847,8 +3525,11 @@ void flutterpi_destroy(struct flutterpi *flutterpi) {
         UNREACHABLE();
 #endif
     }
-    sd_event_unrefp(&flutterpi->event_loop);
-    close(flutterpi->wakeup_event_loop_fd);
+#ifdef HAVE_LIBSYSTEMD
+    sd_event_unrefp(&flutterpi->sd_event_loop);
+    pthread_mutex_destroy(&flutterpi->event_loop_mutex);
+#endif
+    evloop_unref(flutterpi->evloop);
     flutter_paths_free(flutterpi->flutter.paths);
     free(flutterpi->flutter.bundle_path);
     free(flutterpi);
@@ -24,14 +24,18 @@
 #include <flutter_embedder.h>
 #include <libinput.h>
 #include <linux/input.h>
-#include <systemd/sd-event.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
+#include "config.h"
 #include "cursor.h"
 #include "pixel_format.h"
 #include "util/collection.h"
 
+#ifdef HAVE_LIBSYSTEMD
+    #include <systemd/sd-event.h>
+#endif
+
 enum device_orientation { kPortraitUp, kLandscapeLeft, kPortraitDown, kLandscapeRight };
 
 #define ORIENTATION_IS_LANDSCAPE(orientation) ((orientation) == kLandscapeLeft || (orientation) == kLandscapeRight)
@@ -88,9 +92,11 @@ enum flutter_runtime_mode { FLUTTER_RUNTIME_MODE_DEBUG, FLUTTER_RUNTIME_MODE_PRO
 struct compositor;
 struct plugin_registry;
 struct texture_registry;
+struct thread_pool;
 struct drmdev;
 struct locales;
 struct vk_renderer;
+struct window_capture;
 struct flutterpi;
 
 /// TODO: Remove this
@@ -114,6 +120,22 @@ struct platform_message {
     size_t message_size;
 };
 
+/**
+ * @brief Which kinds of key events are sent to flutter.
+ */
+enum keyevent_mode {
+    /// Only the legacy GTK-style JSON events on the `flutter/keyevent` channel. (RawKeyboard)
+    kKeyeventModeLegacy,
+
+    /// Only `FlutterKeyEvent`s, sent using the embedder API. (HardwareKeyboard)
+    kKeyeventModeEmbedder,
+
+    /// Both of the above.
+    kKeyeventModeBoth,
+};
+
+#define FLUTTERPI_MAX_BARCODE_SCANNERS 8
+
 struct flutterpi_cmdline_args {
     bool has_orientation;
     enum device_orientation orientation;
@@ -139,11 +161,33 @@ struct flutterpi_cmdline_args {
 
     char *desired_videomode;
 
+    bool vrr;
+
+    bool mirror;
+
+    double render_scale;
+
     bool dummy_display;
     struct vec2i dummy_display_size;
 
     bool has_drm_fd;
     int drm_fd;
+
+    char *fbdev_path;
+
+    bool coalesce_input;
+    bool resample_input;
+
+    enum keyevent_mode keyevent_mode;
+
+    int n_barcode_scanners;
+    char *barcode_scanners[FLUTTERPI_MAX_BARCODE_SCANNERS];
+
+    bool startup_trace;
+
+    bool prefetch_assets;
+
+    int record_asset_access_secs;
 };
 
 int flutterpi_fill_view_properties(bool has_orientation, enum device_orientation orientation, bool has_rotation, int rotation);
@@ -152,7 +196,14 @@ int flutterpi_post_platform_task(int (*callback)(void *userdata), void *userdata
 
 int flutterpi_post_platform_task_with_time(int (*callback)(void *userdata), void *userdata, uint64_t target_time_usec);
 
+#ifdef HAVE_LIBSYSTEMD
+/**
+ * @brief Adds an IO source to the sd-event loop that's dispatched on the platform thread.
+ *
+ * Only kept for the gstreamer plugins. New code should use the flutter-pi event loop instead.
+ */
 int flutterpi_sd_event_add_io(sd_event_source **source_out, int fd, uint32_t events, sd_event_io_handler_t callback, void *userdata);
+#endif
 
 int flutterpi_send_platform_message(
     struct flutterpi *flutterpi,
@@ -174,6 +225,11 @@ struct texture_registry *flutterpi_get_texture_registry(struct flutterpi *flutte
 
 struct plugin_registry *flutterpi_get_plugin_registry(struct flutterpi *flutterpi);
 
+/**
+ * @brief Returns the thread pool that plugins can use to run blocking or heavy work off the platform thread.
+ */
+struct thread_pool *flutterpi_get_thread_pool(struct flutterpi *flutterpi);
+
 FlutterPlatformMessageResponseHandle *
 flutterpi_create_platform_message_response_handle(struct flutterpi *flutterpi, FlutterDataCallback data_callback, void *userdata);
 
@@ -193,6 +249,24 @@ struct gl_renderer *flutterpi_get_gl_renderer(struct flutterpi *flutterpi);
 
 void flutterpi_set_pointer_kind(struct flutterpi *flutterpi, enum pointer_kind kind);
 
+/**
+ * @brief Sets the gamma LUT and color transformation matrix the display hardware applies to the main window.
+ *
+ * See @ref window_set_color_transform.
+ */
+int flutterpi_set_color_transform(struct flutterpi *flutterpi, const double *gamma_lut, size_t n_gamma_lut_entries, const double *ctm);
+
+/**
+ * @brief Captures the next frame shown in the main window.
+ *
+ * See @ref window_capture.
+ */
+int flutterpi_capture(
+    struct flutterpi *flutterpi,
+    void (*callback)(const struct window_capture *capture, int status, void *userdata),
+    void *userdata
+);
+
 void flutterpi_trace_event_instant(struct flutterpi *flutterpi, const char *name);
 
 void flutterpi_trace_event_begin(struct flutterpi *flutterpi, const char *name);
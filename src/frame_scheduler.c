@@ -54,6 +54,11 @@ void frame_scheduler_destroy(struct frame_scheduler *scheduler) {
     free(scheduler);
 }
 
+enum present_mode frame_scheduler_get_present_mode(struct frame_scheduler *scheduler) {
+    ASSERT_NOT_NULL(scheduler);
+    return scheduler->present_mode;
+}
+
 void frame_scheduler_on_fl_vsync_request(struct frame_scheduler *scheduler, intptr_t vsync_baton) {
     ASSERT_NOT_NULL(scheduler);
     assert(vsync_baton != 0);
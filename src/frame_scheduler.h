@@ -24,7 +24,14 @@ typedef void (*fl_vsync_callback_t)(
 );
 // clang-format on
 
-enum present_mode { kDoubleBufferedVsync_PresentMode, kTripleBufferedVsync_PresentMode };
+/**
+ * @brief How frames are paced.
+ *
+ * With @ref kVariableRefreshRate_PresentMode, KMS windows enable variable refresh rate on the CRTC
+ * (if the display supports it), and estimate the next vblank from the refresh range of the display
+ * instead of the fixed refresh rate of the mode.
+ */
+enum present_mode { kDoubleBufferedVsync_PresentMode, kTripleBufferedVsync_PresentMode, kVariableRefreshRate_PresentMode };
 
 /**
  * @brief Creates a new frame scheduler.
@@ -53,6 +60,8 @@ void frame_scheduler_destroy(struct frame_scheduler *scheduler);
 
 DECLARE_REF_OPS(frame_scheduler)
 
+enum present_mode frame_scheduler_get_present_mode(struct frame_scheduler *scheduler);
+
 /**
  * @brief Called when flutter calls the embedder supplied vsync_callback.
  * Embedder should reply on the platform task thread with the timestamp
@@ -2,7 +2,8 @@
 #include "keyboard.h"
 
 #include <errno.h>
-#include <locale.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -23,6 +24,17 @@
 #include "util/collection.h"
 #include "util/logging.h"
 
+#include "config.h"
+
+#define LIBXKBCOMMON_VER(major, minor, patch) ((((major) & 0xFF) << 16) | (((minor) & 0xFF) << 8) | ((patch) & 0xFF))
+#define THIS_LIBXKBCOMMON_VER LIBXKBCOMMON_VER(LIBXKBCOMMON_VERSION_MAJOR, LIBXKBCOMMON_VERSION_MINOR, LIBXKBCOMMON_VERSION_PATCH)
+
+// xkb_compose_table_iterator_new & friends were added in libxkbcommon 1.6.0.
+// We need those to serialize compose tables for the cache.
+#if THIS_LIBXKBCOMMON_VER >= LIBXKBCOMMON_VER(1, 6, 0)
+    #define HAVE_XKB_COMPOSE_TABLE_ITERATOR
+#endif
+
 static int find_var_offset_in_string(const char *varname, const char *buffer, regmatch_t *match) {
     regmatch_t matches[2];
     char *pattern;
@@ -146,16 +158,178 @@ fail_return_null:
     return NULL;
 }
 
-static struct xkb_keymap *load_default_keymap(struct xkb_context *context) {
+/**
+ * @brief The directory compiled keymaps & compose tables are cached in.
+ *
+ * Either $XDG_CACHE_HOME/flutter-pi or $HOME/.cache/flutter-pi. Returns NULL if neither
+ * is set or the directory can't be created, in which case we just don't cache.
+ */
+static char *get_cache_dir(void) {
+    const char *xdg_cache_home, *home;
+    char *parent, *dir;
+    int ok;
+
+    xdg_cache_home = getenv("XDG_CACHE_HOME");
+    if (xdg_cache_home != NULL && xdg_cache_home[0] == '/') {
+        parent = strdup(xdg_cache_home);
+        if (parent == NULL) {
+            return NULL;
+        }
+    } else {
+        home = getenv("HOME");
+        if (home == NULL || home[0] != '/') {
+            return NULL;
+        }
+
+        ok = asprintf(&parent, "%s/.cache", home);
+        if (ok < 0) {
+            return NULL;
+        }
+    }
+
+    ok = asprintf(&dir, "%s/flutter-pi", parent);
+    if (ok < 0) {
+        free(parent);
+        return NULL;
+    }
+
+    // try to create both, ignore the errors here. If the directory still doesn't exist,
+    // writing the cache files will fail later & we'll just not cache.
+    mkdir(parent, 0755);
+    mkdir(dir, 0755);
+    free(parent);
+
+    return dir;
+}
+
+#define FNV1A_64_OFFSET_BASIS 0xcbf29ce484222325ull
+#define FNV1A_64_PRIME 0x100000001b3ull
+
+static uint64_t hash_bytes(uint64_t hash, const void *bytes, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        hash ^= ((const uint8_t *) bytes)[i];
+        hash *= FNV1A_64_PRIME;
+    }
+    return hash;
+}
+
+static uint64_t hash_str(uint64_t hash, const char *str) {
+    // hash the terminating zero too, so ("ab", "c") and ("a", "bc") hash differently.
+    if (str == NULL) {
+        return hash_bytes(hash, "\xFF", 1);
+    }
+    return hash_bytes(hash, str, strlen(str) + 1);
+}
+
+/**
+ * @brief Hashes the identity & modification time of the file (or directory) at @param path.
+ *
+ * Package updates replace the xkb data files, which changes the inode & mtime, so this
+ * is enough to invalidate the cache when the inputs of the compilation change.
+ */
+static uint64_t hash_file_stat(uint64_t hash, const char *path) {
+    struct stat s;
+    int64_t values[5];
+    int ok;
+
+    hash = hash_str(hash, path);
+
+    ok = stat(path, &s);
+    if (ok < 0) {
+        return hash_bytes(hash, "\xFF", 1);
+    }
+
+    values[0] = s.st_ino;
+    values[1] = s.st_size;
+    values[2] = s.st_mtim.tv_sec;
+    values[3] = s.st_mtim.tv_nsec;
+    values[4] = s.st_ctim.tv_sec;
+
+    return hash_bytes(hash, values, sizeof(values));
+}
+
+static int write_cache_file(const char *path, const char *contents, size_t length) {
+    char *temp_path;
+    ssize_t written;
+    int ok, fd;
+
+    // write to a temporary file first and then atomically rename it, so
+    // a concurrently starting flutter-pi never sees a half-written file.
+    ok = asprintf(&temp_path, "%s.%d.tmp", path, (int) getpid());
+    if (ok < 0) {
+        return ENOMEM;
+    }
+
+    fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        ok = errno;
+        goto fail_free_temp_path;
+    }
+
+    while (length > 0) {
+        written = write(fd, contents, length);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        } else if (written < 0) {
+            ok = errno;
+            goto fail_close;
+        }
+
+        contents += written;
+        length -= written;
+    }
+
+    close(fd);
+
+    ok = rename(temp_path, path);
+    if (ok < 0) {
+        ok = errno;
+        unlink(temp_path);
+        goto fail_free_temp_path;
+    }
+
+    free(temp_path);
+    return 0;
+
+fail_close:
+    close(fd);
+    unlink(temp_path);
+
+fail_free_temp_path:
+    free(temp_path);
+    return ok;
+}
+
+static uint64_t get_keymap_cache_key(struct xkb_context *context, const char *config_file) {
+    static const char *env_vars[] = { "XKB_DEFAULT_RULES", "XKB_DEFAULT_MODEL", "XKB_DEFAULT_LAYOUT", "XKB_DEFAULT_VARIANT", "XKB_DEFAULT_OPTIONS" };
+    static const char *data_subpaths[] = { "rules/evdev", "keycodes", "symbols", "types", "compat" };
+    char path[PATH_MAX];
+    uint64_t hash;
+
+    hash = FNV1A_64_OFFSET_BASIS;
+    hash = hash_str(hash, LIBXKBCOMMON_VERSION);
+    hash = hash_str(hash, config_file);
+
+    // These provide the default RMLVO values for the names that are missing in /etc/default/keyboard.
+    for (size_t i = 0; i < ARRAY_SIZE(env_vars); i++) {
+        hash = hash_str(hash, getenv(env_vars[i]));
+    }
+
+    for (unsigned int i = 0; i < xkb_context_num_include_paths(context); i++) {
+        for (size_t j = 0; j < ARRAY_SIZE(data_subpaths); j++) {
+            snprintf(path, sizeof(path), "%s/%s", xkb_context_include_path_get(context, i), data_subpaths[j]);
+            hash = hash_file_stat(hash, path);
+        }
+    }
+
+    return hash;
+}
+
+static struct xkb_keymap *compile_keymap_from_config_file(struct xkb_context *context, const char *file) {
     struct xkb_keymap *keymap;
-    char *file, *xkbmodel, *xkblayout, *xkbvariant, *xkboptions;
+    char *xkbmodel, *xkblayout, *xkbvariant, *xkboptions;
 
-    file = load_file("/etc/default/keyboard");
     if (file == NULL) {
-        LOG_ERROR(
-            "Could not load keyboard configuration from \"/etc/default/keyboard\". Default keyboard config will be used. load_file: %s\n",
-            strerror(errno)
-        );
         xkbmodel = NULL;
         xkblayout = NULL;
         xkbvariant = NULL;
@@ -181,8 +355,6 @@ static struct xkb_keymap *load_default_keymap(struct xkb_context *context) {
         if (xkboptions == NULL) {
             LOG_ERROR("Could not find \"XKBOPTIONS\" property inside \"/etc/default/keyboard\". Default value will be used.");
         }
-
-        free(file);
     }
 
     struct xkb_rule_names names = { .rules = NULL, .model = xkbmodel, .layout = xkblayout, .variant = xkbvariant, .options = xkboptions };
@@ -205,24 +377,247 @@ static struct xkb_keymap *load_default_keymap(struct xkb_context *context) {
     return keymap;
 }
 
-static struct xkb_compose_table *load_default_compose_table(struct xkb_context *context) {
+static struct xkb_keymap *load_default_keymap(struct xkb_context *context, const char *cache_dir) {
+    struct xkb_keymap *keymap;
+    char *file, *cache_path, *serialized;
+    int ok;
+
+    file = load_file("/etc/default/keyboard");
+    if (file == NULL) {
+        LOG_ERROR(
+            "Could not load keyboard configuration from \"/etc/default/keyboard\". Default keyboard config will be used. load_file: %s\n",
+            strerror(errno)
+        );
+    }
+
+    cache_path = NULL;
+    if (cache_dir != NULL) {
+        ok = asprintf(&cache_path, "%s/keymap-%016" PRIx64 ".xkb", cache_dir, get_keymap_cache_key(context, file));
+        if (ok < 0) {
+            cache_path = NULL;
+        }
+    }
+
+    if (cache_path != NULL) {
+        serialized = load_file(cache_path);
+        if (serialized != NULL) {
+            keymap = xkb_keymap_new_from_string(context, serialized, XKB_KEYMAP_FORMAT_TEXT_V1, XKB_KEYMAP_COMPILE_NO_FLAGS);
+            free(serialized);
+
+            if (keymap != NULL) {
+                free(cache_path);
+                free(file);
+                return keymap;
+            }
+
+            LOG_DEBUG("Cached keymap \"%s\" is invalid. Recompiling.\n", cache_path);
+            unlink(cache_path);
+        }
+    }
+
+    keymap = compile_keymap_from_config_file(context, file);
+    free(file);
+
+    if (keymap != NULL && cache_path != NULL) {
+        serialized = xkb_keymap_get_as_string(keymap, XKB_KEYMAP_FORMAT_TEXT_V1);
+        if (serialized != NULL) {
+            ok = write_cache_file(cache_path, serialized, strlen(serialized));
+            if (ok != 0) {
+                LOG_DEBUG("Could not cache compiled keymap at \"%s\". write_cache_file: %s\n", cache_path, strerror(ok));
+            }
+            free(serialized);
+        }
+    }
+
+    free(cache_path);
+    return keymap;
+}
+
+#ifdef HAVE_XKB_COMPOSE_TABLE_ITERATOR
+static uint64_t get_compose_table_cache_key(const char *locale) {
+    const char *xcomposefile, *xlocaledir, *home;
+    char path[PATH_MAX];
+    uint64_t hash;
+
+    hash = FNV1A_64_OFFSET_BASIS;
+    hash = hash_str(hash, LIBXKBCOMMON_VERSION);
+    hash = hash_str(hash, locale);
+
+    // Same lookup order as xkb_compose_table_new_from_locale:
+    // $XCOMPOSEFILE, then ~/.XCompose, then the system compose file for the locale.
+    xcomposefile = getenv("XCOMPOSEFILE");
+    hash = hash_str(hash, xcomposefile);
+    if (xcomposefile != NULL) {
+        hash = hash_file_stat(hash, xcomposefile);
+    }
+
+    home = getenv("HOME");
+    if (home != NULL) {
+        snprintf(path, sizeof(path), "%s/.XCompose", home);
+        hash = hash_file_stat(hash, path);
+    }
+
+    xlocaledir = getenv("XLOCALEDIR");
+    if (xlocaledir == NULL) {
+        xlocaledir = "/usr/share/X11/locale";
+    }
+
+    snprintf(path, sizeof(path), "%s/compose.dir", xlocaledir);
+    hash = hash_file_stat(hash, path);
+
+    snprintf(path, sizeof(path), "%s/%s/Compose", xlocaledir, locale);
+    hash = hash_file_stat(hash, path);
+
+    return hash;
+}
+
+static void write_compose_string(FILE *stream, const char *str) {
+    fputc('"', stream);
+    for (const char *c = str; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(stream, "\\%c", *c);
+        } else if ((unsigned char) *c < 0x20) {
+            fprintf(stream, "\\%03o", (unsigned char) *c);
+        } else {
+            fputc(*c, stream);
+        }
+    }
+    fputc('"', stream);
+}
+
+/**
+ * @brief Serializes @param table as a flat compose file, i.e. with all includes already resolved.
+ */
+static char *serialize_compose_table(struct xkb_compose_table *table, size_t *length_out) {
+    struct xkb_compose_table_iterator *iter;
+    struct xkb_compose_table_entry *entry;
+    const xkb_keysym_t *sequence;
+    size_t sequence_length;
+    xkb_keysym_t keysym;
+    const char *utf8;
+    char *buffer, name[64];
+    FILE *stream;
+    int ok;
+
+    stream = open_memstream(&buffer, length_out);
+    if (stream == NULL) {
+        return NULL;
+    }
+
+    iter = xkb_compose_table_iterator_new(table);
+    if (iter == NULL) {
+        fclose(stream);
+        free(buffer);
+        return NULL;
+    }
+
+    while ((entry = xkb_compose_table_iterator_next(iter)) != NULL) {
+        sequence = xkb_compose_table_entry_sequence(entry, &sequence_length);
+        for (size_t i = 0; i < sequence_length; i++) {
+            xkb_keysym_get_name(sequence[i], name, sizeof(name));
+            fprintf(stream, "<%s> ", name);
+        }
+
+        fputs(":", stream);
+
+        utf8 = xkb_compose_table_entry_utf8(entry);
+        if (utf8 != NULL && utf8[0] != '\0') {
+            fputc(' ', stream);
+            write_compose_string(stream, utf8);
+        }
+
+        keysym = xkb_compose_table_entry_keysym(entry);
+        if (keysym != XKB_KEY_NoSymbol) {
+            xkb_keysym_get_name(keysym, name, sizeof(name));
+            fprintf(stream, " %s", name);
+        }
+
+        fputc('\n', stream);
+    }
+
+    xkb_compose_table_iterator_free(iter);
+
+    ok = fclose(stream);
+    if (ok != 0) {
+        free(buffer);
+        return NULL;
+    }
+
+    return buffer;
+}
+#endif
+
+static struct xkb_compose_table *load_default_compose_table(struct xkb_context *context, const char *locale, const char *cache_dir) {
     struct xkb_compose_table *tbl;
 
-    setlocale(LC_ALL, "");
+#ifdef HAVE_XKB_COMPOSE_TABLE_ITERATOR
+    char *cache_path, *serialized;
+    size_t length;
+    int ok;
+
+    cache_path = NULL;
+    if (cache_dir != NULL) {
+        ok = asprintf(&cache_path, "%s/compose-%016" PRIx64 ".txt", cache_dir, get_compose_table_cache_key(locale));
+        if (ok < 0) {
+            cache_path = NULL;
+        }
+    }
 
-    tbl = xkb_compose_table_new_from_locale(context, setlocale(LC_CTYPE, NULL), XKB_COMPOSE_COMPILE_NO_FLAGS);
+    if (cache_path != NULL) {
+        serialized = load_file(cache_path);
+        if (serialized != NULL) {
+            tbl = xkb_compose_table_new_from_buffer(
+                context,
+                serialized,
+                strlen(serialized),
+                locale,
+                XKB_COMPOSE_FORMAT_TEXT_V1,
+                XKB_COMPOSE_COMPILE_NO_FLAGS
+            );
+            free(serialized);
+
+            if (tbl != NULL) {
+                free(cache_path);
+                return tbl;
+            }
+
+            LOG_DEBUG("Cached compose table \"%s\" is invalid. Recompiling.\n", cache_path);
+            unlink(cache_path);
+        }
+    }
+#else
+    (void) cache_dir;
+#endif
+
+    tbl = xkb_compose_table_new_from_locale(context, locale, XKB_COMPOSE_COMPILE_NO_FLAGS);
     if (tbl == NULL) {
         LOG_ERROR("Could not create compose table from locale.\n");
     }
 
+#ifdef HAVE_XKB_COMPOSE_TABLE_ITERATOR
+    if (tbl != NULL && cache_path != NULL) {
+        serialized = serialize_compose_table(tbl, &length);
+        if (serialized != NULL) {
+            ok = write_cache_file(cache_path, serialized, length);
+            if (ok != 0) {
+                LOG_DEBUG("Could not cache compose table at \"%s\". write_cache_file: %s\n", cache_path, strerror(ok));
+            }
+            free(serialized);
+        }
+    }
+
+    free(cache_path);
+#endif
+
     return tbl;
 }
 
-struct keyboard_config *keyboard_config_new(void) {
+struct keyboard_config *keyboard_config_new(const char *locale) {
     struct keyboard_config *cfg;
     struct xkb_compose_table *compose_table;
     struct xkb_context *ctx;
     struct xkb_keymap *keymap;
+    char *cache_dir;
 
     cfg = malloc(sizeof *cfg);
     if (cfg == NULL) {
@@ -236,16 +631,20 @@ struct keyboard_config *keyboard_config_new(void) {
         goto fail_free_cfg;
     }
 
-    compose_table = load_default_compose_table(ctx);
+    cache_dir = get_cache_dir();
+
+    compose_table = load_default_compose_table(ctx, locale, cache_dir);
     if (compose_table == NULL) {
-        goto fail_free_context;
+        goto fail_free_cache_dir;
     }
 
-    keymap = load_default_keymap(ctx);
+    keymap = load_default_keymap(ctx, cache_dir);
     if (keymap == NULL) {
         goto fail_free_compose_table;
     }
 
+    free(cache_dir);
+
     cfg->context = ctx;
     cfg->default_compose_table = compose_table;
     cfg->default_keymap = keymap;
@@ -255,7 +654,8 @@ struct keyboard_config *keyboard_config_new(void) {
 fail_free_compose_table:
     xkb_compose_table_unref(compose_table);
 
-fail_free_context:
+fail_free_cache_dir:
+    free(cache_dir);
     xkb_context_unref(ctx);
 
 fail_free_cfg:
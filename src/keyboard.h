@@ -44,7 +44,12 @@ struct keyboard_modifier_state {
 #define KEY_PRESS 1
 #define KEY_REPEAT 2
 
-struct keyboard_config *keyboard_config_new(void);
+/**
+ * @brief Loads the default keymap and the compose table for @param locale (the LC_CTYPE locale).
+ *
+ * Doesn't touch the process locale, so this can run on any thread.
+ */
+struct keyboard_config *keyboard_config_new(const char *locale);
 
 void keyboard_config_destroy(struct keyboard_config *config);
 
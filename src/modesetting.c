@@ -2,6 +2,7 @@
 
 #include <errno.h>
 #include <inttypes.h>
+#include <math.h>
 #include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -12,11 +13,14 @@
 #include <sys/mman.h>
 #include <unistd.h>
 
+#include <libudev.h>
 #include <sys/epoll.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
+#include "notifier_listener.h"
 #include "pixel_format.h"
 #include "util/bitset.h"
 #include "util/list.h"
@@ -42,6 +46,30 @@ struct drm_fb {
     uint32_t handles[4];
     uint32_t pitches[4];
     uint32_t offsets[4];
+
+    /// True if this fb is in the dmabuf fb cache, see @ref drmdev_add_cached_fb_from_dmabuf.
+    bool is_cached;
+
+    /// Number of users of a cached fb. If it's zero, the fb is in the idle list of the drmdev.
+    int n_cache_refs;
+    struct list_head idle_entry;
+};
+
+/// How many cached dmabuf fbs without users we keep around. Every frame is a new dmabuf for the
+/// dmabuf surface, so without these, a recycled decoder buffer would need a new fb every time.
+/// Should be at least the size of a typical decoder buffer pool.
+#define MAX_IDLE_CACHED_FBS 16
+
+/**
+ * @brief A GEM handle on the import fd of the drmdev, and how many cached fbs use it.
+ *
+ * Importing a dmabuf that's already imported returns the existing handle, so handles need to
+ * be refcounted to know when they can be closed.
+ */
+struct gem_handle_ref {
+    struct list_head entry;
+    uint32_t handle;
+    int n_refs;
 };
 
 struct kms_req_layer {
@@ -61,6 +89,33 @@ struct kms_req_layer {
     void *release_callback_userdata;
 };
 
+/**
+ * @brief What a file descriptor polled using the drmdev event fd is for.
+ *
+ * Every fd added to the event epoll has a pointer to one of these as its epoll userdata,
+ * so events can be dispatched without comparing the userdata against all known pointers.
+ */
+struct event_source {
+    enum event_source_type {
+        kModesettingFd_EventSourceType,
+        kUdevMonitor_EventSourceType,
+        kReleaseFence_EventSourceType,
+        kWritebackFence_EventSourceType,
+    } type;
+};
+
+/**
+ * @brief The CRTC out fence of a commit, which signals once the layers of the previous commit
+ * are no longer scanned out.
+ *
+ * It's polled using the drmdev event fd, and when it signals the layers of @ref req are released.
+ */
+struct kms_release_fence {
+    struct event_source source;
+    int fd;
+    struct kms_req_builder *req;
+};
+
 struct kms_req_builder {
     refcount_t n_refs;
 
@@ -81,10 +136,32 @@ struct kms_req_builder {
     bool unset_mode;
     bool has_mode;
     drmModeModeInfo mode;
+
+    bool has_vrr_enabled;
+    bool vrr_enabled;
+
+    /// Filled by the kernel with the CRTC out fence when committing, if supported.
+    int out_fence_fd;
+
+    /// Hash of the plane configuration of all layers so far, for memoizing TEST_ONLY commits.
+    uint64_t config_hash;
 };
 
 COMPILE_ASSERT(BITSET_SIZE(((struct kms_req_builder *) 0)->available_planes) == 128);
 
+/// The initial value of 64-bit FNV-1a hashes.
+#define FNV1A_64_OFFSET_BASIS UINT64_C(0xcbf29ce484222325)
+
+struct kms_writeback {
+    struct drm_connector *connector;
+    uint32_t fb_id;
+    drmdev_writeback_cb_t callback;
+    void *userdata;
+
+    /// Filled by the kernel when committing, signals when the writeback is done.
+    int fence_fd;
+};
+
 struct drmdev {
     int fd;
 
@@ -111,13 +188,39 @@ struct drmdev {
     struct gbm_device *gbm_device;
 
     int event_fd;
+    struct event_source modesetting_fd_source;
+    struct event_source udev_monitor_source;
 
-    struct {
+    struct per_crtc_state {
         kms_scanout_cb_t scanout_callback;
         void *userdata;
         void_callback_t destroy_callback;
 
         struct kms_req *last_flipped;
+
+        /// True if a commit for this CRTC was made, but its page flip event wasn't handled yet.
+        bool flip_pending;
+
+        /// Planes that were allocated for, or are scanned out on this CRTC.
+        /// Planes that could be used on more than one CRTC are only ever used by one of them at a time.
+        BITSET_DECLARE(claimed_planes, 128);
+
+        /// Color management property blobs that are set with the next commit for this CRTC,
+        /// and the ones that are committed right now. A blob id of zero resets the property.
+        bool has_pending_gamma_lut, has_pending_ctm;
+        uint32_t pending_gamma_lut_blob_id, pending_ctm_blob_id;
+        uint32_t gamma_lut_blob_id, ctm_blob_id;
+
+        /// The writeback that's attached to the next commit for this CRTC, and the one whose
+        /// out fence we're waiting for. There's at most one of each.
+        bool has_pending_writeback, has_writeback;
+        struct kms_writeback pending_writeback, writeback;
+        struct event_source writeback_source;
+
+        /// Hashes of plane configurations the kernel accepted in a TEST_ONLY commit (see @ref kms_req_builder.config_hash).
+        /// Reset on every modeset. Rejections aren't remembered, they can be transient or caused by the state of other CRTCs.
+        uint64_t accepted_configs[16];
+        int n_accepted_configs, next_accepted_config;
     } per_crtc_state[32];
 
     int master_fd;
@@ -127,6 +230,26 @@ struct drmdev {
     void *userdata;
 
     struct list_head fbs;
+
+    /// A second, non-master file description of the device, only used to import the dmabufs of cached fbs.
+    /// GEM handles are per file description, so every handle on it was created by the fb cache and can be closed
+    /// by it. On @ref fd, the imported handle could be the one of a GBM BO (or dumb buffer) for the same buffer.
+    /// -1 if it wasn't opened yet.
+    int import_fd;
+
+    /// The GEM handles on @ref import_fd, see @ref gem_handle_ref.
+    struct list_head gem_handles;
+
+    /// Cached dmabuf fbs without users, least recently used first.
+    struct list_head idle_cached_fbs;
+    int n_idle_cached_fbs;
+
+    /// Receives the uevents of the kernel when displays are connected or disconnected.
+    /// NULL if hotplug events are not supported.
+    struct udev_monitor *udev_monitor;
+    dev_t devnum;
+
+    struct notifier hotplug_notifier;
 };
 
 static bool is_drm_master(int fd) {
@@ -174,13 +297,38 @@ void drm_mode_blob_destroy(struct drm_mode_blob *blob) {
 
 DEFINE_STATIC_LOCK_OPS(drmdev, mutex)
 
+void drm_parse_edid_refresh_range(const uint8_t *edid, size_t size, uint32_t *min_hz_out, uint32_t *max_hz_out) {
+    static const uint8_t edid_header[8] = { 0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00 };
+
+    if (size < 128 || memcmp(edid, edid_header, sizeof edid_header) != 0) {
+        return;
+    }
+
+    // 4 18-byte display descriptors, starting at byte 54.
+    for (int i = 0; i < 4; i++) {
+        const uint8_t *desc = edid + 54 + i * 18;
+
+        // display range limits descriptor has tag 0xFD.
+        if (desc[0] != 0 || desc[1] != 0 || desc[3] != 0xFD) {
+            continue;
+        }
+
+        // bits 0 and 1 of byte 4 add 255 to the min / max vertical rate.
+        *min_hz_out = desc[5] + ((desc[4] & 0x01) ? 255 : 0);
+        *max_hz_out = desc[6] + ((desc[4] & 0x02) ? 255 : 0);
+        return;
+    }
+}
+
 static int fetch_connector(int drm_fd, uint32_t connector_id, struct drm_connector *connector_out) {
     struct drm_connector_prop_ids ids;
     drmModeObjectProperties *props;
     drmModePropertyRes *prop_info;
     drmModeConnector *connector;
     drmModeModeInfo *modes;
-    uint32_t crtc_id;
+    uint32_t crtc_id, min_refresh_hz, max_refresh_hz;
+    bool writeback_formats[PIXFMT_COUNT] = { 0 };
+    bool vrr_capable;
     int ok;
 
     drm_connector_prop_ids_init(&ids);
@@ -200,6 +348,9 @@ static int fetch_connector(int drm_fd, uint32_t connector_id, struct drm_connect
     }
 
     crtc_id = DRM_ID_NONE;
+    vrr_capable = false;
+    min_refresh_hz = 0;
+    max_refresh_hz = 0;
     for (int i = 0; i < props->count_props; i++) {
         prop_info = drmModeGetProperty(drm_fd, props->props[i]);
         if (prop_info == NULL) {
@@ -222,6 +373,27 @@ static int fetch_connector(int drm_fd, uint32_t connector_id, struct drm_connect
 
         if (strncmp(prop_info->name, "CRTC_ID", DRM_PROP_NAME_LEN) == 0) {
             crtc_id = props->prop_values[i];
+        } else if (strncmp(prop_info->name, "vrr_capable", DRM_PROP_NAME_LEN) == 0) {
+            vrr_capable = props->prop_values[i] != 0;
+        } else if (strncmp(prop_info->name, "EDID", DRM_PROP_NAME_LEN) == 0 && props->prop_values[i] != 0) {
+            drmModePropertyBlobRes *edid = drmModeGetPropertyBlob(drm_fd, props->prop_values[i]);
+            if (edid != NULL) {
+                drm_parse_edid_refresh_range(edid->data, edid->length, &min_refresh_hz, &max_refresh_hz);
+                drmModeFreePropertyBlob(edid);
+            }
+        } else if (strncmp(prop_info->name, "WRITEBACK_PIXEL_FORMATS", DRM_PROP_NAME_LEN) == 0 && props->prop_values[i] != 0) {
+            drmModePropertyBlobRes *blob = drmModeGetPropertyBlob(drm_fd, props->prop_values[i]);
+            if (blob != NULL) {
+                const uint32_t *formats = blob->data;
+
+                for (size_t j = 0; j < blob->length / sizeof(uint32_t); j++) {
+                    if (has_pixfmt_for_drm_format(formats[j])) {
+                        writeback_formats[get_pixfmt_for_drm_format(formats[j])] = true;
+                    }
+                }
+
+                drmModeFreePropertyBlob(blob);
+            }
         }
 
         drmModeFreeProperty(prop_info);
@@ -253,8 +425,12 @@ static int fetch_connector(int drm_fd, uint32_t connector_id, struct drm_connect
     connector_out->variable_state.height_mm = connector->mmHeight;
     connector_out->variable_state.n_modes = connector->count_modes;
     connector_out->variable_state.modes = modes;
+    connector_out->variable_state.vrr_capable = vrr_capable;
+    connector_out->variable_state.min_refresh_hz = min_refresh_hz;
+    connector_out->variable_state.max_refresh_hz = max_refresh_hz;
     connector_out->committed_state.crtc_id = crtc_id;
     connector_out->committed_state.encoder_id = connector->encoder_id;
+    memcpy(connector_out->writeback_formats, writeback_formats, sizeof writeback_formats);
     drmModeFreeObjectProperties(props);
     drmModeFreeConnector(connector);
     return 0;
@@ -271,6 +447,48 @@ static void free_connector(struct drm_connector *connector) {
     free(connector->variable_state.modes);
 }
 
+/**
+ * @brief Re-fetch the connection state, physical size and modes of this connector.
+ *
+ * Only @ref drm_connector.variable_state is updated, the rest of the connector stays the same,
+ * so pointers to it stay valid. Pointers to the old modes of the connector are not valid anymore
+ * if @param changed_out is set to true.
+ */
+static int refresh_connector(int drm_fd, struct drm_connector *connector, bool *changed_out) {
+    struct drm_connector fetched;
+    bool changed;
+    int ok;
+
+    ok = fetch_connector(drm_fd, connector->id, &fetched);
+    if (ok != 0) {
+        return ok;
+    }
+
+    changed = fetched.variable_state.connection_state != connector->variable_state.connection_state
+        || fetched.variable_state.width_mm != connector->variable_state.width_mm
+        || fetched.variable_state.height_mm != connector->variable_state.height_mm
+        || fetched.variable_state.vrr_capable != connector->variable_state.vrr_capable
+        || fetched.variable_state.n_modes != connector->variable_state.n_modes;
+
+    if (!changed && fetched.variable_state.n_modes != 0) {
+        changed = memcmp(
+            fetched.variable_state.modes,
+            connector->variable_state.modes,
+            fetched.variable_state.n_modes * sizeof(*fetched.variable_state.modes)
+        ) != 0;
+    }
+
+    if (changed) {
+        free_connector(connector);
+        connector->variable_state = fetched.variable_state;
+    } else {
+        free_connector(&fetched);
+    }
+
+    *changed_out = changed;
+    return 0;
+}
+
 static int fetch_connectors(struct drmdev *drmdev, struct drm_connector **connectors_out, size_t *n_connectors_out) {
     struct drm_connector *connectors;
     int ok;
@@ -376,10 +594,13 @@ static int fetch_crtc(int drm_fd, int crtc_index, uint32_t crtc_id, struct drm_c
     drmModeObjectProperties *props;
     drmModePropertyRes *prop_info;
     drmModeCrtc *crtc;
+    uint32_t gamma_lut_size;
+    bool vrr_enabled;
     int ok;
 
     drm_crtc_prop_ids_init(&ids);
 
+    gamma_lut_size = 0;
     crtc = drmModeGetCrtc(drm_fd, crtc_id);
     if (crtc == NULL) {
         ok = errno;
@@ -394,6 +615,7 @@ static int fetch_crtc(int drm_fd, int crtc_index, uint32_t crtc_id, struct drm_c
         goto fail_free_crtc;
     }
 
+    vrr_enabled = false;
     for (int i = 0; i < props->count_props; i++) {
         prop_info = drmModeGetProperty(drm_fd, props->props[i]);
         if (prop_info == NULL) {
@@ -414,6 +636,12 @@ static int fetch_crtc(int drm_fd, int crtc_index, uint32_t crtc_id, struct drm_c
 
 #undef CHECK_ASSIGN_PROPERTY_ID
 
+        if (strncmp(prop_info->name, "VRR_ENABLED", ARRAY_SIZE(prop_info->name)) == 0) {
+            vrr_enabled = props->prop_values[i] != 0;
+        } else if (strncmp(prop_info->name, "GAMMA_LUT_SIZE", ARRAY_SIZE(prop_info->name)) == 0) {
+            gamma_lut_size = (uint32_t) props->prop_values[i];
+        }
+
         drmModeFreeProperty(prop_info);
         prop_info = NULL;
     }
@@ -422,9 +650,11 @@ static int fetch_crtc(int drm_fd, int crtc_index, uint32_t crtc_id, struct drm_c
     crtc_out->index = crtc_index;
     crtc_out->bitmask = 1u << crtc_index;
     crtc_out->ids = ids;
+    crtc_out->gamma_lut_size = gamma_lut_size;
     crtc_out->committed_state.has_mode = crtc->mode_valid;
     crtc_out->committed_state.mode = crtc->mode;
     crtc_out->committed_state.mode_blob = NULL;
+    crtc_out->committed_state.vrr_enabled = vrr_enabled;
     drmModeFreeObjectProperties(props);
     drmModeFreeCrtc(crtc);
     return 0;
@@ -1022,15 +1252,64 @@ static int set_drm_client_caps(int fd, bool *supports_atomic_modesetting) {
         if (supports_atomic_modesetting != NULL) {
             *supports_atomic_modesetting = true;
         }
+
+        // Writeback connectors are only exposed to clients that ask for them. They're optional,
+        // so it's fine if this fails.
+        ok = drmSetClientCap(fd, DRM_CLIENT_CAP_WRITEBACK_CONNECTORS, 1);
+        if (ok < 0) {
+            LOG_DEBUG("Could not set DRM client writeback connectors capable. drmSetClientCap: %s\n", strerror(errno));
+        }
     }
 #endif
 
     return 0;
 }
 
+static struct udev_monitor *open_hotplug_monitor() {
+    struct udev_monitor *monitor;
+    struct udev *udev;
+    int ok;
+
+    udev = udev_new();
+    if (udev == NULL) {
+        LOG_ERROR("Could not create udev instance. udev_new: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    monitor = udev_monitor_new_from_netlink(udev, "udev");
+
+    // the monitor has its own reference on the udev instance.
+    udev_unref(udev);
+
+    if (monitor == NULL) {
+        LOG_ERROR("Could not create udev monitor. udev_monitor_new_from_netlink: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    ok = udev_monitor_filter_add_match_subsystem_devtype(monitor, "drm", "drm_minor");
+    if (ok < 0) {
+        LOG_ERROR("Could not add udev monitor filter. udev_monitor_filter_add_match_subsystem_devtype: %s\n", strerror(-ok));
+        goto fail_unref_monitor;
+    }
+
+    ok = udev_monitor_enable_receiving(monitor);
+    if (ok < 0) {
+        LOG_ERROR("Could not enable udev monitor. udev_monitor_enable_receiving: %s\n", strerror(-ok));
+        goto fail_unref_monitor;
+    }
+
+    return monitor;
+
+fail_unref_monitor:
+    udev_monitor_unref(monitor);
+    return NULL;
+}
+
 struct drmdev *drmdev_new_from_interface_fd(int fd, void *fd_metadata, const struct drmdev_interface *interface, void *userdata) {
+    struct udev_monitor *udev_monitor;
     struct gbm_device *gbm_device;
     struct drmdev *drmdev;
+    struct stat statbuf;
     uint64_t cap;
     bool supports_atomic_modesetting;
     bool supports_dumb_buffers;
@@ -1130,12 +1409,48 @@ struct drmdev *drmdev_new_from_interface_fd(int fd, void *fd_metadata, const str
         goto fail_destroy_gbm_device;
     }
 
-    ok = epoll_ctl(event_fd, EPOLL_CTL_ADD, fd, &(struct epoll_event){ .events = EPOLLIN | EPOLLPRI, .data.ptr = NULL });
+    drmdev->modesetting_fd_source.type = kModesettingFd_EventSourceType;
+    drmdev->udev_monitor_source.type = kUdevMonitor_EventSourceType;
+
+    ok = epoll_ctl(
+        event_fd,
+        EPOLL_CTL_ADD,
+        fd,
+        &(struct epoll_event){ .events = EPOLLIN | EPOLLPRI, .data.ptr = &drmdev->modesetting_fd_source }
+    );
     if (ok != 0) {
         LOG_ERROR("Could not add DRM file descriptor to epoll instance.\n");
         goto fail_close_event_fd;
     }
 
+    ok = fstat(fd, &statbuf);
+    if (ok != 0) {
+        LOG_ERROR("Could not stat DRM device. fstat: %s\n", strerror(errno));
+        goto fail_close_event_fd;
+    }
+
+    // Not being able to listen for hotplug events is not fatal, we just won't notice
+    // when displays are connected or disconnected.
+    udev_monitor = open_hotplug_monitor();
+    if (udev_monitor != NULL) {
+        ok = epoll_ctl(
+            event_fd,
+            EPOLL_CTL_ADD,
+            udev_monitor_get_fd(udev_monitor),
+            &(struct epoll_event){ .events = EPOLLIN, .data.ptr = &drmdev->udev_monitor_source }
+        );
+        if (ok != 0) {
+            LOG_ERROR("Could not add udev monitor to epoll instance. epoll_ctl: %s\n", strerror(errno));
+            udev_monitor_unref(udev_monitor);
+            udev_monitor = NULL;
+        }
+    }
+
+    ok = change_notifier_init(&drmdev->hotplug_notifier);
+    if (ok != 0) {
+        goto fail_unref_udev_monitor;
+    }
+
     pthread_mutex_init(&drmdev->mutex, get_default_mutex_attrs());
     drmdev->n_refs = REFCOUNT_INIT_1;
     drmdev->fd = fd;
@@ -1144,13 +1459,27 @@ struct drmdev *drmdev_new_from_interface_fd(int fd, void *fd_metadata, const str
     drmdev->gbm_device = gbm_device;
     drmdev->event_fd = event_fd;
     memset(drmdev->per_crtc_state, 0, sizeof(drmdev->per_crtc_state));
+    for (int i = 0; i < ARRAY_SIZE(drmdev->per_crtc_state); i++) {
+        drmdev->per_crtc_state[i].writeback_source.type = kWritebackFence_EventSourceType;
+    }
     drmdev->master_fd = master_fd;
     drmdev->master_fd_metadata = fd_metadata;
     drmdev->interface = *interface;
     drmdev->userdata = userdata;
     list_inithead(&drmdev->fbs);
+    drmdev->import_fd = -1;
+    list_inithead(&drmdev->gem_handles);
+    list_inithead(&drmdev->idle_cached_fbs);
+    drmdev->n_idle_cached_fbs = 0;
+    drmdev->udev_monitor = udev_monitor;
+    drmdev->devnum = statbuf.st_rdev;
     return drmdev;
 
+fail_unref_udev_monitor:
+    if (udev_monitor != NULL) {
+        udev_monitor_unref(udev_monitor);
+    }
+
 fail_close_event_fd:
     close(event_fd);
 
@@ -1207,10 +1536,57 @@ struct drmdev *drmdev_new_from_path(const char *path, const struct drmdev_interf
     return drmdev;
 }
 
+static void destroy_blob(struct drmdev *drmdev, uint32_t blob_id) {
+    int ok;
+
+    if (blob_id == 0) {
+        return;
+    }
+
+    ok = drmModeDestroyPropertyBlob(drmdev->fd, blob_id);
+    if (ok != 0) {
+        ok = errno;
+        LOG_ERROR("Couldn't destroy property blob. drmModeDestroyPropertyBlob: %s\n", strerror(ok));
+    }
+}
+
+static void destroy_color_blobs(struct drmdev *drmdev, int crtc_index) {
+    if (drmdev->per_crtc_state[crtc_index].has_pending_gamma_lut) {
+        destroy_blob(drmdev, drmdev->per_crtc_state[crtc_index].pending_gamma_lut_blob_id);
+    }
+    if (drmdev->per_crtc_state[crtc_index].has_pending_ctm) {
+        destroy_blob(drmdev, drmdev->per_crtc_state[crtc_index].pending_ctm_blob_id);
+    }
+    destroy_blob(drmdev, drmdev->per_crtc_state[crtc_index].gamma_lut_blob_id);
+    destroy_blob(drmdev, drmdev->per_crtc_state[crtc_index].ctm_blob_id);
+}
+
 static void drmdev_destroy(struct drmdev *drmdev) {
     assert(refcount_is_zero(&drmdev->n_refs));
 
+    // Users of cached fbs hold a reference on the drmdev, so all cached fbs are idle now.
+    // That also closes all GEM handles on the import fd.
+    drmdev_evict_cached_fbs_locked(drmdev);
+    assert(list_is_empty(&drmdev->gem_handles));
+
+    if (drmdev->import_fd >= 0) {
+        close(drmdev->import_fd);
+    }
+
+    for (int i = 0; i < drmdev->n_crtcs; i++) {
+        destroy_color_blobs(drmdev, i);
+
+        // The writeback callbacks are not called anymore at this point.
+        if (drmdev->per_crtc_state[i].has_writeback) {
+            close(drmdev->per_crtc_state[i].writeback.fence_fd);
+        }
+    }
+
     drmdev->interface.close(drmdev->master_fd, drmdev->master_fd_metadata, drmdev->userdata);
+    notifier_deinit(&drmdev->hotplug_notifier);
+    if (drmdev->udev_monitor != NULL) {
+        udev_monitor_unref(drmdev->udev_monitor);
+    }
     close(drmdev->event_fd);
     gbm_device_destroy(drmdev->gbm_device);
     free_planes(drmdev->planes, drmdev->n_planes);
@@ -1231,13 +1607,67 @@ int drmdev_get_fd(struct drmdev *drmdev) {
 
 int drmdev_get_event_fd(struct drmdev *drmdev) {
     ASSERT_NOT_NULL(drmdev);
-    return drmdev->master_fd;
+
+    // The epoll instance, so we also get notified about release fences & hotplug events,
+    // not just about page flips.
+    return drmdev->event_fd;
+}
+
+static int ref_gem_handle_locked(struct drmdev *drmdev, uint32_t handle) {
+    struct gem_handle_ref *ref;
+
+    list_for_each_entry(struct gem_handle_ref, iter, &drmdev->gem_handles, entry) {
+        if (iter->handle == handle) {
+            iter->n_refs++;
+            return 0;
+        }
+    }
+
+    ref = malloc(sizeof *ref);
+    if (ref == NULL) {
+        return ENOMEM;
+    }
+
+    ref->handle = handle;
+    ref->n_refs = 1;
+    list_add(&ref->entry, &drmdev->gem_handles);
+    return 0;
+}
+
+static void unref_gem_handle_locked(struct drmdev *drmdev, uint32_t handle) {
+    struct drm_gem_close close_req;
+    int ok;
+
+    list_for_each_entry(struct gem_handle_ref, ref, &drmdev->gem_handles, entry) {
+        if (ref->handle == handle) {
+            ref->n_refs--;
+            if (ref->n_refs > 0) {
+                return;
+            }
+
+            memset(&close_req, 0, sizeof close_req);
+            close_req.handle = handle;
+
+            ok = ioctl(drmdev->import_fd, DRM_IOCTL_GEM_CLOSE, &close_req);
+            if (ok < 0) {
+                LOG_ERROR("Couldn't close GEM handle. ioctl: %s\n", strerror(errno));
+            }
+
+            list_del(&ref->entry);
+            free(ref);
+            return;
+        }
+    }
 }
 
 bool drmdev_supports_dumb_buffers(struct drmdev *drmdev) {
     return drmdev->supports_dumb_buffers;
 }
 
+bool drmdev_supports_atomic_modesetting(struct drmdev *drmdev) {
+    return drmdev->supports_atomic_modesetting;
+}
+
 int drmdev_create_dumb_buffer(
     struct drmdev *drmdev,
     int width,
@@ -1330,6 +1760,10 @@ void drmdev_unmap_dumb_buffer(struct drmdev *drmdev, void *map, size_t size) {
     }
 }
 
+static void release_layers(struct kms_req_builder *builder);
+
+static void on_release_fence_signalled_locked(struct drmdev *drmdev, struct kms_release_fence *fence);
+
 static void
 drmdev_on_page_flip_locked(int fd, unsigned int sequence, unsigned int tv_sec, unsigned int tv_usec, unsigned int crtc_id, void *userdata) {
     struct kms_req_builder *builder;
@@ -1355,6 +1789,8 @@ drmdev_on_page_flip_locked(int fd, unsigned int sequence, unsigned int tv_sec, u
 
     ASSERT_NOT_NULL_MSG(crtc, "Invalid CRTC id");
 
+    drmdev->per_crtc_state[crtc->index].flip_pending = false;
+
     if (drmdev->per_crtc_state[crtc->index].scanout_callback != NULL) {
         uint64_t vblank_ns = tv_sec * 1000000000ull + tv_usec * 1000ull;
         drmdev->per_crtc_state[crtc->index].scanout_callback(drmdev, vblank_ns, drmdev->per_crtc_state[crtc->index].userdata);
@@ -1370,6 +1806,10 @@ drmdev_on_page_flip_locked(int fd, unsigned int sequence, unsigned int tv_sec, u
         /// TODO: Remove this if we ever cache KMS reqs.
         /// FIXME: This will fail if we're using blocking commits.
         // assert(refcount_is_one(&((struct kms_req_builder*) *last_flipped)->n_refs));
+
+        // The previous request might still be referenced by its release fence, if the page flip event
+        // was handled before the fence. It's not on screen anymore anyway, so release its layers now.
+        release_layers((struct kms_req_builder *) *last_flipped);
     }
 
     kms_req_swap_ptrs(last_flipped, req);
@@ -1395,12 +1835,94 @@ static int drmdev_on_modesetting_fd_ready_locked(struct drmdev *drmdev) {
     return 0;
 }
 
+
+/**
+ * @brief Handle a uevent of the udev monitor.
+ *
+ * Refreshes the state of the connectors if it's a hotplug event for this DRM device,
+ * and sets @param changed_out to true if any of them changed.
+ */
+static void drmdev_on_udev_monitor_ready_locked(struct drmdev *drmdev, bool *changed_out) {
+    struct udev_device *device;
+    const char *hotplug, *connector_id_str;
+    uint32_t connector_id;
+    bool changed;
+    int ok;
+
+    device = udev_monitor_receive_device(drmdev->udev_monitor);
+    if (device == NULL) {
+        return;
+    }
+
+    hotplug = udev_device_get_property_value(device, "HOTPLUG");
+    if (hotplug == NULL || !streq(hotplug, "1") || udev_device_get_devnum(device) != drmdev->devnum) {
+        goto out_unref_device;
+    }
+
+    // Newer kernels tell us which connector changed.
+    connector_id_str = udev_device_get_property_value(device, "CONNECTOR");
+    connector_id = connector_id_str != NULL ? (uint32_t) strtoul(connector_id_str, NULL, 10) : DRM_ID_NONE;
+
+    for (int i = 0; i < drmdev->n_connectors; i++) {
+        struct drm_connector *connector = drmdev->connectors + i;
+
+        if (DRM_ID_IS_VALID(connector_id) && connector->id != connector_id) {
+            continue;
+        }
+
+        ok = refresh_connector(drmdev->fd, connector, &changed);
+        if (ok != 0) {
+            LOG_ERROR("Could not refresh DRM connector %" PRIu32 " after hotplug.\n", connector->id);
+            continue;
+        }
+
+        if (changed) {
+            LOG_DEBUG(
+                "Connector %" PRIu32 " changed. It's now %s.\n",
+                connector->id,
+                connector->variable_state.connection_state == kConnected_DrmConnectionState ? "connected" : "disconnected"
+            );
+
+            // The display needs a full modeset (link training, etc.) even if it's the same mode as before,
+            // so make sure the next commit on the CRTC driving it uploads the mode again.
+            for (int j = 0; j < drmdev->n_crtcs; j++) {
+                if (DRM_ID_IS_VALID(connector->committed_state.crtc_id) && drmdev->crtcs[j].id == connector->committed_state.crtc_id) {
+                    drmdev->crtcs[j].committed_state.has_mode = false;
+                }
+            }
+
+            *changed_out = true;
+        }
+    }
+
+out_unref_device:
+    udev_device_unref(device);
+}
+
+struct listener *drmdev_add_hotplug_listener(struct drmdev *drmdev, listener_cb_t notify, void *userdata) {
+    ASSERT_NOT_NULL(drmdev);
+    ASSERT_NOT_NULL(notify);
+    return notifier_listen(&drmdev->hotplug_notifier, notify, NULL, userdata);
+}
+
+void drmdev_remove_hotplug_listener(struct drmdev *drmdev, struct listener *listener) {
+    ASSERT_NOT_NULL(drmdev);
+    ASSERT_NOT_NULL(listener);
+    notifier_unlisten(&drmdev->hotplug_notifier, listener);
+}
+
 int drmdev_on_event_fd_ready(struct drmdev *drmdev) {
+    struct kms_writeback done_writebacks[ARRAY_SIZE(drmdev->per_crtc_state)];
+    struct per_crtc_state *crtc_state;
     struct epoll_event events[16];
-    int ok, n_events;
+    bool connectors_changed;
+    int ok, n_events, n_done_writebacks;
 
     ASSERT_NOT_NULL(drmdev);
 
+    connectors_changed = false;
+    n_done_writebacks = 0;
+
     drmdev_lock(drmdev);
 
     while (1) {
@@ -1419,20 +1941,54 @@ int drmdev_on_event_fd_ready(struct drmdev *drmdev) {
 
     n_events = ok;
     for (int i = 0; i < n_events; i++) {
-        // currently this could only be the root drmdev fd.
-        ASSERT_EQUALS(events[i].data.ptr, NULL);
-        ok = drmdev_on_modesetting_fd_ready_locked(drmdev);
-        if (ok != 0) {
-            goto fail_unlock;
+        struct event_source *source = events[i].data.ptr;
+
+        switch (source->type) {
+            case kModesettingFd_EventSourceType:
+                ok = drmdev_on_modesetting_fd_ready_locked(drmdev);
+                if (ok != 0) {
+                    goto fail_unlock;
+                }
+                break;
+            case kUdevMonitor_EventSourceType: drmdev_on_udev_monitor_ready_locked(drmdev, &connectors_changed); break;
+            case kReleaseFence_EventSourceType:
+                on_release_fence_signalled_locked(drmdev, CONTAINER_OF(source, struct kms_release_fence, source));
+                break;
+            case kWritebackFence_EventSourceType:
+                crtc_state = CONTAINER_OF(source, struct per_crtc_state, writeback_source);
+                assert(crtc_state->has_writeback);
+
+                epoll_ctl(drmdev->event_fd, EPOLL_CTL_DEL, crtc_state->writeback.fence_fd, NULL);
+                close(crtc_state->writeback.fence_fd);
+
+                done_writebacks[n_done_writebacks++] = crtc_state->writeback;
+                crtc_state->has_writeback = false;
+                break;
+            default: UNREACHABLE();
         }
     }
 
     drmdev_unlock(drmdev);
 
+    // The callbacks will probably want to use the framebuffer, so don't hold the lock while calling them.
+    for (int i = 0; i < n_done_writebacks; i++) {
+        done_writebacks[i].callback(drmdev, 0, done_writebacks[i].userdata);
+    }
+
+    // Listeners will probably want to commit new modes, so don't hold the lock while notifying them.
+    if (connectors_changed) {
+        notifier_notify(&drmdev->hotplug_notifier, drmdev);
+    }
+
     return 0;
 
 fail_unlock:
     drmdev_unlock(drmdev);
+
+    for (int i = 0; i < n_done_writebacks; i++) {
+        done_writebacks[i].callback(drmdev, 0, done_writebacks[i].userdata);
+    }
+
     return ok;
 }
 
@@ -1467,8 +2023,12 @@ int drmdev_get_last_vblank(struct drmdev *drmdev, uint32_t crtc_id, uint64_t *la
     return ok;
 }
 
-uint32_t drmdev_add_fb_multiplanar_locked(
+/**
+ * @brief Adds a framebuffer for GEM handles on @param fd, which is either the fd of the drmdev or its import fd.
+ */
+static uint32_t add_fb_on_fd_locked(
     struct drmdev *drmdev,
+    int fd,
     uint32_t width,
     uint32_t height,
     enum pixfmt pixel_format,
@@ -1506,11 +2066,14 @@ uint32_t drmdev_add_fb_multiplanar_locked(
     memcpy(fb->handles, bo_handles, sizeof(fb->handles));
     memcpy(fb->pitches, pitches, sizeof(fb->pitches));
     memcpy(fb->offsets, offsets, sizeof(fb->offsets));
+    fb->is_cached = false;
+    fb->n_cache_refs = 0;
+    list_inithead(&fb->idle_entry);
 
     fb_id = 0;
     if (has_modifiers) {
         ok = drmModeAddFB2WithModifiers(
-            drmdev->fd,
+            fd,
             width,
             height,
             get_pixfmt_info(pixel_format)->drm_format,
@@ -1526,7 +2089,7 @@ uint32_t drmdev_add_fb_multiplanar_locked(
             goto fail_free_fb;
         }
     } else {
-        ok = drmModeAddFB2(drmdev->fd, width, height, get_pixfmt_info(pixel_format)->drm_format, bo_handles, pitches, offsets, &fb_id, 0);
+        ok = drmModeAddFB2(fd, width, height, get_pixfmt_info(pixel_format)->drm_format, bo_handles, pitches, offsets, &fb_id, 0);
         if (ok < 0) {
             LOG_ERROR("Couldn't add buffer as DRM fb. drmModeAddFB2: %s\n", strerror(-ok));
             goto fail_free_fb;
@@ -1544,6 +2107,20 @@ fail_free_fb:
     return 0;
 }
 
+uint32_t drmdev_add_fb_multiplanar_locked(
+    struct drmdev *drmdev,
+    uint32_t width,
+    uint32_t height,
+    enum pixfmt pixel_format,
+    const uint32_t bo_handles[4],
+    const uint32_t pitches[4],
+    const uint32_t offsets[4],
+    bool has_modifiers,
+    const uint64_t modifiers[4]
+) {
+    return add_fb_on_fd_locked(drmdev, drmdev->fd, width, height, pixel_format, bo_handles, pitches, offsets, has_modifiers, modifiers);
+}
+
 uint32_t drmdev_add_fb_multiplanar(
     struct drmdev *drmdev,
     uint32_t width,
@@ -1634,7 +2211,7 @@ uint32_t drmdev_add_fb_from_dmabuf_locked(
         return 0;
     }
 
-    return drmdev_add_fb_locked(drmdev, width, height, pixel_format, prime_fd, pitch, offset, has_modifier, modifier);
+    return drmdev_add_fb_locked(drmdev, width, height, pixel_format, bo_handle, pitch, offset, has_modifier, modifier);
 }
 
 uint32_t drmdev_add_fb_from_dmabuf(
@@ -1716,48 +2293,276 @@ uint32_t drmdev_add_fb_from_dmabuf_multiplanar(
     return fb;
 }
 
-uint32_t drmdev_add_fb_from_gbm_bo_locked(struct drmdev *drmdev, struct gbm_bo *bo, bool cast_opaque) {
-    enum pixfmt format;
-    uint32_t fourcc;
-    int n_planes;
-
-    n_planes = gbm_bo_get_plane_count(bo);
-    ASSERT(0 <= n_planes && n_planes <= 4);
+/**
+ * @brief Drops the references a cached fb (or a failed lookup) holds on the GEM handles of its dmabufs.
+ */
+static void unref_imported_gem_handles_locked(struct drmdev *drmdev, const uint32_t handles[4]) {
+    for (int i = 0; i < 4; i++) {
+        if (handles[i] != 0) {
+            unref_gem_handle_locked(drmdev, handles[i]);
+        }
+    }
+}
 
-    fourcc = gbm_bo_get_format(bo);
+/**
+ * @brief Opens the import fd of the drmdev, if it isn't open yet.
+ */
+static int open_import_fd_locked(struct drmdev *drmdev) {
+    drm_magic_t magic;
+    char *path;
+    int fd;
 
-    if (!has_pixfmt_for_gbm_format(fourcc)) {
-        LOG_ERROR("GBM pixel format is not supported.\n");
+    if (drmdev->import_fd >= 0) {
         return 0;
     }
 
-    format = get_pixfmt_for_gbm_format(fourcc);
+    path = drmGetDeviceNameFromFd2(drmdev->fd);
+    if (path == NULL) {
+        LOG_ERROR("Couldn't get the path of the DRM device. drmGetDeviceNameFromFd2: %s\n", strerror(errno));
+        return EIO;
+    }
 
-    if (cast_opaque) {
-        format = pixfmt_opaque(format);
+    fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        fd = errno;
+        LOG_ERROR("Couldn't open DRM device \"%s\" for importing dmabufs. open: %s\n", path, strerror(fd));
+        free(path);
+        return fd;
     }
 
-    uint32_t handles[4];
-    uint32_t pitches[4];
+    free(path);
 
-    // Returns DRM_FORMAT_MOD_INVALID on failure, or DRM_FORMAT_MOD_LINEAR
-    // for dumb buffers.
-    uint64_t modifier = gbm_bo_get_modifier(bo);
-    bool has_modifiers = modifier != DRM_FORMAT_MOD_INVALID;
+    // If nobody is DRM master right now (because we dropped it), the kernel made this fd the master.
+    // It shouldn't be, otherwise we can't become master again.
+    drmDropMaster(fd);
 
-    for (int i = 0; i < n_planes; i++) {
-        // gbm_bo_get_handle_for_plane will return -1 (in gbm_bo_handle.s32) and
-        // set errno on failure.
-        errno = 0;
-        union gbm_bo_handle handle = gbm_bo_get_handle_for_plane(bo, i);
-        if (handle.s32 == -1) {
-            LOG_ERROR("Could not get GEM handle for plane %d: %s\n", i, strerror(errno));
-            return 0;
-        }
+    // Older kernels only allow authenticated clients to import dmabufs.
+    if (drmdev->master_fd >= 0 && drmGetMagic(fd, &magic) == 0) {
+        drmAuthMagic(drmdev->master_fd, magic);
+    }
 
-        handles[i] = handle.u32;
+    drmdev->import_fd = fd;
+    return 0;
+}
 
-        // gbm_bo_get_stride_for_plane will return 0 and set errno on failure.
+static void evict_cached_fb_locked(struct drmdev *drmdev, struct drm_fb *fb) {
+    uint32_t handles[4];
+
+    assert(fb->is_cached && fb->n_cache_refs == 0);
+
+    list_del(&fb->idle_entry);
+    drmdev->n_idle_cached_fbs--;
+
+    // drmdev_rm_fb_locked frees the fb.
+    memcpy(handles, fb->handles, sizeof handles);
+    drmdev_rm_fb_locked(drmdev, fb->id);
+    unref_imported_gem_handles_locked(drmdev, handles);
+}
+
+uint32_t drmdev_add_cached_fb_from_dmabuf_locked(
+    struct drmdev *drmdev,
+    uint32_t width,
+    uint32_t height,
+    enum pixfmt pixel_format,
+    const int prime_fds[4],
+    const uint32_t pitches[4],
+    const uint32_t offsets[4],
+    bool has_modifiers,
+    const uint64_t modifiers[4]
+) {
+    uint32_t bo_handles[4] = { 0 };
+    uint32_t handle, fb_id;
+    int ok;
+
+    ASSERT_NOT_NULL(drmdev);
+
+    ok = open_import_fd_locked(drmdev);
+    if (ok != 0) {
+        return 0;
+    }
+
+    // Importing a dmabuf that's already imported just returns the existing GEM handle,
+    // so the handles identify the buffers.
+    for (int i = 0; (i < 4) && (prime_fds[i] >= 0); i++) {
+        ok = drmPrimeFDToHandle(drmdev->import_fd, prime_fds[i], &handle);
+        if (ok < 0) {
+            LOG_ERROR("Couldn't import DMA-buffer as GEM buffer. drmPrimeFDToHandle: %s\n", strerror(errno));
+            goto fail_unref_handles;
+        }
+
+        ok = ref_gem_handle_locked(drmdev, handle);
+        if (ok != 0) {
+            goto fail_unref_handles;
+        }
+
+        bo_handles[i] = handle;
+    }
+
+    list_for_each_entry(struct drm_fb, fb, &drmdev->fbs, entry) {
+        if (fb->is_cached && fb->width == width && fb->height == height && fb->format == pixel_format
+            && fb->has_modifier == has_modifiers && (!has_modifiers || fb->modifier == modifiers[0])
+            && memcmp(fb->handles, bo_handles, sizeof bo_handles) == 0 && memcmp(fb->pitches, pitches, sizeof fb->pitches) == 0
+            && memcmp(fb->offsets, offsets, sizeof fb->offsets) == 0) {
+            // The cached fb already holds references on the handles from when it was added.
+            unref_imported_gem_handles_locked(drmdev, bo_handles);
+
+            if (fb->n_cache_refs == 0) {
+                list_del(&fb->idle_entry);
+                drmdev->n_idle_cached_fbs--;
+            }
+
+            fb->n_cache_refs++;
+            return fb->id;
+        }
+    }
+
+    // The fb keeps the references on the handles until it's evicted.
+    fb_id = add_fb_on_fd_locked(
+        drmdev,
+        drmdev->import_fd,
+        width,
+        height,
+        pixel_format,
+        bo_handles,
+        pitches,
+        offsets,
+        has_modifiers,
+        modifiers
+    );
+    if (fb_id == 0) {
+        goto fail_unref_handles;
+    }
+
+    // add_fb_on_fd_locked adds new fbs to the front of the list.
+    struct drm_fb *fb = list_first_entry(&drmdev->fbs, struct drm_fb, entry);
+    ASSERT_EQUALS(fb->id, fb_id);
+
+    fb->is_cached = true;
+    fb->n_cache_refs = 1;
+    return fb_id;
+
+fail_unref_handles:
+    unref_imported_gem_handles_locked(drmdev, bo_handles);
+    return 0;
+}
+
+uint32_t drmdev_add_cached_fb_from_dmabuf(
+    struct drmdev *drmdev,
+    uint32_t width,
+    uint32_t height,
+    enum pixfmt pixel_format,
+    const int prime_fds[4],
+    const uint32_t pitches[4],
+    const uint32_t offsets[4],
+    bool has_modifiers,
+    const uint64_t modifiers[4]
+) {
+    uint32_t fb;
+
+    drmdev_lock(drmdev);
+
+    fb = drmdev_add_cached_fb_from_dmabuf_locked(
+        drmdev,
+        width,
+        height,
+        pixel_format,
+        prime_fds,
+        pitches,
+        offsets,
+        has_modifiers,
+        modifiers
+    );
+
+    drmdev_unlock(drmdev);
+
+    return fb;
+}
+
+void drmdev_release_cached_fb_locked(struct drmdev *drmdev, uint32_t fb_id) {
+    ASSERT_NOT_NULL(drmdev);
+
+    list_for_each_entry(struct drm_fb, fb, &drmdev->fbs, entry) {
+        if (fb->id == fb_id) {
+            ASSERT_MSG(fb->is_cached, "Framebuffer was not added using drmdev_add_cached_fb_from_dmabuf.");
+            assert(fb->n_cache_refs > 0);
+
+            // Keep it around, the buffer is probably presented again soon.
+            fb->n_cache_refs--;
+            if (fb->n_cache_refs == 0) {
+                list_addtail(&fb->idle_entry, &drmdev->idle_cached_fbs);
+                drmdev->n_idle_cached_fbs++;
+            }
+            break;
+        }
+    }
+
+    while (drmdev->n_idle_cached_fbs > MAX_IDLE_CACHED_FBS) {
+        evict_cached_fb_locked(drmdev, list_first_entry(&drmdev->idle_cached_fbs, struct drm_fb, idle_entry));
+    }
+}
+
+void drmdev_release_cached_fb(struct drmdev *drmdev, uint32_t fb_id) {
+    drmdev_lock(drmdev);
+    drmdev_release_cached_fb_locked(drmdev, fb_id);
+    drmdev_unlock(drmdev);
+}
+
+void drmdev_evict_cached_fbs_locked(struct drmdev *drmdev) {
+    ASSERT_NOT_NULL(drmdev);
+
+    list_for_each_entry_safe(struct drm_fb, fb, &drmdev->idle_cached_fbs, idle_entry) {
+        evict_cached_fb_locked(drmdev, fb);
+    }
+}
+
+void drmdev_evict_cached_fbs(struct drmdev *drmdev) {
+    drmdev_lock(drmdev);
+    drmdev_evict_cached_fbs_locked(drmdev);
+    drmdev_unlock(drmdev);
+}
+
+uint32_t drmdev_add_fb_from_gbm_bo_locked(struct drmdev *drmdev, struct gbm_bo *bo, bool cast_opaque) {
+    enum pixfmt format;
+    uint32_t fourcc;
+    int n_planes;
+
+    n_planes = gbm_bo_get_plane_count(bo);
+    ASSERT(0 <= n_planes && n_planes <= 4);
+
+    fourcc = gbm_bo_get_format(bo);
+
+    if (!has_pixfmt_for_gbm_format(fourcc)) {
+        LOG_ERROR("GBM pixel format is not supported.\n");
+        return 0;
+    }
+
+    format = get_pixfmt_for_gbm_format(fourcc);
+
+    if (cast_opaque) {
+        format = pixfmt_opaque(format);
+    }
+
+    uint32_t handles[4];
+    uint32_t pitches[4];
+
+    // Returns DRM_FORMAT_MOD_INVALID on failure, or DRM_FORMAT_MOD_LINEAR
+    // for dumb buffers.
+    uint64_t modifier = gbm_bo_get_modifier(bo);
+    bool has_modifiers = modifier != DRM_FORMAT_MOD_INVALID;
+
+    for (int i = 0; i < n_planes; i++) {
+        // gbm_bo_get_handle_for_plane will return -1 (in gbm_bo_handle.s32) and
+        // set errno on failure.
+        errno = 0;
+        union gbm_bo_handle handle = gbm_bo_get_handle_for_plane(bo, i);
+        if (handle.s32 == -1) {
+            LOG_ERROR("Could not get GEM handle for plane %d: %s\n", i, strerror(errno));
+            return 0;
+        }
+
+        handles[i] = handle.u32;
+
+        // gbm_bo_get_stride_for_plane will return 0 and set errno on failure.
         errno = 0;
         uint32_t pitch = gbm_bo_get_stride_for_plane(bo, i);
         if (pitch == 0 && errno != 0) {
@@ -1809,17 +2614,23 @@ uint32_t drmdev_add_fb_from_gbm_bo(struct drmdev *drmdev, struct gbm_bo *bo, boo
 }
 
 int drmdev_rm_fb_locked(struct drmdev *drmdev, uint32_t fb_id) {
-    int ok;
+    int ok, fd;
 
+    // Only the file description that added an fb can remove it.
+    fd = drmdev->fd;
     list_for_each_entry(struct drm_fb, fb, &drmdev->fbs, entry) {
         if (fb->id == fb_id) {
+            if (fb->is_cached) {
+                fd = drmdev->import_fd;
+            }
+
             list_del(&fb->entry);
             free(fb);
             break;
         }
     }
 
-    ok = drmModeRmFB(drmdev->fd, fb_id);
+    ok = drmModeRmFB(fd, fb_id);
     if (ok < 0) {
         ok = -ok;
         LOG_ERROR("Could not remove DRM framebuffer. drmModeRmFB: %s\n", strerror(ok));
@@ -1841,6 +2652,368 @@ int drmdev_rm_fb(struct drmdev *drmdev, uint32_t fb_id) {
     return ok;
 }
 
+bool drmdev_crtc_has_pending_flip(struct drmdev *drmdev, uint32_t crtc_id) {
+    struct drm_crtc *crtc;
+    bool pending;
+
+    ASSERT_NOT_NULL(drmdev);
+
+    for_each_crtc_in_drmdev(drmdev, crtc) {
+        if (crtc->id == crtc_id) {
+            break;
+        }
+    }
+
+    ASSERT_NOT_NULL_MSG(crtc, "Could not find CRTC with given id.");
+
+    drmdev_lock(drmdev);
+
+    pending = drmdev->per_crtc_state[crtc->index].flip_pending;
+
+    drmdev_unlock(drmdev);
+
+    return pending;
+}
+
+static double clamp_unit(double value) {
+    return value < 0.0 ? 0.0 : value > 1.0 ? 1.0 : value;
+}
+
+static uint16_t unit_to_u16(double value) {
+    return (uint16_t) lround(clamp_unit(value) * 0xFFFF);
+}
+
+/**
+ * @brief Converts to the S31.32 sign-magnitude fixed point format the kernel uses for the CTM.
+ */
+static uint64_t double_to_s31_32(double value) {
+    uint64_t magnitude;
+
+    magnitude = (uint64_t) llround(fabs(value) * 4294967296.0);
+
+    // The magnitude only has 63 bits.
+    if (magnitude > INT64_MAX) {
+        magnitude = INT64_MAX;
+    }
+
+    return magnitude | (value < 0.0 ? (1ull << 63) : 0);
+}
+
+/**
+ * @brief Replaces the pending (not yet committed) blob for a color management property.
+ */
+static void set_pending_blob(struct drmdev *drmdev, bool *has_pending, uint32_t *pending_blob_id, uint32_t blob_id) {
+    if (*has_pending) {
+        destroy_blob(drmdev, *pending_blob_id);
+    }
+
+    *has_pending = true;
+    *pending_blob_id = blob_id;
+}
+
+/**
+ * @brief Checks whether the display controller accepts @param blob_id as the value for the color management
+ * property @param prop_id of @param crtc, using a test-only atomic commit.
+ *
+ * Without this, a rejected blob would only fail the next frame commit (and all after it).
+ */
+static int test_crtc_color_blob_locked(struct drmdev *drmdev, struct drm_crtc *crtc, uint32_t prop_id, uint32_t blob_id) {
+    drmModeAtomicReq *req;
+    int ok;
+
+    // Without DRM master, we can't test anything.
+    if (drmdev->master_fd < 0) {
+        return 0;
+    }
+
+    req = drmModeAtomicAlloc();
+    if (req == NULL) {
+        return ENOMEM;
+    }
+
+    drmModeAtomicAddProperty(req, crtc->id, prop_id, blob_id);
+
+    ok = drmModeAtomicCommit(drmdev->master_fd, req, DRM_MODE_ATOMIC_TEST_ONLY, NULL);
+    if (ok != 0) {
+        ok = errno;
+        LOG_ERROR("The display controller rejected the color management property. drmModeAtomicCommit: %s\n", strerror(ok));
+    }
+
+    drmModeAtomicFree(req);
+    return ok;
+}
+
+int drmdev_set_crtc_gamma_lut(struct drmdev *drmdev, uint32_t crtc_id, const double *lut, size_t n_entries) {
+    struct drm_color_lut *entries;
+    struct drm_crtc *crtc;
+    uint32_t blob_id;
+    size_t size;
+    int ok;
+
+    ASSERT_NOT_NULL(drmdev);
+    assert(lut == NULL || n_entries >= 2);
+
+    for_each_crtc_in_drmdev(drmdev, crtc) {
+        if (crtc->id == crtc_id) {
+            break;
+        }
+    }
+
+    ASSERT_NOT_NULL_MSG(crtc, "Could not find CRTC with given id.");
+
+    if (!drmdev->supports_atomic_modesetting || !DRM_ID_IS_VALID(crtc->ids.gamma_lut) || crtc->gamma_lut_size == 0) {
+        return EOPNOTSUPP;
+    }
+
+    blob_id = 0;
+    if (lut != NULL) {
+        // Drivers only accept LUTs of exactly the size they support, so resample it linearly.
+        size = crtc->gamma_lut_size;
+
+        entries = malloc(size * sizeof *entries);
+        if (entries == NULL) {
+            return ENOMEM;
+        }
+
+        for (size_t i = 0; i < size; i++) {
+            double pos = (double) i * (n_entries - 1) / (size > 1 ? size - 1 : 1);
+            size_t lower = MIN2((size_t) pos, n_entries - 2);
+            double t = pos - lower;
+
+            entries[i].red = unit_to_u16(lut[lower * 3 + 0] * (1.0 - t) + lut[(lower + 1) * 3 + 0] * t);
+            entries[i].green = unit_to_u16(lut[lower * 3 + 1] * (1.0 - t) + lut[(lower + 1) * 3 + 1] * t);
+            entries[i].blue = unit_to_u16(lut[lower * 3 + 2] * (1.0 - t) + lut[(lower + 1) * 3 + 2] * t);
+            entries[i].reserved = 0;
+        }
+
+        ok = drmModeCreatePropertyBlob(drmdev->fd, entries, size * sizeof *entries, &blob_id);
+        free(entries);
+        if (ok != 0) {
+            ok = errno;
+            LOG_ERROR("Couldn't upload gamma LUT to kernel. drmModeCreatePropertyBlob: %s\n", strerror(ok));
+            return ok;
+        }
+    }
+
+    drmdev_lock(drmdev);
+
+    ok = test_crtc_color_blob_locked(drmdev, crtc, crtc->ids.gamma_lut, blob_id);
+    if (ok != 0) {
+        drmdev_unlock(drmdev);
+        destroy_blob(drmdev, blob_id);
+        return ok;
+    }
+
+    set_pending_blob(
+        drmdev,
+        &drmdev->per_crtc_state[crtc->index].has_pending_gamma_lut,
+        &drmdev->per_crtc_state[crtc->index].pending_gamma_lut_blob_id,
+        blob_id
+    );
+
+    drmdev_unlock(drmdev);
+
+    return 0;
+}
+
+int drmdev_set_crtc_ctm(struct drmdev *drmdev, uint32_t crtc_id, const double *matrix) {
+    struct drm_color_ctm ctm;
+    struct drm_crtc *crtc;
+    uint32_t blob_id;
+    int ok;
+
+    ASSERT_NOT_NULL(drmdev);
+
+    for_each_crtc_in_drmdev(drmdev, crtc) {
+        if (crtc->id == crtc_id) {
+            break;
+        }
+    }
+
+    ASSERT_NOT_NULL_MSG(crtc, "Could not find CRTC with given id.");
+
+    if (!drmdev->supports_atomic_modesetting || !DRM_ID_IS_VALID(crtc->ids.ctm)) {
+        return EOPNOTSUPP;
+    }
+
+    blob_id = 0;
+    if (matrix != NULL) {
+        for (int i = 0; i < 9; i++) {
+            ctm.matrix[i] = double_to_s31_32(matrix[i]);
+        }
+
+        ok = drmModeCreatePropertyBlob(drmdev->fd, &ctm, sizeof ctm, &blob_id);
+        if (ok != 0) {
+            ok = errno;
+            LOG_ERROR("Couldn't upload color transformation matrix to kernel. drmModeCreatePropertyBlob: %s\n", strerror(ok));
+            return ok;
+        }
+    }
+
+    drmdev_lock(drmdev);
+
+    ok = test_crtc_color_blob_locked(drmdev, crtc, crtc->ids.ctm, blob_id);
+    if (ok != 0) {
+        drmdev_unlock(drmdev);
+        destroy_blob(drmdev, blob_id);
+        return ok;
+    }
+
+    set_pending_blob(
+        drmdev,
+        &drmdev->per_crtc_state[crtc->index].has_pending_ctm,
+        &drmdev->per_crtc_state[crtc->index].pending_ctm_blob_id,
+        blob_id
+    );
+
+    drmdev_unlock(drmdev);
+
+    return 0;
+}
+
+static bool connector_is_used_for_writeback_locked(struct drmdev *drmdev, struct drm_connector *connector) {
+    for (int i = 0; i < drmdev->n_crtcs; i++) {
+        struct per_crtc_state *crtc_state = drmdev->per_crtc_state + i;
+
+        if ((crtc_state->has_pending_writeback && crtc_state->pending_writeback.connector == connector)
+            || (crtc_state->has_writeback && crtc_state->writeback.connector == connector)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * @brief Finds a writeback connector that can capture @param crtc, preferably the one that's attached to it already.
+ */
+static struct drm_connector *find_writeback_connector_locked(struct drmdev *drmdev, struct drm_crtc *crtc, enum pixfmt format) {
+    struct drm_connector *connector, *found;
+    struct drm_encoder *encoder;
+
+    found = NULL;
+    for_each_connector_in_drmdev(drmdev, connector) {
+        if (connector->type != kWRITEBACK_DrmConnectorType || !connector->writeback_formats[format]) {
+            continue;
+        }
+
+        if (connector->committed_state.crtc_id == crtc->id) {
+            return connector;
+        }
+
+        // Don't steal writeback connectors from other CRTCs.
+        if (found != NULL || DRM_ID_IS_VALID(connector->committed_state.crtc_id)
+            || connector_is_used_for_writeback_locked(drmdev, connector)) {
+            continue;
+        }
+
+        for (int i = 0; i < connector->n_encoders && found == NULL; i++) {
+            for_each_encoder_in_drmdev(drmdev, encoder) {
+                if (encoder->encoder->encoder_id == connector->encoders[i] && (encoder->encoder->possible_crtcs & crtc->bitmask)) {
+                    found = connector;
+                    break;
+                }
+            }
+        }
+    }
+
+    return found;
+}
+
+bool drmdev_crtc_supports_writeback(struct drmdev *drmdev, uint32_t crtc_id, enum pixfmt format) {
+    struct drm_crtc *crtc;
+    bool supported;
+
+    ASSERT_NOT_NULL(drmdev);
+
+    for_each_crtc_in_drmdev(drmdev, crtc) {
+        if (crtc->id == crtc_id) {
+            break;
+        }
+    }
+
+    ASSERT_NOT_NULL_MSG(crtc, "Could not find CRTC with given id.");
+
+    if (!drmdev->supports_atomic_modesetting) {
+        return false;
+    }
+
+    drmdev_lock(drmdev);
+
+    supported = find_writeback_connector_locked(drmdev, crtc, format) != NULL;
+
+    drmdev_unlock(drmdev);
+
+    return supported;
+}
+
+int drmdev_queue_writeback(struct drmdev *drmdev, uint32_t crtc_id, uint32_t fb_id, drmdev_writeback_cb_t callback, void *userdata) {
+    struct per_crtc_state *crtc_state;
+    struct drm_connector *connector;
+    struct drm_crtc *crtc;
+    struct drm_fb *fb;
+    int ok;
+
+    ASSERT_NOT_NULL(drmdev);
+    ASSERT_NOT_NULL(callback);
+
+    for_each_crtc_in_drmdev(drmdev, crtc) {
+        if (crtc->id == crtc_id) {
+            break;
+        }
+    }
+
+    ASSERT_NOT_NULL_MSG(crtc, "Could not find CRTC with given id.");
+
+    if (!drmdev->supports_atomic_modesetting) {
+        return EOPNOTSUPP;
+    }
+
+    drmdev_lock(drmdev);
+
+    crtc_state = drmdev->per_crtc_state + crtc->index;
+    if (crtc_state->has_pending_writeback) {
+        ok = EBUSY;
+        goto fail_unlock;
+    }
+
+    // We need the pixel format of the framebuffer to find a connector that supports it.
+    fb = NULL;
+    list_for_each_entry(struct drm_fb, fb_iter, &drmdev->fbs, entry) {
+        if (fb_iter->id == fb_id) {
+            fb = fb_iter;
+            break;
+        }
+    }
+
+    if (fb == NULL) {
+        LOG_ERROR("Writeback framebuffer must be added using drmdev_add_fb.\n");
+        ok = EINVAL;
+        goto fail_unlock;
+    }
+
+    connector = find_writeback_connector_locked(drmdev, crtc, fb->format);
+    if (connector == NULL) {
+        ok = EOPNOTSUPP;
+        goto fail_unlock;
+    }
+
+    crtc_state->pending_writeback.connector = connector;
+    crtc_state->pending_writeback.fb_id = fb_id;
+    crtc_state->pending_writeback.callback = callback;
+    crtc_state->pending_writeback.userdata = userdata;
+    crtc_state->pending_writeback.fence_fd = -1;
+    crtc_state->has_pending_writeback = true;
+
+    drmdev_unlock(drmdev);
+
+    return 0;
+
+fail_unlock:
+    drmdev_unlock(drmdev);
+    return ok;
+}
+
 bool drmdev_can_modeset(struct drmdev *drmdev) {
     bool can_modeset;
 
@@ -1938,6 +3111,36 @@ int drmdev_move_cursor(struct drmdev *drmdev, uint32_t crtc_id, struct vec2i pos
     return 0;
 }
 
+int drmdev_wait_vblank(struct drmdev *drmdev, uint32_t crtc_id) {
+    struct drm_crtc *crtc;
+    drmVBlank vblank;
+    int ok;
+
+    ASSERT_NOT_NULL(drmdev);
+
+    for_each_crtc_in_drmdev(drmdev, crtc) {
+        if (crtc->id == crtc_id) {
+            break;
+        }
+    }
+
+    ASSERT_NOT_NULL_MSG(crtc, "Could not find CRTC with given id.");
+
+    memset(&vblank, 0, sizeof vblank);
+    vblank.request.type = DRM_VBLANK_RELATIVE | ((crtc->index << DRM_VBLANK_HIGH_CRTC_SHIFT) & DRM_VBLANK_HIGH_CRTC_MASK);
+    vblank.request.sequence = 1;
+
+    // Don't lock the drmdev here, this blocks for up to one frame.
+    ok = drmWaitVBlank(drmdev->fd, &vblank);
+    if (ok < 0) {
+        ok = errno;
+        LOG_ERROR("Couldn't wait for vblank. drmWaitVBlank: %s\n", strerror(ok));
+        return ok;
+    }
+
+    return 0;
+}
+
 static void drmdev_set_scanout_callback_locked(
     struct drmdev *drmdev,
     uint32_t crtc_id,
@@ -2181,6 +3384,18 @@ static bool plane_qualifies(
     return true;
 }
 
+static bool plane_claimed_by_other_crtc(struct drmdev *drmdev, struct drm_crtc *crtc, int plane_index) {
+    struct drm_crtc *other;
+
+    for_each_crtc_in_drmdev(drmdev, other) {
+        if (other != crtc && BITSET_TEST(drmdev->per_crtc_state[other->index].claimed_planes, plane_index)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
 static struct drm_plane *allocate_plane(
     // clang-format off
     struct kms_req_builder *builder,
@@ -2194,10 +3409,14 @@ static struct drm_plane *allocate_plane(
     bool has_id_range, uint32_t id_lower_limit
     // clang-format on
 ) {
+    struct drmdev *drmdev = builder->drmdev;
+
+    drmdev_lock(drmdev);
+
     for (int i = 0; i < BITSET_SIZE(builder->available_planes); i++) {
-        struct drm_plane *plane = builder->drmdev->planes + i;
+        struct drm_plane *plane = drmdev->planes + i;
 
-        if (BITSET_TEST(builder->available_planes, i)) {
+        if (BITSET_TEST(builder->available_planes, i) && !plane_claimed_by_other_crtc(drmdev, builder->crtc, i)) {
             // find out if the plane matches our criteria
             bool qualifies = plane_qualifies(
                 plane,
@@ -2223,10 +3442,14 @@ static struct drm_plane *allocate_plane(
 
             // we found one, mark it as used and return it
             BITSET_CLEAR(builder->available_planes, i);
+            BITSET_SET(drmdev->per_crtc_state[builder->crtc->index].claimed_planes, i);
+            drmdev_unlock(drmdev);
             return plane;
         }
     }
 
+    drmdev_unlock(drmdev);
+
     // we didn't find an available plane matching our criteria
     return NULL;
 }
@@ -2321,6 +3544,10 @@ struct kms_req_builder *drmdev_create_request_builder(struct drmdev *drmdev, uin
     builder->n_layers = 0;
     builder->has_mode = false;
     builder->unset_mode = false;
+    builder->has_vrr_enabled = false;
+    builder->vrr_enabled = false;
+    builder->out_fence_fd = -1;
+    builder->config_hash = FNV1A_64_OFFSET_BASIS;
     return builder;
 
 fail_free_builder:
@@ -2331,21 +3558,123 @@ fail_unlock:
     return NULL;
 }
 
-static void kms_req_builder_destroy(struct kms_req_builder *builder) {
-    /// TODO: Is this complete?
+static void close_in_fences(struct kms_req_builder *builder) {
+    for (int i = 0; i < builder->n_layers; i++) {
+        if (builder->layers[i].layer.has_in_fence_fd) {
+            close(builder->layers[i].layer.in_fence_fd);
+            builder->layers[i].layer.has_in_fence_fd = false;
+        }
+    }
+}
+
+/**
+ * @brief Calls the release callbacks of all layers that weren't released yet.
+ */
+static void release_layers(struct kms_req_builder *builder) {
     for (int i = 0; i < builder->n_layers; i++) {
         if (builder->layers[i].release_callback != NULL) {
             builder->layers[i].release_callback(builder->layers[i].release_callback_userdata);
         }
+
+        builder->layers[i].release_callback = NULL;
+        builder->layers[i].deferred_release_callback = NULL;
+    }
+}
+
+static void kms_req_builder_destroy(struct kms_req_builder *builder) {
+    /// TODO: Is this complete?
+    close_in_fences(builder);
+    release_layers(builder);
+    if (builder->out_fence_fd >= 0) {
+        close(builder->out_fence_fd);
+    }
+    if (builder->req != NULL) {
+        drmModeAtomicFree(builder->req);
+    }
+    drmdev_unref(builder->drmdev);
+    free(builder);
+}
+
+DEFINE_REF_OPS(kms_req_builder, n_refs)
+
+static void on_release_fence_signalled_locked(struct drmdev *drmdev, struct kms_release_fence *fence) {
+    epoll_ctl(drmdev->event_fd, EPOLL_CTL_DEL, fence->fd, NULL);
+    close(fence->fd);
+
+    release_layers(fence->req);
+    kms_req_builder_unref(fence->req);
+    free(fence);
+}
+
+/**
+ * @brief Release the layers of @param prev (the request that's on screen right now) once the
+ * out fence of the request that replaces it signals, instead of waiting for the page flip event.
+ *
+ * Layers that have a deferred release callback get a duplicate of the fence right away, for all other layers
+ * the fence is polled using the drmdev event fd and the release callbacks are called once it signals.
+ */
+static void release_layers_on_fence_locked(struct kms_req_builder *prev, int out_fence_fd) {
+    struct kms_release_fence *fence;
+    bool needs_polling;
+    int fd, ok;
+
+    needs_polling = false;
+    for (int i = 0; i < prev->n_layers; i++) {
+        struct kms_req_layer *layer = prev->layers + i;
+
+        if (layer->deferred_release_callback != NULL) {
+            fd = dup(out_fence_fd);
+            if (fd < 0) {
+                // The release callback will be called on the page flip event then.
+                continue;
+            }
+
+            layer->deferred_release_callback(layer->release_callback_userdata, fd);
+            layer->deferred_release_callback = NULL;
+            layer->release_callback = NULL;
+        } else if (layer->release_callback != NULL) {
+            needs_polling = true;
+        }
     }
-    if (builder->req != NULL) {
-        drmModeAtomicFree(builder->req);
+
+    if (!needs_polling) {
+        return;
     }
-    drmdev_unref(builder->drmdev);
-    free(builder);
-}
 
-DEFINE_REF_OPS(kms_req_builder, n_refs)
+    fence = malloc(sizeof *fence);
+    if (fence == NULL) {
+        return;
+    }
+
+    fence->fd = dup(out_fence_fd);
+    if (fence->fd < 0) {
+        goto fail_free_fence;
+    }
+
+    fence->source.type = kReleaseFence_EventSourceType;
+    fence->req = kms_req_builder_ref(prev);
+
+    // sync_file fds become readable once the fence is signalled.
+    ok = epoll_ctl(
+        prev->drmdev->event_fd,
+        EPOLL_CTL_ADD,
+        fence->fd,
+        &(struct epoll_event){ .events = EPOLLIN, .data.ptr = &fence->source }
+    );
+    if (ok < 0) {
+        LOG_ERROR("Couldn't poll KMS out fence. epoll_ctl: %s\n", strerror(errno));
+        goto fail_unref_req;
+    }
+
+    return;
+
+fail_unref_req:
+    kms_req_builder_unref(fence->req);
+    close(fence->fd);
+
+fail_free_fence:
+    free(fence);
+}
 
 struct drmdev *kms_req_builder_get_drmdev(struct kms_req_builder *builder) {
     return builder->drmdev;
@@ -2360,6 +3689,12 @@ bool kms_req_builder_prefer_next_layer_opaque(struct kms_req_builder *builder) {
     return builder->n_layers == 0;
 }
 
+bool kms_req_builder_last_layer_has_in_fence(struct kms_req_builder *builder) {
+    ASSERT_NOT_NULL(builder);
+    assert(builder->n_layers > 0);
+    return builder->layers[builder->n_layers - 1].layer.has_in_fence_fd;
+}
+
 int kms_req_builder_set_mode(struct kms_req_builder *builder, const drmModeModeInfo *mode) {
     ASSERT_NOT_NULL(builder);
     ASSERT_NOT_NULL(mode);
@@ -2371,6 +3706,13 @@ int kms_req_builder_set_mode(struct kms_req_builder *builder, const drmModeModeI
 int kms_req_builder_unset_mode(struct kms_req_builder *builder) {
     ASSERT_NOT_NULL(builder);
     assert(!builder->has_mode);
+
+    if (!builder->use_legacy) {
+        // A CRTC without a mode can't be active.
+        // This overrides the ACTIVE property we added when creating the builder.
+        drmModeAtomicAddProperty(builder->req, builder->crtc->id, builder->crtc->ids.active, 0);
+    }
+
     builder->unset_mode = true;
     return 0;
 }
@@ -2396,43 +3738,25 @@ int kms_req_builder_set_connector(struct kms_req_builder *builder, uint32_t conn
     return 0;
 }
 
-int kms_req_builder_push_fb_layer(
-    struct kms_req_builder *builder,
-    const struct kms_fb_layer *layer,
-    kms_fb_release_cb_t release_callback,
-    kms_deferred_fb_release_cb_t deferred_release_callback,
-    void *userdata,
-    bool *allocated_cursor_plane
-) {
-    struct drm_plane *plane;
-    int64_t zpos;
-    bool has_zpos;
-    bool close_in_fence_fd_after;
-    int ok, index;
-
+int kms_req_builder_set_vrr_enabled(struct kms_req_builder *builder, bool enabled) {
     ASSERT_NOT_NULL(builder);
-    ASSERT_NOT_NULL(layer);
-    ASSERT_NOT_NULL(release_callback);
-    ASSERT_EQUALS_MSG(deferred_release_callback, NULL, "deferred release callbacks are not supported right now.");
 
-    if (builder->use_legacy && builder->supports_atomic && builder->n_layers > 1) {
-        // if we already have a first layer and we should use legacy modesetting even though the kernel driver
-        // supports atomic modesetting, return EINVAL.
-        // if the driver supports atomic modesetting, drmModeSetPlane will block for vblank, so we can't use it,
-        // and we can't use drmModeAtomicCommit for non-blocking multi-plane commits of course.
-        // For the first layer we can use drmModePageFlip though.
-        LOG_DEBUG("Can't do multi-plane commits when using legacy modesetting (and driver supports atomic modesetting).\n");
-        return EINVAL;
+    if (builder->use_legacy || !DRM_ID_IS_VALID(builder->crtc->ids.vrr_enabled)) {
+        return EOPNOTSUPP;
     }
 
-    close_in_fence_fd_after = false;
-    if (builder->use_legacy && layer->has_in_fence_fd) {
-        LOG_DEBUG("Explicit fencing is not supported for legacy modesetting. Implicit fencing will be used instead.\n");
-        close_in_fence_fd_after = true;
-    }
+    builder->has_vrr_enabled = true;
+    builder->vrr_enabled = enabled;
+    return 0;
+}
 
-    // Index of our layer.
-    index = builder->n_layers;
+/**
+ * @brief Finds an unused plane for layer @param index of the request, following the usual
+ * primary plane -> overlay planes (bottom to top) order. The cursor plane is tried first if the layer prefers it.
+ */
+static struct drm_plane *
+select_plane_for_layer(struct kms_req_builder *builder, const struct kms_fb_layer *layer, int index, bool *allocated_cursor_plane) {
+    struct drm_plane *plane;
 
     // If we should prefer a cursor plane, try to find one first.
     plane = NULL;
@@ -2531,61 +3855,272 @@ int kms_req_builder_push_fb_layer(
         }
     }
 
-    if (plane == NULL) {
-        LOG_DEBUG("Could not find a suitable unused DRM plane for pushing the framebuffer.\n");
-        return EIO;
+    return plane;
+}
+
+static void add_layer_properties(
+    struct kms_req_builder *builder,
+    struct drm_plane *plane,
+    const struct kms_fb_layer *layer,
+    int index,
+    int64_t zpos,
+    bool pass_in_fence_fd
+) {
+    uint32_t plane_id = plane->id;
+
+    /// TODO: Error checking
+    /// TODO: Maybe add these in the kms_req_builder_commit instead?
+    drmModeAtomicAddProperty(builder->req, plane_id, plane->ids.crtc_id, builder->crtc->id);
+    drmModeAtomicAddProperty(builder->req, plane_id, plane->ids.fb_id, layer->drm_fb_id);
+    drmModeAtomicAddProperty(builder->req, plane_id, plane->ids.crtc_x, layer->dst_x);
+    drmModeAtomicAddProperty(builder->req, plane_id, plane->ids.crtc_y, layer->dst_y);
+    drmModeAtomicAddProperty(builder->req, plane_id, plane->ids.crtc_w, layer->dst_w);
+    drmModeAtomicAddProperty(builder->req, plane_id, plane->ids.crtc_h, layer->dst_h);
+    drmModeAtomicAddProperty(builder->req, plane_id, plane->ids.src_x, layer->src_x);
+    drmModeAtomicAddProperty(builder->req, plane_id, plane->ids.src_y, layer->src_y);
+    drmModeAtomicAddProperty(builder->req, plane_id, plane->ids.src_w, layer->src_w);
+    drmModeAtomicAddProperty(builder->req, plane_id, plane->ids.src_h, layer->src_h);
+
+    if (plane->has_zpos && !plane->has_hardcoded_zpos) {
+        drmModeAtomicAddProperty(builder->req, plane_id, plane->ids.zpos, zpos);
     }
 
-    // Now that we have a plane, use the minimum zpos
-    // that's both higher than the last layers zpos and
-    // also supported by the plane.
-    // This will also work for planes with hardcoded zpos.
-    has_zpos = plane->has_zpos;
-    if (has_zpos) {
-        zpos = builder->next_zpos;
-        if (plane->min_zpos > zpos) {
-            zpos = plane->min_zpos;
+    if (layer->has_rotation && plane->has_rotation && !plane->has_hardcoded_rotation) {
+        drmModeAtomicAddProperty(builder->req, plane_id, plane->ids.rotation, layer->rotation.u64);
+    }
+
+    if (pass_in_fence_fd) {
+        drmModeAtomicAddProperty(builder->req, plane_id, plane->ids.in_fence_fd, layer->in_fence_fd);
+    }
+
+    if (index == 0) {
+        if (plane->has_alpha) {
+            drmModeAtomicAddProperty(builder->req, plane_id, plane->ids.alpha, plane->max_alpha);
+        }
+
+        if (plane->has_blend_mode && plane->supported_blend_modes[kNone_DrmBlendMode]) {
+            drmModeAtomicAddProperty(builder->req, plane_id, plane->ids.pixel_blend_mode, kNone_DrmBlendMode);
         }
-    } else {
-        // just to silence an uninitialized use warning below.
-        zpos = 0;
     }
+}
 
-    if (builder->use_legacy) {
-    } else {
-        uint32_t plane_id = plane->id;
+static bool drm_plane_is_active(struct drm_plane *plane) {
+    return plane->committed_state.fb_id != 0 && plane->committed_state.crtc_id != 0;
+}
+
+static uint64_t hash_u64s(uint64_t hash, const uint64_t *values, size_t n_values) {
+    // 64-bit FNV-1a
+    for (size_t i = 0; i < n_values; i++) {
+        for (int j = 0; j < 8; j++) {
+            hash ^= (values[i] >> (j * 8)) & 0xFF;
+            hash *= UINT64_C(0x100000001b3);
+        }
+    }
+
+    return hash;
+}
+
+/**
+ * @brief Hashes everything about a layer that decides whether the display controller can show it,
+ * i.e. everything except the framebuffer contents.
+ */
+static uint64_t hash_layer(uint64_t hash, const struct drm_plane *plane, const struct kms_fb_layer *layer, int64_t zpos) {
+    // Cursors move around all the time. Cursor planes can be positioned freely anyway.
+    bool hash_position = plane->type != kCursor_DrmPlaneType;
+
+    // clang-format off
+    uint64_t values[] = {
+        plane->id,
+        layer->format,
+        layer->has_modifier ? layer->modifier : DRM_FORMAT_MOD_INVALID,
+        (uint32_t) layer->src_x, (uint32_t) layer->src_y, (uint32_t) layer->src_w, (uint32_t) layer->src_h,
+        hash_position ? (uint32_t) layer->dst_x : 0, hash_position ? (uint32_t) layer->dst_y : 0,
+        (uint32_t) layer->dst_w, (uint32_t) layer->dst_h,
+        layer->has_rotation ? layer->rotation.u64 : 0,
+        (uint64_t) zpos,
+    };
+    // clang-format on
+
+    return hash_u64s(hash, values, ARRAY_SIZE(values));
+}
+
+/**
+ * @brief Checks whether the display controller can show the layers of the request so far,
+ * using a TEST_ONLY commit. The result is memoized per CRTC using @param config_hash,
+ * so the test commit is only done when the layer structure changes.
+ *
+ * Requests that change the mode are not checked, the real commit will tell.
+ */
+static bool check_layers_locked(struct kms_req_builder *builder, uint64_t config_hash) {
+    struct per_crtc_state *crtc_state;
+    drmModeAtomicReq *req;
+    bool valid;
+    int ok, cursor;
+
+    crtc_state = builder->drmdev->per_crtc_state + builder->crtc->index;
+    req = builder->req;
+
+    if (builder->drmdev->master_fd < 0 || builder->unset_mode || builder->connector != NULL
+        || (builder->has_mode
+            && (!builder->crtc->committed_state.has_mode
+                || memcmp(&builder->crtc->committed_state.mode, &builder->mode, sizeof builder->mode) != 0))) {
+        return true;
+    }
+
+    for (int i = 0; i < crtc_state->n_accepted_configs; i++) {
+        if (crtc_state->accepted_configs[i] == config_hash) {
+            return true;
+        }
+    }
+
+    // The planes on this CRTC this request doesn't use are disabled on commit, so disable them for the test as well.
+    cursor = drmModeAtomicGetCursor(req);
+    {
+        int i;
+        BITSET_FOREACH_SET(i, builder->available_planes, BITSET_SIZE(builder->available_planes)) {
+            struct drm_plane *plane = builder->drmdev->planes + i;
+
+            if (drm_plane_is_active(plane) && plane->committed_state.crtc_id == builder->crtc->id) {
+                drmModeAtomicAddProperty(req, plane->id, plane->ids.crtc_id, 0);
+                drmModeAtomicAddProperty(req, plane->id, plane->ids.fb_id, 0);
+            }
+        }
+    }
+
+    ok = drmModeAtomicCommit(builder->drmdev->master_fd, req, DRM_MODE_ATOMIC_TEST_ONLY, NULL);
+    valid = ok == 0;
+    if (!valid) {
+        LOG_DEBUG("Plane configuration was rejected by the display controller. drmModeAtomicCommit: %s\n", strerror(errno));
+    }
+
+    drmModeAtomicSetCursor(req, cursor);
+
+    if (valid) {
+        crtc_state->accepted_configs[crtc_state->next_accepted_config] = config_hash;
+        crtc_state->next_accepted_config = (crtc_state->next_accepted_config + 1) % ARRAY_SIZE(crtc_state->accepted_configs);
+        if (crtc_state->n_accepted_configs < ARRAY_SIZE(crtc_state->accepted_configs)) {
+            crtc_state->n_accepted_configs++;
+        }
+    }
+
+    return valid;
+}
+
+int kms_req_builder_push_fb_layer(
+    struct kms_req_builder *builder,
+    const struct kms_fb_layer *layer,
+    kms_fb_release_cb_t release_callback,
+    kms_deferred_fb_release_cb_t deferred_release_callback,
+    void *userdata,
+    bool *allocated_cursor_plane
+) {
+    BITSET_DECLARE(rejected_planes, 128);
+    struct drm_plane *plane;
+    uint64_t config_hash;
+    int64_t zpos;
+    bool has_zpos;
+    bool close_in_fence_fd_after;
+    bool valid;
+    int ok, index, cursor;
+
+    ASSERT_NOT_NULL(builder);
+    ASSERT_NOT_NULL(layer);
+    ASSERT_NOT_NULL(release_callback);
+
+    if (builder->use_legacy && builder->supports_atomic && builder->n_layers > 1) {
+        // if we already have a first layer and we should use legacy modesetting even though the kernel driver
+        // supports atomic modesetting, return EINVAL.
+        // if the driver supports atomic modesetting, drmModeSetPlane will block for vblank, so we can't use it,
+        // and we can't use drmModeAtomicCommit for non-blocking multi-plane commits of course.
+        // For the first layer we can use drmModePageFlip though.
+        LOG_DEBUG("Can't do multi-plane commits when using legacy modesetting (and driver supports atomic modesetting).\n");
+        return EINVAL;
+    }
 
-        /// TODO: Error checking
-        /// TODO: Maybe add these in the kms_req_builder_commit instead?
-        drmModeAtomicAddProperty(builder->req, plane_id, plane->ids.crtc_id, builder->crtc->id);
-        drmModeAtomicAddProperty(builder->req, plane_id, plane->ids.fb_id, layer->drm_fb_id);
-        drmModeAtomicAddProperty(builder->req, plane_id, plane->ids.crtc_x, layer->dst_x);
-        drmModeAtomicAddProperty(builder->req, plane_id, plane->ids.crtc_y, layer->dst_y);
-        drmModeAtomicAddProperty(builder->req, plane_id, plane->ids.crtc_w, layer->dst_w);
-        drmModeAtomicAddProperty(builder->req, plane_id, plane->ids.crtc_h, layer->dst_h);
-        drmModeAtomicAddProperty(builder->req, plane_id, plane->ids.src_x, layer->src_x);
-        drmModeAtomicAddProperty(builder->req, plane_id, plane->ids.src_y, layer->src_y);
-        drmModeAtomicAddProperty(builder->req, plane_id, plane->ids.src_w, layer->src_w);
-        drmModeAtomicAddProperty(builder->req, plane_id, plane->ids.src_h, layer->src_h);
+    // Index of our layer.
+    index = builder->n_layers;
 
-        if (plane->has_zpos && !plane->has_hardcoded_zpos) {
-            drmModeAtomicAddProperty(builder->req, plane_id, plane->ids.zpos, zpos);
+    // Try the candidate planes until the display controller accepts one. Rejected planes stay
+    // unavailable until we're done, so they're not selected again.
+    BITSET_ZERO(rejected_planes);
+    while (true) {
+        plane = select_plane_for_layer(builder, layer, index, allocated_cursor_plane);
+        if (plane == NULL) {
+            break;
         }
 
-        if (layer->has_rotation && plane->has_rotation && !plane->has_hardcoded_rotation) {
-            drmModeAtomicAddProperty(builder->req, plane_id, plane->ids.rotation, layer->rotation.u64);
+        // Now that we have a plane, use the minimum zpos
+        // that's both higher than the last layers zpos and
+        // also supported by the plane.
+        // This will also work for planes with hardcoded zpos.
+        has_zpos = plane->has_zpos;
+        if (has_zpos) {
+            zpos = builder->next_zpos;
+            if (plane->min_zpos > zpos) {
+                zpos = plane->min_zpos;
+            }
+        } else {
+            // just to silence an uninitialized use warning below.
+            zpos = 0;
         }
 
-        if (index == 0) {
-            if (plane->has_alpha) {
-                drmModeAtomicAddProperty(builder->req, plane_id, plane->ids.alpha, plane->max_alpha);
+        // We can only pass the in fence to KMS when using atomic modesetting and the plane has an IN_FENCE_FD property.
+        // Otherwise the kernel falls back to implicit fencing (it waits for the rendering to finish
+        // using the fences attached to the buffer), so we can just close the fence fd.
+        close_in_fence_fd_after = false;
+        if (layer->has_in_fence_fd && (builder->use_legacy || !DRM_ID_IS_VALID(plane->ids.in_fence_fd))) {
+            static bool logged_implicit_fencing = false;
+            if (!logged_implicit_fencing) {
+                LOG_DEBUG(
+                    "Explicit fencing is not supported for legacy modesetting or this plane. Implicit fencing will be used instead.\n"
+                );
+                logged_implicit_fencing = true;
             }
+            close_in_fence_fd_after = true;
+        }
+
+        if (builder->use_legacy) {
+            break;
+        }
+
+        cursor = drmModeAtomicGetCursor(builder->req);
+        add_layer_properties(builder, plane, layer, index, zpos, layer->has_in_fence_fd && !close_in_fence_fd_after);
+
+        config_hash = hash_layer(builder->config_hash, plane, layer, zpos);
+
+        drmdev_lock(builder->drmdev);
+        valid = check_layers_locked(builder, config_hash);
+        drmdev_unlock(builder->drmdev);
+
+        if (valid) {
+            builder->config_hash = config_hash;
+            break;
+        }
+
+        drmModeAtomicSetCursor(builder->req, cursor);
+        BITSET_SET(rejected_planes, plane - builder->drmdev->planes);
+    }
 
-            if (plane->has_blend_mode && plane->supported_blend_modes[kNone_DrmBlendMode]) {
-                drmModeAtomicAddProperty(builder->req, plane_id, plane->ids.pixel_blend_mode, kNone_DrmBlendMode);
+    // Give the rejected planes back. allocate_plane claimed them for our CRTC, so other CRTCs can use them
+    // again as well, unless they're still scanning out our last commit.
+    drmdev_lock(builder->drmdev);
+    {
+        int i;
+        BITSET_FOREACH_SET(i, rejected_planes, BITSET_SIZE(rejected_planes)) {
+            struct drm_plane *rejected = builder->drmdev->planes + i;
+
+            BITSET_SET(builder->available_planes, i);
+            if (!(drm_plane_is_active(rejected) && rejected->committed_state.crtc_id == builder->crtc->id)) {
+                BITSET_CLEAR(builder->drmdev->per_crtc_state[builder->crtc->index].claimed_planes, i);
             }
         }
     }
+    drmdev_unlock(builder->drmdev);
+
+    if (plane == NULL) {
+        LOG_DEBUG("Could not find a suitable unused DRM plane for pushing the framebuffer.\n");
+        return EIO;
+    }
 
     // This should be done when we're sure we're not failing.
     // Because on failure it would be the callers job to close the fd.
@@ -2606,6 +4141,9 @@ int kms_req_builder_push_fb_layer(
         builder->next_zpos = zpos + 1;
     }
     builder->layers[index].layer = *layer;
+    if (close_in_fence_fd_after) {
+        builder->layers[index].layer.has_in_fence_fd = false;
+    }
     builder->layers[index].plane_id = plane->id;
     builder->layers[index].plane = plane;
     builder->layers[index].set_zpos = has_zpos;
@@ -2649,25 +4187,29 @@ UNUSED void kms_req_swap_ptrs(struct kms_req **oldp, struct kms_req *new) {
     return kms_req_builder_swap_ptrs((struct kms_req_builder **) oldp, (struct kms_req_builder *) new);
 }
 
-static bool drm_plane_is_active(struct drm_plane *plane) {
-    return plane->committed_state.fb_id != 0 && plane->committed_state.crtc_id != 0;
-}
-
 static int
 kms_req_commit_common(struct kms_req *req, bool blocking, kms_scanout_cb_t scanout_cb, void *userdata, void_callback_t destroy_cb) {
+    struct per_crtc_state *crtc_state;
     struct kms_req_builder *builder;
     struct drm_mode_blob *mode_blob;
+    struct kms_writeback *writeback, failed_writeback;
     uint32_t flags;
     bool internally_blocking;
     bool update_mode;
-    int ok;
+    bool has_failed_writeback;
+    int ok, failed_writeback_status;
 
     internally_blocking = false;
     update_mode = false;
     mode_blob = NULL;
+    writeback = NULL;
+    failed_writeback = (struct kms_writeback){ 0 };
+    failed_writeback_status = 0;
+    has_failed_writeback = false;
 
     ASSERT_NOT_NULL(req);
     builder = (struct kms_req_builder *) req;
+    crtc_state = builder->drmdev->per_crtc_state + builder->crtc->index;
 
     drmdev_lock(builder->drmdev);
 
@@ -2714,7 +4256,26 @@ kms_req_commit_common(struct kms_req *req, bool blocking, kms_scanout_cb_t scano
         mode_blob = NULL;
     }
 
-    if (builder->use_legacy) {
+    // Writeback connectors can only be used with atomic modesetting.
+    // Fail a queued writeback instead of keeping it queued forever.
+    if (builder->use_legacy && crtc_state->has_pending_writeback) {
+        failed_writeback = crtc_state->pending_writeback;
+        failed_writeback_status = EOPNOTSUPP;
+        has_failed_writeback = true;
+        crtc_state->has_pending_writeback = false;
+    }
+
+    if (builder->use_legacy && builder->unset_mode) {
+        // Legacy KMS turns off a CRTC by setting it without a framebuffer, connectors and mode.
+        ok = drmModeSetCrtc(builder->drmdev->master_fd, builder->crtc->id, 0, 0, 0, NULL, 0, NULL);
+        if (ok != 0) {
+            ok = errno;
+            LOG_ERROR("Could not disable CRTC. drmModeSetCrtc: %s\n", strerror(ok));
+            goto fail_unlock;
+        }
+
+        internally_blocking = true;
+    } else if (builder->use_legacy) {
         ASSERT_EQUALS(builder->layers[0].layer.dst_x, 0);
         ASSERT_EQUALS(builder->layers[0].layer.dst_y, 0);
         ASSERT_EQUALS(builder->layers[0].layer.dst_w, builder->mode.hdisplay);
@@ -2814,15 +4375,14 @@ kms_req_commit_common(struct kms_req *req, bool blocking, kms_scanout_cb_t scano
         /// TODO: Call drmModeSetPlane for all other layers
         /// TODO: Assert here
     } else {
-        /// TODO: If we can do explicit fencing, don't use the page flip event.
-        /// TODO: Can we set OUT_FENCE_PTR even though we didn't set any IN_FENCE_FDs?
+        // We still need the page flip event for the vblank timestamp, even when we release buffers using the out fence.
         flags = DRM_MODE_PAGE_FLIP_EVENT | (blocking ? 0 : DRM_MODE_ATOMIC_NONBLOCK) | (update_mode ? DRM_MODE_ATOMIC_ALLOW_MODESET : 0);
 
         // All planes that are not used by us and are connected to our CRTC
         // should be disabled.
         {
             int i;
-            BITSET_FOREACH_SET(i, builder->available_planes, 32) {
+            BITSET_FOREACH_SET(i, builder->available_planes, BITSET_SIZE(builder->available_planes)) {
                 struct drm_plane *plane = builder->drmdev->planes + i;
 
                 if (drm_plane_is_active(plane) && plane->committed_state.crtc_id == builder->crtc->id) {
@@ -2832,9 +4392,34 @@ kms_req_commit_common(struct kms_req *req, bool blocking, kms_scanout_cb_t scano
             }
         }
 
-        if (builder->connector != NULL) {
+        if (builder->connector != NULL || builder->unset_mode) {
+            struct drm_connector *conn;
+
             // add the CRTC_ID property if that was explicitly set
-            drmModeAtomicAddProperty(builder->req, builder->connector->id, builder->connector->ids.crtc_id, builder->crtc->id);
+            if (builder->connector != NULL) {
+                drmModeAtomicAddProperty(builder->req, builder->connector->id, builder->connector->ids.crtc_id, builder->crtc->id);
+            }
+
+            // Detach any other connector that's still driven by this CRTC, for example
+            // the one that was unplugged before this connector was plugged in.
+            // Writeback connectors stay attached, so the next writeback doesn't need a modeset.
+            for_each_connector_in_drmdev(builder->drmdev, conn) {
+                if (conn != builder->connector && conn->committed_state.crtc_id == builder->crtc->id
+                    && (conn->type != kWRITEBACK_DrmConnectorType || builder->unset_mode)) {
+                    drmModeAtomicAddProperty(builder->req, conn->id, conn->ids.crtc_id, 0);
+                }
+            }
+        }
+
+        // A CRTC that's being disabled won't scan out anything we could wait for.
+        if (DRM_ID_IS_VALID(builder->crtc->ids.out_fence_ptr) && !builder->unset_mode) {
+            builder->out_fence_fd = -1;
+            drmModeAtomicAddProperty(
+                builder->req,
+                builder->crtc->id,
+                builder->crtc->ids.out_fence_ptr,
+                (uint64_t) (uintptr_t) &builder->out_fence_fd
+            );
         }
 
         if (update_mode) {
@@ -2845,6 +4430,37 @@ kms_req_commit_common(struct kms_req *req, bool blocking, kms_scanout_cb_t scano
             }
         }
 
+        if (builder->has_vrr_enabled && builder->vrr_enabled != builder->crtc->committed_state.vrr_enabled) {
+            drmModeAtomicAddProperty(builder->req, builder->crtc->id, builder->crtc->ids.vrr_enabled, builder->vrr_enabled);
+        }
+
+        if (crtc_state->has_pending_gamma_lut) {
+            drmModeAtomicAddProperty(builder->req, builder->crtc->id, builder->crtc->ids.gamma_lut, crtc_state->pending_gamma_lut_blob_id);
+        }
+
+        if (crtc_state->has_pending_ctm) {
+            drmModeAtomicAddProperty(builder->req, builder->crtc->id, builder->crtc->ids.ctm, crtc_state->pending_ctm_blob_id);
+        }
+
+        // Only one writeback per CRTC is in flight at a time, a queued one waits for the next commit then.
+        if (crtc_state->has_pending_writeback && !crtc_state->has_writeback && !builder->unset_mode) {
+            writeback = &crtc_state->pending_writeback;
+
+            if (writeback->connector->committed_state.crtc_id != builder->crtc->id) {
+                drmModeAtomicAddProperty(builder->req, writeback->connector->id, writeback->connector->ids.crtc_id, builder->crtc->id);
+                flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+            }
+
+            writeback->fence_fd = -1;
+            drmModeAtomicAddProperty(builder->req, writeback->connector->id, writeback->connector->ids.writeback_fb_id, writeback->fb_id);
+            drmModeAtomicAddProperty(
+                builder->req,
+                writeback->connector->id,
+                writeback->connector->ids.writeback_out_fence_ptr,
+                (uint64_t) (uintptr_t) &writeback->fence_fd
+            );
+        }
+
         /// TODO: If we're on raspberry pi and only have one layer, we can do an async pageflip
         /// on the primary plane to replace the next queued frame. (To do _real_ triple buffering
         /// with fully decoupled framerate, potentially)
@@ -2852,10 +4468,95 @@ kms_req_commit_common(struct kms_req *req, bool blocking, kms_scanout_cb_t scano
         if (ok != 0) {
             ok = errno;
             LOG_ERROR("Could not commit display update. drmModeAtomicCommit: %s\n", strerror(ok));
+            close_in_fences(builder);
+
+            // A configuration that passed the test before might not work anymore, for example because
+            // another CRTC uses more bandwidth now. Test them again.
+            crtc_state->n_accepted_configs = 0;
+            crtc_state->next_accepted_config = 0;
+
+            // Don't retry the writeback with the next commit, it might be the reason this one failed.
+            if (writeback != NULL) {
+                failed_writeback = *writeback;
+                failed_writeback_status = ok;
+                has_failed_writeback = true;
+                crtc_state->has_pending_writeback = false;
+            }
+
+            // Same for the color transform. It passed the test when it was set, but the previous one
+            // is still applied, so drop it instead of failing every following commit as well.
+            if (crtc_state->has_pending_gamma_lut) {
+                destroy_blob(builder->drmdev, crtc_state->pending_gamma_lut_blob_id);
+                crtc_state->has_pending_gamma_lut = false;
+            }
+
+            if (crtc_state->has_pending_ctm) {
+                destroy_blob(builder->drmdev, crtc_state->pending_ctm_blob_id);
+                crtc_state->has_pending_ctm = false;
+            }
+
             goto fail_unref_builder;
         }
+
+        // The kernel has its own reference on the in fences now.
+        close_in_fences(builder);
+
+        // The kernel has its own reference on the blobs as well, so the ones that were committed before can be destroyed.
+        if (crtc_state->has_pending_gamma_lut) {
+            destroy_blob(builder->drmdev, crtc_state->gamma_lut_blob_id);
+            crtc_state->gamma_lut_blob_id = crtc_state->pending_gamma_lut_blob_id;
+            crtc_state->has_pending_gamma_lut = false;
+        }
+
+        if (crtc_state->has_pending_ctm) {
+            destroy_blob(builder->drmdev, crtc_state->ctm_blob_id);
+            crtc_state->ctm_blob_id = crtc_state->pending_ctm_blob_id;
+            crtc_state->has_pending_ctm = false;
+        }
+
+        if (writeback != NULL) {
+            writeback->connector->committed_state.crtc_id = builder->crtc->id;
+            crtc_state->has_pending_writeback = false;
+
+            // sync_file fds become readable once the fence is signalled, i.e. the writeback is done.
+            crtc_state->writeback = *writeback;
+            ok = epoll_ctl(
+                builder->drmdev->event_fd,
+                EPOLL_CTL_ADD,
+                crtc_state->writeback.fence_fd,
+                &(struct epoll_event){ .events = EPOLLIN, .data.ptr = &crtc_state->writeback_source }
+            );
+            if (ok < 0) {
+                LOG_ERROR("Couldn't poll writeback out fence. epoll_ctl: %s\n", strerror(errno));
+                if (crtc_state->writeback.fence_fd >= 0) {
+                    close(crtc_state->writeback.fence_fd);
+                }
+
+                failed_writeback = crtc_state->writeback;
+                failed_writeback_status = EIO;
+                has_failed_writeback = true;
+            } else {
+                crtc_state->has_writeback = true;
+            }
+        }
+
+        // The out fence of this commit signals when the previous frame isn't shown anymore.
+        if (builder->out_fence_fd >= 0) {
+            struct kms_req *prev = builder->drmdev->per_crtc_state[builder->crtc->index].last_flipped;
+            if (prev != NULL) {
+                release_layers_on_fence_locked((struct kms_req_builder *) prev, builder->out_fence_fd);
+            }
+
+            close(builder->out_fence_fd);
+            builder->out_fence_fd = -1;
+        }
     }
 
+    builder->drmdev->per_crtc_state[builder->crtc->index].flip_pending = true;
+
+    // Only the planes of this commit are used by this CRTC now, the others can be used by other CRTCs again.
+    BITSET_ZERO(builder->drmdev->per_crtc_state[builder->crtc->index].claimed_planes);
+
     // update struct drm_plane.committed_state for all planes
     for (int i = 0; i < builder->n_layers; i++) {
         struct drm_plane *plane = builder->layers[i].plane;
@@ -2882,12 +4583,18 @@ kms_req_commit_common(struct kms_req *req, bool blocking, kms_scanout_cb_t scano
         plane->committed_state.has_format = true;
         plane->committed_state.format = layer->layer.format;
 
+        BITSET_SET(builder->drmdev->per_crtc_state[builder->crtc->index].claimed_planes, plane - builder->drmdev->planes);
+
         // builder->layers[i].plane->committed_state.alpha = layer->alpha;
         // builder->layers[i].plane->committed_state.blend_mode = builder->layers[i].layer.blend_mode;
     }
 
     // update struct drm_crtc.committed_state
     if (update_mode) {
+        // Whether a plane configuration works can depend on the mode.
+        builder->drmdev->per_crtc_state[builder->crtc->index].n_accepted_configs = 0;
+        builder->drmdev->per_crtc_state[builder->crtc->index].next_accepted_config = 0;
+
         // destroy the old mode blob
         if (builder->crtc->committed_state.mode_blob != NULL) {
             /// TODO: Should we defer this to after the pageflip?
@@ -2905,9 +4612,29 @@ kms_req_commit_common(struct kms_req *req, bool blocking, kms_scanout_cb_t scano
         }
     }
 
+    if (builder->has_vrr_enabled) {
+        builder->crtc->committed_state.vrr_enabled = builder->vrr_enabled;
+    }
+
     // update struct drm_connector.committed_state
-    builder->connector->committed_state.crtc_id = builder->crtc->id;
-    // builder->connector->committed_state.encoder_id = 0;
+    if (builder->connector != NULL || builder->unset_mode) {
+        struct drm_connector *conn;
+
+        // drmModeSetCrtc without connectors detaches all of them on legacy KMS too.
+        if (!builder->use_legacy || builder->unset_mode) {
+            for_each_connector_in_drmdev(builder->drmdev, conn) {
+                if (conn != builder->connector && conn->committed_state.crtc_id == builder->crtc->id
+                    && (conn->type != kWRITEBACK_DrmConnectorType || builder->unset_mode)) {
+                    conn->committed_state.crtc_id = 0;
+                }
+            }
+        }
+
+        if (builder->connector != NULL) {
+            builder->connector->committed_state.crtc_id = builder->crtc->id;
+            // builder->connector->committed_state.encoder_id = 0;
+        }
+    }
 
     drmdev_set_scanout_callback_locked(builder->drmdev, builder->crtc->id, scanout_cb, userdata, destroy_cb);
 
@@ -2916,11 +4643,16 @@ kms_req_commit_common(struct kms_req *req, bool blocking, kms_scanout_cb_t scano
         uint64_t ns = 0;
         int ok;
 
-        ok = drmCrtcGetSequence(builder->drmdev->fd, builder->crtc->id, &sequence, &ns);
-        if (ok != 0) {
-            ok = errno;
-            LOG_ERROR("Could not get vblank timestamp. drmCrtcGetSequence: %s\n", strerror(ok));
-            goto fail_unref_builder;
+        if (builder->unset_mode) {
+            // A disabled CRTC doesn't have vblanks anymore.
+            ns = get_monotonic_time();
+        } else {
+            ok = drmCrtcGetSequence(builder->drmdev->fd, builder->crtc->id, &sequence, &ns);
+            if (ok != 0) {
+                ok = errno;
+                LOG_ERROR("Could not get vblank timestamp. drmCrtcGetSequence: %s\n", strerror(ok));
+                goto fail_unref_builder;
+            }
         }
 
         drmdev_on_page_flip_locked(
@@ -2942,9 +4674,14 @@ kms_req_commit_common(struct kms_req *req, bool blocking, kms_scanout_cb_t scano
 
     drmdev_unlock(builder->drmdev);
 
+    if (has_failed_writeback) {
+        failed_writeback.callback(builder->drmdev, failed_writeback_status, failed_writeback.userdata);
+    }
+
     return 0;
 
 fail_unset_scanout_callback:
+    builder->drmdev->per_crtc_state[builder->crtc->index].flip_pending = false;
     builder->drmdev->per_crtc_state[builder->crtc->index].scanout_callback = NULL;
     builder->drmdev->per_crtc_state[builder->crtc->index].destroy_callback = NULL;
     builder->drmdev->per_crtc_state[builder->crtc->index].userdata = NULL;
@@ -2960,6 +4697,10 @@ fail_maybe_destroy_mode_blob:
 fail_unlock:
     drmdev_unlock(builder->drmdev);
 
+    if (has_failed_writeback) {
+        failed_writeback.callback(builder->drmdev, failed_writeback_status, failed_writeback.userdata);
+    }
+
     return ok;
 }
 
@@ -19,6 +19,7 @@
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
+#include "notifier_listener.h"
 #include "pixel_format.h"
 #include "util/collection.h"
 #include "util/geometry.h"
@@ -107,7 +108,7 @@
     /* V("underscan hborder", underscan_hborder) */                 \
     /* V("underscan vborder", underscan_vborder) */                 \
     /* V("vibrant hue", vibrant_hue) */                             \
-    /* V("vrr_capable", vrr_capable) */
+    V("vrr_capable", vrr_capable)
 
 // again, crtc properties that are not available on pi 4
 // are commented out.
@@ -374,12 +375,23 @@ struct drm_connector {
         uint32_t width_mm, height_mm;
         uint32_t n_modes;
         drmModeModeInfo *modes;
+
+        /// True if the connector & sink support variable refresh rate. (The `vrr_capable` property)
+        bool vrr_capable;
+
+        /// The vertical refresh rate range of the sink, from the EDID monitor range limits.
+        /// Zero if unknown.
+        uint32_t min_refresh_hz, max_refresh_hz;
     } variable_state;
 
     struct {
         uint32_t crtc_id;
         uint32_t encoder_id;
     } committed_state;
+
+    /// @brief The framebuffer formats this connector can write the output of a CRTC into,
+    /// if it's a writeback connector. (The `WRITEBACK_PIXEL_FORMATS` property)
+    bool writeback_formats[PIXFMT_COUNT];
 };
 
 struct drm_encoder {
@@ -393,10 +405,14 @@ struct drm_crtc {
 
     struct drm_crtc_prop_ids ids;
 
+    /// @brief The number of entries the gamma LUT of this CRTC has, or 0 if it doesn't have one.
+    uint32_t gamma_lut_size;
+
     struct {
         bool has_mode;
         drmModeModeInfo mode;
         struct drm_mode_blob *mode_blob;
+        bool vrr_enabled;
     } committed_state;
 };
 
@@ -616,6 +632,13 @@ bool drm_plane_supports_unmodified_format(struct drm_plane *plane, enum pixfmt f
 
 bool drm_crtc_any_plane_supports_format(struct drmdev *drmdev, struct drm_crtc *crtc, enum pixfmt pixel_format);
 
+/**
+ * @brief Get the vertical refresh rate range from the monitor range limits descriptor of an EDID.
+ *
+ * Only looks at the base block. Leaves the outputs untouched if there's no such descriptor.
+ */
+void drm_parse_edid_refresh_range(const uint8_t *edid, size_t size, uint32_t *min_hz_out, uint32_t *max_hz_out);
+
 struct _drmModeModeInfo;
 
 struct drmdev_interface {
@@ -635,6 +658,7 @@ struct _drmModeModeInfo;
 int drmdev_get_fd(struct drmdev *drmdev);
 int drmdev_get_event_fd(struct drmdev *drmdev);
 bool drmdev_supports_dumb_buffers(struct drmdev *drmdev);
+bool drmdev_supports_atomic_modesetting(struct drmdev *drmdev);
 int drmdev_create_dumb_buffer(
     struct drmdev *drmdev,
     int width,
@@ -648,6 +672,20 @@ void drmdev_destroy_dumb_buffer(struct drmdev *drmdev, uint32_t gem_handle);
 void *drmdev_map_dumb_buffer(struct drmdev *drmdev, uint32_t gem_handle, size_t size);
 void drmdev_unmap_dumb_buffer(struct drmdev *drmdev, void *map, size_t size);
 int drmdev_on_event_fd_ready(struct drmdev *drmdev);
+
+/**
+ * @brief Call @param notify whenever a display was connected, disconnected or its modes changed.
+ *
+ * The state of the connectors of the drmdev is already updated when @param notify is called,
+ * so @ref for_each_connector_in_drmdev and friends will return the new state.
+ * Any pointers to the previous modes of a changed connector are invalid after that.
+ *
+ * @param notify is called on the thread calling @ref drmdev_on_event_fd_ready, with the drmdev as the argument.
+ * @returns The listener, for @ref drmdev_remove_hotplug_listener, or NULL on failure.
+ */
+struct listener *drmdev_add_hotplug_listener(struct drmdev *drmdev, listener_cb_t notify, void *userdata);
+
+void drmdev_remove_hotplug_listener(struct drmdev *drmdev, struct listener *listener);
 const struct drm_connector *drmdev_get_selected_connector(struct drmdev *drmdev);
 const struct drm_encoder *drmdev_get_selected_encoder(struct drmdev *drmdev);
 const struct drm_crtc *drmdev_get_selected_crtc(struct drmdev *drmdev);
@@ -703,6 +741,51 @@ uint32_t drmdev_add_fb_from_dmabuf_multiplanar(
     const uint64_t modifiers[4]
 );
 
+/**
+ * @brief Returns a framebuffer for a (possibly multi-planar) dmabuf, from the dmabuf fb cache of the drmdev.
+ *
+ * Framebuffers are keyed by the GEM handles of the dmabufs, the format, modifier, pitches and offsets.
+ * The dmabufs are imported on a separate file description of the device, so these GEM handles never
+ * alias the ones of GBM BOs or dumb buffers, and can be closed when the framebuffer is evicted.
+ * If the same buffer is presented again (for example, because a video decoder recycles its buffers),
+ * the existing framebuffer is returned instead of adding a new one.
+ *
+ * Unused planes need to have a prime fd of -1 and zero pitches & offsets.
+ * Every framebuffer returned by this function needs to be released using @ref drmdev_release_cached_fb,
+ * not @ref drmdev_rm_fb.
+ *
+ * @returns The framebuffer id, or 0 on error.
+ */
+uint32_t drmdev_add_cached_fb_from_dmabuf(
+    struct drmdev *drmdev,
+    uint32_t width,
+    uint32_t height,
+    enum pixfmt pixel_format,
+    const int prime_fds[4],
+    const uint32_t pitches[4],
+    const uint32_t offsets[4],
+    bool has_modifiers,
+    const uint64_t modifiers[4]
+);
+
+/**
+ * @brief Drops a reference on a framebuffer returned by @ref drmdev_add_cached_fb_from_dmabuf.
+ *
+ * Framebuffers without users are kept in the cache (which also keeps the dmabuf memory alive),
+ * until too many unused framebuffers are cached, @ref drmdev_evict_cached_fbs is called,
+ * or the drmdev is destroyed.
+ */
+void drmdev_release_cached_fb(struct drmdev *drmdev, uint32_t fb_id);
+
+void drmdev_evict_cached_fbs_locked(struct drmdev *drmdev);
+
+/**
+ * @brief Removes all cached dmabuf framebuffers that are not used anymore, so the memory of their dmabufs can be freed.
+ *
+ * Should be called when the dmabufs won't be presented again, for example when a video decoder frees its buffer pool.
+ */
+void drmdev_evict_cached_fbs(struct drmdev *drmdev);
+
 uint32_t drmdev_add_fb_from_gbm_bo(struct drmdev *drmdev, struct gbm_bo *bo, bool cast_opaque);
 
 int drmdev_rm_fb_locked(struct drmdev *drmdev, uint32_t fb_id);
@@ -711,14 +794,99 @@ int drmdev_rm_fb(struct drmdev *drmdev, uint32_t fb_id);
 
 int drmdev_get_last_vblank(struct drmdev *drmdev, uint32_t crtc_id, uint64_t *last_vblank_ns_out);
 
+/**
+ * @brief Returns true if there's a commit for this CRTC whose page flip
+ * wasn't handled yet, i.e. a non-blocking commit on it would fail with EBUSY.
+ */
+bool drmdev_crtc_has_pending_flip(struct drmdev *drmdev, uint32_t crtc_id);
+
 bool drmdev_can_modeset(struct drmdev *drmdev);
 
+/**
+ * @brief Sets the gamma lookup table that the CRTC applies to its output, after blending all planes.
+ *
+ * The LUT is only uploaded and tested here, it's applied together with the next KMS request
+ * that is committed for this CRTC. If that commit fails, the LUT is dropped.
+ *
+ * @param drmdev The KMS device.
+ * @param crtc_id The CRTC to set the gamma LUT for.
+ * @param lut @param n_entries red, green, blue triplets, each value between 0.0 and 1.0.
+ *            The LUT is resampled to the size the hardware supports.
+ *            NULL to reset to the identity mapping.
+ * @param n_entries The number of entries in @param lut, at least 2.
+ * @returns Zero if successful, EOPNOTSUPP if the CRTC doesn't support a gamma LUT or legacy
+ *          modesetting is used, EINVAL if the display controller rejected the LUT,
+ *          or another positive errno-style error on failure.
+ */
+int drmdev_set_crtc_gamma_lut(struct drmdev *drmdev, uint32_t crtc_id, const double *lut, size_t n_entries);
+
+/**
+ * @brief Sets the color transformation matrix that the CRTC applies to its output, before the gamma LUT.
+ *
+ * Like @ref drmdev_set_crtc_gamma_lut, this is applied with the next KMS request committed for this CRTC.
+ *
+ * @param drmdev The KMS device.
+ * @param crtc_id The CRTC to set the matrix for.
+ * @param matrix A 3x3 matrix in row-major order that maps (linear) input RGB to output RGB,
+ *               or NULL to reset to the identity matrix.
+ * @returns Zero if successful, EOPNOTSUPP if the CRTC doesn't support a CTM or legacy
+ *          modesetting is used, EINVAL if the display controller rejected the matrix,
+ *          or another positive errno-style error on failure.
+ */
+int drmdev_set_crtc_ctm(struct drmdev *drmdev, uint32_t crtc_id, const double *matrix);
+
+/**
+ * @brief Called once the writeback queued using @ref drmdev_queue_writeback is done, i.e. the framebuffer
+ * contains everything the CRTC scanned out for one frame, or if the writeback failed.
+ *
+ * Called without the drmdev locked, on the thread calling @ref drmdev_on_event_fd_ready or, if committing
+ * the writeback failed, on the thread that committed the KMS request.
+ *
+ * @param drmdev The KMS device.
+ * @param status Zero if the framebuffer contains the output of the CRTC now, a positive errno-style error code otherwise.
+ * @param userdata The userdata passed to @ref drmdev_queue_writeback.
+ */
+typedef void (*drmdev_writeback_cb_t)(struct drmdev *drmdev, int status, void *userdata);
+
+/**
+ * @brief Returns true if there's a writeback connector that can capture the output of this CRTC
+ * into a framebuffer with pixel format @param format.
+ */
+bool drmdev_crtc_supports_writeback(struct drmdev *drmdev, uint32_t crtc_id, enum pixfmt format);
+
+/**
+ * @brief Captures the output of the CRTC into a framebuffer, using a writeback connector.
+ *
+ * The writeback connector is attached to the CRTC with the next KMS request that is committed for it,
+ * so it captures exactly what's scanned out, including all overlay planes and the cursor.
+ * The first writeback on a CRTC needs a modeset (for attaching the connector), later ones don't.
+ *
+ * @param drmdev The KMS device.
+ * @param crtc_id The CRTC to capture.
+ * @param fb_id The framebuffer to write into. Must have the size of the CRTC mode and a pixel format
+ *              that's supported by the writeback connector (see @ref drmdev_crtc_supports_writeback).
+ *              Must not be destroyed before @param callback was called.
+ * @param callback Called once the writeback is done. Only called if this function returns zero.
+ * @param userdata Passed to @param callback.
+ * @returns Zero if successful, EOPNOTSUPP if there's no writeback connector for the CRTC or legacy
+ *          modesetting is used, EBUSY if there's already a writeback queued for the CRTC,
+ *          or another positive errno-style error on failure.
+ */
+int drmdev_queue_writeback(struct drmdev *drmdev, uint32_t crtc_id, uint32_t fb_id, drmdev_writeback_cb_t callback, void *userdata);
+
 void drmdev_suspend(struct drmdev *drmdev);
 
 int drmdev_resume(struct drmdev *drmdev);
 
 int drmdev_move_cursor(struct drmdev *drmdev, uint32_t crtc_id, struct vec2i pos);
 
+/**
+ * @brief Blocks until the next vblank of the CRTC with id @param crtc_id.
+ *
+ * Doesn't lock the drmdev, so other threads can still commit / move the cursor while we wait.
+ */
+int drmdev_wait_vblank(struct drmdev *drmdev, uint32_t crtc_id);
+
 static inline double mode_get_vrefresh(const drmModeModeInfo *mode) {
     return mode->clock * 1000.0 / (mode->htotal * mode->vtotal);
 }
@@ -785,8 +953,12 @@ int kms_req_builder_set_mode(struct kms_req_builder *builder, const drmModeModeI
  * output mode for this CRTC on commit, regardless of whether the currently
  * committed output mdoe is already unset.
  *
+ * This also disables the CRTC and detaches all connectors from it.
+ * With legacy modesetting, the CRTC is disabled using drmModeSetCrtc and any
+ * layers pushed to the builder are ignored.
+ *
  * @param builder The KMS request builder.
- * @returns Zero if successful, positive errno-style error on failure.
+ * @returns Zero if successful.
  */
 int kms_req_builder_unset_mode(struct kms_req_builder *builder);
 
@@ -800,6 +972,17 @@ int kms_req_builder_unset_mode(struct kms_req_builder *builder);
  */
 int kms_req_builder_set_connector(struct kms_req_builder *builder, uint32_t connector_id);
 
+/**
+ * @brief Enable or disable variable refresh rate for the CRTC of this request.
+ *
+ * With VRR enabled, the display will refresh as soon as a new frame is committed
+ * (within the limits of the panel), instead of at fixed vblank intervals.
+ *
+ * @returns 0 on success, EOPNOTSUPP if the CRTC has no `VRR_ENABLED` property or the
+ *          request will be committed using legacy modesetting.
+ */
+int kms_req_builder_set_vrr_enabled(struct kms_req_builder *builder, bool enabled);
+
 /**
  * @brief True if the next layer pushed using @ref kms_req_builder_push_fb_layer
  * should be opaque, i.e. use a framebuffer which has a pixel format that has no
@@ -822,24 +1005,40 @@ bool kms_req_builder_prefer_next_layer_opaque(struct kms_req_builder *builder);
  * (CRTC).
  *
  * To allow the use of explicit fencing, specify an in_fence_fd in @param layer
- * and a @param deferred_release_callback.
+ * and/or a @param deferred_release_callback.
  *
  * If explicit fencing is supported:
- *   - the in_fence_fd should be a DRM syncobj fd that signals
+ *   - the in_fence_fd should be a sync_file fd that signals
  *     when the GPU has finished rendering to the framebuffer and is ready
- *     to be scanned out.
- *   - @param deferred_release_callback will be called
- *     with a DRM syncobj fd that is signaled once the framebuffer is no longer
- *     being displayed on screen (and can be rendered into again)
+ *     to be scanned out. The builder takes ownership of the fd and closes it
+ *     once the request was committed (or destroyed).
+ *   - @param deferred_release_callback will be called as soon as the next
+ *     request is committed, with a sync_file fd (the CRTC out fence of the
+ *     next request) that is signaled once the framebuffer is no longer
+ *     being displayed on screen (and can be rendered into again).
+ *   - if there's no @param deferred_release_callback, @param release_callback
+ *     is called once that out fence signals, which can be earlier than the
+ *     page flip event is handled.
  *
  * If explicit fencing is not supported:
- *   - the in_fence_fd in @param layer will be closed by this procedure.
+ *   - the in_fence_fd in @param layer will be closed by this procedure,
+ *     and the kernel will wait for the rendering using implicit fencing.
  *   - @param deferred_release_callback will NOT be called and
- *     @param release_callback will be called instead.
+ *     @param release_callback will be called instead, on the page flip
+ *     event of the next request.
+ *
+ * In fences are supported when atomic modesetting is being used and
+ * the plane that was chosen for the layer has an IN_FENCE_FD property.
+ * Out fences are supported when atomic modesetting is being used and
+ * the CRTC has an OUT_FENCE_PTR property.
  *
- * Explicit fencing is supported: When atomic modesetting is being used and
- * the driver supports it. (Driver has IN_FENCE_FD plane and OUT_FENCE_PTR crtc
- * properties)
+ * If this procedure fails, the caller still owns the in_fence_fd.
+ *
+ * With atomic modesetting, the layers pushed so far are checked using a TEST_ONLY commit,
+ * so planes the display controller can't use for this layer (because of bandwidth or scaler limits,
+ * for example) are skipped and the next candidate plane is tried. The results are memoized per CRTC
+ * by the plane configuration (everything except the framebuffer contents), so the test commits are
+ * only done when the layer structure changes. Requests that change the mode are not checked.
  *
  * @param builder          The KMS request builder.
  * @param layer            The exact details (src pos, output pos, rotation,
@@ -849,12 +1048,14 @@ bool kms_req_builder_prefer_next_layer_opaque(struct kms_req_builder *builder);
  *                         longer being shown on screen. This is called with the
  *                         drmdev locked, so make sure to use _locked variants
  *                         of any drmdev calls.
- * @param deferred_release_callback (Unimplemented right now) If this is present,
+ * @param deferred_release_callback If this is present,
  *                                  this callback might be called instead of
  *                                  @param release_callback.
- *                                  This is called with a DRM syncobj fd that is
+ *                                  This is called with a sync_file fd that is
  *                                  signaled when the framebuffer is no longer
- *                                  shown on screen.
+ *                                  shown on screen. The callback takes
+ *                                  ownership of the fd. Also called with the
+ *                                  drmdev locked.
  *                                  Legacy DRM modesetting does not support
  *                                  explicit fencing, in which case
  *                                  @param release_callback will be called
@@ -871,8 +1072,9 @@ bool kms_req_builder_prefer_next_layer_opaque(struct kms_req_builder *builder);
  *                being used.
  *            - EIO: if no DRM plane could be found that supports displaying
  *                this framebuffer layer. Either the pixel format is not
- *                supported, the modifier, the rotation or the drm device
- *                doesn't have enough planes.
+ *                supported, the modifier, the rotation, the drm device
+ *                doesn't have enough planes or the display controller
+ *                rejected all candidate planes.
  *            - The error returned by @ref close if closing the in_fence_fd
  *              fails.
  */
@@ -885,6 +1087,20 @@ int kms_req_builder_push_fb_layer(
     bool *allocated_cursor_plane
 );
 
+/**
+ * @brief True if the KMS commit will wait for the in fence of the layer that was last pushed
+ * using @ref kms_req_builder_push_fb_layer.
+ *
+ * The in fence is closed instead (and the kernel uses implicit fencing) when legacy modesetting
+ * is used or the plane has no `IN_FENCE_FD` property. Renderers that don't attach implicit fences
+ * to their buffers need to wait for rendering to finish themselves in that case.
+ *
+ * @param builder The KMS request builder.
+ * @returns True if the in fence of the last layer is passed to KMS, false if it was closed
+ *          or the layer had none.
+ */
+bool kms_req_builder_last_layer_has_in_fence(struct kms_req_builder *builder);
+
 /**
  * @brief Push a "fake" layer that just keeps one zpos free, incase something
  * other than KMS wants to display contents there. (e.g. omxplayer)
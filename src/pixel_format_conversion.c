@@ -0,0 +1,913 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Pixel Format Conversion
+ *
+ * - see pixel_format_conversion.h for details
+ *
+ * Copyright (c) 2023, Hannes Winkler <hanneswinkler2000@web.de>
+ */
+
+#include "pixel_format_conversion.h"
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "pixel_format.h"
+#include "util/asserts.h"
+#include "util/logging.h"
+#include "util/macros.h"
+
+#include "config.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    #include <arm_neon.h>
+    #define HAVE_NEON_KERNELS
+    #if !defined(__aarch64__)
+        #include <sys/auxv.h>
+        #ifndef HWCAP_NEON
+            #define HWCAP_NEON (1 << 12)
+        #endif
+    #endif
+#elif defined(__SSE2__)
+    #include <emmintrin.h>
+    #define HAVE_SSE2_KERNELS
+#endif
+
+/**
+ * @brief How many pixels are converted at once when we need to go via an intermediate ARGB8888 buffer.
+ *
+ * Small enough to keep the buffer on the stack and in L1.
+ */
+#define CHUNK_SIZE 256
+
+/**
+ * @brief Edge length (in pixels) of the tiles rotated images are converted in.
+ *
+ * 32x32 ARGB8888 pixels of source and destination (4KiB each) comfortably fit into L1.
+ */
+#define TILE_SIZE 32
+
+struct channel_layout {
+    uint8_t bits_per_pixel;
+    uint8_t r_length, r_offset;
+    uint8_t g_length, g_offset;
+    uint8_t b_length, b_offset;
+    uint8_t a_length, a_offset;
+};
+
+// clang-format off
+#define CHANNEL_LAYOUT(_name, _arg_name, _format, _bpp, _bit_depth, _is_opaque, _vk_format, _r_length, _r_offset, _g_length, _g_offset, _b_length, _b_offset, _a_length, _a_offset, _gbm_format, _drm_format) \
+    [_format] = {                                                                                                                                                                                         \
+        .bits_per_pixel = _bpp,                                                                                                                                                                           \
+        .r_length = _r_length, .r_offset = _r_offset,                                                                                                                                                     \
+        .g_length = _g_length, .g_offset = _g_offset,                                                                                                                                                     \
+        .b_length = _b_length, .b_offset = _b_offset,                                                                                                                                                     \
+        .a_length = _a_length, .a_offset = _a_offset,                                                                                                                                                     \
+    },
+// clang-format on
+
+static const struct channel_layout channel_layouts[PIXFMT_COUNT] = { PIXFMT_LIST(CHANNEL_LAYOUT) };
+
+#undef CHANNEL_LAYOUT
+
+static inline uint32_t alpha_mask(enum pixfmt format) {
+    const struct channel_layout *layout = channel_layouts + format;
+    return ((1u << layout->a_length) - 1) << layout->a_offset;
+}
+
+/**
+ * @brief x / 255, rounded to nearest. Exact for all x <= 255 * 255.
+ *
+ * The SIMD kernels use the same formula, so the results are bit-identical.
+ */
+static inline uint32_t div255(uint32_t x) {
+    return (x + 128 + ((x + 128) >> 8)) >> 8;
+}
+
+/*
+ * Scalar kernels
+ */
+static void argb8888_to_rgb565_scalar(uint16_t *restrict dst, const uint32_t *restrict src, int n) {
+    for (int i = 0; i < n; i++) {
+        uint32_t p = src[i];
+        dst[i] = (uint16_t) (((p >> 8) & 0xF800) | ((p >> 5) & 0x07E0) | ((p >> 3) & 0x001F));
+    }
+}
+
+static void rgb565_to_argb8888_scalar(uint32_t *restrict dst, const uint16_t *restrict src, int n) {
+    for (int i = 0; i < n; i++) {
+        uint32_t p = src[i];
+        uint32_t r = (p >> 11) & 0x1F, g = (p >> 5) & 0x3F, b = p & 0x1F;
+
+        r = (r << 3) | (r >> 2);
+        g = (g << 2) | (g >> 4);
+        b = (b << 3) | (b >> 2);
+
+        dst[i] = 0xFF000000 | r << 16 | g << 8 | b;
+    }
+}
+
+static void bswap32_scalar(uint32_t *restrict dst, const uint32_t *restrict src, int n) {
+    for (int i = 0; i < n; i++) {
+        dst[i] = __builtin_bswap32(src[i]);
+    }
+}
+
+static void rgba8888_to_argb8888_scalar(uint32_t *restrict dst, const uint32_t *restrict src, int n) {
+    for (int i = 0; i < n; i++) {
+        dst[i] = (src[i] >> 8) | (src[i] << 24);
+    }
+}
+
+static void argb8888_to_rgba8888_scalar(uint32_t *restrict dst, const uint32_t *restrict src, int n) {
+    for (int i = 0; i < n; i++) {
+        dst[i] = (src[i] << 8) | (src[i] >> 24);
+    }
+}
+
+static void or_mask_scalar(uint32_t *dst, const uint32_t *src, uint32_t mask, int n) {
+    for (int i = 0; i < n; i++) {
+        dst[i] = src[i] | mask;
+    }
+}
+
+static void premultiply_argb8888_scalar(uint32_t *restrict dst, const uint32_t *restrict src, int n) {
+    for (int i = 0; i < n; i++) {
+        uint32_t p = src[i];
+        uint32_t a = p >> 24;
+
+        dst[i] = a << 24 | div255(((p >> 16) & 0xFF) * a) << 16 | div255(((p >> 8) & 0xFF) * a) << 8 | div255((p & 0xFF) * a);
+    }
+}
+
+static void unpremultiply_argb8888_scalar(uint32_t *restrict dst, const uint32_t *restrict src, int n) {
+    for (int i = 0; i < n; i++) {
+        uint32_t p = src[i];
+        uint32_t a = p >> 24;
+        uint32_t r, g, b;
+
+        if (a == 0) {
+            dst[i] = 0;
+            continue;
+        } else if (a == 0xFF) {
+            dst[i] = p;
+            continue;
+        }
+
+        r = MIN2((((p >> 16) & 0xFF) * 255 + a / 2) / a, 255);
+        g = MIN2((((p >> 8) & 0xFF) * 255 + a / 2) / a, 255);
+        b = MIN2(((p & 0xFF) * 255 + a / 2) / a, 255);
+
+        dst[i] = a << 24 | r << 16 | g << 8 | b;
+    }
+}
+
+static void blend_argb8888_scalar(uint32_t *restrict dst, const uint32_t *restrict src, int n) {
+    for (int i = 0; i < n; i++) {
+        uint32_t s = src[i], d = dst[i];
+        uint32_t inv_alpha = 255 - (s >> 24);
+        uint32_t rb, ag;
+
+        // Process two channels at once. This is the same as div255 above, just for both channels in parallel.
+        rb = (d & 0x00FF00FF) * inv_alpha + 0x00800080;
+        rb = ((rb + ((rb >> 8) & 0x00FF00FF)) >> 8) & 0x00FF00FF;
+
+        ag = ((d >> 8) & 0x00FF00FF) * inv_alpha + 0x00800080;
+        ag = (ag + ((ag >> 8) & 0x00FF00FF)) & 0xFF00FF00;
+
+        dst[i] = s + (rb | ag);
+    }
+}
+
+static const struct pixfmt_conversion_kernels scalar_kernels = {
+    .name = "scalar",
+    .argb8888_to_rgb565 = argb8888_to_rgb565_scalar,
+    .rgb565_to_argb8888 = rgb565_to_argb8888_scalar,
+    .bswap32 = bswap32_scalar,
+    .rgba8888_to_argb8888 = rgba8888_to_argb8888_scalar,
+    .argb8888_to_rgba8888 = argb8888_to_rgba8888_scalar,
+    .or_mask = or_mask_scalar,
+    .premultiply_argb8888 = premultiply_argb8888_scalar,
+    .unpremultiply_argb8888 = unpremultiply_argb8888_scalar,
+    .blend_argb8888 = blend_argb8888_scalar,
+};
+
+/*
+ * NEON kernels
+ *
+ * These process 8 or 16 pixels per iteration and hand the remaining pixels to the scalar kernels.
+ * vld4 / vst4 de-interleave ARGB8888 pixels into B, G, R, A planes (on little endian).
+ */
+#ifdef HAVE_NEON_KERNELS
+
+static inline uint8x8_t div255_u16_neon(uint16x8_t x) {
+    // (x + 128 + ((x + 128) >> 8)) >> 8
+    return vrshrn_n_u16(vrsraq_n_u16(x, x, 8), 8);
+}
+
+static inline uint8x16_t mul_div255_neon(uint8x16_t a, uint8x16_t b) {
+    uint16x8_t lo = vmull_u8(vget_low_u8(a), vget_low_u8(b));
+    uint16x8_t hi = vmull_u8(vget_high_u8(a), vget_high_u8(b));
+    return vcombine_u8(div255_u16_neon(lo), div255_u16_neon(hi));
+}
+
+static inline uint16x8_t pack_rgb565_neon(uint8x8_t r, uint8x8_t g, uint8x8_t b) {
+    uint16x8_t p = vshll_n_u8(r, 8);
+    p = vsriq_n_u16(p, vshll_n_u8(g, 8), 5);
+    p = vsriq_n_u16(p, vshll_n_u8(b, 8), 11);
+    return p;
+}
+
+static void argb8888_to_rgb565_neon(uint16_t *restrict dst, const uint32_t *restrict src, int n) {
+    int i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        uint8x16x4_t p = vld4q_u8((const uint8_t *) (src + i));
+
+        vst1q_u16(dst + i, pack_rgb565_neon(vget_low_u8(p.val[2]), vget_low_u8(p.val[1]), vget_low_u8(p.val[0])));
+        vst1q_u16(dst + i + 8, pack_rgb565_neon(vget_high_u8(p.val[2]), vget_high_u8(p.val[1]), vget_high_u8(p.val[0])));
+    }
+
+    argb8888_to_rgb565_scalar(dst + i, src + i, n - i);
+}
+
+static void rgb565_to_argb8888_neon(uint32_t *restrict dst, const uint16_t *restrict src, int n) {
+    int i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        uint16x8_t p = vld1q_u16(src + i);
+        uint8x8x4_t o;
+
+        o.val[2] = vshrn_n_u16(p, 8);
+        o.val[2] = vsri_n_u8(o.val[2], o.val[2], 5);
+        o.val[1] = vshrn_n_u16(vshlq_n_u16(p, 5), 8);
+        o.val[1] = vsri_n_u8(o.val[1], o.val[1], 6);
+        o.val[0] = vmovn_u16(vshlq_n_u16(p, 3));
+        o.val[0] = vsri_n_u8(o.val[0], o.val[0], 5);
+        o.val[3] = vdup_n_u8(0xFF);
+
+        vst4_u8((uint8_t *) (dst + i), o);
+    }
+
+    rgb565_to_argb8888_scalar(dst + i, src + i, n - i);
+}
+
+static void bswap32_neon(uint32_t *restrict dst, const uint32_t *restrict src, int n) {
+    int i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        vst1q_u8((uint8_t *) (dst + i), vrev32q_u8(vld1q_u8((const uint8_t *) (src + i))));
+    }
+
+    bswap32_scalar(dst + i, src + i, n - i);
+}
+
+static void rgba8888_to_argb8888_neon(uint32_t *restrict dst, const uint32_t *restrict src, int n) {
+    int i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        uint32x4_t p = vld1q_u32(src + i);
+        vst1q_u32(dst + i, vsriq_n_u32(vshlq_n_u32(p, 24), p, 8));
+    }
+
+    rgba8888_to_argb8888_scalar(dst + i, src + i, n - i);
+}
+
+static void argb8888_to_rgba8888_neon(uint32_t *restrict dst, const uint32_t *restrict src, int n) {
+    int i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        uint32x4_t p = vld1q_u32(src + i);
+        vst1q_u32(dst + i, vsliq_n_u32(vshrq_n_u32(p, 24), p, 8));
+    }
+
+    argb8888_to_rgba8888_scalar(dst + i, src + i, n - i);
+}
+
+static void or_mask_neon(uint32_t *dst, const uint32_t *src, uint32_t mask, int n) {
+    uint32x4_t m = vdupq_n_u32(mask);
+    int i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        vst1q_u32(dst + i, vorrq_u32(vld1q_u32(src + i), m));
+    }
+
+    or_mask_scalar(dst + i, src + i, mask, n - i);
+}
+
+static void premultiply_argb8888_neon(uint32_t *restrict dst, const uint32_t *restrict src, int n) {
+    int i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        uint8x16x4_t p = vld4q_u8((const uint8_t *) (src + i));
+
+        p.val[0] = mul_div255_neon(p.val[0], p.val[3]);
+        p.val[1] = mul_div255_neon(p.val[1], p.val[3]);
+        p.val[2] = mul_div255_neon(p.val[2], p.val[3]);
+
+        vst4q_u8((uint8_t *) (dst + i), p);
+    }
+
+    premultiply_argb8888_scalar(dst + i, src + i, n - i);
+}
+
+static void blend_argb8888_neon(uint32_t *restrict dst, const uint32_t *restrict src, int n) {
+    int i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        uint8x16x4_t s = vld4q_u8((const uint8_t *) (src + i));
+        uint8x16x4_t d = vld4q_u8((const uint8_t *) (dst + i));
+        uint8x16_t inv_alpha = vmvnq_u8(s.val[3]);
+
+        for (int c = 0; c < 4; c++) {
+            d.val[c] = vaddq_u8(s.val[c], mul_div255_neon(d.val[c], inv_alpha));
+        }
+
+        vst4q_u8((uint8_t *) (dst + i), d);
+    }
+
+    blend_argb8888_scalar(dst + i, src + i, n - i);
+}
+
+static const struct pixfmt_conversion_kernels simd_kernels = {
+    .name = "NEON",
+    .argb8888_to_rgb565 = argb8888_to_rgb565_neon,
+    .rgb565_to_argb8888 = rgb565_to_argb8888_neon,
+    .bswap32 = bswap32_neon,
+    .rgba8888_to_argb8888 = rgba8888_to_argb8888_neon,
+    .argb8888_to_rgba8888 = argb8888_to_rgba8888_neon,
+    .or_mask = or_mask_neon,
+    .premultiply_argb8888 = premultiply_argb8888_neon,
+    // A division per pixel doesn't vectorize well and this is rarely used.
+    .unpremultiply_argb8888 = unpremultiply_argb8888_scalar,
+    .blend_argb8888 = blend_argb8888_neon,
+};
+
+static bool cpu_supports_simd_kernels(void) {
+    #ifdef __aarch64__
+    // Advanced SIMD is mandatory on AArch64.
+    return true;
+    #else
+    return (getauxval(AT_HWCAP) & HWCAP_NEON) != 0;
+    #endif
+}
+
+#endif  // HAVE_NEON_KERNELS
+
+/*
+ * SSE2 kernels
+ *
+ * SSE2 has no byte shuffles, so channels are moved around using 16 / 32-bit shifts instead.
+ */
+#ifdef HAVE_SSE2_KERNELS
+
+static inline __m128i div255_epi16_sse2(__m128i x) {
+    // (x + 128 + ((x + 128) >> 8)) >> 8
+    x = _mm_add_epi16(x, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+static inline __m128i broadcast_alpha_epi16_sse2(__m128i x) {
+    // x contains two pixels, as 16-bit B, G, R, A lanes.
+    return _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+}
+
+static void argb8888_to_rgb565_sse2(uint16_t *restrict dst, const uint32_t *restrict src, int n) {
+    const __m128i r_mask = _mm_set1_epi32(0xF800), g_mask = _mm_set1_epi32(0x07E0), b_mask = _mm_set1_epi32(0x001F);
+    int i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m128i p[2];
+
+        for (int j = 0; j < 2; j++) {
+            __m128i x = _mm_loadu_si128((const __m128i *) (src + i + 4 * j));
+
+            x = _mm_or_si128(
+                _mm_or_si128(_mm_and_si128(_mm_srli_epi32(x, 8), r_mask), _mm_and_si128(_mm_srli_epi32(x, 5), g_mask)),
+                _mm_and_si128(_mm_srli_epi32(x, 3), b_mask)
+            );
+
+            // sign-extend, so the signed saturation in packs_epi32 below doesn't clamp anything.
+            p[j] = _mm_srai_epi32(_mm_slli_epi32(x, 16), 16);
+        }
+
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_packs_epi32(p[0], p[1]));
+    }
+
+    argb8888_to_rgb565_scalar(dst + i, src + i, n - i);
+}
+
+static void rgb565_to_argb8888_sse2(uint32_t *restrict dst, const uint16_t *restrict src, int n) {
+    const __m128i mask5 = _mm_set1_epi32(0x1F), mask6 = _mm_set1_epi32(0x3F), alpha = _mm_set1_epi32(0xFF000000);
+    const __m128i zero = _mm_setzero_si128();
+    int i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m128i p = _mm_loadu_si128((const __m128i *) (src + i));
+
+        for (int j = 0; j < 2; j++) {
+            __m128i x = j == 0 ? _mm_unpacklo_epi16(p, zero) : _mm_unpackhi_epi16(p, zero);
+            __m128i r = _mm_and_si128(_mm_srli_epi32(x, 11), mask5);
+            __m128i g = _mm_and_si128(_mm_srli_epi32(x, 5), mask6);
+            __m128i b = _mm_and_si128(x, mask5);
+
+            r = _mm_or_si128(_mm_slli_epi32(r, 3), _mm_srli_epi32(r, 2));
+            g = _mm_or_si128(_mm_slli_epi32(g, 2), _mm_srli_epi32(g, 4));
+            b = _mm_or_si128(_mm_slli_epi32(b, 3), _mm_srli_epi32(b, 2));
+
+            x = _mm_or_si128(_mm_or_si128(alpha, _mm_slli_epi32(r, 16)), _mm_or_si128(_mm_slli_epi32(g, 8), b));
+            _mm_storeu_si128((__m128i *) (dst + i + 4 * j), x);
+        }
+    }
+
+    rgb565_to_argb8888_scalar(dst + i, src + i, n - i);
+}
+
+static void bswap32_sse2(uint32_t *restrict dst, const uint32_t *restrict src, int n) {
+    int i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        __m128i x = _mm_loadu_si128((const __m128i *) (src + i));
+
+        // swap the bytes in each 16-bit word, then the words in each 32-bit pixel.
+        x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+        x = _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, _MM_SHUFFLE(2, 3, 0, 1)), _MM_SHUFFLE(2, 3, 0, 1));
+
+        _mm_storeu_si128((__m128i *) (dst + i), x);
+    }
+
+    bswap32_scalar(dst + i, src + i, n - i);
+}
+
+static void rgba8888_to_argb8888_sse2(uint32_t *restrict dst, const uint32_t *restrict src, int n) {
+    int i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        __m128i x = _mm_loadu_si128((const __m128i *) (src + i));
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_or_si128(_mm_srli_epi32(x, 8), _mm_slli_epi32(x, 24)));
+    }
+
+    rgba8888_to_argb8888_scalar(dst + i, src + i, n - i);
+}
+
+static void argb8888_to_rgba8888_sse2(uint32_t *restrict dst, const uint32_t *restrict src, int n) {
+    int i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        __m128i x = _mm_loadu_si128((const __m128i *) (src + i));
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_or_si128(_mm_slli_epi32(x, 8), _mm_srli_epi32(x, 24)));
+    }
+
+    argb8888_to_rgba8888_scalar(dst + i, src + i, n - i);
+}
+
+static void or_mask_sse2(uint32_t *dst, const uint32_t *src, uint32_t mask, int n) {
+    const __m128i m = _mm_set1_epi32((int) mask);
+    int i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_or_si128(_mm_loadu_si128((const __m128i *) (src + i)), m));
+    }
+
+    or_mask_scalar(dst + i, src + i, mask, n - i);
+}
+
+static void premultiply_argb8888_sse2(uint32_t *restrict dst, const uint32_t *restrict src, int n) {
+    // Multiply the alpha lane by 255 instead of by alpha, so it stays the same after dividing by 255.
+    const __m128i color_lanes = _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+    const __m128i alpha_lanes = _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0);
+    const __m128i zero = _mm_setzero_si128();
+    int i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        __m128i x = _mm_loadu_si128((const __m128i *) (src + i));
+        __m128i lo = _mm_unpacklo_epi8(x, zero);
+        __m128i hi = _mm_unpackhi_epi8(x, zero);
+        __m128i lo_factor = _mm_or_si128(_mm_and_si128(broadcast_alpha_epi16_sse2(lo), color_lanes), alpha_lanes);
+        __m128i hi_factor = _mm_or_si128(_mm_and_si128(broadcast_alpha_epi16_sse2(hi), color_lanes), alpha_lanes);
+
+        lo = div255_epi16_sse2(_mm_mullo_epi16(lo, lo_factor));
+        hi = div255_epi16_sse2(_mm_mullo_epi16(hi, hi_factor));
+
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_packus_epi16(lo, hi));
+    }
+
+    premultiply_argb8888_scalar(dst + i, src + i, n - i);
+}
+
+static void blend_argb8888_sse2(uint32_t *restrict dst, const uint32_t *restrict src, int n) {
+    const __m128i all_ones = _mm_set1_epi16(255);
+    const __m128i zero = _mm_setzero_si128();
+    int i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        __m128i s = _mm_loadu_si128((const __m128i *) (src + i));
+        __m128i d = _mm_loadu_si128((const __m128i *) (dst + i));
+        __m128i s_lo = _mm_unpacklo_epi8(s, zero), s_hi = _mm_unpackhi_epi8(s, zero);
+        __m128i d_lo = _mm_unpacklo_epi8(d, zero), d_hi = _mm_unpackhi_epi8(d, zero);
+
+        d_lo = div255_epi16_sse2(_mm_mullo_epi16(d_lo, _mm_sub_epi16(all_ones, broadcast_alpha_epi16_sse2(s_lo))));
+        d_hi = div255_epi16_sse2(_mm_mullo_epi16(d_hi, _mm_sub_epi16(all_ones, broadcast_alpha_epi16_sse2(s_hi))));
+
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_add_epi8(s, _mm_packus_epi16(d_lo, d_hi)));
+    }
+
+    blend_argb8888_scalar(dst + i, src + i, n - i);
+}
+
+static const struct pixfmt_conversion_kernels simd_kernels = {
+    .name = "SSE2",
+    .argb8888_to_rgb565 = argb8888_to_rgb565_sse2,
+    .rgb565_to_argb8888 = rgb565_to_argb8888_sse2,
+    .bswap32 = bswap32_sse2,
+    .rgba8888_to_argb8888 = rgba8888_to_argb8888_sse2,
+    .argb8888_to_rgba8888 = argb8888_to_rgba8888_sse2,
+    .or_mask = or_mask_sse2,
+    .premultiply_argb8888 = premultiply_argb8888_sse2,
+    // A division per pixel doesn't vectorize well and this is rarely used.
+    .unpremultiply_argb8888 = unpremultiply_argb8888_scalar,
+    .blend_argb8888 = blend_argb8888_sse2,
+};
+
+static bool cpu_supports_simd_kernels(void) {
+    // __SSE2__ is only defined if the compiler is allowed to assume SSE2 anyway.
+    return true;
+}
+
+#endif  // HAVE_SSE2_KERNELS
+
+static _Atomic(const struct pixfmt_conversion_kernels *) active_kernels = NULL;
+
+const struct pixfmt_conversion_kernels *pixfmt_conversion_get_scalar_kernels(void) {
+    return &scalar_kernels;
+}
+
+const struct pixfmt_conversion_kernels *pixfmt_conversion_get_simd_kernels(void) {
+#if defined(HAVE_NEON_KERNELS) || defined(HAVE_SSE2_KERNELS)
+    if (cpu_supports_simd_kernels()) {
+        return &simd_kernels;
+    }
+#endif
+
+    return NULL;
+}
+
+const struct pixfmt_conversion_kernels *pixfmt_conversion_get_kernels(void) {
+    const struct pixfmt_conversion_kernels *kernels;
+
+    kernels = atomic_load_explicit(&active_kernels, memory_order_acquire);
+    if (kernels == NULL) {
+        kernels = pixfmt_conversion_get_simd_kernels();
+        if (kernels == NULL) {
+            kernels = &scalar_kernels;
+        }
+
+        LOG_DEBUG("Using %s pixel format conversion kernels.\n", kernels->name);
+
+        // If another thread was faster, it selected the same kernels anyway.
+        atomic_store_explicit(&active_kernels, kernels, memory_order_release);
+    }
+
+    return kernels;
+}
+
+void pixfmt_conversion_set_kernels(const struct pixfmt_conversion_kernels *kernels) {
+    atomic_store_explicit(&active_kernels, kernels, memory_order_release);
+}
+
+/**
+ * @brief Converts directly between two formats using a single kernel, if there's one for that pair.
+ *
+ * @returns true if the pixels were converted, false if there's no direct path.
+ */
+static bool convert_row_direct(
+    const struct pixfmt_conversion_kernels *k,
+    void *restrict dst,
+    enum pixfmt dst_format,
+    const void *restrict src,
+    enum pixfmt src_format,
+    int n
+) {
+    const struct pixfmt_info *dst_info, *src_info;
+    enum pixfmt dst_opaque, src_opaque;
+    bool fill_alpha;
+
+    dst_info = get_pixfmt_info(dst_format);
+    src_info = get_pixfmt_info(src_format);
+
+    // True if the source has no alpha, but the destination has, so we need to make it opaque.
+    fill_alpha = src_info->is_opaque && !dst_info->is_opaque;
+
+    // Compare the channel layouts, disregarding alpha.
+    dst_opaque = pixfmt_opaque(dst_format);
+    src_opaque = pixfmt_opaque(src_format);
+
+    if (dst_opaque == src_opaque && !fill_alpha) {
+        memcpy(dst, src, (size_t) n * src_info->bits_per_pixel / 8);
+        return true;
+    }
+
+    if (dst_info->bits_per_pixel == 32 && src_info->bits_per_pixel == 32) {
+        if (dst_opaque == src_opaque) {
+            k->or_mask(dst, src, alpha_mask(dst_format), n);
+            return true;
+        } else if ((src_opaque == PIXFMT_XRGB8888 && dst_opaque == PIXFMT_BGRX8888) ||
+                   (src_opaque == PIXFMT_BGRX8888 && dst_opaque == PIXFMT_XRGB8888)) {
+            k->bswap32(dst, src, n);
+        } else if (src_opaque == PIXFMT_RGBX8888 && dst_opaque == PIXFMT_XRGB8888) {
+            k->rgba8888_to_argb8888(dst, src, n);
+        } else if (src_opaque == PIXFMT_XRGB8888 && dst_opaque == PIXFMT_RGBX8888) {
+            k->argb8888_to_rgba8888(dst, src, n);
+        } else {
+            return false;
+        }
+
+        if (fill_alpha) {
+            k->or_mask(dst, dst, alpha_mask(dst_format), n);
+        }
+        return true;
+    }
+
+    if (src_opaque == PIXFMT_XRGB8888 && dst_format == PIXFMT_RGB565) {
+        k->argb8888_to_rgb565(dst, src, n);
+        return true;
+    } else if (src_format == PIXFMT_RGB565 && dst_opaque == PIXFMT_XRGB8888) {
+        k->rgb565_to_argb8888(dst, src, n);
+        return true;
+    }
+
+    return false;
+}
+
+static uint32_t expand_to_8bit(uint32_t value, uint32_t length) {
+    if (length >= 8) {
+        return value >> (length - 8);
+    }
+
+    // Scale so the max. value maps to 0xFF.
+    return (value * 255 + ((1u << length) - 1) / 2) / ((1u << length) - 1);
+}
+
+static void unpack_row_generic(uint32_t *restrict dst, const void *restrict src, enum pixfmt format, int n) {
+    const struct channel_layout *l = channel_layouts + format;
+
+    for (int i = 0; i < n; i++) {
+        uint32_t p, r, g, b, a;
+
+        if (l->bits_per_pixel == 16) {
+            p = ((const uint16_t *) src)[i];
+        } else {
+            p = ((const uint32_t *) src)[i];
+        }
+
+        r = expand_to_8bit((p >> l->r_offset) & ((1u << l->r_length) - 1), l->r_length);
+        g = expand_to_8bit((p >> l->g_offset) & ((1u << l->g_length) - 1), l->g_length);
+        b = expand_to_8bit((p >> l->b_offset) & ((1u << l->b_length) - 1), l->b_length);
+        if (l->a_length != 0) {
+            a = expand_to_8bit((p >> l->a_offset) & ((1u << l->a_length) - 1), l->a_length);
+        } else {
+            a = 0xFF;
+        }
+
+        dst[i] = a << 24 | r << 16 | g << 8 | b;
+    }
+}
+
+static void pack_row_generic(void *restrict dst, const uint32_t *restrict src, enum pixfmt format, int n) {
+    const struct channel_layout *l = channel_layouts + format;
+
+    for (int i = 0; i < n; i++) {
+        uint32_t s = src[i], p = 0;
+
+        p |= (((s >> 16) & 0xFF) >> (8 - l->r_length)) << l->r_offset;
+        p |= (((s >> 8) & 0xFF) >> (8 - l->g_length)) << l->g_offset;
+        p |= ((s & 0xFF) >> (8 - l->b_length)) << l->b_offset;
+        if (l->a_length != 0) {
+            p |= ((s >> 24) >> (8 - l->a_length)) << l->a_offset;
+        }
+
+        if (l->bits_per_pixel == 16) {
+            ((uint16_t *) dst)[i] = (uint16_t) p;
+        } else {
+            ((uint32_t *) dst)[i] = p;
+        }
+    }
+}
+
+static void convert_row(
+    const struct pixfmt_conversion_kernels *k,
+    void *restrict dst,
+    enum pixfmt dst_format,
+    const void *restrict src,
+    enum pixfmt src_format,
+    int n
+) {
+    uint32_t argb[CHUNK_SIZE];
+    int dst_bytes_per_pixel, src_bytes_per_pixel;
+
+    if (convert_row_direct(k, dst, dst_format, src, src_format, n)) {
+        return;
+    }
+
+    dst_bytes_per_pixel = get_pixfmt_info(dst_format)->bits_per_pixel / 8;
+    src_bytes_per_pixel = get_pixfmt_info(src_format)->bits_per_pixel / 8;
+
+    // Go via an intermediate ARGB8888 buffer.
+    for (int i = 0; i < n; i += CHUNK_SIZE) {
+        const uint8_t *s = (const uint8_t *) src + (size_t) i * src_bytes_per_pixel;
+        uint8_t *d = (uint8_t *) dst + (size_t) i * dst_bytes_per_pixel;
+        int m = MIN2(CHUNK_SIZE, n - i);
+
+        if (!convert_row_direct(k, argb, PIXFMT_ARGB8888, s, src_format, m)) {
+            unpack_row_generic(argb, s, src_format, m);
+        }
+
+        if (!convert_row_direct(k, d, dst_format, argb, PIXFMT_ARGB8888, m)) {
+            pack_row_generic(d, argb, dst_format, m);
+        }
+    }
+}
+
+void pixfmt_convert_row(void *restrict dst, enum pixfmt dst_format, const void *restrict src, enum pixfmt src_format, int n) {
+    ASSERT_NOT_NULL(dst);
+    ASSERT_NOT_NULL(src);
+    ASSERT_PIXFMT_VALID(dst_format);
+    ASSERT_PIXFMT_VALID(src_format);
+
+    if (n <= 0) {
+        return;
+    }
+
+    convert_row(pixfmt_conversion_get_kernels(), dst, dst_format, src, src_format, n);
+}
+
+void pixfmt_premultiply_row(uint32_t *restrict dst, const uint32_t *restrict src, int n) {
+    ASSERT_NOT_NULL(dst);
+    ASSERT_NOT_NULL(src);
+    pixfmt_conversion_get_kernels()->premultiply_argb8888(dst, src, n);
+}
+
+void pixfmt_unpremultiply_row(uint32_t *restrict dst, const uint32_t *restrict src, int n) {
+    ASSERT_NOT_NULL(dst);
+    ASSERT_NOT_NULL(src);
+    pixfmt_conversion_get_kernels()->unpremultiply_argb8888(dst, src, n);
+}
+
+void pixfmt_blend_row(uint32_t *restrict dst, const uint32_t *restrict src, int n) {
+    ASSERT_NOT_NULL(dst);
+    ASSERT_NOT_NULL(src);
+    pixfmt_conversion_get_kernels()->blend_argb8888(dst, src, n);
+}
+
+/**
+ * @brief Get the source image coordinates of the destination pixel at @param x, @param y.
+ */
+static void get_source_coords(enum pixfmt_transform transform, int src_width, int src_height, int x, int y, int *src_x_out, int *src_y_out) {
+    int dst_width, dst_height;
+
+    if ((transform & PIXFMT_TRANSFORM_ROTATION_MASK) == PIXFMT_TRANSFORM_ROTATE_90 ||
+        (transform & PIXFMT_TRANSFORM_ROTATION_MASK) == PIXFMT_TRANSFORM_ROTATE_270) {
+        dst_width = src_height;
+        dst_height = src_width;
+    } else {
+        dst_width = src_width;
+        dst_height = src_height;
+    }
+
+    // The flips are applied after rotating, so un-flip first.
+    if (transform & PIXFMT_TRANSFORM_FLIP_X) {
+        x = dst_width - 1 - x;
+    }
+    if (transform & PIXFMT_TRANSFORM_FLIP_Y) {
+        y = dst_height - 1 - y;
+    }
+
+    switch (transform & PIXFMT_TRANSFORM_ROTATION_MASK) {
+        case PIXFMT_TRANSFORM_ROTATE_0:
+            *src_x_out = x;
+            *src_y_out = y;
+            break;
+        case PIXFMT_TRANSFORM_ROTATE_90:
+            *src_x_out = y;
+            *src_y_out = src_height - 1 - x;
+            break;
+        case PIXFMT_TRANSFORM_ROTATE_180:
+            *src_x_out = src_width - 1 - x;
+            *src_y_out = src_height - 1 - y;
+            break;
+        case PIXFMT_TRANSFORM_ROTATE_270:
+            *src_x_out = src_width - 1 - y;
+            *src_y_out = x;
+            break;
+        default: UNREACHABLE();
+    }
+}
+
+static ptrdiff_t get_source_offset(enum pixfmt_transform transform, int src_width, int src_height, int src_pitch, int bytes_per_pixel, int x, int y) {
+    int src_x, src_y;
+
+    get_source_coords(transform, src_width, src_height, x, y, &src_x, &src_y);
+    return (ptrdiff_t) src_y * src_pitch + (ptrdiff_t) src_x * bytes_per_pixel;
+}
+
+static void gather_row(void *restrict dst, const uint8_t *restrict src, ptrdiff_t step, int bytes_per_pixel, int n) {
+    if (bytes_per_pixel == 4) {
+        uint32_t *d = dst;
+        for (int i = 0; i < n; i++) {
+            memcpy(d + i, src + i * step, sizeof(uint32_t));
+        }
+    } else {
+        ASSUME(bytes_per_pixel == 2);
+
+        uint16_t *d = dst;
+        for (int i = 0; i < n; i++) {
+            memcpy(d + i, src + i * step, sizeof(uint16_t));
+        }
+    }
+}
+
+void pixfmt_convert_image(
+    void *restrict dst,
+    enum pixfmt dst_format,
+    int dst_pitch,
+    const void *restrict src,
+    enum pixfmt src_format,
+    int src_pitch,
+    int src_width,
+    int src_height,
+    enum pixfmt_transform transform
+) {
+    const struct pixfmt_conversion_kernels *k;
+    ptrdiff_t origin, step_x, step_y;
+    int dst_width, dst_height, src_bpp, dst_bpp;
+
+    ASSERT_NOT_NULL(dst);
+    ASSERT_NOT_NULL(src);
+    ASSERT_PIXFMT_VALID(dst_format);
+    ASSERT_PIXFMT_VALID(src_format);
+
+    if (src_width <= 0 || src_height <= 0) {
+        return;
+    }
+
+    k = pixfmt_conversion_get_kernels();
+    src_bpp = get_pixfmt_info(src_format)->bits_per_pixel / 8;
+    dst_bpp = get_pixfmt_info(dst_format)->bits_per_pixel / 8;
+
+    if ((transform & PIXFMT_TRANSFORM_ROTATION_MASK) == PIXFMT_TRANSFORM_ROTATE_90 ||
+        (transform & PIXFMT_TRANSFORM_ROTATION_MASK) == PIXFMT_TRANSFORM_ROTATE_270) {
+        dst_width = src_height;
+        dst_height = src_width;
+    } else {
+        dst_width = src_width;
+        dst_height = src_height;
+    }
+
+    // The mapping from destination to source coordinates is affine,
+    // so we just need the source address of pixel (0, 0) and the steps in x and y.
+    origin = get_source_offset(transform, src_width, src_height, src_pitch, src_bpp, 0, 0);
+    step_x = get_source_offset(transform, src_width, src_height, src_pitch, src_bpp, 1, 0) - origin;
+    step_y = get_source_offset(transform, src_width, src_height, src_pitch, src_bpp, 0, 1) - origin;
+
+    if (step_x == src_bpp) {
+        // Destination rows map to source rows, just convert row-by-row.
+        for (int y = 0; y < dst_height; y++) {
+            convert_row(
+                k,
+                (uint8_t *) dst + (ptrdiff_t) y * dst_pitch,
+                dst_format,
+                (const uint8_t *) src + origin + y * step_y,
+                src_format,
+                dst_width
+            );
+        }
+        return;
+    }
+
+    // Destination rows are source columns (or reversed source rows).
+    // Walk the destination in tiles, so the source cache lines we touch for one
+    // destination row are still in cache for the next one.
+    for (int tile_y = 0; tile_y < dst_height; tile_y += TILE_SIZE) {
+        for (int tile_x = 0; tile_x < dst_width; tile_x += TILE_SIZE) {
+            int tile_width = MIN2(TILE_SIZE, dst_width - tile_x);
+            int tile_height = MIN2(TILE_SIZE, dst_height - tile_y);
+
+            for (int y = tile_y; y < tile_y + tile_height; y++) {
+                uint32_t gathered[TILE_SIZE];
+
+                gather_row(gathered, (const uint8_t *) src + origin + y * step_y + tile_x * step_x, step_x, src_bpp, tile_width);
+
+                convert_row(
+                    k,
+                    (uint8_t *) dst + (ptrdiff_t) y * dst_pitch + (ptrdiff_t) tile_x * dst_bpp,
+                    dst_format,
+                    gathered,
+                    src_format,
+                    tile_width
+                );
+            }
+        }
+    }
+}
@@ -0,0 +1,179 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Pixel Format Conversion
+ *
+ * - converts rows / images of pixels between the formats listed in pixel_format.h
+ * - optionally rotates / flips images while converting
+ * - uses NEON / SSE2 accelerated kernels for the common RGB formats if the CPU
+ *   supports them, and portable scalar kernels otherwise
+ *
+ * Copyright (c) 2023, Hannes Winkler <hanneswinkler2000@web.de>
+ */
+
+#ifndef _FLUTTERPI_SRC_PIXEL_FORMAT_CONVERSION_H
+#define _FLUTTERPI_SRC_PIXEL_FORMAT_CONVERSION_H
+
+#include <stdint.h>
+
+#include "pixel_format.h"
+#include "util/collection.h"
+
+/**
+ * @brief A set of row conversion kernels.
+ *
+ * All kernels convert @param n pixels from @param src into @param dst.
+ * ARGB8888 here always means 0xAARRGGBB stored in a native-endian uint32_t,
+ * which equals DRM_FORMAT_ARGB8888 on little-endian machines.
+ *
+ * @ref pixfmt_convert_row, @ref pixfmt_convert_image and the blending functions
+ * all go through the kernel table returned by @ref pixfmt_conversion_get_kernels.
+ */
+struct pixfmt_conversion_kernels {
+    /**
+     * @brief A human-readable name for this kernel set, for example "NEON".
+     */
+    const char *name;
+
+    /**
+     * @brief ARGB8888 / XRGB8888 to RGB565, dropping the alpha channel.
+     */
+    void (*argb8888_to_rgb565)(uint16_t *restrict dst, const uint32_t *restrict src, int n);
+
+    /**
+     * @brief RGB565 to ARGB8888, with the alpha channel set to 0xFF.
+     *
+     * The color channels are expanded to 8 bits by bit replication, so 0x1F maps to 0xFF.
+     */
+    void (*rgb565_to_argb8888)(uint32_t *restrict dst, const uint16_t *restrict src, int n);
+
+    /**
+     * @brief Reverses the byte order of every pixel. (ARGB8888 <-> BGRA8888, XRGB8888 <-> BGRX8888)
+     */
+    void (*bswap32)(uint32_t *restrict dst, const uint32_t *restrict src, int n);
+
+    /**
+     * @brief RGBA8888 to ARGB8888. (rotates every pixel right by 8 bits)
+     */
+    void (*rgba8888_to_argb8888)(uint32_t *restrict dst, const uint32_t *restrict src, int n);
+
+    /**
+     * @brief ARGB8888 to RGBA8888. (rotates every pixel left by 8 bits)
+     */
+    void (*argb8888_to_rgba8888)(uint32_t *restrict dst, const uint32_t *restrict src, int n);
+
+    /**
+     * @brief ORs every pixel with @param mask. Used to make the X channel of XRGB-style formats opaque.
+     *
+     * Unlike the other kernels, @param dst and @param src may be the same buffer.
+     */
+    void (*or_mask)(uint32_t *dst, const uint32_t *src, uint32_t mask, int n);
+
+    /**
+     * @brief Converts straight alpha ARGB8888 to premultiplied alpha ARGB8888.
+     */
+    void (*premultiply_argb8888)(uint32_t *restrict dst, const uint32_t *restrict src, int n);
+
+    /**
+     * @brief Converts premultiplied alpha ARGB8888 to straight alpha ARGB8888.
+     */
+    void (*unpremultiply_argb8888)(uint32_t *restrict dst, const uint32_t *restrict src, int n);
+
+    /**
+     * @brief Blends @param src on top of @param dst (source-over). Both are premultiplied ARGB8888.
+     *
+     * @param src must contain valid premultiplied pixels (no color channel bigger than alpha),
+     * otherwise the result is undefined.
+     */
+    void (*blend_argb8888)(uint32_t *restrict dst, const uint32_t *restrict src, int n);
+};
+
+/**
+ * @brief The portable, scalar kernels. Always available.
+ */
+ATTR_CONST const struct pixfmt_conversion_kernels *pixfmt_conversion_get_scalar_kernels(void);
+
+/**
+ * @brief The SIMD (NEON or SSE2) accelerated kernels, or NULL if this build or
+ * the CPU we're running on doesn't support them.
+ */
+const struct pixfmt_conversion_kernels *pixfmt_conversion_get_simd_kernels(void);
+
+/**
+ * @brief The kernels that are currently used for all conversions.
+ *
+ * On first use, this selects the SIMD kernels if they are supported, and the scalar kernels otherwise.
+ */
+const struct pixfmt_conversion_kernels *pixfmt_conversion_get_kernels(void);
+
+/**
+ * @brief Overrides the kernels used for all conversions. Pass NULL to restore the default selection.
+ *
+ * Should only be called at startup (or in tests), before any conversions run.
+ */
+void pixfmt_conversion_set_kernels(const struct pixfmt_conversion_kernels *kernels);
+
+/**
+ * @brief Converts @param n pixels of format @param src_format into @param dst_format.
+ *
+ * Channels that @param dst_format has but @param src_format hasn't are filled with 0xFF (alpha).
+ * The alpha channel is copied as-is, no premultiplication is done. @param dst and @param src must not overlap.
+ */
+void pixfmt_convert_row(void *restrict dst, enum pixfmt dst_format, const void *restrict src, enum pixfmt src_format, int n);
+
+/**
+ * @brief Premultiplies / un-premultiplies the color channels of @param n ARGB8888 pixels with their alpha.
+ */
+void pixfmt_premultiply_row(uint32_t *restrict dst, const uint32_t *restrict src, int n);
+void pixfmt_unpremultiply_row(uint32_t *restrict dst, const uint32_t *restrict src, int n);
+
+/**
+ * @brief Blends @param n premultiplied ARGB8888 pixels of @param src on top of @param dst (source-over).
+ */
+void pixfmt_blend_row(uint32_t *restrict dst, const uint32_t *restrict src, int n);
+
+/**
+ * @brief A transformation to apply to an image while converting it.
+ *
+ * The rotation is clock-wise. The flips are applied after rotating.
+ */
+enum pixfmt_transform {
+    PIXFMT_TRANSFORM_ROTATE_0 = 0,
+    PIXFMT_TRANSFORM_ROTATE_90 = 1,
+    PIXFMT_TRANSFORM_ROTATE_180 = 2,
+    PIXFMT_TRANSFORM_ROTATE_270 = 3,
+    PIXFMT_TRANSFORM_ROTATION_MASK = 3,
+    PIXFMT_TRANSFORM_FLIP_X = 1 << 2,
+    PIXFMT_TRANSFORM_FLIP_Y = 1 << 3,
+};
+
+/**
+ * @brief Converts a @param src_width x @param src_height image into @param dst_format,
+ * transforming it by @param transform.
+ *
+ * If @param transform contains a 90 or 270 degree rotation, the destination image is
+ * @param src_height pixels wide and @param src_width pixels high. Otherwise it has the same size as the source.
+ * Rotated images are converted in small tiles so both the source and destination stay in cache.
+ *
+ * @param dst Pointer to the first pixel of the destination image.
+ * @param dst_format Pixel format of the destination image.
+ * @param dst_pitch Length of one row of the destination image, in bytes.
+ * @param src Pointer to the first pixel of the source image.
+ * @param src_format Pixel format of the source image.
+ * @param src_pitch Length of one row of the source image, in bytes.
+ * @param src_width Width of the source image, in pixels.
+ * @param src_height Height of the source image, in pixels.
+ * @param transform The transformation to apply.
+ */
+void pixfmt_convert_image(
+    void *restrict dst,
+    enum pixfmt dst_format,
+    int dst_pitch,
+    const void *restrict src,
+    enum pixfmt src_format,
+    int src_pitch,
+    int src_width,
+    int src_height,
+    enum pixfmt_transform transform
+);
+
+#endif  // _FLUTTERPI_SRC_PIXEL_FORMAT_CONVERSION_H
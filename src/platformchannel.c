@@ -1704,6 +1704,142 @@ struct std_value *stdmap_get_str(struct std_value *map, char *key) {
     return stdmap_get(map, &STDSTRING(key));
 }
 
+static uint32_t hash_map_key(const char *key, size_t length) {
+    // 32-bit FNV-1a. Keys are short, so this is good enough.
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t) key[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static int std_map_index_init_with_capacity(struct std_map_index *index, size_t n_entries) {
+    size_t n_buckets;
+
+    // keep the load factor at or below 0.5, so probe sequences stay short.
+    n_buckets = 8;
+    while (n_buckets < n_entries * 2) {
+        n_buckets *= 2;
+    }
+
+    if (n_buckets <= ARRAY_SIZE(index->inline_buckets)) {
+        index->buckets = index->inline_buckets;
+        memset(index->buckets, 0, n_buckets * sizeof *index->buckets);
+    } else {
+        index->buckets = calloc(n_buckets, sizeof *index->buckets);
+        if (index->buckets == NULL) {
+            return ENOMEM;
+        }
+    }
+
+    index->n_buckets = n_buckets;
+    return 0;
+}
+
+static void std_map_index_insert(struct std_map_index *index, const char *key, size_t length, const void *value) {
+    struct std_map_index_entry *entry;
+    uint32_t hash;
+    size_t mask;
+
+    hash = hash_map_key(key, length);
+    mask = index->n_buckets - 1;
+
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        entry = index->buckets + i;
+
+        if (entry->key == NULL) {
+            entry->hash = hash;
+            entry->length = length;
+            entry->key = key;
+            entry->value = value;
+            return;
+        } else if (entry->hash == hash && entry->length == length && memcmp(entry->key, key, length) == 0) {
+            // the first entry with this key wins.
+            return;
+        }
+    }
+}
+
+static const void *std_map_index_find(const struct std_map_index *index, const char *key) {
+    const struct std_map_index_entry *entry;
+    uint32_t hash;
+    size_t length, mask;
+
+    length = strlen(key);
+    hash = hash_map_key(key, length);
+    mask = index->n_buckets - 1;
+
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        entry = index->buckets + i;
+
+        if (entry->key == NULL) {
+            return NULL;
+        } else if (entry->hash == hash && entry->length == length && memcmp(entry->key, key, length) == 0) {
+            return entry->value;
+        }
+    }
+}
+
+int stdmap_index_init(struct std_map_index *index, struct std_value *map) {
+    int ok;
+
+    ASSERT_NOT_NULL(index);
+    ASSERT_NOT_NULL(map);
+    assert(STDVALUE_IS_MAP(*map));
+
+    ok = std_map_index_init_with_capacity(index, map->size);
+    if (ok != 0) {
+        return ok;
+    }
+
+    for (int i = 0; i < map->size; i++) {
+        if (STDVALUE_IS_STRING(map->keys[i])) {
+            std_map_index_insert(index, map->keys[i].string_value, strlen(map->keys[i].string_value), map->values + i);
+        }
+    }
+
+    return 0;
+}
+
+void std_map_index_deinit(struct std_map_index *index) {
+    ASSERT_NOT_NULL(index);
+
+    if (index->buckets != index->inline_buckets) {
+        free(index->buckets);
+    }
+}
+
+struct std_value *stdmap_index_get_str(const struct std_map_index *index, const char *key) {
+    ASSERT_NOT_NULL(index);
+    ASSERT_NOT_NULL(key);
+    return (struct std_value *) std_map_index_find(index, key);
+}
+
+int stdmap_extract(struct std_value *map, const struct std_map_field *fields, size_t n_fields, void *out) {
+    struct std_map_index index;
+    int ok;
+
+    ASSERT_NOT_NULL(map);
+    ASSERT_NOT_NULL(fields);
+    ASSERT_NOT_NULL(out);
+
+    ok = stdmap_index_init(&index, map);
+    if (ok != 0) {
+        return ok;
+    }
+
+    for (size_t i = 0; i < n_fields; i++) {
+        struct std_value *value = stdmap_index_get_str(&index, fields[i].key);
+        memcpy((uint8_t *) out + fields[i].offset, &value, sizeof value);
+    }
+
+    std_map_index_deinit(&index);
+    return 0;
+}
+
 /**
  * BEGIN Raw Standard Message Codec Value API.
  *
@@ -2219,6 +2355,55 @@ ATTR_PURE const struct raw_std_value *raw_std_map_find_str(const struct raw_std_
     return NULL;
 }
 
+int raw_std_map_index_init(struct std_map_index *index, const struct raw_std_value *map) {
+    int ok;
+
+    ASSERT_NOT_NULL(index);
+    ASSERT_NOT_NULL(map);
+    assert(raw_std_value_is_map(map));
+
+    ok = std_map_index_init_with_capacity(index, raw_std_map_get_size(map));
+    if (ok != 0) {
+        return ok;
+    }
+
+    for_each_entry_in_raw_std_map(key, value, map) {
+        if (raw_std_value_is_string(key)) {
+            std_map_index_insert(index, raw_std_string_get_nonzero_terminated(key), raw_std_string_get_length(key), value);
+        }
+    }
+
+    return 0;
+}
+
+const struct raw_std_value *raw_std_map_index_find_str(const struct std_map_index *index, const char *key) {
+    ASSERT_NOT_NULL(index);
+    ASSERT_NOT_NULL(key);
+    return std_map_index_find(index, key);
+}
+
+int raw_std_map_extract(const struct raw_std_value *map, const struct std_map_field *fields, size_t n_fields, void *out) {
+    struct std_map_index index;
+    int ok;
+
+    ASSERT_NOT_NULL(map);
+    ASSERT_NOT_NULL(fields);
+    ASSERT_NOT_NULL(out);
+
+    ok = raw_std_map_index_init(&index, map);
+    if (ok != 0) {
+        return ok;
+    }
+
+    for (size_t i = 0; i < n_fields; i++) {
+        const struct raw_std_value *value = raw_std_map_index_find_str(&index, fields[i].key);
+        memcpy((uint8_t *) out + fields[i].offset, &value, sizeof value);
+    }
+
+    std_map_index_deinit(&index);
+    return 0;
+}
+
 ATTR_PURE static bool check_size(const struct raw_std_value *value, size_t buffer_size) {
     size_t size;
 
@@ -16,6 +16,7 @@
 #define _FLUTTERPI_SRC_PLATFORMCHANNEL_H
 
 #include <errno.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include <flutter_embedder.h>
@@ -1566,6 +1567,63 @@ struct std_value *stdmap_get_str(struct std_value *map, char *key);
 
 struct raw_std_value;
 
+struct std_map_index_entry {
+    uint32_t hash;
+    uint32_t length;
+    const char *key;
+    const void *value;
+};
+
+/**
+ * @brief A hash index over the string keys of a std map (decoded or raw), for O(1) lookups.
+ *
+ * Building the index is a single pass over the map, and maps with up to 16 entries don't need any allocation.
+ * Entries with non-string keys are not indexed. If a key occurs multiple times, the first entry wins,
+ * same as for @ref stdmap_get_str and @ref raw_std_map_find_str.
+ *
+ * The index points into the map, so it's only valid as long as the map is.
+ */
+struct std_map_index {
+    size_t n_buckets;
+    struct std_map_index_entry *buckets;
+    struct std_map_index_entry inline_buckets[32];
+};
+
+/**
+ * @brief Describes one key to extract from a map using @ref stdmap_extract or @ref raw_std_map_extract.
+ *
+ * The value for @ref key is stored at byte offset @ref offset of the output struct.
+ */
+struct std_map_field {
+    const char *key;
+    size_t offset;
+};
+
+#define STD_MAP_FIELD(_struct_type, _member, _key) { .key = (_key), .offset = offsetof(_struct_type, _member) }
+
+int stdmap_index_init(struct std_map_index *index, struct std_value *map);
+
+int raw_std_map_index_init(struct std_map_index *index, const struct raw_std_value *map);
+
+void std_map_index_deinit(struct std_map_index *index);
+
+struct std_value *stdmap_index_get_str(const struct std_map_index *index, const char *key);
+
+const struct raw_std_value *raw_std_map_index_find_str(const struct std_map_index *index, const char *key);
+
+/**
+ * @brief Looks up all the keys in @param fields in @param map, and stores a pointer to the value
+ * (a `struct std_value *`, or NULL if the key wasn't found) for each one in @param out.
+ *
+ * @returns 0 on success, ENOMEM if the index couldn't be allocated.
+ */
+int stdmap_extract(struct std_value *map, const struct std_map_field *fields, size_t n_fields, void *out);
+
+/**
+ * @brief Same as @ref stdmap_extract, but for raw maps. The values are stored as `const struct raw_std_value *`.
+ */
+int raw_std_map_extract(const struct raw_std_value *map, const struct std_map_field *fields, size_t n_fields, void *out);
+
 ATTR_PURE enum std_value_type raw_std_value_get_type(const struct raw_std_value *value);
 ATTR_PURE bool raw_std_value_is_null(const struct raw_std_value *value);
 ATTR_PURE bool raw_std_value_is_true(const struct raw_std_value *value);
@@ -1628,9 +1686,9 @@ ATTR_PURE const struct raw_std_value *raw_std_method_call_get_arg(const struct r
     for (const struct raw_std_value *key = raw_std_map_get_first_key(map), *value = raw_std_value_after(key), *guard = NULL; \
          guard == NULL;                                                                                                      \
          guard = (void *) 1)                                                                                                 \
-        for (size_t index = 0; index < raw_std_map_get_size(map); index++,                                                   \
-                    key = (index) < raw_std_map_get_size(map) ? raw_std_value_after(value) : NULL,                           \
-                    value = (index) < raw_std_map_get_size(map) ? raw_std_value_after(key) : NULL)
+        for (size_t index = 0, CONCAT(index, _size) = raw_std_map_get_size(map); index < CONCAT(index, _size); index++,      \
+                    key = (index) < CONCAT(index, _size) ? raw_std_value_after(value) : NULL,                                \
+                    value = (index) < CONCAT(index, _size) ? raw_std_value_after(key) : NULL)
 
 #define for_each_entry_in_raw_std_map(key, value, map) \
     for_each_entry_in_raw_std_map_indexed(UNIQUE_NAME(__raw_std_map_entry_index), key, value, map)
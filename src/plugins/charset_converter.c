@@ -1,44 +1,188 @@
 #include "plugins/charset_converter.h"
 #include "flutter-pi.h"
 #include "pluginregistry.h"
+#include "thread_pool.h"
 #include "util/logging.h"
 #include <iconv.h>
 
-static bool convert(char *inbuf, char *outbuf, size_t len, const char *from, const char *to)
-{
-    iconv_t iconv_cd = iconv_open(to, from);
+/**
+ * @brief encode, decode and availableCharsets can take a while (the latter spawns processes),
+ * so they're run on the flutter-pi thread pool. The job owns copies of the arguments.
+ */
+struct conversion_job {
+    FlutterPlatformMessageResponseHandle *response_handle;
+    const char *from;
+    const char *to;
+    size_t input_size;
+    char *charset;
+    char input[];
+};
+
+/**
+ * @brief Converts @param len bytes of @param inbuf from charset @param from to charset @param to.
+ *
+ * On success, @param output_out is a newly allocated buffer (which the caller needs to free) with the
+ * @param output_size_out bytes of converted data.
+ *
+ * @returns 0 on success, ENOTSUP if iconv doesn't know one of the charsets, EILSEQ if the input is not
+ * valid in the source charset, or ENOMEM.
+ */
+static int convert(char *inbuf, size_t len, const char *from, const char *to, char **output_out, size_t *output_size_out) {
+    iconv_t iconv_cd;
+    size_t inlen, outlen, capacity, written, res;
+    char *output, *outbuf, *new_output;
+    bool flushing;
+    int ok;
+
+    iconv_cd = iconv_open(to, from);
     if (iconv_cd == (iconv_t) -1) {
         LOG_ERROR("Conversion from charset \"%s\" to charset \"%s\" is not supported. iconv_open: %s\n", from, to, strerror(errno));
-        return false;
+        return ENOTSUP;
     }
 
-    size_t inlen = len;
-    size_t outlen = len;
-    size_t res = 0;
+    // A character takes at most 4 bytes in (practically) all encodings. This is only an initial guess though,
+    // iconv might emit a BOM or shift sequences, so the buffer is grown if it's too small.
+    capacity = len * 4 + 16;
+    output = malloc(capacity);
+    if (output == NULL) {
+        ok = ENOMEM;
+        goto fail_close_cd;
+    }
 
-    while (inlen > 0 && outlen > 0) {
-        res = iconv(iconv_cd, &inbuf, &inlen, &outbuf, &outlen);
-        if (res == 0) {
-            break;
+    outbuf = output;
+    outlen = capacity;
+    inlen = len;
+    flushing = false;
+    while (true) {
+        if (flushing) {
+            // Write out the final shift sequence, if the target charset has one.
+            res = iconv(iconv_cd, NULL, NULL, &outbuf, &outlen);
+        } else {
+            res = iconv(iconv_cd, &inbuf, &inlen, &outbuf, &outlen);
         }
 
-        if (res == (size_t) (-1)) {
-            iconv_close(iconv_cd);
-            *outbuf = '\0';
+        if (res != (size_t) -1) {
+            if (flushing) {
+                break;
+            }
+
+            flushing = true;
+            continue;
+        }
 
-            return false;
+        if (errno == E2BIG) {
+            written = outbuf - output;
+
+            new_output = realloc(output, capacity * 2);
+            if (new_output == NULL) {
+                ok = ENOMEM;
+                goto fail_free_output;
+            }
+
+            outbuf = new_output + written;
+            outlen += capacity;
+            capacity *= 2;
+            output = new_output;
+        } else if (errno == EILSEQ || errno == EINVAL) {
+            LOG_ERROR("Input is not valid \"%s\". iconv: %s\n", from, strerror(errno));
+            ok = EILSEQ;
+            goto fail_free_output;
+        } else {
+            ok = errno;
+            LOG_ERROR("Couldn't convert from charset \"%s\" to charset \"%s\". iconv: %s\n", from, to, strerror(ok));
+            goto fail_free_output;
         }
     }
 
     iconv_close(iconv_cd);
-    *outbuf = '\0';
 
-    return true;
+    *output_out = output;
+    *output_size_out = capacity - outlen;
+    return 0;
+
+fail_free_output:
+    free(output);
+
+fail_close_cd:
+    iconv_close(iconv_cd);
+    return ok;
+}
+
+static void on_run_conversion(void *userdata) {
+    struct conversion_job *job;
+    size_t output_size;
+    char *output;
+    int ok;
+
+    job = userdata;
+    output = NULL;
+    output_size = 0;
+
+    ok = convert(job->input, job->input_size, job->from, job->to, &output, &output_size);
+    if (ok == ENOTSUP) {
+        platch_respond_error_std(job->response_handle, "error_id", "charset_name_unrecognized", NULL);
+        goto out_free_job;
+    } else if (ok == EILSEQ) {
+        platch_respond_error_std(job->response_handle, "error_id", "malformed_input", NULL);
+        goto out_free_job;
+    } else if (ok != 0) {
+        platch_respond_native_error_std(job->response_handle, ok);
+        goto out_free_job;
+    }
+
+    ok = platch_respond_success_std(
+        job->response_handle,
+        &(struct std_value) {
+            .type = kStdUInt8Array,
+            .size = output_size,
+            .uint8array = (uint8_t*) output,
+        }
+    );
+    if (ok != 0) {
+        LOG_ERROR("Couldn't respond to charset conversion. platch_respond_success_std: %s\n", strerror(ok));
+    }
+
+    free(output);
+
+out_free_job:
+    free(job->charset);
+    free(job);
+}
+
+static int submit_conversion(FlutterPlatformMessageResponseHandle *response_handle, const char *input, size_t input_size, const char *charset, bool encode) {
+    struct conversion_job *job;
+    int ok;
+
+    job = malloc(sizeof *job + input_size);
+    if (job == NULL) {
+        return platch_respond_native_error_std(response_handle, ENOMEM);
+    }
+
+    job->charset = strdup(charset);
+    if (job->charset == NULL) {
+        free(job);
+        return platch_respond_native_error_std(response_handle, ENOMEM);
+    }
+
+    job->response_handle = response_handle;
+    job->from = encode ? "UTF-8" : job->charset;
+    job->to = encode ? job->charset : "UTF-8";
+    job->input_size = input_size;
+    memcpy(job->input, input, input_size);
+
+    ok = thread_pool_submit(flutterpi_get_thread_pool(flutterpi), on_run_conversion, job);
+    if (ok != 0) {
+        free(job->charset);
+        free(job);
+        return platch_respond_native_error_std(response_handle, ok);
+    }
+
+    return 0;
 }
 
 static int on_encode(struct platch_obj *object, FlutterPlatformMessageResponseHandle *response_handle) {
     struct std_value *args, *tmp;
-    char *charset, *input, *output;
+    char *charset, *input;
 
     args = &object->std_arg;
 
@@ -59,31 +203,13 @@ static int on_encode(struct platch_obj *object, FlutterPlatformMessageResponseHa
     }
 
     input = STDVALUE_AS_STRING(*tmp);
-    output = malloc(strlen(input) + 1);
 
-    bool res = convert(input, output, strlen(input) + 1, "UTF-8", charset);
-    if(!res) {
-        free(output);
-        return platch_respond_error_std(response_handle, "error_id", "charset_name_unrecognized", NULL);
-    }
-
-    int ok = platch_respond_success_std(
-        response_handle,
-        &(struct std_value) {
-            .type = kStdUInt8Array,
-            .size = strlen(output),
-            .uint8array = (uint8_t*) output,
-        }
-    );
-
-    free(output);
-
-    return ok;
+    return submit_conversion(response_handle, input, strlen(input), charset, true);
 }
 
 static int on_decode(struct platch_obj *object, FlutterPlatformMessageResponseHandle *response_handle) {
     struct std_value *args, *tmp;
-    char *charset, *output;
+    char *charset;
     const uint8_t *input;
 
     args = &object->std_arg;
@@ -105,39 +231,28 @@ static int on_decode(struct platch_obj *object, FlutterPlatformMessageResponseHa
     }
 
     input = tmp->uint8array;
-    output = malloc(strlen((char*) input) + 1);
-
-    bool res = convert((char*) input, output, strlen((char*) input) + 1, "UTF-8", charset);
-    if(!res) {
-        free(output);
-        return platch_respond_error_std(response_handle, "error_id", "charset_name_unrecognized", NULL);
-    }
 
-    int ok = platch_respond_success_std(
-        response_handle,
-        &(struct std_value) {
-            .type = kStdUInt8Array,
-            .size = strlen(output),
-            .uint8array = (uint8_t*) output,
-        }
-    );
-
-    free(output);
-
-    return ok;
+    // The data is not zero-terminated, so use the size of the list here.
+    return submit_conversion(response_handle, (const char *) input, tmp->size, charset, false);
 }
 
-static int on_available_charsets(struct platch_obj *object, FlutterPlatformMessageResponseHandle *response_handle) {
-    (void) object;
-
+static void on_run_available_charsets(void *userdata) {
+    FlutterPlatformMessageResponseHandle *response_handle;
     char* output;
     size_t length, count;
     FILE *fp;
+    int ok;
+
+    response_handle = userdata;
+    output = NULL;
+    length = 0;
+    count = 0;
 
     // Count the available charsets
     fp = popen("iconv --list | wc -w", "r");
     if(!fp) {
-        return platch_respond_error_std(response_handle, "error_id", "charsets_not_available", NULL);
+        platch_respond_error_std(response_handle, "error_id", "charsets_not_available", NULL);
+        return;
     }
 
     while (getline(&output, &length, fp) >= 0) {
@@ -148,16 +263,24 @@ static int on_available_charsets(struct platch_obj *object, FlutterPlatformMessa
 
     fp = popen("iconv --list", "r");
     if(!fp) {
-        return platch_respond_error_std(response_handle, "error_id", "charsets_not_available", NULL);
+        free(output);
+        platch_respond_error_std(response_handle, "error_id", "charsets_not_available", NULL);
+        return;
     }
 
     struct std_value values;
 
     values.type = kStdList;
-    values.size = count;
-    values.list = alloca(sizeof(struct std_value) * count);
+    values.size = 0;
+    values.list = calloc(count ? count : 1, sizeof(struct std_value));
+    if (values.list == NULL) {
+        pclose(fp);
+        free(output);
+        platch_respond_native_error_std(response_handle, ENOMEM);
+        return;
+    }
 
-    for (int index = 0; index < count; index++) {
+    for (size_t index = 0; index < count; index++) {
         if(getline(&output, &length, fp) < 0) {
             break;
         }
@@ -166,11 +289,38 @@ static int on_available_charsets(struct platch_obj *object, FlutterPlatformMessa
 
         values.list[index].type = kStdString;
         values.list[index].string_value = strdup(output);
+        if (values.list[index].string_value == NULL) {
+            break;
+        }
+
+        values.size++;
     }
 
     pclose(fp);
+    free(output);
+
+    ok = platch_respond_success_std(response_handle, &values);
+    if (ok != 0) {
+        LOG_ERROR("Couldn't respond with the available charsets. platch_respond_success_std: %s\n", strerror(ok));
+    }
+
+    for (size_t index = 0; index < values.size; index++) {
+        free(values.list[index].string_value);
+    }
+    free(values.list);
+}
+
+static int on_available_charsets(struct platch_obj *object, FlutterPlatformMessageResponseHandle *response_handle) {
+    (void) object;
+
+    int ok;
+
+    ok = thread_pool_submit(flutterpi_get_thread_pool(flutterpi), on_run_available_charsets, response_handle);
+    if (ok != 0) {
+        return platch_respond_native_error_std(response_handle, ok);
+    }
 
-    return platch_respond_success_std(response_handle, &values);
+    return 0;
 }
 
 static int on_check(struct platch_obj *object, FlutterPlatformMessageResponseHandle *response_handle) {
@@ -0,0 +1,108 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Display color plugin - lets apps set the gamma LUT and color transformation matrix
+ * that the display hardware applies to everything flutter-pi shows.
+ *
+ * Method channel "flutter-pi/display_color", standard method codec:
+ *
+ * - setColorTransform({"gammaLut": Float64List?, "ctm": Float64List?})
+ *     gammaLut: red, green, blue triplets between 0.0 and 1.0, at least 2 of them.
+ *               Resampled to the size supported by the hardware. null resets it.
+ *     ctm: a 3x3 matrix in row-major order that's applied to the (linear) RGB values
+ *          before the gamma LUT. null resets it.
+ *
+ *   Fails with the "unsupported" error code if the display doesn't support (one of) them.
+ *
+ * Copyright (c) 2023, Hannes Winkler <hanneswinkler2000@web.de>
+ */
+
+#include "plugins/display_color.h"
+
+#include <errno.h>
+
+#include "flutter-pi.h"
+#include "pluginregistry.h"
+#include "util/logging.h"
+
+static int on_set_color_transform(struct platch_obj *object, FlutterPlatformMessageResponseHandle *response_handle) {
+    struct std_value *arg, *gamma_lut, *ctm;
+    int ok;
+
+    arg = &object->std_arg;
+    if (!STDVALUE_IS_MAP(*arg)) {
+        return platch_respond_illegal_arg_std(response_handle, "Expected `arg` to be a map.");
+    }
+
+    gamma_lut = stdmap_get_str(arg, "gammaLut");
+    if (gamma_lut != NULL && STDVALUE_IS_NULL(*gamma_lut)) {
+        gamma_lut = NULL;
+    }
+
+    if (gamma_lut != NULL && (!STDVALUE_IS_FLOAT_ARRAY(*gamma_lut) || gamma_lut->size % 3 != 0 || gamma_lut->size < 6)) {
+        return platch_respond_illegal_arg_std(
+            response_handle,
+            "Expected `arg['gammaLut']` to be null or a Float64List of at least 2 red, green, blue triplets."
+        );
+    }
+
+    ctm = stdmap_get_str(arg, "ctm");
+    if (ctm != NULL && STDVALUE_IS_NULL(*ctm)) {
+        ctm = NULL;
+    }
+
+    if (ctm != NULL && (!STDVALUE_IS_FLOAT_ARRAY(*ctm) || ctm->size != 9)) {
+        return platch_respond_illegal_arg_std(response_handle, "Expected `arg['ctm']` to be null or a Float64List with 9 elements.");
+    }
+
+    ok = flutterpi_set_color_transform(
+        flutterpi,
+        gamma_lut != NULL ? gamma_lut->float64array : NULL,
+        gamma_lut != NULL ? gamma_lut->size / 3 : 0,
+        ctm != NULL ? ctm->float64array : NULL
+    );
+    if (ok == EOPNOTSUPP) {
+        return platch_respond_error_std(
+            response_handle,
+            "unsupported",
+            "The display doesn't support setting a gamma LUT or color transformation matrix.",
+            NULL
+        );
+    } else if (ok != 0) {
+        return platch_respond_native_error_std(response_handle, ok);
+    }
+
+    return platch_respond_success_std(response_handle, NULL);
+}
+
+static int on_receive(char *channel, struct platch_obj *object, FlutterPlatformMessageResponseHandle *response_handle) {
+    (void) channel;
+
+    if (streq(object->method, "setColorTransform")) {
+        return on_set_color_transform(object, response_handle);
+    }
+
+    return platch_respond_not_implemented(response_handle);
+}
+
+enum plugin_init_result display_color_init(struct flutterpi *flutterpi, void **userdata_out) {
+    int ok;
+
+    (void) flutterpi;
+
+    ok = plugin_registry_set_receiver_locked(DISPLAY_COLOR_CHANNEL, kStandardMethodCall, on_receive);
+    if (ok != 0) {
+        return PLUGIN_INIT_RESULT_ERROR;
+    }
+
+    *userdata_out = NULL;
+
+    return PLUGIN_INIT_RESULT_INITIALIZED;
+}
+
+void display_color_deinit(struct flutterpi *flutterpi, void *userdata) {
+    (void) userdata;
+
+    plugin_registry_remove_receiver_v2_locked(flutterpi_get_plugin_registry(flutterpi), DISPLAY_COLOR_CHANNEL);
+}
+
+FLUTTERPI_PLUGIN("display color", display_color, display_color_init, display_color_deinit)
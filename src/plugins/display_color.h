@@ -0,0 +1,6 @@
+#ifndef _DISPLAY_COLOR_PLUGIN_H
+#define _DISPLAY_COLOR_PLUGIN_H
+
+#define DISPLAY_COLOR_CHANNEL "flutter-pi/display_color"
+
+#endif
@@ -2,6 +2,7 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -641,6 +642,8 @@ struct rawkb {
     void *userdata;
 };
 
+static bool barcode_scanner_has_listener = false;
+
 int rawkb_send_android_keyevent(
     uint32_t flags,
     uint32_t code_point,
@@ -726,39 +729,34 @@ int rawkb_send_android_keyevent(
 int rawkb_send_gtk_keyevent(uint32_t unicode_scalar_values, uint32_t key_code, uint32_t scan_code, uint32_t modifiers, bool is_down) {
     /**
      * keymap: linux
-     * toolkit: glfw
+     * toolkit: gtk
      * unicodeScalarValues: code_point
      * keyCode: key_code
      * scanCode: scan_code
      * modifiers: mods
      * type: is_down? "keydown" : "keyup"
+     *
+     * The message always has the same shape, so instead of building a json_value
+     * and running it through the JSON encoder (which allocates), we just fill in
+     * the numbers of a pre-encoded template on the stack.
      */
-
-    // clang-format off
-    return platch_send(
-        KEY_EVENT_CHANNEL,
-        &(struct platch_obj){
-            .codec = kJSONMessageCodec,
-            .json_value = {
-                .type = kJsonObject,
-                .size = 7,
-                .keys = (char *[7]){ "keymap", "toolkit", "unicodeScalarValues", "keyCode", "scanCode", "modifiers", "type", },
-                .values = (struct json_value[7]){
-                    /* keymap */ { .type = kJsonString, .string_value = "linux" },
-                    /* toolkit */ { .type = kJsonString, .string_value = "gtk" },
-                    /* unicodeScalarValues */ { .type = kJsonNumber, .number_value = unicode_scalar_values },
-                    /* keyCode */ { .type = kJsonNumber, .number_value = key_code },
-                    /* scanCode */ { .type = kJsonNumber, .number_value = scan_code },
-                    /* modifiers */ { .type = kJsonNumber, .number_value = modifiers },
-                    /* type */ { .type = kJsonString, .string_value = is_down ? "keydown" : "keyup", },
-                },
-            },
-        },
-        kJSONMessageCodec,
-        NULL,
-        NULL
+    char message[160];
+    int length;
+
+    length = snprintf(
+        message,
+        sizeof message,
+        "{\"keymap\":\"linux\",\"toolkit\":\"gtk\",\"unicodeScalarValues\":%" PRIu32 ",\"keyCode\":%" PRIu32 ",\"scanCode\":%" PRIu32
+        ",\"modifiers\":%" PRIu32 ",\"type\":\"%s\"}",
+        unicode_scalar_values,
+        key_code,
+        scan_code,
+        modifiers,
+        is_down ? "keydown" : "keyup"
     );
-    // clang-format on
+    ASSERT_MSG(length > 0 && (size_t) length < sizeof message, "GTK keyevent message template buffer too small.");
+
+    return flutterpi_send_platform_message(flutterpi, KEY_EVENT_CHANNEL, (const uint8_t *) message, length, NULL);
 }
 
 int rawkb_send_flutter_keyevent(
@@ -813,12 +811,15 @@ int rawkb_on_key_event(
         type = kFlutterKeyEventTypeUp;
     }
 
-    ok = rawkb_send_flutter_keyevent(rawkb, (double) timestamp_us, type, physical, logical, text, false);
-    if (ok != 0) {
-        return ok;
+    (void) plain_codepoint;
+    (void) modifiers;
+
+    // flutter expects key up events to not have a character.
+    if (type == kFlutterKeyEventTypeUp || (text != NULL && text[0] == '\0')) {
+        text = NULL;
     }
 
-    ok = rawkb_send_gtk_keyevent(plain_codepoint, xkb_keysym, xkb_keycode, modifiers.u32, is_down);
+    ok = rawkb_send_flutter_keyevent(rawkb, (double) timestamp_us, type, physical, logical, text, false);
     if (ok != 0) {
         return ok;
     }
@@ -826,6 +827,56 @@ int rawkb_on_key_event(
     return 0;
 }
 
+struct rawkb *rawkb_new(const struct key_event_interface *interface, void *userdata) {
+    struct rawkb *rawkb;
+
+    ASSERT_NOT_NULL(interface);
+    ASSERT_NOT_NULL(interface->send_key_event);
+
+    rawkb = malloc(sizeof *rawkb);
+    if (rawkb == NULL) {
+        return NULL;
+    }
+
+    rawkb->interface = *interface;
+    rawkb->userdata = userdata;
+    return rawkb;
+}
+
+void rawkb_destroy(struct rawkb *rawkb) {
+    free(rawkb);
+}
+
+int rawkb_send_barcode_scan(const char *device_name, const char *text) {
+    if (!barcode_scanner_has_listener) {
+        return 0;
+    }
+
+    // clang-format off
+    return platch_send_success_event_std(
+        BARCODE_SCANNER_CHANNEL,
+        &STDMAP2(
+            STDSTRING("device"), STDSTRING((char *) device_name),
+            STDSTRING("data"), STDSTRING((char *) text)
+        )
+    );
+    // clang-format on
+}
+
+static int on_receive_barcode_scanner(char *channel, struct platch_obj *object, FlutterPlatformMessageResponseHandle *responsehandle) {
+    (void) channel;
+
+    if (streq(object->method, "listen")) {
+        barcode_scanner_has_listener = true;
+        return platch_respond_success_std(responsehandle, NULL);
+    } else if (streq(object->method, "cancel")) {
+        barcode_scanner_has_listener = false;
+        return platch_respond_success_std(responsehandle, NULL);
+    }
+
+    return platch_respond_not_implemented(responsehandle);
+}
+
 static void assert_key_modifiers_work() {
     key_modifiers_t mods;
     memset(&mods, 0, sizeof(mods));
@@ -902,17 +953,28 @@ static void assert_key_modifiers_work() {
 }
 
 enum plugin_init_result rawkb_init(struct flutterpi *flutterpi, void **userdata_out) {
+    int ok;
+
     (void) flutterpi;
     (void) userdata_out;
 
     assert_key_modifiers_work();
 
+    barcode_scanner_has_listener = false;
+
+    ok = plugin_registry_set_receiver_locked(BARCODE_SCANNER_CHANNEL, kStandardMethodCall, on_receive_barcode_scanner);
+    if (ok != 0) {
+        return PLUGIN_INIT_RESULT_ERROR;
+    }
+
     return PLUGIN_INIT_RESULT_INITIALIZED;
 }
 
 void rawkb_deinit(struct flutterpi *flutterpi, void *userdata) {
     (void) flutterpi;
     (void) userdata;
+
+    plugin_registry_remove_receiver_locked(BARCODE_SCANNER_CHANNEL);
 }
 
 FLUTTERPI_PLUGIN("raw keyboard plugin", rawkb, rawkb_init, rawkb_deinit)
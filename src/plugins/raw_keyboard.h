@@ -31,6 +31,11 @@ struct rawkb;
 
 #define KEY_EVENT_CHANNEL "flutter/keyevent"
 
+/**
+ * @brief Event channel for barcode scans. Each event is a map `{"device": String, "data": String}`.
+ */
+#define BARCODE_SCANNER_CHANNEL "flutter-pi/barcode_scanner"
+
 int rawkb_send_android_keyevent(
     uint32_t flags,
     uint32_t code_point,
@@ -47,8 +52,31 @@ int rawkb_send_android_keyevent(
     char *character
 );
 
+/**
+ * @brief Sends a legacy GTK-style key event to flutter on the `flutter/keyevent` channel (JSON).
+ */
 int rawkb_send_gtk_keyevent(uint32_t unicode_scalar_values, uint32_t key_code, uint32_t scan_code, uint32_t modifiers, bool is_down);
 
+/**
+ * @brief Creates a new raw keyboard instance, which translates key events to
+ * `FlutterKeyEvent`s (HardwareKeyboard) and sends them using @param interface.
+ */
+struct rawkb *rawkb_new(const struct key_event_interface *interface, void *userdata);
+
+void rawkb_destroy(struct rawkb *rawkb);
+
+/**
+ * @brief Sends a key event to flutter via the embedder key event API.
+ *
+ * This does not send the legacy GTK key event, use @ref rawkb_send_gtk_keyevent for that.
+ */
+/**
+ * @brief Sends a complete barcode scan to flutter, as a single event on @ref BARCODE_SCANNER_CHANNEL.
+ *
+ * The scan is dropped if there's no listener on the dart side.
+ */
+int rawkb_send_barcode_scan(const char *device_name, const char *text);
+
 int rawkb_on_key_event(
     struct rawkb *rawkb,
     uint64_t timestamp_us,
@@ -0,0 +1,103 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Screen capture plugin - lets apps capture exactly what's shown on the display,
+ * using a KMS writeback connector.
+ *
+ * Method channel "flutter-pi/screen_capture", standard method codec:
+ *
+ * - capture()
+ *     Returns {"width": int, "height": int, "stride": int, "format": String, "pixels": Uint8List}
+ *     with the next frame shown on the display. format is the name of the pixel format,
+ *     like "XRGB8888" (see the --pixelformat option), stride the number of bytes per row in pixels.
+ *
+ *   Fails with the "unsupported" error code if the display doesn't support capturing.
+ *
+ * Copyright (c) 2023, Hannes Winkler <hanneswinkler2000@web.de>
+ */
+
+#include "plugins/screen_capture.h"
+
+#include <errno.h>
+
+#include "flutter-pi.h"
+#include "pixel_format.h"
+#include "pluginregistry.h"
+#include "util/logging.h"
+#include "window.h"
+
+static void on_capture_done(const struct window_capture *capture, int status, void *userdata) {
+    FlutterPlatformMessageResponseHandle *response_handle;
+
+    response_handle = userdata;
+
+    if (status != 0) {
+        platch_respond_native_error_std(response_handle, status);
+        return;
+    }
+
+    // clang-format off
+    platch_respond_success_std(
+        response_handle,
+        &STDMAP5(
+            STDSTRING("width"), STDINT32(capture->width),
+            STDSTRING("height"), STDINT32(capture->height),
+            STDSTRING("stride"), STDINT32(capture->stride),
+            STDSTRING("format"), STDSTRING((char *) get_pixfmt_info(capture->format)->arg_name),
+            STDSTRING("pixels"), ((struct std_value){
+                .type = kStdUInt8Array,
+                .size = (size_t) capture->stride * capture->height,
+                .uint8array = capture->pixels,
+            })
+        )
+    );
+    // clang-format on
+}
+
+static int on_capture(struct platch_obj *object, FlutterPlatformMessageResponseHandle *response_handle) {
+    int ok;
+
+    (void) object;
+
+    ok = flutterpi_capture(flutterpi, on_capture_done, response_handle);
+    if (ok == EOPNOTSUPP) {
+        return platch_respond_error_std(response_handle, "unsupported", "The display doesn't support capturing.", NULL);
+    } else if (ok != 0) {
+        return platch_respond_native_error_std(response_handle, ok);
+    }
+
+    // on_capture_done responds.
+    return 0;
+}
+
+static int on_receive(char *channel, struct platch_obj *object, FlutterPlatformMessageResponseHandle *response_handle) {
+    (void) channel;
+
+    if (streq(object->method, "capture")) {
+        return on_capture(object, response_handle);
+    }
+
+    return platch_respond_not_implemented(response_handle);
+}
+
+enum plugin_init_result screen_capture_init(struct flutterpi *flutterpi, void **userdata_out) {
+    int ok;
+
+    (void) flutterpi;
+
+    ok = plugin_registry_set_receiver_locked(SCREEN_CAPTURE_CHANNEL, kStandardMethodCall, on_receive);
+    if (ok != 0) {
+        return PLUGIN_INIT_RESULT_ERROR;
+    }
+
+    *userdata_out = NULL;
+
+    return PLUGIN_INIT_RESULT_INITIALIZED;
+}
+
+void screen_capture_deinit(struct flutterpi *flutterpi, void *userdata) {
+    (void) userdata;
+
+    plugin_registry_remove_receiver_v2_locked(flutterpi_get_plugin_registry(flutterpi), SCREEN_CAPTURE_CHANNEL);
+}
+
+FLUTTERPI_PLUGIN("screen capture", screen_capture, screen_capture_init, screen_capture_deinit)
@@ -0,0 +1,6 @@
+#ifndef _SCREEN_CAPTURE_PLUGIN_H
+#define _SCREEN_CAPTURE_PLUGIN_H
+
+#define SCREEN_CAPTURE_CHANNEL "flutter-pi/screen_capture"
+
+#endif
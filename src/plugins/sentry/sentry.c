@@ -58,26 +58,59 @@ static void on_init_native_sdk(
         return;
     }
 
+    struct init_args {
+        const struct raw_std_value *dsn;
+        const struct raw_std_value *debug;
+        const struct raw_std_value *environment;
+        const struct raw_std_value *release;
+        const struct raw_std_value *dist;
+        const struct raw_std_value *auto_session_tracking;
+    } fields;
+
+    // clang-format off
+    static const struct std_map_field init_fields[] = {
+        STD_MAP_FIELD(struct init_args, dsn, "dsn"),
+        STD_MAP_FIELD(struct init_args, debug, "debug"),
+        STD_MAP_FIELD(struct init_args, environment, "environment"),
+        STD_MAP_FIELD(struct init_args, release, "release"),
+        STD_MAP_FIELD(struct init_args, dist, "dist"),
+        STD_MAP_FIELD(struct init_args, auto_session_tracking, "enableAutoSessionTracking"),
+    };
+    // clang-format on
+
+    // look up all options in one pass over the map, instead of one pass per option.
+    ok = raw_std_map_extract(arg, init_fields, ARRAY_SIZE(init_fields), &fields);
+    if (ok != 0) {
+        platch_respond_native_error_std(responsehandle, ok);
+        return;
+    }
+
     sentry_options_t *options = sentry_options_new();
 
-    const struct raw_std_value *dsn = raw_std_map_find_str(arg, "dsn");
-    if (raw_std_value_is_string(dsn)) {
+    const struct raw_std_value *dsn = fields.dsn;
+    if (dsn == NULL) {
+        // not specified
+    } else if (raw_std_value_is_string(dsn)) {
         sentry_options_set_dsn_n(options, raw_std_string_get_nonzero_terminated(dsn), raw_std_string_get_length(dsn));
     } else if (!raw_std_value_is_null(dsn)) {
         platch_respond_error_std(responsehandle, "4", "Expected `arg['dsn']` to be a string or null.", &STDNULL);
         return;
     }
 
-    const struct raw_std_value *debug = raw_std_map_find_str(arg, "debug");
-    if (raw_std_value_is_bool(debug)) {
+    const struct raw_std_value *debug = fields.debug;
+    if (debug == NULL) {
+        // not specified
+    } else if (raw_std_value_is_bool(debug)) {
         sentry_options_set_debug(options, raw_std_value_as_bool(debug) ? 1 : 0);
     } else if (!raw_std_value_is_null(debug)) {
         platch_respond_error_std(responsehandle, "4", "Expected `arg['debug']` to be a bool or null.", &STDNULL);
         return;
     }
 
-    const struct raw_std_value *environment = raw_std_map_find_str(arg, "environment");
-    if (raw_std_value_is_string(environment)) {
+    const struct raw_std_value *environment = fields.environment;
+    if (environment == NULL) {
+        // not specified
+    } else if (raw_std_value_is_string(environment)) {
         sentry_options_set_environment_n(
             options,
             raw_std_string_get_nonzero_terminated(environment),
@@ -88,26 +121,32 @@ static void on_init_native_sdk(
         return;
     }
 
-    const struct raw_std_value *release = raw_std_map_find_str(arg, "release");
-    if (raw_std_value_is_string(release)) {
+    const struct raw_std_value *release = fields.release;
+    if (release == NULL) {
+        // not specified
+    } else if (raw_std_value_is_string(release)) {
         sentry_options_set_release_n(options, raw_std_string_get_nonzero_terminated(release), raw_std_string_get_length(release));
     } else if (!raw_std_value_is_null(release)) {
         platch_respond_error_std(responsehandle, "4", "Expected `arg['release']` to be a string or null.", &STDNULL);
         return;
     }
 
-    const struct raw_std_value *dist = raw_std_map_find_str(arg, "dist");
-    if (raw_std_value_is_string(dist)) {
+    const struct raw_std_value *dist = fields.dist;
+    if (dist == NULL) {
+        // not specified
+    } else if (raw_std_value_is_string(dist)) {
         sentry_options_set_dist_n(options, raw_std_string_get_nonzero_terminated(dist), raw_std_string_get_length(dist));
     } else if (!raw_std_value_is_null(dist)) {
         platch_respond_error_std(responsehandle, "4", "Expected `arg['dist']` to be a string or null.", &STDNULL);
         return;
     }
 
-    const struct raw_std_value *auto_session_tracking = raw_std_map_find_str(arg, "enableAutoSessionTracking");
-    if (raw_std_value_is_bool(auto_session_tracking)) {
+    const struct raw_std_value *auto_session_tracking = fields.auto_session_tracking;
+    if (auto_session_tracking == NULL) {
+        // not specified
+    } else if (raw_std_value_is_bool(auto_session_tracking)) {
         sentry_options_set_auto_session_tracking(options, raw_std_value_as_bool(auto_session_tracking) ? 1 : 0);
-    } else if (!raw_std_value_is_null(dist)) {
+    } else if (!raw_std_value_is_null(auto_session_tracking)) {
         platch_respond_error_std(responsehandle, "4", "Expected `arg['enableAutoSessionTracking']` to be a bool or null.", &STDNULL);
         return;
     }
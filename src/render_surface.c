@@ -88,6 +88,11 @@ int render_surface_queue_present(struct render_surface *surface, const FlutterBa
     return ok;
 }
 
+struct vec2i render_surface_get_size(struct render_surface *surface) {
+    ASSERT_NOT_NULL(surface);
+    return surface->size;
+}
+
 #ifdef DEBUG
 ATTR_PURE struct render_surface *__checked_cast_render_surface(void *ptr) {
     struct render_surface *surface;
@@ -35,4 +35,6 @@ int render_surface_fill(struct render_surface *store, FlutterBackingStore *fl_st
 
 int render_surface_queue_present(struct render_surface *store, const FlutterBackingStore *fl_store);
 
+struct vec2i render_surface_get_size(struct render_surface *store);
+
 #endif  // _FLUTTERPI_SRC_BACKING_STORE_H
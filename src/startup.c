@@ -0,0 +1,209 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Startup - runs independent startup steps concurrently and records a startup timeline.
+ *
+ * Copyright (c) 2023, Hannes Winkler <hanneswinkler2000@web.de>
+ */
+
+#include "startup.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/asserts.h"
+#include "util/collection.h"
+#include "util/logging.h"
+
+#define MAX_STARTUP_EVENTS 64
+
+struct startup_event {
+    const char *name;
+    const char *thread;
+    uint64_t begin_ns, end_ns;
+};
+
+struct startup {
+    bool trace;
+    uint64_t start_ns;
+
+    pthread_mutex_t lock;
+    int n_events;
+    struct startup_event events[MAX_STARTUP_EVENTS];
+};
+
+struct startup_task {
+    struct startup *startup;
+    const char *name;
+    int (*fn)(void *userdata);
+    void *userdata;
+
+    bool has_thread;
+    pthread_t thread;
+    int result;
+};
+
+struct startup *startup_new(bool trace) {
+    struct startup *startup;
+
+    startup = malloc(sizeof *startup);
+    if (startup == NULL) {
+        return NULL;
+    }
+
+    startup->trace = trace;
+    startup->start_ns = get_monotonic_time();
+    pthread_mutex_init(&startup->lock, get_default_mutex_attrs());
+    startup->n_events = 0;
+    return startup;
+}
+
+void startup_destroy(struct startup *startup) {
+    pthread_mutex_destroy(&startup->lock);
+    free(startup);
+}
+
+static int begin_event(struct startup *startup, const char *name, const char *thread) {
+    int id;
+
+    if (!startup->trace) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&startup->lock);
+
+    if (startup->n_events < MAX_STARTUP_EVENTS) {
+        id = startup->n_events++;
+        startup->events[id].name = name;
+        startup->events[id].thread = thread;
+        startup->events[id].begin_ns = get_monotonic_time();
+        startup->events[id].end_ns = 0;
+    } else {
+        id = -1;
+    }
+
+    pthread_mutex_unlock(&startup->lock);
+    return id;
+}
+
+static void end_event(struct startup *startup, int id) {
+    if (id < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&startup->lock);
+    startup->events[id].end_ns = get_monotonic_time();
+    pthread_mutex_unlock(&startup->lock);
+}
+
+int startup_begin_step(struct startup *startup, const char *name) {
+    ASSERT_NOT_NULL(startup);
+    ASSERT_NOT_NULL(name);
+    return begin_event(startup, name, "main");
+}
+
+void startup_end_step(struct startup *startup, int id) {
+    ASSERT_NOT_NULL(startup);
+    end_event(startup, id);
+}
+
+static void run_task(struct startup_task *task) {
+    int id;
+
+    id = begin_event(task->startup, task->name, task->name);
+    task->result = task->fn(task->userdata);
+    end_event(task->startup, id);
+}
+
+static void *task_entry(void *userdata) {
+    run_task(userdata);
+    return NULL;
+}
+
+struct startup_task *startup_start_task(struct startup *startup, const char *name, int (*fn)(void *userdata), void *userdata) {
+    struct startup_task *task;
+    int ok;
+
+    ASSERT_NOT_NULL(startup);
+    ASSERT_NOT_NULL(name);
+    ASSERT_NOT_NULL(fn);
+
+    task = malloc(sizeof *task);
+    if (task == NULL) {
+        return NULL;
+    }
+
+    task->startup = startup;
+    task->name = name;
+    task->fn = fn;
+    task->userdata = userdata;
+    task->result = 0;
+
+    ok = pthread_create(&task->thread, NULL, task_entry, task);
+    if (ok != 0) {
+        LOG_ERROR("Couldn't create thread for startup task \"%s\", running it synchronously. pthread_create: %s\n", name, strerror(ok));
+        task->has_thread = false;
+        run_task(task);
+    } else {
+        task->has_thread = true;
+    }
+
+    return task;
+}
+
+int startup_join_task(struct startup *startup, struct startup_task *task) {
+    int ok, id;
+
+    ASSERT_NOT_NULL(startup);
+    ASSERT_NOT_NULL(task);
+
+    if (task->has_thread) {
+        // if this takes a noticeable time in the timeline, the main thread is stalled waiting for the task.
+        id = begin_event(startup, task->name, "main, waiting for");
+
+        ok = pthread_join(task->thread, NULL);
+        ASSERT_ZERO(ok);
+        (void) ok;
+
+        end_event(startup, id);
+    }
+
+    ok = task->result;
+    free(task);
+    return ok;
+}
+
+void startup_print_trace(struct startup *startup) {
+    ASSERT_NOT_NULL(startup);
+
+    if (!startup->trace) {
+        return;
+    }
+
+    pthread_mutex_lock(&startup->lock);
+
+    LOG_ERROR_UNPREFIXED("===================================\n");
+    LOG_ERROR_UNPREFIXED("startup timeline (ms since start):\n");
+    LOG_ERROR_UNPREFIXED("   begin      end   duration  thread / step\n");
+
+    for (int i = 0; i < startup->n_events; i++) {
+        const struct startup_event *event = startup->events + i;
+        double begin_ms = (event->begin_ns - startup->start_ns) / 1e6;
+
+        if (event->end_ns != 0) {
+            double end_ms = (event->end_ns - startup->start_ns) / 1e6;
+
+            LOG_ERROR_UNPREFIXED("%8.1f %8.1f %8.1f ms  %s / %s\n", begin_ms, end_ms, end_ms - begin_ms, event->thread, event->name);
+        } else {
+            LOG_ERROR_UNPREFIXED("%8.1f        -          -     %s / %s\n", begin_ms, event->thread, event->name);
+        }
+    }
+
+    LOG_ERROR_UNPREFIXED("total: %.1f ms\n", (get_monotonic_time() - startup->start_ns) / 1e6);
+    LOG_ERROR_UNPREFIXED("===================================\n");
+
+    pthread_mutex_unlock(&startup->lock);
+}
@@ -0,0 +1,66 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Startup - runs independent startup steps concurrently and records a startup timeline.
+ *
+ * - startup tasks run on their own thread, the main thread joins them once it needs their results
+ * - steps on the main thread and startup tasks can both be traced, the resulting timeline
+ *   can be printed with @ref startup_print_trace (see the --startup-trace option)
+ *
+ * Copyright (c) 2023, Hannes Winkler <hanneswinkler2000@web.de>
+ */
+
+#ifndef _FLUTTERPI_SRC_STARTUP_H
+#define _FLUTTERPI_SRC_STARTUP_H
+
+#include <stdbool.h>
+
+struct startup;
+struct startup_task;
+
+/**
+ * @brief Creates a new startup context.
+ *
+ * @param trace Whether to record a timeline of all steps & tasks.
+ */
+struct startup *startup_new(bool trace);
+
+/**
+ * @brief Destroys the startup context. All tasks must be joined before.
+ */
+void startup_destroy(struct startup *startup);
+
+/**
+ * @brief Starts running @param fn on a new thread.
+ *
+ * If no thread can be created, @param fn is run synchronously instead.
+ * The task must be joined using @ref startup_join_task.
+ *
+ * @param name Name of the task for the timeline. Must be a string literal (or outlive the startup context).
+ * @returns The task, or NULL if there was not enough memory.
+ */
+struct startup_task *startup_start_task(struct startup *startup, const char *name, int (*fn)(void *userdata), void *userdata);
+
+/**
+ * @brief Waits for @param task to complete, frees it and returns the return value of its function.
+ */
+int startup_join_task(struct startup *startup, struct startup_task *task);
+
+/**
+ * @brief Marks the beginning of a step on the calling thread, for the startup timeline.
+ *
+ * @param name Name of the step. Must be a string literal (or outlive the startup context).
+ * @returns An id that should be passed to @ref startup_end_step.
+ */
+int startup_begin_step(struct startup *startup, const char *name);
+
+/**
+ * @brief Marks the end of the step @param id.
+ */
+void startup_end_step(struct startup *startup, int id);
+
+/**
+ * @brief Prints the timeline of all steps & tasks so far to stderr, if tracing is enabled.
+ */
+void startup_print_trace(struct startup *startup);
+
+#endif  // _FLUTTERPI_SRC_STARTUP_H
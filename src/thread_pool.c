@@ -0,0 +1,362 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Thread Pool
+ *
+ * Copyright (c) 2023, Hannes Winkler <hanneswinkler2000@web.de>
+ */
+
+#define _GNU_SOURCE
+#include "thread_pool.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "util/asserts.h"
+#include "util/collection.h"
+#include "util/list.h"
+#include "util/logging.h"
+
+/**
+ * @brief More workers than this don't make sense for the kind of work we do.
+ */
+#define MAX_WORKERS 64
+
+struct thread_pool_job {
+    struct list_head entry;
+    void_callback_t fn;
+    void *userdata;
+    uint64_t submit_time_ns;
+};
+
+struct thread_pool_queue {
+    pthread_mutex_t mutex;
+    struct list_head jobs;
+    struct thread_pool_queue_stats stats;
+};
+
+struct thread_pool_worker {
+    struct thread_pool *pool;
+    int index;
+    pthread_t thread;
+};
+
+struct thread_pool {
+    int n_workers;
+    struct thread_pool_queue *queues;
+    struct thread_pool_worker *workers;
+
+    /// Where the next job submitted from outside the pool goes.
+    atomic_uint next_queue;
+
+    /// Number of jobs in all queues.
+    atomic_int n_pending;
+
+    /// Number of workers sleeping (or about to) because there are no jobs.
+    atomic_int n_idle;
+
+    /// Number of jobs that were submitted but didn't finish yet (including their stats update).
+    atomic_int n_unfinished;
+
+    pthread_mutex_t idle_mutex;
+    pthread_cond_t idle_cond;
+
+    /// Signalled (with idle_mutex held) when n_unfinished drops to zero.
+    pthread_cond_t finished_cond;
+    bool stop;
+};
+
+static __thread struct thread_pool_worker *current_worker = NULL;
+
+static struct thread_pool_job *take_job(struct thread_pool_queue *queue, bool steal) {
+    struct thread_pool_job *job;
+
+    pthread_mutex_lock(&queue->mutex);
+
+    if (list_is_empty(&queue->jobs)) {
+        pthread_mutex_unlock(&queue->mutex);
+        return NULL;
+    }
+
+    // The owner takes the oldest job, thieves the newest one, so they don't
+    // fight over the same end of the queue.
+    if (steal) {
+        job = list_last_entry(&queue->jobs, struct thread_pool_job, entry);
+    } else {
+        job = list_first_entry(&queue->jobs, struct thread_pool_job, entry);
+    }
+    list_del(&job->entry);
+
+    queue->stats.depth--;
+    queue->stats.total_wait_time_ns += get_monotonic_time() - job->submit_time_ns;
+
+    pthread_mutex_unlock(&queue->mutex);
+    return job;
+}
+
+static void run_job(struct thread_pool_queue *origin, struct thread_pool_job *job, bool stolen) {
+    uint64_t start_ns, end_ns;
+
+    start_ns = get_monotonic_time();
+    job->fn(job->userdata);
+    end_ns = get_monotonic_time();
+
+    pthread_mutex_lock(&origin->mutex);
+    if (stolen) {
+        origin->stats.n_stolen++;
+    } else {
+        origin->stats.n_executed++;
+    }
+    origin->stats.total_run_time_ns += end_ns - start_ns;
+    pthread_mutex_unlock(&origin->mutex);
+
+    free(job);
+}
+
+static void *worker_entry(void *userdata) {
+    struct thread_pool_worker *worker;
+    struct thread_pool_queue *origin;
+    struct thread_pool_job *job;
+    struct thread_pool *pool;
+    bool stolen;
+
+    worker = userdata;
+    pool = worker->pool;
+    current_worker = worker;
+
+    for (;;) {
+        origin = pool->queues + worker->index;
+        stolen = false;
+
+        job = take_job(origin, false);
+        for (int i = 1; job == NULL && i < pool->n_workers; i++) {
+            origin = pool->queues + (worker->index + i) % pool->n_workers;
+            job = take_job(origin, true);
+            stolen = true;
+        }
+
+        if (job != NULL) {
+            atomic_fetch_sub(&pool->n_pending, 1);
+            run_job(origin, job, stolen);
+
+            if (atomic_fetch_sub(&pool->n_unfinished, 1) == 1) {
+                pthread_mutex_lock(&pool->idle_mutex);
+                pthread_cond_broadcast(&pool->finished_cond);
+                pthread_mutex_unlock(&pool->idle_mutex);
+            }
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->idle_mutex);
+
+        // When stopping, we still run all jobs that are left.
+        if (pool->stop && atomic_load(&pool->n_pending) == 0) {
+            pthread_mutex_unlock(&pool->idle_mutex);
+            break;
+        }
+
+        // Submitters check n_idle after increasing n_pending, so either we see the new job here
+        // or they see we're idle and signal the condition variable.
+        atomic_fetch_add(&pool->n_idle, 1);
+        while (atomic_load(&pool->n_pending) == 0 && !pool->stop) {
+            pthread_cond_wait(&pool->idle_cond, &pool->idle_mutex);
+        }
+        atomic_fetch_sub(&pool->n_idle, 1);
+
+        pthread_mutex_unlock(&pool->idle_mutex);
+    }
+
+    current_worker = NULL;
+    return NULL;
+}
+
+struct thread_pool *thread_pool_new(int n_threads) {
+    struct thread_pool *pool;
+    char name[16];
+    long n_cpus;
+    int ok, n_started;
+
+    if (n_threads <= 0) {
+        n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n_threads = n_cpus > 0 ? (int) n_cpus : 1;
+    }
+
+    if (n_threads > MAX_WORKERS) {
+        n_threads = MAX_WORKERS;
+    }
+
+    pool = malloc(sizeof *pool);
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    pool->queues = calloc(n_threads, sizeof *pool->queues);
+    if (pool->queues == NULL) {
+        goto fail_free_pool;
+    }
+
+    pool->workers = calloc(n_threads, sizeof *pool->workers);
+    if (pool->workers == NULL) {
+        goto fail_free_queues;
+    }
+
+    pool->n_workers = n_threads;
+    pool->next_queue = 0;
+    pool->n_pending = 0;
+    pool->n_idle = 0;
+    pool->n_unfinished = 0;
+    pool->stop = false;
+    pthread_mutex_init(&pool->idle_mutex, get_default_mutex_attrs());
+    pthread_cond_init(&pool->idle_cond, NULL);
+    pthread_cond_init(&pool->finished_cond, NULL);
+
+    for (int i = 0; i < n_threads; i++) {
+        pthread_mutex_init(&pool->queues[i].mutex, get_default_mutex_attrs());
+        list_inithead(&pool->queues[i].jobs);
+        memset(&pool->queues[i].stats, 0, sizeof pool->queues[i].stats);
+    }
+
+    for (n_started = 0; n_started < n_threads; n_started++) {
+        pool->workers[n_started].pool = pool;
+        pool->workers[n_started].index = n_started;
+
+        ok = pthread_create(&pool->workers[n_started].thread, NULL, worker_entry, pool->workers + n_started);
+        if (ok != 0) {
+            LOG_ERROR("Could not create thread pool worker. pthread_create: %s\n", strerror(ok));
+            goto fail_stop_workers;
+        }
+
+        snprintf(name, sizeof name, "pool-%d", n_started);
+        pthread_setname_np(pool->workers[n_started].thread, name);
+    }
+
+    return pool;
+
+fail_stop_workers:
+    pthread_mutex_lock(&pool->idle_mutex);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_mutex);
+
+    for (int i = 0; i < n_started; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+
+    for (int i = 0; i < n_threads; i++) {
+        pthread_mutex_destroy(&pool->queues[i].mutex);
+    }
+    pthread_cond_destroy(&pool->finished_cond);
+    pthread_cond_destroy(&pool->idle_cond);
+    pthread_mutex_destroy(&pool->idle_mutex);
+    free(pool->workers);
+
+fail_free_queues:
+    free(pool->queues);
+
+fail_free_pool:
+    free(pool);
+    return NULL;
+}
+
+void thread_pool_destroy(struct thread_pool *pool) {
+    ASSERT_NOT_NULL(pool);
+    assert(current_worker == NULL || current_worker->pool != pool);
+
+    pthread_mutex_lock(&pool->idle_mutex);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_mutex);
+
+    for (int i = 0; i < pool->n_workers; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+
+    for (int i = 0; i < pool->n_workers; i++) {
+        assert(list_is_empty(&pool->queues[i].jobs));
+        pthread_mutex_destroy(&pool->queues[i].mutex);
+    }
+
+    pthread_cond_destroy(&pool->finished_cond);
+    pthread_cond_destroy(&pool->idle_cond);
+    pthread_mutex_destroy(&pool->idle_mutex);
+    free(pool->workers);
+    free(pool->queues);
+    free(pool);
+}
+
+void thread_pool_wait_idle(struct thread_pool *pool) {
+    ASSERT_NOT_NULL(pool);
+    assert(current_worker == NULL || current_worker->pool != pool);
+
+    pthread_mutex_lock(&pool->idle_mutex);
+    while (atomic_load(&pool->n_unfinished) > 0) {
+        pthread_cond_wait(&pool->finished_cond, &pool->idle_mutex);
+    }
+    pthread_mutex_unlock(&pool->idle_mutex);
+}
+
+int thread_pool_submit(struct thread_pool *pool, void_callback_t fn, void *userdata) {
+    struct thread_pool_queue *queue;
+    struct thread_pool_job *job;
+
+    ASSERT_NOT_NULL(pool);
+    ASSERT_NOT_NULL(fn);
+
+    job = malloc(sizeof *job);
+    if (job == NULL) {
+        return ENOMEM;
+    }
+
+    job->fn = fn;
+    job->userdata = userdata;
+    job->submit_time_ns = get_monotonic_time();
+
+    atomic_fetch_add(&pool->n_unfinished, 1);
+
+    // Jobs submitted by a job probably work on the same data, so keep them on the same worker
+    // (unless some other worker is idle and steals it).
+    if (current_worker != NULL && current_worker->pool == pool) {
+        queue = pool->queues + current_worker->index;
+    } else {
+        queue = pool->queues + atomic_fetch_add(&pool->next_queue, 1) % pool->n_workers;
+    }
+
+    pthread_mutex_lock(&queue->mutex);
+    list_addtail(&job->entry, &queue->jobs);
+    queue->stats.n_submitted++;
+    queue->stats.depth++;
+    if (queue->stats.depth > queue->stats.max_depth) {
+        queue->stats.max_depth = queue->stats.depth;
+    }
+    pthread_mutex_unlock(&queue->mutex);
+
+    atomic_fetch_add(&pool->n_pending, 1);
+
+    if (atomic_load(&pool->n_idle) > 0) {
+        pthread_mutex_lock(&pool->idle_mutex);
+        pthread_cond_signal(&pool->idle_cond);
+        pthread_mutex_unlock(&pool->idle_mutex);
+    }
+
+    return 0;
+}
+
+int thread_pool_get_n_queues(struct thread_pool *pool) {
+    ASSERT_NOT_NULL(pool);
+    return pool->n_workers;
+}
+
+void thread_pool_get_queue_stats(struct thread_pool *pool, int queue, struct thread_pool_queue_stats *stats_out) {
+    ASSERT_NOT_NULL(pool);
+    ASSERT_NOT_NULL(stats_out);
+    assert(queue >= 0 && queue < pool->n_workers);
+
+    pthread_mutex_lock(&pool->queues[queue].mutex);
+    *stats_out = pool->queues[queue].stats;
+    pthread_mutex_unlock(&pool->queues[queue].mutex);
+}
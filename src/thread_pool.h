@@ -0,0 +1,76 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Thread Pool - runs blocking or heavy work (of plugins, for example) off the platform thread.
+ *
+ * - every worker has its own job queue, idle workers steal jobs from the other queues
+ * - jobs submitted from a worker go to the queue of that worker, all others are distributed round-robin
+ * - per-queue statistics can be queried using @ref thread_pool_get_queue_stats
+ *
+ * Copyright (c) 2023, Hannes Winkler <hanneswinkler2000@web.de>
+ */
+
+#ifndef _FLUTTERPI_SRC_THREAD_POOL_H
+#define _FLUTTERPI_SRC_THREAD_POOL_H
+
+#include <stdint.h>
+
+#include "util/collection.h"
+
+struct thread_pool;
+
+struct thread_pool_queue_stats {
+    /// Jobs that were submitted to this queue.
+    uint64_t n_submitted;
+
+    /// Jobs of this queue that were executed by its own worker.
+    uint64_t n_executed;
+
+    /// Jobs of this queue that were executed by another worker.
+    uint64_t n_stolen;
+
+    /// Jobs currently waiting in this queue, and the most there ever were.
+    unsigned depth;
+    unsigned max_depth;
+
+    /// Total time jobs of this queue spent waiting to be executed, and executing.
+    uint64_t total_wait_time_ns;
+    uint64_t total_run_time_ns;
+};
+
+/**
+ * @brief Creates a new thread pool.
+ *
+ * @param n_threads The number of worker threads (and queues). If 0, one per CPU core is used.
+ *                  At most 64 workers are created.
+ */
+struct thread_pool *thread_pool_new(int n_threads);
+
+/**
+ * @brief Runs all jobs that are still queued, then stops the workers and frees the pool.
+ *
+ * Must not be called from a worker of the pool.
+ */
+void thread_pool_destroy(struct thread_pool *pool);
+
+/**
+ * @brief Blocks until all submitted jobs (and jobs submitted by those jobs) have finished.
+ *
+ * The queue stats of finished jobs are up to date when this returns.
+ * Must not be called from a worker of the pool.
+ */
+void thread_pool_wait_idle(struct thread_pool *pool);
+
+/**
+ * @brief Runs @param fn on one of the workers of the pool.
+ *
+ * Can be called from any thread. Jobs can block, but every blocked job occupies a worker.
+ * To respond to a platform message from the job, just call any of the `platch_respond` functions,
+ * those can be used on any thread.
+ */
+int thread_pool_submit(struct thread_pool *pool, void_callback_t fn, void *userdata);
+
+int thread_pool_get_n_queues(struct thread_pool *pool);
+
+void thread_pool_get_queue_stats(struct thread_pool *pool, int queue, struct thread_pool_queue_stats *stats_out);
+
+#endif  // _FLUTTERPI_SRC_THREAD_POOL_H
@@ -13,17 +13,41 @@
 #include <libinput.h>
 #include <linux/input-event-codes.h>
 #include <memory.h>
-#include <systemd/sd-event.h>
 
 #include "compositor_ng.h"
 #include "flutter-pi.h"
 #include "keyboard.h"
 #include "util/collection.h"
+#include "util/list.h"
 #include "util/logging.h"
 
 #define LIBINPUT_VER(major, minor, patch) ((((major) & 0xFF) << 16) | (((minor) & 0xFF) << 8) | ((patch) & 0xFF))
 #define THIS_LIBINPUT_VER LIBINPUT_VER(LIBINPUT_VERSION_MAJOR, LIBINPUT_VERSION_MINOR, LIBINPUT_VERSION_PATCH)
 
+/**
+ * @brief When resampling, we target a point this far before the frame time, so we
+ * can usually interpolate between two real samples instead of predicting.
+ */
+#define RESAMPLE_LATENCY_US 5000
+
+/**
+ * @brief Never predict pointer positions further than this into the future.
+ */
+#define RESAMPLE_MAX_PREDICTION_US 8000
+
+/**
+ * @brief Don't resample if two samples are closer than this, the velocity would be too noisy.
+ */
+#define RESAMPLE_MIN_DELTA_US 2000
+
+struct barcode_scanner_match {
+    struct list_head entry;
+
+    bool has_ids;
+    uint16_t vendor_id, product_id;
+    char *name;
+};
+
 struct input_device_data {
     struct keyboard_state *keyboard_state;
     int64_t buttons;
@@ -49,6 +73,22 @@ struct input_device_data {
      */
     struct vec2f *positions;
 
+    /**
+     * @brief True if this keyboard is a barcode scanner, i.e. its key events should
+     * be assembled into strings instead of being sent as individual key events.
+     */
+    bool is_barcode_scanner;
+
+    /**
+     * @brief Barcode scanner state, only valid if @ref is_barcode_scanner is true.
+     */
+    struct {
+        struct list_head entry;
+        struct user_input *input;
+        struct libinput_device *device;
+        struct barcode_buffer buffer;
+    } barcode;
+
     int64_t touch_device_id_offset;
     int64_t stylus_device_id;
 };
@@ -94,6 +134,28 @@ struct user_input {
      * @brief Number of pointer events currently contained in @ref collected_flutter_pointer_events.
      */
     size_t n_collected_flutter_pointer_events;
+
+    /**
+     * @brief If true, pointer events are not sent to flutter when the input fd is drained, but only
+     * when @ref user_input_flush_pointer_events is called (typically once per vblank).
+     */
+    bool batch_pointer_events;
+
+    /**
+     * @brief If true, the position of the last move of each pointer is resampled to the frame time
+     * when flushing batched pointer events.
+     */
+    bool resample_pointer_events;
+
+    /**
+     * @brief The devices that should be treated as barcode scanners, see @ref user_input_add_barcode_scanner.
+     */
+    struct list_head barcode_scanner_matches;
+
+    /**
+     * @brief All connected barcode scanner devices. (their @ref input_device_data)
+     */
+    struct list_head barcode_scanners;
 };
 
 static inline FlutterPointerEvent make_touch_event(FlutterPointerPhase phase, size_t timestamp, struct vec2f pos, int32_t device_id) {
@@ -281,9 +343,9 @@ struct user_input *user_input_new(
     const struct mat3f *display_to_view_transform,
     const struct mat3f *view_to_display_transform,
     unsigned int display_width,
-    unsigned int display_height
+    unsigned int display_height,
+    struct keyboard_config *kbdcfg
 ) {
-    struct keyboard_config *kbdcfg;
     struct user_input *input;
     struct libinput *libinput;
     struct udev *udev;
@@ -317,15 +379,6 @@ struct user_input *user_input_new(
         goto fail_unref_libinput;
     }
 
-#ifdef BUILD_TEXT_INPUT_PLUGIN
-    kbdcfg = keyboard_config_new();
-    if (kbdcfg == NULL) {
-        LOG_ERROR("Could not initialize keyboard configuration. Flutter-pi will run without text/raw keyboard input.\n");
-    }
-#else
-    kbdcfg = NULL;
-#endif
-
     input->libinput = libinput;
     input->kbdcfg = kbdcfg;
     input->next_unused_flutter_device_id = 0;
@@ -338,6 +391,11 @@ struct user_input *user_input_new(
     input->cursor_y = 0.0;
 
     input->n_collected_flutter_pointer_events = 0;
+    input->batch_pointer_events = false;
+    input->resample_pointer_events = false;
+
+    list_inithead(&input->barcode_scanner_matches);
+    list_inithead(&input->barcode_scanners);
 
     return input;
 
@@ -352,6 +410,9 @@ fail_free_input:
     free(input);
 
 fail_return_null:
+    if (kbdcfg != NULL) {
+        keyboard_config_destroy(kbdcfg);
+    }
     return NULL;
 }
 
@@ -387,6 +448,12 @@ void user_input_destroy(struct user_input *input) {
         libinput_event_destroy(event);
     }
 
+    list_for_each_entry_safe(struct barcode_scanner_match, match, &input->barcode_scanner_matches, entry) {
+        list_del(&match->entry);
+        free(match->name);
+        free(match);
+    }
+
     if (input->kbdcfg != NULL) {
         keyboard_config_destroy(input->kbdcfg);
     }
@@ -436,6 +503,74 @@ int user_input_resume(struct user_input *input) {
     return 0;
 }
 
+static bool is_coalescable_pointer_event(const FlutterPointerEvent *event) {
+    return (event->phase == kMove || event->phase == kHover) && event->signal_kind == kFlutterPointerSignalKindNone;
+}
+
+static void resample_pointer_event(FlutterPointerEvent *event, const FlutterPointerEvent *previous, uint64_t frame_time_us) {
+    int64_t delta, target, min_target, max_target;
+    double alpha;
+
+    delta = (int64_t) event->timestamp - (int64_t) previous->timestamp;
+    if (delta < RESAMPLE_MIN_DELTA_US) {
+        return;
+    }
+
+    // Interpolate between the last two samples if possible, and only predict a little bit.
+    min_target = previous->timestamp;
+    max_target = event->timestamp + MIN2(delta / 2, RESAMPLE_MAX_PREDICTION_US);
+    target = CLAMP((int64_t) frame_time_us - RESAMPLE_LATENCY_US, min_target, max_target);
+
+    alpha = (double) (target - (int64_t) event->timestamp) / (double) delta;
+
+    event->x += (event->x - previous->x) * alpha;
+    event->y += (event->y - previous->y) * alpha;
+    event->timestamp = target;
+}
+
+size_t user_input_coalesce_pointer_events(FlutterPointerEvent *events, size_t n_events, bool resample, uint64_t frame_time_us) {
+    FlutterPointerEvent previous[MAX_COLLECTED_FLUTTER_POINTER_EVENTS];
+    bool has_previous[MAX_COLLECTED_FLUTTER_POINTER_EVENTS] = { 0 };
+    size_t n_kept = 0;
+
+    assert(n_events <= MAX_COLLECTED_FLUTTER_POINTER_EVENTS);
+
+    for (size_t i = 0; i < n_events; i++) {
+        if (is_coalescable_pointer_event(events + i)) {
+            size_t next = i + 1;
+
+            // find the next event of the same pointer.
+            while (next < n_events && events[next].device != events[i].device) {
+                next++;
+            }
+
+            if (next < n_events && is_coalescable_pointer_event(events + next) && events[next].phase == events[i].phase &&
+                events[next].buttons == events[i].buttons) {
+                previous[next] = events[i];
+                has_previous[next] = true;
+                continue;
+            }
+        }
+
+        if (resample && has_previous[i]) {
+            resample_pointer_event(events + i, previous + i, frame_time_us);
+        }
+
+        events[n_kept++] = events[i];
+    }
+
+    return n_kept;
+}
+
+static void coalesce_pointer_events(struct user_input *input, bool resample, uint64_t frame_time_us) {
+    input->n_collected_flutter_pointer_events = user_input_coalesce_pointer_events(
+        input->collected_flutter_pointer_events,
+        input->n_collected_flutter_pointer_events,
+        resample,
+        frame_time_us
+    );
+}
+
 static void flush_pointer_events(struct user_input *input) {
     assert(input != NULL);
 
@@ -486,6 +621,11 @@ UNUSED static void emit_pointer_events(struct user_input *input, const FlutterPo
 static void emit_pointer_event(struct user_input *input, const FlutterPointerEvent event) {
     assert(input != NULL);
 
+    // if we're batching, try to make some room first.
+    if (input->batch_pointer_events && input->n_collected_flutter_pointer_events == MAX_COLLECTED_FLUTTER_POINTER_EVENTS) {
+        coalesce_pointer_events(input, false, 0);
+    }
+
     // if the internal buffer is full, flush it
     if (input->n_collected_flutter_pointer_events == MAX_COLLECTED_FLUTTER_POINTER_EVENTS) {
         flush_pointer_events(input);
@@ -529,6 +669,126 @@ static void maybe_disable_mouse_cursor(struct user_input *input, uint64_t timest
     }
 }
 
+static bool is_barcode_scanner(struct user_input *input, struct libinput_device *device) {
+    list_for_each_entry(struct barcode_scanner_match, match, &input->barcode_scanner_matches, entry) {
+        if (match->has_ids) {
+            if (libinput_device_get_id_vendor(device) == match->vendor_id && libinput_device_get_id_product(device) == match->product_id) {
+                return true;
+            }
+        } else if (streq(libinput_device_get_name(device), match->name)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+int barcode_buffer_init(struct barcode_buffer *buffer, barcode_scan_text_callback_t on_scan, void *userdata) {
+    ASSERT_NOT_NULL(buffer);
+    ASSERT_NOT_NULL(on_scan);
+
+    buffer->text = malloc(MAX_BARCODE_LENGTH + 1);
+    if (buffer->text == NULL) {
+        return ENOMEM;
+    }
+
+    buffer->length = 0;
+    buffer->last_key_timestamp = 0;
+    buffer->on_scan = on_scan;
+    buffer->userdata = userdata;
+    return 0;
+}
+
+void barcode_buffer_deinit(struct barcode_buffer *buffer) {
+    ASSERT_NOT_NULL(buffer);
+    free(buffer->text);
+}
+
+void barcode_buffer_flush(struct barcode_buffer *buffer) {
+    ASSERT_NOT_NULL(buffer);
+
+    if (buffer->length == 0) {
+        return;
+    }
+
+    buffer->text[buffer->length] = '\0';
+    buffer->length = 0;
+
+    buffer->on_scan(buffer->userdata, buffer->text);
+}
+
+void barcode_buffer_on_key(
+    struct barcode_buffer *buffer,
+    uint64_t timestamp_us,
+    xkb_keysym_t keysym,
+    const char *utf8_character,
+    bool is_down
+) {
+    size_t length;
+
+    ASSERT_NOT_NULL(buffer);
+    ASSERT_NOT_NULL(utf8_character);
+
+    // all the information we need is in the key down events.
+    if (!is_down) {
+        return;
+    }
+
+    // a pause longer than the burst timeout means this is a new scan.
+    if (buffer->length > 0 && timestamp_us - buffer->last_key_timestamp >= BARCODE_BURST_TIMEOUT_US) {
+        barcode_buffer_flush(buffer);
+    }
+
+    buffer->last_key_timestamp = timestamp_us;
+
+    // most scanners terminate a scan with enter or tab.
+    if (keysym == XKB_KEY_Return || keysym == XKB_KEY_KP_Enter || keysym == XKB_KEY_ISO_Enter || keysym == XKB_KEY_Tab) {
+        barcode_buffer_flush(buffer);
+        return;
+    }
+
+    length = strlen(utf8_character);
+    if (length == 0) {
+        return;
+    }
+
+    if (buffer->length + length > MAX_BARCODE_LENGTH) {
+        barcode_buffer_flush(buffer);
+    }
+
+    memcpy(buffer->text + buffer->length, utf8_character, length);
+    buffer->length += length;
+}
+
+bool barcode_buffer_get_deadline(const struct barcode_buffer *buffer, uint64_t *deadline_us_out) {
+    ASSERT_NOT_NULL(buffer);
+    ASSERT_NOT_NULL(deadline_us_out);
+
+    if (buffer->length == 0) {
+        return false;
+    }
+
+    *deadline_us_out = buffer->last_key_timestamp + BARCODE_BURST_TIMEOUT_US;
+    return true;
+}
+
+void barcode_buffer_flush_if_timed_out(struct barcode_buffer *buffer, uint64_t now_us) {
+    ASSERT_NOT_NULL(buffer);
+
+    if (buffer->length > 0 && now_us - buffer->last_key_timestamp >= BARCODE_BURST_TIMEOUT_US) {
+        barcode_buffer_flush(buffer);
+    }
+}
+
+static void on_barcode_scan_text(void *userdata, const char *text) {
+    struct input_device_data *data = userdata;
+    struct user_input *input = data->barcode.input;
+
+    if (input->interface.on_barcode_scan != NULL) {
+        input->interface.on_barcode_scan(input->userdata, libinput_device_get_name(data->barcode.device), text);
+    }
+}
+
 static int on_device_added(struct user_input *input, struct libinput_event *event, uint64_t timestamp) {
     struct input_device_data *data;
     struct libinput_device *device;
@@ -553,6 +813,7 @@ static int on_device_added(struct user_input *input, struct libinput_event *even
     data->has_emitted_pointer_events = false;
     data->tip = false;
     data->positions = NULL;
+    data->is_barcode_scanner = false;
 
     libinput_device_set_user_data(device, data);
 
@@ -601,6 +862,19 @@ static int on_device_added(struct user_input *input, struct libinput_event *even
             // If we don't have a keyboard config
             data->keyboard_state = NULL;
         }
+
+        if (data->keyboard_state != NULL && is_barcode_scanner(input, device)) {
+            if (barcode_buffer_init(&data->barcode.buffer, on_barcode_scan_text, data) != 0) {
+                goto fail_free_data;
+            }
+
+            data->is_barcode_scanner = true;
+            data->barcode.input = input;
+            data->barcode.device = device;
+            list_add(&data->barcode.entry, &input->barcode_scanners);
+
+            LOG_DEBUG("Using input device \"%s\" as a barcode scanner.\n", libinput_device_get_name(device));
+        }
     }
 
     if (libinput_device_has_capability(device, LIBINPUT_DEVICE_CAP_TABLET_TOOL)) {
@@ -614,6 +888,13 @@ static int on_device_added(struct user_input *input, struct libinput_event *even
     return 0;
 
 fail_free_data:
+    if (data->positions != NULL) {
+        free(data->positions);
+    }
+    if (data->keyboard_state != NULL) {
+        keyboard_state_destroy(data->keyboard_state);
+    }
+    libinput_device_set_user_data(device, NULL);
     free(data);
     return EINVAL;
 }
@@ -661,6 +942,16 @@ static int on_device_removed(struct user_input *input, struct libinput_event *ev
         }
     }
 
+    if (data->is_barcode_scanner) {
+        // deliver whatever we have so far, the scan is not going to continue.
+        if (emit_flutter_events) {
+            barcode_buffer_flush(&data->barcode.buffer);
+        }
+
+        list_del(&data->barcode.entry);
+        barcode_buffer_deinit(&data->barcode.buffer);
+    }
+
     if (libinput_device_has_capability(device, LIBINPUT_DEVICE_CAP_KEYBOARD)) {
         // create a new keyboard state for this keyboard
         if (data->keyboard_state != NULL) {
@@ -767,6 +1058,21 @@ static int on_key_event(struct user_input *input, struct libinput_event *event)
         }
     }
 
+    if (data->is_barcode_scanner) {
+        // Barcode scanners send whole bursts of key events. Instead of sending each one to flutter
+        // (which is slow and can drop characters), we assemble them into a single string.
+        barcode_buffer_on_key(
+            &data->barcode.buffer,
+            libinput_event_keyboard_get_time_usec(key_event),
+            keysym,
+            (const char *) utf8_character,
+            key_state == LIBINPUT_KEY_STATE_PRESSED
+        );
+        return 0;
+    }
+
+    // The embedder key event (HardwareKeyboard) and the legacy GTK keyevent are independent,
+    // the user input interface can have either one, both, or none of them.
     if (input->interface.on_key_event) {
         input->interface.on_key_event(
             input->userdata,
@@ -785,7 +1091,9 @@ static int on_key_event(struct user_input *input, struct libinput_event *event)
             key_state == LIBINPUT_KEY_STATE_PRESSED,
             false
         );
-    } else {
+    }
+
+    if (input->interface.on_gtk_keyevent) {
         // call the GTK keyevent callback.
         /// TODO: Simplify the meta state construction.
         input->interface.on_gtk_keyevent(
@@ -798,15 +1106,16 @@ static int on_key_event(struct user_input *input, struct libinput_event *event)
                 (keyboard_state_is_numlock_active(data->keyboard_state) << 4) | (keyboard_state_is_meta_active(data->keyboard_state) << 28),
             key_state
         );
+    }
 
-        if (utf8_character[0]) {
-            input->interface.on_utf8_character(input->userdata, utf8_character);
-        }
+    // text input still needs the characters & keysyms, no matter which key events are sent to flutter.
+    if (utf8_character[0]) {
+        input->interface.on_utf8_character(input->userdata, utf8_character);
+    }
 
-        // Call the XKB keysym callback if we've got a keysym.
-        if (keysym) {
-            input->interface.on_xkb_keysym(input->userdata, keysym);
-        }
+    // Call the XKB keysym callback if we've got a keysym.
+    if (keysym) {
+        input->interface.on_xkb_keysym(input->userdata, keysym);
     }
 
     return 0;
@@ -1529,8 +1838,11 @@ int user_input_on_fd_ready(struct user_input *input) {
     cursor_x = round(input->cursor_x);
     cursor_y = round(input->cursor_y);
 
-    // make sure we've dispatched all the flutter pointer events
-    flush_pointer_events(input);
+    // make sure we've dispatched all the flutter pointer events,
+    // unless they're batched until the next frame.
+    if (!input->batch_pointer_events) {
+        flush_pointer_events(input);
+    }
 
     // call the interface callback if the cursor has been enabled or disabled
     if (cursor_enabled && !cursor_enabled_before) {
@@ -1546,3 +1858,89 @@ int user_input_on_fd_ready(struct user_input *input) {
 
     return 0;
 }
+
+void user_input_set_pointer_event_batching(struct user_input *input, bool batch, bool resample) {
+    ASSERT_NOT_NULL(input);
+
+    // flush everything that was batched until now.
+    if (input->batch_pointer_events && !batch) {
+        flush_pointer_events(input);
+    }
+
+    input->batch_pointer_events = batch;
+    input->resample_pointer_events = batch && resample;
+}
+
+bool user_input_has_pending_pointer_events(struct user_input *input) {
+    ASSERT_NOT_NULL(input);
+    return input->n_collected_flutter_pointer_events > 0;
+}
+
+void user_input_flush_pointer_events(struct user_input *input, uint64_t frame_time_us) {
+    ASSERT_NOT_NULL(input);
+
+    coalesce_pointer_events(input, input->resample_pointer_events, frame_time_us);
+    flush_pointer_events(input);
+}
+
+int user_input_add_barcode_scanner(struct user_input *input, const char *match) {
+    struct barcode_scanner_match *entry;
+    unsigned int vendor_id, product_id;
+    int n_chars;
+
+    ASSERT_NOT_NULL(input);
+    ASSERT_NOT_NULL(match);
+
+    entry = malloc(sizeof *entry);
+    if (entry == NULL) {
+        return ENOMEM;
+    }
+
+    // "vvvv:pppp" (hex) matches the USB vendor & product id, everything else the device name.
+    n_chars = 0;
+    if (sscanf(match, "%4x:%4x%n", &vendor_id, &product_id, &n_chars) == 2 && match[n_chars] == '\0') {
+        entry->has_ids = true;
+        entry->vendor_id = vendor_id;
+        entry->product_id = product_id;
+        entry->name = NULL;
+    } else {
+        entry->has_ids = false;
+        entry->vendor_id = 0;
+        entry->product_id = 0;
+        entry->name = strdup(match);
+        if (entry->name == NULL) {
+            free(entry);
+            return ENOMEM;
+        }
+    }
+
+    list_addtail(&entry->entry, &input->barcode_scanner_matches);
+    return 0;
+}
+
+bool user_input_get_barcode_flush_deadline(struct user_input *input, uint64_t *deadline_us_out) {
+    bool has_deadline;
+
+    ASSERT_NOT_NULL(input);
+    ASSERT_NOT_NULL(deadline_us_out);
+
+    has_deadline = false;
+    list_for_each_entry(struct input_device_data, data, &input->barcode_scanners, barcode.entry) {
+        uint64_t deadline;
+
+        if (barcode_buffer_get_deadline(&data->barcode.buffer, &deadline) && (!has_deadline || deadline < *deadline_us_out)) {
+            *deadline_us_out = deadline;
+            has_deadline = true;
+        }
+    }
+
+    return has_deadline;
+}
+
+void user_input_flush_barcode_scans(struct user_input *input, uint64_t now_us) {
+    ASSERT_NOT_NULL(input);
+
+    list_for_each_entry(struct input_device_data, data, &input->barcode_scanners, barcode.entry) {
+        barcode_buffer_flush_if_timed_out(&data->barcode.buffer, now_us);
+    }
+}
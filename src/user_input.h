@@ -38,6 +38,8 @@ typedef void (*gtk_keyevent_callback_t)(
 );
 // clang-format on
 
+typedef void (*barcode_scan_callback_t)(void *userdata, const char *device_name, const char *text);
+
 typedef void (*set_cursor_enabled_callback_t)(void *userdata, bool enabled);
 
 typedef void (*move_cursor_callback_t)(void *userdata, struct vec2f delta);
@@ -67,13 +69,19 @@ struct user_input_interface {
     void (*close)(int fd, void *userdata);
     void (*on_switch_vt)(void *userdata, int vt);
     keyevent_callback_t on_key_event;
+    barcode_scan_callback_t on_barcode_scan;
 };
 
 struct user_input;
 
+struct keyboard_config;
+
 /**
- * @brief Create a new user input instance. Will try to load the default keyboard config from /etc/default/keyboard
- * and create a udev-backed libinput instance.
+ * @brief Create a new user input instance, backed by a udev libinput instance.
+ *
+ * @param kbdcfg The keyboard config (see @ref keyboard_config_new) used for all keyboards.
+ * The user input instance takes ownership of it, even if creating the instance fails.
+ * If NULL, keyboard input is ignored.
  */
 struct user_input *user_input_new(
     const struct user_input_interface *interface,
@@ -81,7 +89,8 @@ struct user_input *user_input_new(
     const struct mat3f *display_to_view_transform,
     const struct mat3f *view_to_display_transform,
     unsigned int display_width,
-    unsigned int display_height
+    unsigned int display_height,
+    struct keyboard_config *kbdcfg
 );
 
 /**
@@ -119,6 +128,139 @@ int user_input_get_fd(struct user_input *input);
  */
 int user_input_on_fd_ready(struct user_input *input);
 
+/**
+ * @brief Configures whether pointer events should be batched until the next frame.
+ *
+ * If @param batch is true, pointer events are no longer sent to flutter in @ref user_input_on_fd_ready.
+ * Instead, @ref user_input_flush_pointer_events should be called once per frame (e.g. at the vblank),
+ * which coalesces the moves of each pointer and sends the events.
+ *
+ * If @param resample is true too, the position of each pointer is resampled to the frame time,
+ * using the timestamps of the last two input samples.
+ */
+void user_input_set_pointer_event_batching(struct user_input *input, bool batch, bool resample);
+
+/**
+ * @brief Returns true if there are batched pointer events that weren't sent to flutter yet.
+ */
+bool user_input_has_pending_pointer_events(struct user_input *input);
+
+/**
+ * @brief Coalesces (and optionally resamples) all batched pointer events and sends them to flutter.
+ *
+ * @param frame_time_us The time of the frame the events should be resampled to, in microseconds,
+ * on the same clock as the libinput event timestamps. (CLOCK_MONOTONIC)
+ */
+void user_input_flush_pointer_events(struct user_input *input, uint64_t frame_time_us);
+
+/**
+ * @brief Drops pointer move / hover events that are followed by another move / hover of the same pointer
+ * (and with the same buttons pressed), since only the latest position matters for the next frame.
+ *
+ * Events of other pointers may be in between, but the order of all other events (add, down, up, remove, scroll)
+ * is kept, and no move is ever moved across one of those.
+ *
+ * If @param resample is true, the remaining moves are resampled to @param frame_time_us
+ * using the last dropped move of the same pointer.
+ *
+ * This is what @ref user_input_flush_pointer_events does with the batched events.
+ * At most @ref MAX_COLLECTED_FLUTTER_POINTER_EVENTS events can be coalesced at once.
+ *
+ * @returns The number of events that are left at the start of @param events.
+ */
+size_t user_input_coalesce_pointer_events(FlutterPointerEvent *events, size_t n_events, bool resample, uint64_t frame_time_us);
+
+/**
+ * @brief Treat the keyboards matching @param match as barcode scanners.
+ *
+ * @param match is either a USB vendor & product id in hex (e.g. "05e0:1200"), or the exact libinput device name.
+ *
+ * The key events of barcode scanners are not sent to flutter individually. Instead, all the characters
+ * of one scan are assembled into a string (using the keyboard layout) and delivered using the
+ * `on_barcode_scan` callback. A scan ends with enter or tab, or when the scanner pauses for a short while.
+ *
+ * Only applies to devices that are added after this call, so should be called right after
+ * @ref user_input_new.
+ *
+ * @returns 0 on success, ENOMEM if there was not enough memory.
+ */
+int user_input_add_barcode_scanner(struct user_input *input, const char *match);
+
+/**
+ * @brief If there's a barcode scan in progress, returns true and stores the time (on the libinput event clock,
+ * CLOCK_MONOTONIC, in microseconds) at which it will be complete in @param deadline_us_out.
+ *
+ * @ref user_input_flush_barcode_scans should be called at that time, in case no more input arrives.
+ */
+bool user_input_get_barcode_flush_deadline(struct user_input *input, uint64_t *deadline_us_out);
+
+/**
+ * @brief Delivers all barcode scans that have timed out at @param now_us.
+ */
+void user_input_flush_barcode_scans(struct user_input *input, uint64_t now_us);
+
+/**
+ * @brief If a barcode scanner doesn't send a key for this long, the scan is considered finished.
+ *
+ * Scanners send a whole barcode within a few milliseconds, so this can be pretty short.
+ */
+#define BARCODE_BURST_TIMEOUT_US 30000
+
+/**
+ * @brief Maximum length of a single barcode scan in bytes (UTF-8). Longer scans are split.
+ */
+#define MAX_BARCODE_LENGTH 512
+
+typedef void (*barcode_scan_text_callback_t)(void *userdata, const char *text);
+
+/**
+ * @brief Assembles the key presses of a single barcode scanner into scans.
+ *
+ * A scan ends with enter or tab, when the scanner pauses for @ref BARCODE_BURST_TIMEOUT_US,
+ * or when it's longer than @ref MAX_BARCODE_LENGTH bytes.
+ */
+struct barcode_buffer {
+    char *text;
+    size_t length;
+    uint64_t last_key_timestamp;
+
+    barcode_scan_text_callback_t on_scan;
+    void *userdata;
+};
+
+int barcode_buffer_init(struct barcode_buffer *buffer, barcode_scan_text_callback_t on_scan, void *userdata);
+
+void barcode_buffer_deinit(struct barcode_buffer *buffer);
+
+/**
+ * @brief Adds a key event of the scanner, with the UTF-8 text it produces in the keyboard layout.
+ *
+ * Calls the scan callback if the key completes a scan, or if it's the first key of a new scan
+ * after the scanner paused.
+ */
+void barcode_buffer_on_key(
+    struct barcode_buffer *buffer,
+    uint64_t timestamp_us,
+    xkb_keysym_t keysym,
+    const char *utf8_character,
+    bool is_down
+);
+
+/**
+ * @brief Delivers the scan in progress (if any) using the scan callback.
+ */
+void barcode_buffer_flush(struct barcode_buffer *buffer);
+
+/**
+ * @brief If there's a scan in progress, returns true and stores the time it times out in @param deadline_us_out.
+ */
+bool barcode_buffer_get_deadline(const struct barcode_buffer *buffer, uint64_t *deadline_us_out);
+
+/**
+ * @brief Delivers the scan in progress if the scanner didn't send a key for @ref BARCODE_BURST_TIMEOUT_US at @param now_us.
+ */
+void barcode_buffer_flush_if_timed_out(struct barcode_buffer *buffer, uint64_t now_us);
+
 void user_input_suspend(struct user_input *input);
 
 int user_input_resume(struct user_input *input);
@@ -189,6 +189,19 @@ struct mat3f {
         .pers2 = 1,                                 \
     })
 
+#define MAT3F_SCALE(scale_x, scale_y) \
+    ((struct mat3f){                  \
+        .scaleX = scale_x,            \
+        .skewX = 0,                   \
+        .transX = 0,                  \
+        .skewY = 0,                   \
+        .scaleY = scale_y,            \
+        .transY = 0,                  \
+        .pers0 = 0,                   \
+        .pers1 = 0,                   \
+        .pers2 = 1,                   \
+    })
+
 /**
  * @brief A flutter transformation that rotates any coords around the x-axis, counter-clockwise.
  */
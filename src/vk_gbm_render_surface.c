@@ -18,6 +18,7 @@
 
 #include <vulkan.h>
 
+#include "fbdev.h"
 #include "render_surface.h"
 #include "render_surface_private.h"
 #include "surface.h"
@@ -43,6 +44,12 @@ struct locked_fb {
     atomic_flag is_locked;
     refcount_t n_refs;
     struct fb *fb;
+
+    /**
+     * @brief sync_file fd that signals once flutter has finished rendering into this fb, or -1.
+     *
+     */
+    int render_fence_fd;
 };
 
 struct vk_gbm_render_surface {
@@ -91,6 +98,15 @@ struct vk_gbm_render_surface {
      */
     struct locked_fb *front_fb;
 
+    /**
+     * @brief Semaphore that's signalled after all rendering work flutter submitted, and then exported as a
+     * sync_file for the KMS plane IN_FENCE_FD.
+     *
+     * VK_NULL_HANDLE if the device can't export semaphores as sync_files.
+     */
+    VkSemaphore render_semaphore;
+    PFN_vkGetSemaphoreFdKHR get_semaphore_fd;
+
     /**
      * @brief The pixel format to use for all framebuffers.
      *
@@ -112,6 +128,11 @@ static void locked_fb_destroy(struct locked_fb *fb) {
     surface = fb->surface;
     fb->surface = NULL;
 
+    if (fb->render_fence_fd >= 0) {
+        close(fb->render_fence_fd);
+        fb->render_fence_fd = -1;
+    }
+
 #ifdef DEBUG
     atomic_fetch_sub(&surface->n_locked_fbs, 1);
 #endif
@@ -427,6 +448,106 @@ fail_destroy_bo:
     return EIO;
 }
 
+static VkSemaphore create_exportable_semaphore(struct vk_renderer *renderer) {
+    VkExternalSemaphoreProperties props;
+    VkSemaphore semaphore;
+    VkResult ok;
+
+    props = (VkExternalSemaphoreProperties){
+        .sType = VK_STRUCTURE_TYPE_EXTERNAL_SEMAPHORE_PROPERTIES,
+        .pNext = NULL,
+    };
+
+    vkGetPhysicalDeviceExternalSemaphoreProperties(
+        vk_renderer_get_physical_device(renderer),
+        &(const VkPhysicalDeviceExternalSemaphoreInfo){
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_SEMAPHORE_INFO,
+            .pNext = NULL,
+            .handleType = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_SYNC_FD_BIT,
+        },
+        &props
+    );
+
+    if (!(props.externalSemaphoreFeatures & VK_EXTERNAL_SEMAPHORE_FEATURE_EXPORTABLE_BIT)) {
+        LOG_DEBUG("Vulkan device can't export semaphores as sync_files. Implicit fencing will be used for KMS.\n");
+        return VK_NULL_HANDLE;
+    }
+
+    ok = vkCreateSemaphore(
+        vk_renderer_get_device(renderer),
+        &(const VkSemaphoreCreateInfo){
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+            .pNext =
+                &(const VkExportSemaphoreCreateInfo){
+                    .sType = VK_STRUCTURE_TYPE_EXPORT_SEMAPHORE_CREATE_INFO,
+                    .pNext = NULL,
+                    .handleTypes = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_SYNC_FD_BIT,
+                },
+            .flags = 0,
+        },
+        NULL,
+        &semaphore
+    );
+    if (ok != VK_SUCCESS) {
+        LOG_VK_ERROR(ok, "Couldn't create exportable render semaphore. vkCreateSemaphore");
+        return VK_NULL_HANDLE;
+    }
+
+    return semaphore;
+}
+
+/**
+ * @brief Signal the render semaphore after all the work flutter submitted for this frame
+ * and export it as a sync_file.
+ *
+ * The signal operation of a queue submission waits for all commands submitted to the queue before it,
+ * so an empty submission is enough. We're called on the raster thread, the same thread flutter
+ * submits from, so we don't need any additional locking for the queue.
+ *
+ * @returns The sync_file fd, or -1 on error.
+ */
+static int export_render_fence(struct vk_gbm_render_surface *surface) {
+    VkResult ok;
+    int fd;
+
+    ok = vkQueueSubmit(
+        vk_renderer_get_queue(surface->renderer),
+        1,
+        &(const VkSubmitInfo){
+            .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+            .pNext = NULL,
+            .waitSemaphoreCount = 0,
+            .commandBufferCount = 0,
+            .signalSemaphoreCount = 1,
+            .pSignalSemaphores = &surface->render_semaphore,
+        },
+        VK_NULL_HANDLE
+    );
+    if (ok != VK_SUCCESS) {
+        LOG_VK_ERROR(ok, "Couldn't signal render semaphore. vkQueueSubmit");
+        return -1;
+    }
+
+    // Exporting a sync_file also resets the semaphore, so we can signal it again next frame.
+    fd = -1;
+    ok = surface->get_semaphore_fd(
+        vk_renderer_get_device(surface->renderer),
+        &(const VkSemaphoreGetFdInfoKHR){
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_GET_FD_INFO_KHR,
+            .pNext = NULL,
+            .semaphore = surface->render_semaphore,
+            .handleType = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_SYNC_FD_BIT,
+        },
+        &fd
+    );
+    if (ok != VK_SUCCESS) {
+        LOG_VK_ERROR(ok, "Couldn't export render semaphore as sync_file. vkGetSemaphoreFdKHR");
+        return -1;
+    }
+
+    return fd;
+}
+
 static void fb_deinit(struct fb *fb, VkDevice device) {
     ASSERT_NOT_NULL(fb);
 
@@ -471,6 +592,13 @@ fail_deinit_previous_fbs:
         surface->locked_fbs[i].is_locked = (atomic_flag) ATOMIC_FLAG_INIT;
         surface->locked_fbs[i].n_refs = REFCOUNT_INIT_0;
         surface->locked_fbs[i].fb = surface->fbs + i;
+        surface->locked_fbs[i].render_fence_fd = -1;
+    }
+
+    surface->render_semaphore = VK_NULL_HANDLE;
+    surface->get_semaphore_fd = (PFN_vkGetSemaphoreFdKHR) vkGetDeviceProcAddr(vk_renderer_get_device(renderer), "vkGetSemaphoreFdKHR");
+    if (surface->get_semaphore_fd != NULL) {
+        surface->render_semaphore = create_exportable_semaphore(renderer);
     }
 
     COMPILE_ASSERT(ARRAY_SIZE(surface->fbs) == ARRAY_SIZE(surface->locked_fbs));
@@ -536,6 +664,10 @@ void vk_gbm_render_surface_deinit(struct surface *s) {
         fb_deinit(vk_surface->fbs + i, vk_renderer_get_device(vk_surface->renderer));
     }
 
+    if (vk_surface->render_semaphore != VK_NULL_HANDLE) {
+        vkDestroySemaphore(vk_renderer_get_device(vk_surface->renderer), vk_surface->render_semaphore, NULL);
+    }
+
     render_surface_deinit(s);
 }
 
@@ -584,7 +716,7 @@ static int vk_gbm_render_surface_present_kms(struct surface *s, const struct fl_
     struct gbm_bo *bo;
     enum pixfmt pixel_format;
     uint32_t fb_id;
-    int ok;
+    int in_fence_fd, ok;
 
     vk_surface = CAST_THIS(s);
     (void) props;
@@ -666,7 +798,14 @@ static int vk_gbm_render_surface_present_kms(struct surface *s, const struct fl_
     fb_id = meta->fb_id;
     pixel_format = vk_surface->pixel_format;
 
-    vkDeviceWaitIdle(vk_renderer_get_device(vk_surface->renderer));
+    // see egl_gbm_render_surface_present_kms
+    in_fence_fd = -1;
+    if (vk_surface->front_fb->render_fence_fd >= 0) {
+        in_fence_fd = dup(vk_surface->front_fb->render_fence_fd);
+        if (in_fence_fd < 0) {
+            LOG_ERROR("Couldn't duplicate render fence fd. dup: %s\n", strerror(errno));
+        }
+    }
 
     TRACER_BEGIN(vk_surface->surface.tracer, "kms_req_builder_push_fb_layer");
     ok = kms_req_builder_push_fb_layer(
@@ -691,8 +830,8 @@ static int vk_gbm_render_surface_present_kms(struct surface *s, const struct fl_
             .has_rotation = true,
             .rotation = PLANE_TRANSFORM_ROTATE_0,
 
-            .has_in_fence_fd = false,
-            .in_fence_fd = 0,
+            .has_in_fence_fd = in_fence_fd >= 0,
+            .in_fence_fd = in_fence_fd,
         },
         on_release_layer,
         NULL,
@@ -704,10 +843,19 @@ static int vk_gbm_render_surface_present_kms(struct surface *s, const struct fl_
         goto fail_unref_locked_fb;
     }
 
+    // Without a render fence (or if KMS can't use it and closed it), KMS can't wait for rendering
+    // to finish, so we need to do it here.
+    if (!kms_req_builder_last_layer_has_in_fence(builder)) {
+        vkDeviceWaitIdle(vk_renderer_get_device(vk_surface->renderer));
+    }
+
     surface_unlock(s);
     return ok;
 
 fail_unref_locked_fb:
+    if (in_fence_fd >= 0) {
+        close(in_fence_fd);
+    }
     locked_fb_unref(vk_surface->front_fb);
     goto fail_unlock;
 
@@ -721,19 +869,66 @@ fail_unlock:
 
 static int
 vk_gbm_render_surface_present_fbdev(struct surface *s, const struct fl_layer_props *props, struct fbdev_commit_builder *builder) {
-    struct vk_gbm_render_surface *render_surface;
+    struct vk_gbm_render_surface *vk_surface;
+    struct gbm_bo *bo;
+    uint32_t stride;
+    void *map_data, *vaddr;
+    int ok;
 
-    /// TODO: Implement by mmapping the current front bo, copy it into the fbdev
     /// TODO: Print a warning here if we're not using explicit linear tiling and transition to linear layout with vulkan instead of gbm_bo_map in that case
 
-    render_surface = CAST_THIS(s);
-    (void) render_surface;
-    (void) props;
-    (void) builder;
+    vk_surface = CAST_THIS(s);
+
+    /// TODO: Implement non axis-aligned fl_layer_props
+    ASSERT_MSG(props->is_aa_rect, "only axis aligned view geometry is supported right now");
 
-    UNIMPLEMENTED();
+    surface_lock(s);
 
+    ASSERT_NOT_NULL_MSG(
+        vk_surface->front_fb,
+        "There's no framebuffer available for scanout right now. Make sure you called render_surface_queue_present() before presenting."
+    );
+
+    bo = vk_surface->front_fb->fb->bo;
+
+    map_data = NULL;
+    TRACER_BEGIN(vk_surface->surface.tracer, "gbm_bo_map");
+    vaddr = gbm_bo_map(bo, 0, 0, gbm_bo_get_width(bo), gbm_bo_get_height(bo), GBM_BO_TRANSFER_READ, &stride, &map_data);
+    TRACER_END(vk_surface->surface.tracer, "gbm_bo_map");
+    if (vaddr == NULL) {
+        ok = EIO;
+        LOG_ERROR("Couldn't map GBM buffer for copying it into the framebuffer.\n");
+        goto fail_unlock;
+    }
+
+    TRACER_BEGIN(vk_surface->surface.tracer, "fbdev_commit_builder_push_layer");
+    ok = fbdev_commit_builder_push_layer(
+        builder,
+        &(const struct fbdev_layer){
+            .vaddr = vaddr,
+            .format = vk_surface->pixel_format,
+            .width = (int) gbm_bo_get_width(bo),
+            .height = (int) gbm_bo_get_height(bo),
+            .pitch = (int) stride,
+            .dst_x = (int) props->aa_rect.offset.x,
+            .dst_y = (int) props->aa_rect.offset.y,
+        }
+    );
+    TRACER_END(vk_surface->surface.tracer, "fbdev_commit_builder_push_layer");
+
+    gbm_bo_unmap(bo, map_data);
+
+    if (ok != 0) {
+        LOG_ERROR("Couldn't copy GBM buffer into the framebuffer.\n");
+        goto fail_unlock;
+    }
+
+    surface_unlock(s);
     return 0;
+
+fail_unlock:
+    surface_unlock(s);
+    return ok;
 }
 
 static int vk_gbm_render_surface_fill(struct render_surface *s, FlutterBackingStore *fl_store) {
@@ -813,6 +1008,12 @@ static int vk_gbm_render_surface_queue_present(struct render_surface *s, const F
         return EINVAL;
     }
 
+    if (vk_surface->render_semaphore != VK_NULL_HANDLE) {
+        TRACER_BEGIN(vk_surface->surface.tracer, "export_render_fence");
+        fb->render_fence_fd = export_render_fence(vk_surface);
+        TRACER_END(vk_surface->surface.tracer, "export_render_fence");
+    }
+
     // Replace the front fb with the new one
     // (will unref the old one if not NULL internally)
     locked_fb_swap_ptrs(&vk_surface->front_fb, fb);
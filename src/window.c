@@ -11,21 +11,28 @@
 #include "window.h"
 
 #include <errno.h>
+#include <math.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 
 #include <pthread.h>
+#include <unistd.h>
 
 #include <flutter_embedder.h>
 
 #include "compositor_ng.h"
 #include "cursor.h"
+#include "fbdev.h"
 #include "flutter-pi.h"
 #include "frame_scheduler.h"
 #include "modesetting.h"
+#include "notifier_listener.h"
+#include "pixel_format_conversion.h"
 #include "render_surface.h"
 #include "surface.h"
 #include "tracer.h"
 #include "util/collection.h"
+#include "util/list.h"
 #include "util/logging.h"
 #include "util/refcounting.h"
 
@@ -41,6 +48,21 @@
     #include "vk_renderer.h"
 #endif
 
+/**
+ * @brief A KMS window shows its frames on at most this many other displays.
+ */
+#define MAX_MIRRORS 3
+
+/**
+ * @brief Another display that shows the same framebuffers as the main display of a KMS window,
+ * driven by its own CRTC.
+ */
+struct kms_mirror {
+    struct drm_connector *connector;
+    struct drm_crtc *crtc;
+    drmModeModeInfo mode;
+};
+
 struct window {
     pthread_mutex_t lock;
     refcount_t n_refs;
@@ -65,6 +87,16 @@ struct window {
      */
     double refresh_rate;
 
+    /**
+     * @brief True if the display refreshes when a new frame is presented (variable refresh rate),
+     * instead of at a fixed rate.
+     *
+     * In that case, @ref refresh_rate is the highest refresh rate of the display and @ref min_refresh_rate
+     * the lowest one, or 0 if unknown.
+     */
+    bool vrr;
+    double min_refresh_rate;
+
     /**
      * @brief Flutter device pixel ratio (in the horizontal axis). Number of physical pixels per logical pixel.
      *
@@ -102,6 +134,19 @@ struct window {
      */
     struct vec2f display_size;
 
+    /**
+     * @brief Flutter renders at the display size multiplied by this factor, between 0 (exclusive) and 1.
+     *
+     * The layers flutter renders are then upscaled to the display size by the display controller,
+     * using the source & destination rectangles of the hardware planes.
+     */
+    double render_scale;
+
+    /**
+     * @brief The size of the buffers flutter renders into, in pixels. (So not rotated, unlike @ref view_size)
+     */
+    struct vec2f render_size;
+
     /**
      * @brief The rotation we should apply to the flutter layers to present them on screen.
      */
@@ -131,13 +176,20 @@ struct window {
     /**
      * @brief Matrix for transforming view coordinates to display coordinates.
      *
-     * Can be used as a root surface transform, for fitting the flutter view into the desired display frame.
-     *
      * Useful if for example flutter has specified a custom device orientation (for example kPortraitDown),
      * because we need to rotate the flutter view in that case.
      */
     struct mat3f view_to_display_transform;
 
+    /**
+     * @brief Matrices for transforming between view coordinates and the coordinates of the buffers flutter renders into.
+     *
+     * Same as @ref display_to_view_transform and @ref view_to_display_transform, but without the render scale.
+     * @ref view_to_render_transform is the root surface transform flutter should apply.
+     */
+    struct mat3f render_to_view_transform;
+    struct mat3f view_to_render_transform;
+
     /**
      * @brief True if we should use a specific pixel format.
      *
@@ -156,6 +208,12 @@ struct window {
      */
     struct fl_layer_composition *composition;
 
+    /**
+     * @brief Notified (with the window as the argument) when the view geometry changed,
+     * for example because another display was connected.
+     */
+    struct notifier geometry_notifier;
+
     /**
      * @brief KMS-specific fields if this is a KMS window.
      *
@@ -165,17 +223,86 @@ struct window {
         struct drm_connector *connector;
         struct drm_encoder *encoder;
         struct drm_crtc *crtc;
-        drmModeModeInfo *mode;
+        drmModeModeInfo mode;
 
         bool should_apply_mode;
 
+        /**
+         * @brief False while there's no display connected, or the connected one can't be driven by our CRTC.
+         * Frames are not committed in that case.
+         */
+        bool connected;
+
+        /**
+         * @brief Needed to select a new mode when another display is connected.
+         */
+        char *desired_videomode;
+        bool has_explicit_dimensions;
+        int explicit_width_mm, explicit_height_mm;
+        struct listener *hotplug_listener;
+
+        /**
+         * @brief If true, every other connected display that supports a mode with the same resolution
+         * as the main display shows the same content.
+         */
+        bool mirror;
+        struct kms_mirror mirrors[MAX_MIRRORS];
+        size_t n_mirrors;
+
+        /**
+         * @brief The color transform set using @ref window_set_color_transform, so it can be
+         * applied to mirrors that are added later. NULL / false if not set.
+         */
+        double *gamma_lut;
+        size_t n_gamma_lut_entries;
+        bool has_ctm;
+        double ctm[9];
+
         const struct pointer_icon *pointer_icon;
         struct cursor_buffer *cursor;
 
+        /**
+         * @brief Cursor buffers we've already created, most recently used first.
+         *
+         * Each entry holds a reference to the cursor buffer.
+         */
+        struct list_head cursor_cache;
+        int n_cached_cursors;
+
+        /**
+         * @brief Applies cursor movements independently of flutter frames.
+         *
+         * All movements that arrive while the thread waits for a vblank are coalesced
+         * into a single update. Protected by the window lock.
+         */
+        struct {
+            bool running;
+            bool stop;
+            bool dirty;
+            pthread_t thread;
+            pthread_cond_t cond;
+        } cursor_thread;
+
         bool logged_cursor_plane_allocation_failed;
         bool has_cursor_plane;
+
+        /// Set when the geometry was changed while presenting (because the render scale had to be disabled),
+        /// so the geometry listeners can be notified once the window is unlocked.
+        bool geometry_changed;
+
+        /// Set by the frame scheduler (without the window lock) when an upscaled frame couldn't be committed.
+        atomic_bool upscaled_commit_failed;
     } kms;
 
+    /**
+     * @brief fbdev-specific fields if this is a fbdev window.
+     *
+     */
+    struct {
+        struct fbdev *fbdev;
+        struct gbm_device *gbm_device;
+    } fbdev;
+
     /**
      * @brief The type of rendering that should be used. (gl, vk)
      *
@@ -243,6 +370,9 @@ struct window {
         bool has_pos,
         struct vec2i pos
     );
+    int (*get_last_vblank)(struct window *window, uint64_t *last_vblank_ns_out);
+    int (*set_color_transform_locked)(struct window *window, const double *gamma_lut, size_t n_gamma_lut_entries, const double *ctm);
+    int (*capture_locked)(struct window *window, window_capture_cb_t callback, void *userdata);
     void (*deinit)(struct window *window);
 };
 
@@ -289,6 +419,101 @@ static void fill_view_matrices(
 
 static void window_deinit(struct window *window);
 
+static double calculate_pixel_ratio(int width, int height, bool has_dimensions, int width_mm, int height_mm) {
+    if (has_dimensions == false) {
+        LOG_DEBUG(
+            "WARNING: display didn't provide valid physical dimensions. The device-pixel ratio will default "
+            "to 1.0, which may not be the fitting device-pixel ratio for your display. \n"
+            "Use the `-d` commandline parameter to specify the physical dimensions of your display.\n"
+        );
+        return 1.0;
+    }
+
+    int horizontal_dpi = (int) (width / (width_mm / 25.4));
+    int vertical_dpi = (int) (height / (height_mm / 25.4));
+
+    if (horizontal_dpi != vertical_dpi) {
+        // See https://github.com/flutter/flutter/issues/71865 for current status of this issue.
+        LOG_DEBUG("INFO: display has non-square pixels. Non-square-pixels are not supported by flutter.\n");
+    }
+
+    return (10.0 * width) / (width_mm * 38.0);
+}
+
+struct vec2i window_get_render_size(struct vec2i display_size, double render_scale) {
+    return VEC2I(MAX2(1, (int) round(display_size.x * render_scale)), MAX2(1, (int) round(display_size.y * render_scale)));
+}
+
+struct fl_layer_props
+fl_layer_props_render_to_display(const struct fl_layer_props *props, struct vec2f render_size, struct vec2f display_size) {
+    struct fl_layer_props display_props;
+    struct mat3f render_to_display;
+
+    render_to_display = MAT3F_SCALE(display_size.x / render_size.x, display_size.y / render_size.y);
+
+    display_props = *props;
+    display_props.aa_rect = quad_get_aa_bounding_rect(transform_aa_rect(render_to_display, props->aa_rect));
+    display_props.quad = transform_quad(render_to_display, props->quad);
+    return display_props;
+}
+
+void window_get_display_view_transforms(
+    struct vec2i display_size,
+    double render_scale,
+    drm_plane_transform_t rotation,
+    struct mat3f *display_to_view_out,
+    struct mat3f *view_to_display_out
+) {
+    struct mat3f render_to_view, view_to_render, render_to_display, display_to_render;
+    struct vec2i render_size;
+
+    render_size = window_get_render_size(display_size, render_scale);
+
+    fill_view_matrices(rotation, render_size.x, render_size.y, &render_to_view, &view_to_render);
+
+    render_to_display = MAT3F_SCALE((double) display_size.x / render_size.x, (double) display_size.y / render_size.y);
+    display_to_render = MAT3F_SCALE((double) render_size.x / display_size.x, (double) render_size.y / display_size.y);
+
+    *display_to_view_out = multiply_mat3f(render_to_view, display_to_render);
+    *view_to_display_out = multiply_mat3f(render_to_display, view_to_render);
+}
+
+/**
+ * @brief Updates the display size, physical dimensions & everything derived from them, keeping the rotation
+ * and render scale.
+ *
+ * Listeners of @ref window_add_geometry_listener need to be notified afterwards, without the window lock held.
+ */
+static void window_set_display_size_locked(struct window *window, int width, int height, bool has_dimensions, int width_mm, int height_mm) {
+    drm_plane_transform_t rotation = window->rotation;
+    struct vec2i render_size;
+    int render_width, render_height;
+
+    render_size = window_get_render_size(VEC2I(width, height), window->render_scale);
+    render_width = render_size.x;
+    render_height = render_size.y;
+
+    fill_view_matrices(rotation, render_width, render_height, &window->render_to_view_transform, &window->view_to_render_transform);
+
+    window_get_display_view_transforms(
+        VEC2I(width, height),
+        window->render_scale,
+        rotation,
+        &window->display_to_view_transform,
+        &window->view_to_display_transform
+    );
+
+    // Flutter only sees the render size, so the physical pixels are the rendered pixels.
+    window->pixel_ratio = calculate_pixel_ratio(render_width, render_height, has_dimensions, width_mm, height_mm);
+    window->has_dimensions = has_dimensions;
+    window->width_mm = width_mm;
+    window->height_mm = height_mm;
+    window->view_size =
+        rotation.rotate_90 || rotation.rotate_270 ? VEC2F(render_height, render_width) : VEC2F(render_width, render_height);
+    window->display_size = VEC2F(width, height);
+    window->render_size = VEC2F(render_width, render_height);
+}
+
 static int window_init(
     // clang-format off
     struct window *window,
@@ -299,11 +524,11 @@ static int window_init(
     int width, int height,
     bool has_dimensions, int width_mm, int height_mm,
     double refresh_rate,
-    bool has_forced_pixel_format, enum pixfmt forced_pixel_format
+    bool has_forced_pixel_format, enum pixfmt forced_pixel_format,
+    double render_scale
     // clang-format on
 ) {
     enum device_orientation original_orientation;
-    double pixel_ratio;
 
     ASSERT_NOT_NULL(window);
     ASSERT_NOT_NULL(tracer);
@@ -311,27 +536,7 @@ static int window_init(
     assert(!has_rotation || PLANE_TRANSFORM_IS_ONLY_ROTATION(rotation));
     assert(!has_orientation || ORIENTATION_IS_VALID(orientation));
     assert(!has_dimensions || (width_mm > 0 && height_mm > 0));
-
-    if (has_dimensions == false) {
-        LOG_DEBUG(
-            "WARNING: display didn't provide valid physical dimensions. The device-pixel ratio will default "
-            "to 1.0, which may not be the fitting device-pixel ratio for your display. \n"
-            "Use the `-d` commandline parameter to specify the physical dimensions of your display.\n"
-        );
-        pixel_ratio = 1.0;
-    } else {
-        pixel_ratio = (10.0 * width) / (width_mm * 38.0);
-
-        int horizontal_dpi = (int) (width / (width_mm / 25.4));
-        int vertical_dpi = (int) (height / (height_mm / 25.4));
-
-        if (horizontal_dpi != vertical_dpi) {
-            // See https://github.com/flutter/flutter/issues/71865 for current status of this issue.
-            LOG_DEBUG("INFO: display has non-square pixels. Non-square-pixels are not supported by flutter.\n");
-        }
-    }
-
-    assert(!has_rotation || PLANE_TRANSFORM_IS_ONLY_ROTATION(rotation));
+    assert(render_scale > 0.0 && render_scale <= 1.0);
 
     if (width > height) {
         original_orientation = kLandscapeLeft;
@@ -385,20 +590,17 @@ static int window_init(
 
     assert(has_orientation && has_rotation);
 
-    fill_view_matrices(rotation, width, height, &window->display_to_view_transform, &window->view_to_display_transform);
+    window->rotation = rotation;
+    window->render_scale = render_scale;
+    window_set_display_size_locked(window, width, height, has_dimensions, width_mm, height_mm);
 
     pthread_mutex_init(&window->lock, NULL);
     window->n_refs = REFCOUNT_INIT_1;
     window->tracer = tracer_ref(tracer);
     window->frame_scheduler = frame_scheduler_ref(scheduler);
     window->refresh_rate = refresh_rate;
-    window->pixel_ratio = pixel_ratio;
-    window->has_dimensions = has_dimensions;
-    window->width_mm = width_mm;
-    window->height_mm = height_mm;
-    window->view_size = rotation.rotate_90 || rotation.rotate_270 ? VEC2F(height, width) : VEC2F(width, height);
-    window->display_size = VEC2F(width, height);
-    window->rotation = rotation;
+    window->vrr = false;
+    window->min_refresh_rate = 0.0;
     window->orientation = orientation;
     window->original_orientation = original_orientation;
     window->has_forced_pixel_format = has_forced_pixel_format;
@@ -408,6 +610,7 @@ static int window_init(
     window->gl_renderer = NULL;
     window->vk_renderer = NULL;
     window->render_surface = NULL;
+    change_notifier_init(&window->geometry_notifier);
     window->cursor_enabled = false;
     window->cursor_pos = VEC2I(0, 0);
     window->push_composition = NULL;
@@ -417,6 +620,9 @@ static int window_init(
     window->get_egl_surface = NULL;
 #endif
     window->set_cursor_locked = NULL;
+    window->get_last_vblank = NULL;
+    window->set_color_transform_locked = NULL;
+    window->capture_locked = NULL;
     window->deinit = window_deinit;
     return 0;
 }
@@ -427,6 +633,7 @@ static void window_deinit(struct window *window) {
         fl_layer_composition_unref(window->composition);
     }
 
+    notifier_deinit(&window->geometry_notifier);
     frame_scheduler_unref(window->frame_scheduler);
     tracer_unref(window->tracer);
     pthread_mutex_destroy(&window->lock);
@@ -447,6 +654,12 @@ int window_push_composition(struct window *window, struct fl_layer_composition *
     return window->push_composition(window, composition);
 }
 
+struct listener *window_add_geometry_listener(struct window *window, listener_cb_t notify, void *userdata) {
+    ASSERT_NOT_NULL(window);
+    ASSERT_NOT_NULL(notify);
+    return notifier_listen(&window->geometry_notifier, notify, NULL, userdata);
+}
+
 struct view_geometry window_get_view_geometry(struct window *window) {
     ASSERT_NOT_NULL(window);
 
@@ -454,8 +667,11 @@ struct view_geometry window_get_view_geometry(struct window *window) {
     struct view_geometry geometry = {
         .view_size = window->view_size,
         .display_size = window->display_size,
+        .render_size = window->render_size,
         .display_to_view_transform = window->display_to_view_transform,
         .view_to_display_transform = window->view_to_display_transform,
+        .render_to_view_transform = window->render_to_view_transform,
+        .view_to_render_transform = window->view_to_render_transform,
         .device_pixel_ratio = window->pixel_ratio,
     };
     window_unlock(window);
@@ -470,14 +686,41 @@ double window_get_refresh_rate(struct window *window) {
 }
 
 int window_get_next_vblank(struct window *window, uint64_t *next_vblank_ns_out) {
+    uint64_t last_vblank_ns, interval_ns, now;
+    int ok;
+
     ASSERT_NOT_NULL(window);
     ASSERT_NOT_NULL(next_vblank_ns_out);
-    (void) window;
-    (void) next_vblank_ns_out;
 
-    /// TODO: Implement
-    UNIMPLEMENTED();
+    interval_ns = (uint64_t) (1000000000.0 / (window->refresh_rate > 0 ? window->refresh_rate : 60.0));
+    now = get_monotonic_time();
+
+    // If we don't know when the last vblank happened, we can't know the phase.
+    // Just assume vblanks are aligned to the interval.
+    last_vblank_ns = 0;
+    if (window->get_last_vblank != NULL) {
+        ok = window->get_last_vblank(window, &last_vblank_ns);
+        if (ok != 0 || last_vblank_ns > now) {
+            last_vblank_ns = 0;
+        }
+    }
+
+    if (window->vrr) {
+        // With VRR, the next frame can be scanned out as soon as the panel allows it,
+        // i.e. one max-refresh-rate interval after the last one.
+        // If no frame arrived for longer than the panel can hold an image, it refreshed on its own,
+        // so the next frame can come one interval after that self-refresh.
+        if (window->min_refresh_rate > 0 && last_vblank_ns != 0) {
+            uint64_t max_interval_ns = (uint64_t) (1000000000.0 / window->min_refresh_rate);
+
+            last_vblank_ns += (now - last_vblank_ns) / max_interval_ns * max_interval_ns;
+        }
+
+        *next_vblank_ns_out = MAX2(now, last_vblank_ns + interval_ns);
+        return 0;
+    }
 
+    *next_vblank_ns_out = last_vblank_ns + ((now - last_vblank_ns) / interval_ns + 1) * interval_ns;
     return 0;
 }
 
@@ -532,8 +775,53 @@ int window_set_cursor(
     return ok;
 }
 
+int window_set_color_transform(struct window *window, const double *gamma_lut, size_t n_gamma_lut_entries, const double *ctm) {
+    int ok;
+
+    ASSERT_NOT_NULL(window);
+
+    if (window->set_color_transform_locked == NULL) {
+        return EOPNOTSUPP;
+    }
+
+    window_lock(window);
+
+    ok = window->set_color_transform_locked(window, gamma_lut, n_gamma_lut_entries, ctm);
+
+    window_unlock(window);
+
+    return ok;
+}
+
+int window_capture(struct window *window, window_capture_cb_t callback, void *userdata) {
+    int ok;
+
+    ASSERT_NOT_NULL(window);
+    ASSERT_NOT_NULL(callback);
+
+    if (window->capture_locked == NULL) {
+        return EOPNOTSUPP;
+    }
+
+    window_lock(window);
+
+    ok = window->capture_locked(window, callback, userdata);
+
+    window_unlock(window);
+
+    return ok;
+}
+
+/**
+ * @brief The max. number of cursor buffers we keep around per window.
+ *
+ * There are ~35 pointer kinds, but typically only a handful are used by an app.
+ */
+#define MAX_CACHED_CURSORS 16
+
 struct cursor_buffer {
     refcount_t n_refs;
+    struct list_head entry;
 
     const struct pointer_icon *icon;
     enum pixfmt format;
@@ -625,27 +913,20 @@ static struct cursor_buffer *cursor_buffer_new(struct drmdev *drmdev, const stru
             goto fail_free_duped_pixel_data;
         }
 
-        for (int y = 0; y < size.y; y++) {
-            for (int x = 0; x < size.x; x++) {
-                int buffer_x, buffer_y;
-                if (rotation.rotate_90) {
-                    buffer_x = size.y - y - 1;
-                    buffer_y = x;
-                } else if (rotation.rotate_180) {
-                    buffer_x = size.y - y - 1;
-                    buffer_y = size.x - x - 1;
-                } else {
-                    ASSUME(rotation.rotate_270);
-                    buffer_x = y;
-                    buffer_y = size.x - x - 1;
-                }
-
-                int buffer_offset = rotated_size.x * buffer_y + buffer_x;
-                int cursor_offset = size.x * y + x;
-
-                rotated[buffer_offset] = pixel_data[cursor_offset];
-            }
-        }
+        // Rotates in cache-friendly tiles.
+        pixfmt_convert_image(
+            rotated,
+            PIXFMT_ARGB8888,
+            rotated_size.x * 4,
+            pixel_data,
+            PIXFMT_ARGB8888,
+            size.x * 4,
+            size.x,
+            size.y,
+            rotation.rotate_90  ? PIXFMT_TRANSFORM_ROTATE_90 :
+            rotation.rotate_180 ? PIXFMT_TRANSFORM_ROTATE_180 :
+                                  PIXFMT_TRANSFORM_ROTATE_270
+        );
 
         ok = gbm_bo_write(bo, rotated, gbm_bo_get_stride(bo) * rotated_size.y);
 
@@ -675,6 +956,7 @@ static struct cursor_buffer *cursor_buffer_new(struct drmdev *drmdev, const stru
     }
 
     b->n_refs = REFCOUNT_INIT_1;
+    list_inithead(&b->entry);
     b->icon = icon;
     b->format = PIXFMT_ARGB8888;
     b->width = rotated_size.x;
@@ -724,6 +1006,47 @@ static void cursor_buffer_unref_with_locked_drmdev(void *userdata) {
     }
 }
 
+/**
+ * @brief Get a cursor buffer for @param icon rotated by @param rotation from the window's cursor cache,
+ * or create and cache a new one if there's none yet.
+ *
+ * Pointer icons are unique for each (pointer kind, pixel ratio) pair, so this is effectively
+ * keyed by (pointer kind, pixel ratio, rotation).
+ *
+ * @returns A new reference to the cursor buffer, or NULL on error.
+ */
+static struct cursor_buffer *kms_window_get_cursor_buffer_locked(struct window *window, const struct pointer_icon *icon, drm_plane_transform_t rotation) {
+    struct cursor_buffer *cursor;
+
+    list_for_each_entry(struct cursor_buffer, cached, &window->kms.cursor_cache, entry) {
+        if (cached->icon == icon && cached->rotation.u32 == rotation.u32) {
+            // move it to the front, so the least recently used buffer is at the end.
+            list_del(&cached->entry);
+            list_add(&cached->entry, &window->kms.cursor_cache);
+            return cursor_buffer_ref(cached);
+        }
+    }
+
+    cursor = cursor_buffer_new(window->kms.drmdev, icon, rotation);
+    if (cursor == NULL) {
+        return NULL;
+    }
+
+    if (window->kms.n_cached_cursors >= MAX_CACHED_CURSORS) {
+        struct cursor_buffer *last = list_last_entry(&window->kms.cursor_cache, struct cursor_buffer, entry);
+
+        list_del(&last->entry);
+        cursor_buffer_unref(last);
+        window->kms.n_cached_cursors--;
+    }
+
+    // the cache takes over the initial reference.
+    list_add(&cursor->entry, &window->kms.cursor_cache);
+    window->kms.n_cached_cursors++;
+
+    return cursor_buffer_ref(cursor);
+}
+
 static int select_mode(
     struct drmdev *drmdev,
     struct drm_connector **connector_out,
@@ -738,9 +1061,9 @@ static int select_mode(
     drmModeModeInfo *mode, *mode_iter;
     int ok;
 
-    // find any connected connector
+    // find any connected connector. Writeback connectors are always connected, but don't drive a display.
     for_each_connector_in_drmdev(drmdev, connector) {
-        if (connector->variable_state.connection_state == kConnected_DrmConnectionState) {
+        if (connector->variable_state.connection_state == kConnected_DrmConnectionState && connector->type != kWRITEBACK_DrmConnectorType) {
             break;
         }
     }
@@ -880,6 +1203,24 @@ static EGLSurface kms_window_get_egl_surface(struct window *window);
 #endif
 
 static void kms_window_deinit(struct window *window);
+static int kms_window_get_last_vblank(struct window *window, uint64_t *last_vblank_ns_out);
+static int
+kms_window_set_color_transform_locked(struct window *window, const double *gamma_lut, size_t n_gamma_lut_entries, const double *ctm);
+static int kms_window_capture_locked(struct window *window, window_capture_cb_t callback, void *userdata);
+static enum listener_return kms_window_on_hotplug(void *arg, void *userdata);
+static void *kms_window_cursor_thread(void *userdata);
+
+static bool crtc_has_cursor_plane(struct drmdev *drmdev, struct drm_crtc *crtc) {
+    struct drm_plane *plane;
+
+    for_each_plane_in_drmdev(drmdev, plane) {
+        if (plane->type == kCursor_DrmPlaneType && (plane->possible_crtcs & crtc->bitmask)) {
+            return true;
+        }
+    }
+
+    return false;
+}
 static int kms_window_set_cursor_locked(
     // clang-format off
     struct window *window,
@@ -889,95 +1230,348 @@ static int kms_window_set_cursor_locked(
     // clang-format on
 );
 
-MUST_CHECK struct window *kms_window_new(
-    // clang-format off
-    struct tracer *tracer,
-    struct frame_scheduler *scheduler,
-    enum renderer_type renderer_type,
-    struct gl_renderer *gl_renderer,
-    struct vk_renderer *vk_renderer,
-    bool has_rotation, drm_plane_transform_t rotation,
-    bool has_orientation, enum device_orientation orientation,
-    bool has_explicit_dimensions, int width_mm, int height_mm,
-    bool has_forced_pixel_format, enum pixfmt forced_pixel_format,
-    struct drmdev *drmdev,
-    const char *desired_videomode
-    // clang-format on
-) {
-    struct window *window;
-    struct drm_connector *selected_connector;
-    struct drm_encoder *selected_encoder;
-    struct drm_crtc *selected_crtc;
-    drmModeModeInfo *selected_mode;
-    bool has_dimensions;
-    int ok;
+/**
+ * @brief Get the physical dimensions of the display connected to @param connector, if they look valid.
+ */
+static bool get_connector_dimensions(const struct drm_connector *connector, int *width_mm_out, int *height_mm_out) {
+    if (connector->variable_state.width_mm % 10 || connector->variable_state.height_mm % 10) {
+        // as a heuristic, assume the physical dimensions are valid if they're not both multiples of 10.
+        // dimensions like 160x90mm, 150x100mm are often bogus.
+        *width_mm_out = connector->variable_state.width_mm;
+        *height_mm_out = connector->variable_state.height_mm;
+        return true;
+    } else if (connector->type == DRM_MODE_CONNECTOR_DSI
+        && connector->variable_state.width_mm == 0
+        && connector->variable_state.height_mm == 0) {
+        // assume this is the official Raspberry Pi DSI display.
+        *width_mm_out = 155;
+        *height_mm_out = 86;
+        return true;
+    } else {
+        return false;
+    }
+}
 
-    ASSERT_NOT_NULL(drmdev);
+/**
+ * @brief Enables variable refresh rate if it was requested and the current connector & CRTC support it,
+ * and updates the refresh rate of the window accordingly.
+ */
+static void kms_window_update_vrr_locked(struct window *window) {
+    struct drm_connector *connector = window->kms.connector;
 
-#if !defined(HAVE_VULKAN)
-    ASSUME(renderer_type != kVulkan_RendererType);
-#endif
+    window->vrr = false;
+    window->min_refresh_rate = 0.0;
+    window->refresh_rate = mode_get_vrefresh(&window->kms.mode);
 
-#if !defined(HAVE_EGL_GLES2)
-    ASSUME(renderer_type != kOpenGL_RendererType);
-#endif
+    if (frame_scheduler_get_present_mode(window->frame_scheduler) != kVariableRefreshRate_PresentMode) {
+        return;
+    }
 
-    // if opengl --> gl_renderer != NULL && vk_renderer == NULL
-    assert(renderer_type != kOpenGL_RendererType || (gl_renderer != NULL && vk_renderer == NULL));
+    if (!connector->variable_state.vrr_capable) {
+        LOG_ERROR("The selected display doesn't support variable refresh rate. Falling back to fixed refresh rate.\n");
+        return;
+    } else if (!DRM_ID_IS_VALID(window->kms.crtc->ids.vrr_enabled)) {
+        LOG_ERROR("The selected CRTC doesn't support variable refresh rate. Falling back to fixed refresh rate.\n");
+        return;
+    }
 
-    // if vulkan --> vk_renderer != NULL && gl_renderer == NULL
-    assert(renderer_type != kVulkan_RendererType || (vk_renderer != NULL && gl_renderer == NULL));
+    window->vrr = true;
 
-    window = malloc(sizeof *window);
-    if (window == NULL) {
-        return NULL;
+    // With VRR, the mode refresh rate is the fastest the panel will go.
+    // The slowest is only known from the EDID.
+    if (connector->variable_state.max_refresh_hz != 0 && connector->variable_state.max_refresh_hz < window->refresh_rate) {
+        window->refresh_rate = connector->variable_state.max_refresh_hz;
     }
+    window->min_refresh_rate = connector->variable_state.min_refresh_hz;
 
-    ok = select_mode(drmdev, &selected_connector, &selected_encoder, &selected_crtc, &selected_mode, desired_videomode);
-    if (ok != 0) {
-        goto fail_free_window;
-    }
+    LOG_DEBUG("Using variable refresh rate, %" PRIu32 "Hz - %fHz.\n", connector->variable_state.min_refresh_hz, window->refresh_rate);
+}
 
-    if (has_explicit_dimensions) {
-        has_dimensions = true;
-    } else if (selected_connector->variable_state.width_mm % 10 || selected_connector->variable_state.height_mm % 10) {
-        // as a heuristic, assume the physical dimensions are valid if they're not both multiples of 10.
-        // dimensions like 160x90mm, 150x100mm are often bogus.
-        has_dimensions = true;
-        width_mm = selected_connector->variable_state.width_mm;
-        height_mm = selected_connector->variable_state.height_mm;
-    } else if (selected_connector->type == DRM_MODE_CONNECTOR_DSI
-        && selected_connector->variable_state.width_mm == 0
-        && selected_connector->variable_state.height_mm == 0) {
-        // assume this is the official Raspberry Pi DSI display.
-        has_dimensions = true;
-        width_mm = 155;
-        height_mm = 86;
-    } else {
-        has_dimensions = false;
+/**
+ * @brief Finds a mode with the same resolution as @param main_mode for @param connector, and a CRTC
+ * that can drive it and is not in @param used_crtcs.
+ */
+static bool select_mirror(
+    struct drmdev *drmdev,
+    struct drm_connector *connector,
+    uint32_t used_crtcs,
+    const drmModeModeInfo *main_mode,
+    struct kms_mirror *mirror_out
+) {
+    struct drm_encoder *encoder;
+    struct drm_crtc *crtc;
+    drmModeModeInfo *mode, *mode_iter;
+    double diff, best_diff;
+
+    // The planes are positioned in main display coordinates, so the resolution has to match.
+    // Prefer the refresh rate closest to that of the main display, so both displays flip in step.
+    mode = NULL;
+    best_diff = INFINITY;
+    for_each_mode_in_connector(connector, mode_iter) {
+        if (mode_iter->hdisplay != main_mode->hdisplay || mode_iter->vdisplay != main_mode->vdisplay) {
+            continue;
+        }
+
+        diff = fabs(mode_get_vrefresh(mode_iter) - mode_get_vrefresh(main_mode));
+        if (diff < best_diff) {
+            mode = mode_iter;
+            best_diff = diff;
+        }
     }
 
-    ok = window_init(
-        // clang-format off
-        window,
-        tracer,
-        scheduler,
-        has_rotation, rotation,
-        has_orientation, orientation,
-        selected_mode->hdisplay, selected_mode->vdisplay,
-        has_dimensions, width_mm, height_mm,
-        mode_get_vrefresh(selected_mode),
-        has_forced_pixel_format, forced_pixel_format
-        // clang-format on
-    );
-    if (ok != 0) {
-        free(window);
-        return NULL;
+    if (mode == NULL) {
+        return false;
     }
 
-    LOG_DEBUG_UNPREFIXED(
-        "display mode:\n"
-        "  resolution: %" PRIu16 " x %" PRIu16
+    crtc = NULL;
+    for (int i = 0; i < connector->n_encoders && crtc == NULL; i++) {
+        for_each_encoder_in_drmdev(drmdev, encoder) {
+            if (encoder->encoder->encoder_id == connector->encoders[i]) {
+                break;
+            }
+        }
+
+        if (encoder == NULL) {
+            continue;
+        }
+
+        for_each_crtc_in_drmdev(drmdev, crtc) {
+            if ((encoder->encoder->possible_crtcs & crtc->bitmask) && !(used_crtcs & crtc->bitmask)) {
+                break;
+            }
+        }
+    }
+
+    if (crtc == NULL) {
+        return false;
+    }
+
+    mirror_out->connector = connector;
+    mirror_out->crtc = crtc;
+    mirror_out->mode = *mode;
+    return true;
+}
+
+/**
+ * @brief Turns off a CRTC we don't use anymore, which also releases the framebuffers it still shows.
+ */
+static void kms_window_disable_crtc_locked(struct window *window, struct drm_crtc *crtc) {
+    struct kms_req_builder *builder;
+    struct kms_req *req;
+    int ok;
+
+    builder = drmdev_create_request_builder(window->kms.drmdev, crtc->id);
+    if (builder == NULL) {
+        return;
+    }
+
+    ok = kms_req_builder_unset_mode(builder);
+    if (ok != 0) {
+        LOG_ERROR("Couldn't turn off the display that's not mirrored anymore. kms_req_builder_unset_mode: %s\n", strerror(ok));
+        kms_req_builder_unref(builder);
+        return;
+    }
+
+    req = kms_req_builder_build(builder);
+    kms_req_builder_unref(builder);
+    if (req == NULL) {
+        return;
+    }
+
+    ok = kms_req_commit_blocking(req, NULL);
+    if (ok != 0) {
+        LOG_ERROR("Couldn't turn off the display that's not mirrored anymore. kms_req_commit_blocking: %s\n", strerror(ok));
+    }
+
+    kms_req_unref(req);
+}
+
+/**
+ * @brief Uploads the color transform of the window for @param crtc, to be applied with its next commit.
+ */
+static int kms_window_apply_color_transform_locked(struct window *window, struct drm_crtc *crtc) {
+    int ok;
+
+    ok = drmdev_set_crtc_gamma_lut(window->kms.drmdev, crtc->id, window->kms.gamma_lut, window->kms.n_gamma_lut_entries);
+    if (ok != 0 && !(ok == EOPNOTSUPP && window->kms.gamma_lut == NULL)) {
+        return ok;
+    }
+
+    ok = drmdev_set_crtc_ctm(window->kms.drmdev, crtc->id, window->kms.has_ctm ? window->kms.ctm : NULL);
+    if (ok != 0 && !(ok == EOPNOTSUPP && !window->kms.has_ctm)) {
+        return ok;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Re-selects the displays that mirror the main display, if mirroring is enabled.
+ *
+ * Must be called when the main display or its mode changed, or displays were (dis-)connected.
+ */
+static void kms_window_update_mirrors_locked(struct window *window) {
+    struct drm_connector *connector;
+    struct kms_mirror mirrors[MAX_MIRRORS];
+    uint32_t used_crtcs;
+    size_t n_mirrors;
+    bool still_used;
+
+    if (!window->kms.mirror) {
+        return;
+    }
+
+    n_mirrors = 0;
+    used_crtcs = window->kms.crtc->bitmask;
+    for_each_connector_in_drmdev(window->kms.drmdev, connector) {
+        if (connector == window->kms.connector || connector->type == kWRITEBACK_DrmConnectorType
+            || connector->variable_state.connection_state != kConnected_DrmConnectionState) {
+            continue;
+        }
+
+        if (n_mirrors == MAX_MIRRORS) {
+            LOG_ERROR(
+                "Only %d displays can mirror the main display. Ignoring the display on connector %" PRIu32 ".\n",
+                MAX_MIRRORS,
+                connector->id
+            );
+            continue;
+        }
+
+        if (!select_mirror(window->kms.drmdev, connector, used_crtcs, &window->kms.mode, mirrors + n_mirrors)) {
+            LOG_ERROR(
+                "The display on connector %" PRIu32 " can't mirror the main display, it either doesn't support a %" PRIu16 "x%" PRIu16
+                " mode or there's no CRTC left to drive it.\n",
+                connector->id,
+                window->kms.mode.hdisplay,
+                window->kms.mode.vdisplay
+            );
+            continue;
+        }
+
+        LOG_DEBUG(
+            "Mirroring to connector %" PRIu32 " using CRTC %" PRIu32 ", at %fHz.\n",
+            connector->id,
+            mirrors[n_mirrors].crtc->id,
+            mode_get_vrefresh(&mirrors[n_mirrors].mode)
+        );
+
+        used_crtcs |= mirrors[n_mirrors].crtc->bitmask;
+        n_mirrors++;
+    }
+
+    // Turn off the CRTCs we don't use anymore, so they don't keep showing (and holding on to) an old frame.
+    for (size_t i = 0; i < window->kms.n_mirrors; i++) {
+        still_used = false;
+        for (size_t j = 0; j < n_mirrors; j++) {
+            if (mirrors[j].crtc == window->kms.mirrors[i].crtc) {
+                still_used = true;
+                break;
+            }
+        }
+
+        if (!still_used && window->kms.mirrors[i].crtc != window->kms.crtc) {
+            kms_window_disable_crtc_locked(window, window->kms.mirrors[i].crtc);
+        }
+    }
+
+    memcpy(window->kms.mirrors, mirrors, n_mirrors * sizeof *mirrors);
+    window->kms.n_mirrors = n_mirrors;
+
+    if (window->kms.gamma_lut != NULL || window->kms.has_ctm) {
+        for (size_t i = 0; i < n_mirrors; i++) {
+            if (kms_window_apply_color_transform_locked(window, mirrors[i].crtc) != 0) {
+                LOG_ERROR("Couldn't apply the color transform to the display on connector %" PRIu32 ".\n", mirrors[i].connector->id);
+            }
+        }
+    }
+}
+
+MUST_CHECK struct window *kms_window_new(
+    // clang-format off
+    struct tracer *tracer,
+    struct frame_scheduler *scheduler,
+    enum renderer_type renderer_type,
+    struct gl_renderer *gl_renderer,
+    struct vk_renderer *vk_renderer,
+    bool has_rotation, drm_plane_transform_t rotation,
+    bool has_orientation, enum device_orientation orientation,
+    bool has_explicit_dimensions, int width_mm, int height_mm,
+    bool has_forced_pixel_format, enum pixfmt forced_pixel_format,
+    struct drmdev *drmdev,
+    const char *desired_videomode,
+    bool mirror,
+    double render_scale
+    // clang-format on
+) {
+    struct window *window;
+    struct drm_connector *selected_connector;
+    struct drm_encoder *selected_encoder;
+    struct drm_crtc *selected_crtc;
+    drmModeModeInfo *selected_mode;
+    bool has_dimensions;
+    int ok;
+
+    ASSERT_NOT_NULL(drmdev);
+
+#if !defined(HAVE_VULKAN)
+    ASSUME(renderer_type != kVulkan_RendererType);
+#endif
+
+#if !defined(HAVE_EGL_GLES2)
+    ASSUME(renderer_type != kOpenGL_RendererType);
+#endif
+
+    // if opengl --> gl_renderer != NULL && vk_renderer == NULL
+    assert(renderer_type != kOpenGL_RendererType || (gl_renderer != NULL && vk_renderer == NULL));
+
+    // if vulkan --> vk_renderer != NULL && gl_renderer == NULL
+    assert(renderer_type != kVulkan_RendererType || (vk_renderer != NULL && gl_renderer == NULL));
+
+    window = malloc(sizeof *window);
+    if (window == NULL) {
+        return NULL;
+    }
+
+    ok = select_mode(drmdev, &selected_connector, &selected_encoder, &selected_crtc, &selected_mode, desired_videomode);
+    if (ok != 0) {
+        goto fail_free_window;
+    }
+
+    if (has_explicit_dimensions) {
+        has_dimensions = true;
+    } else {
+        has_dimensions = get_connector_dimensions(selected_connector, &width_mm, &height_mm);
+    }
+
+    // Legacy modesetting can't scale, it always scans out the framebuffer at the mode size.
+    if (render_scale != 1.0 && !drmdev_supports_atomic_modesetting(drmdev)) {
+        LOG_ERROR("Rendering at a lower resolution needs atomic modesetting. Rendering at the display resolution instead.\n");
+        render_scale = 1.0;
+    }
+
+    ok = window_init(
+        // clang-format off
+        window,
+        tracer,
+        scheduler,
+        has_rotation, rotation,
+        has_orientation, orientation,
+        selected_mode->hdisplay, selected_mode->vdisplay,
+        has_dimensions, width_mm, height_mm,
+        mode_get_vrefresh(selected_mode),
+        has_forced_pixel_format, forced_pixel_format,
+        render_scale
+        // clang-format on
+    );
+    if (ok != 0) {
+        free(window);
+        return NULL;
+    }
+
+    LOG_DEBUG_UNPREFIXED(
+        "display mode:\n"
+        "  resolution: %" PRIu16 " x %" PRIu16
         "\n"
         "  refresh rate: %fHz\n"
         "  physical size: %dmm x %dmm\n"
@@ -996,10 +1590,27 @@ MUST_CHECK struct window *kms_window_new(
     window->kms.connector = selected_connector;
     window->kms.encoder = selected_encoder;
     window->kms.crtc = selected_crtc;
-    window->kms.mode = selected_mode;
+    window->kms.mode = *selected_mode;
     window->kms.should_apply_mode = true;
+    window->kms.connected = true;
+    window->kms.desired_videomode = desired_videomode != NULL ? strdup(desired_videomode) : NULL;
+    window->kms.has_explicit_dimensions = has_explicit_dimensions;
+    window->kms.explicit_width_mm = width_mm;
+    window->kms.explicit_height_mm = height_mm;
+    kms_window_update_vrr_locked(window);
+    window->kms.mirror = mirror;
+    window->kms.n_mirrors = 0;
+    window->kms.gamma_lut = NULL;
+    window->kms.n_gamma_lut_entries = 0;
+    window->kms.has_ctm = false;
+    kms_window_update_mirrors_locked(window);
     window->kms.cursor = NULL;
+    window->kms.logged_cursor_plane_allocation_failed = false;
+    window->kms.geometry_changed = false;
+    window->kms.upscaled_commit_failed = false;
     window->kms.pointer_icon = NULL;
+    list_inithead(&window->kms.cursor_cache);
+    window->kms.n_cached_cursors = 0;
     window->renderer_type = renderer_type;
     if (gl_renderer != NULL) {
 #ifdef HAVE_EGL_GLES2
@@ -1025,6 +1636,33 @@ MUST_CHECK struct window *kms_window_new(
 #endif
     window->deinit = kms_window_deinit;
     window->set_cursor_locked = kms_window_set_cursor_locked;
+    window->get_last_vblank = kms_window_get_last_vblank;
+    window->set_color_transform_locked = kms_window_set_color_transform_locked;
+    window->capture_locked = kms_window_capture_locked;
+
+    window->kms.cursor_thread.stop = false;
+    window->kms.cursor_thread.dirty = false;
+    pthread_cond_init(&window->kms.cursor_thread.cond, NULL);
+
+    // Not fatal either, we just won't adapt to other displays being connected.
+    window->kms.hotplug_listener = drmdev_add_hotplug_listener(drmdev, kms_window_on_hotplug, window);
+    if (window->kms.hotplug_listener == NULL) {
+        LOG_ERROR("Couldn't listen for display hotplug events.\n");
+    }
+
+    // Without a cursor plane, cursor movements are applied with the next flutter frame,
+    // so the thread would only sit there.
+    window->kms.cursor_thread.running = false;
+    if (crtc_has_cursor_plane(drmdev, window->kms.crtc)) {
+        ok = pthread_create(&window->kms.cursor_thread.thread, NULL, kms_window_cursor_thread, window);
+        if (ok != 0) {
+            // Not fatal, we'll just move the cursor synchronously.
+            LOG_ERROR("Couldn't start cursor thread. pthread_create: %s\n", strerror(ok));
+        } else {
+            window->kms.cursor_thread.running = true;
+        }
+    }
+
     return window;
 
 fail_free_window:
@@ -1057,9 +1695,28 @@ void kms_window_deinit(struct window *window) {
     kms_req_unref(req);
     */
 
+    if (window->kms.cursor_thread.running) {
+        window_lock(window);
+        window->kms.cursor_thread.stop = true;
+        pthread_cond_signal(&window->kms.cursor_thread.cond);
+        window_unlock(window);
+
+        pthread_join(window->kms.cursor_thread.thread, NULL);
+    }
+    pthread_cond_destroy(&window->kms.cursor_thread.cond);
+
     if (window->kms.cursor != NULL) {
         cursor_buffer_unref(window->kms.cursor);
     }
+    list_for_each_entry_safe(struct cursor_buffer, cursor, &window->kms.cursor_cache, entry) {
+        list_del(&cursor->entry);
+        cursor_buffer_unref(cursor);
+    }
+    if (window->kms.hotplug_listener != NULL) {
+        drmdev_remove_hotplug_listener(window->kms.drmdev, window->kms.hotplug_listener);
+    }
+    free(window->kms.desired_videomode);
+    free(window->kms.gamma_lut);
     if (window->render_surface != NULL) {
         surface_unref(CAST_SURFACE(window->render_surface));
     }
@@ -1082,11 +1739,29 @@ void kms_window_deinit(struct window *window) {
 }
 
 struct frame {
+    struct window *window;
     struct tracer *tracer;
     struct kms_req *req;
     bool unset_should_apply_mode_on_commit;
+    bool is_upscaled;
+
+    struct drmdev *drmdev;
+    struct kms_req *mirror_reqs[MAX_MIRRORS];
+    uint32_t mirror_crtc_ids[MAX_MIRRORS];
+    size_t n_mirror_reqs;
 };
 
+static void frame_destroy(struct frame *frame) {
+    for (size_t i = 0; i < frame->n_mirror_reqs; i++) {
+        kms_req_unref(frame->mirror_reqs[i]);
+    }
+    drmdev_unref(frame->drmdev);
+    tracer_unref(frame->tracer);
+    kms_req_unref(frame->req);
+    window_unref(frame->window);
+    free(frame);
+}
+
 UNUSED static void on_scanout(struct drmdev *drmdev, uint64_t vblank_ns, void *userdata) {
     ASSERT_NOT_NULL(drmdev);
     (void) drmdev;
@@ -1104,17 +1779,34 @@ static void on_present_frame(void *userdata) {
 
     frame = userdata;
 
+    // The mirrors are committed first, without blocking, so they show the frame at about the same time
+    // as the main display. If a mirror still has a flip pending (because it's out of phase with the main
+    // display), it skips this frame instead of delaying the main display.
+    for (size_t i = 0; i < frame->n_mirror_reqs; i++) {
+        if (drmdev_crtc_has_pending_flip(frame->drmdev, frame->mirror_crtc_ids[i])) {
+            continue;
+        }
+
+        ok = kms_req_commit_nonblocking(frame->mirror_reqs[i], NULL, NULL, NULL);
+        if (ok != 0) {
+            LOG_ERROR("Could not commit frame request for mirrored display.\n");
+        }
+    }
+
     TRACER_BEGIN(frame->tracer, "kms_req_commit_nonblocking");
     ok = kms_req_commit_blocking(frame->req, NULL);
     TRACER_END(frame->tracer, "kms_req_commit_nonblocking");
 
     if (ok != 0) {
         LOG_ERROR("Could not commit frame request.\n");
+
+        // We might be called without the window lock, so let the window disable the render scale itself.
+        if (frame->is_upscaled) {
+            atomic_store(&frame->window->kms.upscaled_commit_failed, true);
+        }
     }
 
-    tracer_unref(frame->tracer);
-    kms_req_unref(frame->req);
-    free(frame);
+    frame_destroy(frame);
 }
 
 static void on_cancel_frame(void *userdata) {
@@ -1123,14 +1815,92 @@ static void on_cancel_frame(void *userdata) {
 
     frame = userdata;
 
-    tracer_unref(frame->tracer);
-    kms_req_unref(frame->req);
-    free(frame);
+    frame_destroy(frame);
 }
 
-static int kms_window_push_composition_locked(struct window *window, struct fl_layer_composition *composition) {
+/**
+ * @brief Returns the props of a flutter layer in display coordinates.
+ *
+ * Flutter gives us the layer geometry in the coordinates of the buffers it renders into. If we render
+ * at a lower resolution, the geometry is scaled up here, so the hardware planes upscale the layers.
+ */
+/**
+ * @brief Renders at the display resolution from now on, because the display controller can't upscale the frames.
+ *
+ * Flutter renders a new frame with the new size once it's notified about the geometry change.
+ */
+static void kms_window_disable_render_scale_locked(struct window *window) {
+    LOG_ERROR("Couldn't upscale the rendered frame to the display size. Disabling the render scale.\n");
+    window->render_scale = 1.0;
+    window_set_display_size_locked(
+        window,
+        (int) window->display_size.x,
+        (int) window->display_size.y,
+        window->has_dimensions,
+        window->width_mm,
+        window->height_mm
+    );
+    window->kms.geometry_changed = true;
+}
+
+static struct fl_layer_props get_display_layer_props(struct window *window, const struct fl_layer_props *props) {
+    if (window->render_scale == 1.0) {
+        return *props;
+    }
+
+    return fl_layer_props_render_to_display(props, window->render_size, window->display_size);
+}
+
+/**
+ * @brief Builds a KMS request that shows the same framebuffers as the main display on a mirror.
+ *
+ * The cursor is only shown on the main display.
+ */
+static struct kms_req *
+kms_window_build_mirror_req_locked(struct window *window, struct kms_mirror *mirror, struct fl_layer_composition *composition) {
     struct kms_req_builder *builder;
     struct kms_req *req;
+    int ok;
+
+    builder = drmdev_create_request_builder(window->kms.drmdev, mirror->crtc->id);
+    if (builder == NULL) {
+        return NULL;
+    }
+
+    // Like for the main display, the mode is only actually changed if it differs from the committed one.
+    ok = kms_req_builder_set_connector(builder, mirror->connector->id);
+    if (ok != 0) {
+        goto fail_unref_builder;
+    }
+
+    ok = kms_req_builder_set_mode(builder, &mirror->mode);
+    if (ok != 0) {
+        goto fail_unref_builder;
+    }
+
+    for (size_t i = 0; i < fl_layer_composition_get_n_layers(composition); i++) {
+        struct fl_layer *layer = fl_layer_composition_peek_layer(composition, i);
+        struct fl_layer_props props = get_display_layer_props(window, &layer->props);
+
+        ok = surface_present_kms(layer->surface, &props, builder);
+        if (ok != 0) {
+            LOG_ERROR("Couldn't present flutter layer on mirrored display. surface_present_kms: %s\n", strerror(ok));
+            goto fail_unref_builder;
+        }
+    }
+
+    req = kms_req_builder_build(builder);
+    kms_req_builder_unref(builder);
+    return req;
+
+fail_unref_builder:
+    kms_req_builder_unref(builder);
+    return NULL;
+}
+
+static int kms_window_push_composition_locked(struct window *window, struct fl_layer_composition *composition) {
+    struct kms_req_builder *builder;
+    struct kms_req *req, *mirror_req;
     struct frame *frame;
     int ok;
 
@@ -1155,6 +1925,15 @@ static int kms_window_push_composition_locked(struct window *window, struct fl_l
     /// TODO: If we don't have new revisions, we don't need to scanout anything.
     fl_layer_composition_swap_ptrs(&window->composition, composition);
 
+    // There's no display to show this on right now. We still keep the composition,
+    // so we can show it once a display is connected again.
+    if (!window->kms.connected) {
+        return 0;
+    }
+
+    // This frame contains the latest cursor position.
+    window->kms.cursor_thread.dirty = false;
+
     builder = drmdev_create_request_builder(window->kms.drmdev, window->kms.crtc->id);
     if (builder == NULL) {
         ok = ENOMEM;
@@ -1169,18 +1948,38 @@ static int kms_window_push_composition_locked(struct window *window, struct fl_l
             goto fail_unref_builder;
         }
 
-        ok = kms_req_builder_set_mode(builder, window->kms.mode);
+        ok = kms_req_builder_set_mode(builder, &window->kms.mode);
         if (ok != 0) {
             LOG_ERROR("Couldn't apply output mode.\n");
             goto fail_unref_builder;
         }
+
+        if (window->vrr) {
+            ok = kms_req_builder_set_vrr_enabled(builder, true);
+            if (ok != 0) {
+                // Not fatal, we just present at the fixed refresh rate of the mode.
+                LOG_ERROR("Couldn't enable variable refresh rate. Falling back to fixed refresh rate.\n");
+                window->vrr = false;
+                window->min_refresh_rate = 0.0;
+                window->refresh_rate = mode_get_vrefresh(&window->kms.mode);
+            }
+        }
     }
 
     for (size_t i = 0; i < fl_layer_composition_get_n_layers(composition); i++) {
         struct fl_layer *layer = fl_layer_composition_peek_layer(composition, i);
+        struct fl_layer_props props = get_display_layer_props(window, &layer->props);
 
-        ok = surface_present_kms(layer->surface, &layer->props, builder);
-        if (ok != 0) {
+        ok = surface_present_kms(layer->surface, &props, builder);
+        if (ok == EIO && i == 0 && window->render_scale != 1.0) {
+            // The display controller can't upscale the bottom-most layer (for example, because the primary plane
+            // doesn't support scaling).
+            kms_window_disable_render_scale_locked(window);
+            goto fail_unref_builder;
+        } else if (ok != 0) {
+            // This includes the case where no plane (or no plane configuration that passes the TEST_ONLY check)
+            // is left for this layer. We can't composite it into the layers below ourselves, and presenting
+            // the frame without it would show an incomplete scene, so fail the whole frame.
             LOG_ERROR("Couldn't present flutter layer on screen. surface_present_kms: %s\n", strerror(ok));
             goto fail_unref_builder;
         }
@@ -1238,13 +2037,36 @@ static int kms_window_push_composition_locked(struct window *window, struct fl_l
         goto fail_unref_req;
     }
 
+    frame->window = window_ref(window);
     frame->req = req;
     frame->tracer = tracer_ref(window->tracer);
     frame->unset_should_apply_mode_on_commit = window->kms.should_apply_mode;
+    frame->is_upscaled = window->render_scale != 1.0;
+    frame->drmdev = drmdev_ref(window->kms.drmdev);
+    frame->n_mirror_reqs = 0;
+
+    // The main display was built first, so it gets first pick of the planes.
+    for (size_t i = 0; i < window->kms.n_mirrors; i++) {
+        mirror_req = kms_window_build_mirror_req_locked(window, window->kms.mirrors + i, composition);
+        if (mirror_req == NULL) {
+            // Not fatal, the mirror just shows the previous frame.
+            continue;
+        }
+
+        frame->mirror_reqs[frame->n_mirror_reqs] = mirror_req;
+        frame->mirror_crtc_ids[frame->n_mirror_reqs] = window->kms.mirrors[i].crtc->id;
+        frame->n_mirror_reqs++;
+    }
 
     frame_scheduler_present_frame(window->frame_scheduler, on_present_frame, frame, on_cancel_frame);
 
-    // if (window->present_mode == kDoubleBufferedVsync_PresentMode) {
+    // Pushing the layers can succeed and the commit still fail, because modesets aren't
+    // checked with a test commit beforehand.
+    if (atomic_exchange(&window->kms.upscaled_commit_failed, false) && window->render_scale != 1.0) {
+        kms_window_disable_render_scale_locked(window);
+    }
+
+    // if (window->present_mode == kDoubleBufferedVsync_PresentMode) {
     //     TRACER_BEGIN(window->tracer, "kms_req_builder_commit");
     //     ok = kms_req_commit(req, /* blocking: */ false);
     //     TRACER_END(window->tracer, "kms_req_builder_commit");
@@ -1308,17 +2130,122 @@ fail_unref_builder:
 }
 
 static int kms_window_push_composition(struct window *window, struct fl_layer_composition *composition) {
+    bool geometry_changed;
     int ok;
 
     window_lock(window);
 
     ok = kms_window_push_composition_locked(window, composition);
 
+    geometry_changed = window->kms.geometry_changed;
+    window->kms.geometry_changed = false;
+
     window_unlock(window);
 
+    if (geometry_changed) {
+        notifier_notify(&window->geometry_notifier, window);
+    }
+
     return ok;
 }
 
+static enum listener_return kms_window_on_hotplug(void *arg, void *userdata) {
+    struct drm_connector *connector;
+    struct drm_encoder *encoder;
+    struct drm_crtc *crtc;
+    drmModeModeInfo *mode;
+    struct window *window;
+    bool has_dimensions, geometry_changed;
+    int width_mm, height_mm, ok;
+
+    ASSERT_NOT_NULL(userdata);
+    window = userdata;
+
+    // Called with the initial (NULL) state when registering. The mode was just selected then.
+    if (arg == NULL) {
+        return kNoAction;
+    }
+
+    geometry_changed = false;
+    width_mm = 0;
+    height_mm = 0;
+
+    window_lock(window);
+
+    ok = select_mode(window->kms.drmdev, &connector, &encoder, &crtc, &mode, window->kms.desired_videomode);
+    if (ok != 0) {
+        if (window->kms.connected) {
+            LOG_DEBUG("Display disconnected.\n");
+            window->kms.connected = false;
+        }
+        kms_window_update_mirrors_locked(window);
+        goto out_unlock;
+    }
+
+    // Moving to another CRTC would mean moving all our planes and the cursor thread as well.
+    // Most of the time, the CRTC we have can drive the new display anyway.
+    if (crtc != window->kms.crtc) {
+        if (!(encoder->encoder->possible_crtcs & window->kms.crtc->bitmask)) {
+            LOG_ERROR("The connected display can't be driven by the CRTC flutter-pi is using. Restart flutter-pi to use it.\n");
+            window->kms.connected = false;
+            kms_window_update_mirrors_locked(window);
+            goto out_unlock;
+        }
+
+        crtc = window->kms.crtc;
+    }
+
+    if (window->kms.has_explicit_dimensions) {
+        has_dimensions = true;
+        width_mm = window->kms.explicit_width_mm;
+        height_mm = window->kms.explicit_height_mm;
+    } else {
+        has_dimensions = get_connector_dimensions(connector, &width_mm, &height_mm);
+    }
+
+    geometry_changed = mode->hdisplay != window->kms.mode.hdisplay || mode->vdisplay != window->kms.mode.vdisplay
+        || has_dimensions != window->has_dimensions
+        || (has_dimensions && (width_mm != window->width_mm || height_mm != window->height_mm));
+
+    LOG_DEBUG(
+        "Display connected. Using mode %" PRIu16 "x%" PRIu16 "@%f on connector %" PRIu32 ".\n",
+        mode->hdisplay,
+        mode->vdisplay,
+        mode_get_vrefresh(mode),
+        connector->id
+    );
+
+    window->kms.connector = connector;
+    window->kms.encoder = encoder;
+    window->kms.mode = *mode;
+    window->kms.should_apply_mode = true;
+    window->kms.connected = true;
+    kms_window_update_vrr_locked(window);
+    kms_window_update_mirrors_locked(window);
+
+    if (geometry_changed) {
+        // The render surface is replaced as soon as flutter asks for one with the new size.
+        window_set_display_size_locked(window, mode->hdisplay, mode->vdisplay, has_dimensions, width_mm, height_mm);
+    } else if (window->composition != NULL) {
+        // Flutter won't necessarily render a new frame, so show the last one on the new display.
+        ok = kms_window_push_composition_locked(window, window->composition);
+        if (ok != 0) {
+            LOG_ERROR("Couldn't present the last frame on the connected display.\n");
+        }
+    }
+
+out_unlock:
+    geometry_changed = geometry_changed || window->kms.geometry_changed;
+    window->kms.geometry_changed = false;
+    window_unlock(window);
+
+    if (geometry_changed) {
+        notifier_notify(&window->geometry_notifier, window);
+    }
+
+    return kNoAction;
+}
+
 static bool count_modifiers_for_pixel_format(
     UNUSED struct drm_plane *plane,
     UNUSED int index,
@@ -1363,18 +2290,31 @@ static bool extract_modifiers_for_pixel_format(
 
 static struct render_surface *kms_window_get_render_surface_internal(struct window *window, bool has_size, UNUSED struct vec2i size) {
     struct render_surface *render_surface;
+    UNUSED bool replaced;
 
     ASSERT_NOT_NULL(window);
 
+    replaced = false;
     if (window->render_surface != NULL) {
-        return window->render_surface;
+        struct vec2i current_size = render_surface_get_size(window->render_surface);
+
+        if (!has_size || (current_size.x == size.x && current_size.y == size.y)) {
+            return window->render_surface;
+        }
+
+        // The display was resized (another display was connected) and flutter now renders with the new size.
+        // Flutter and the frames still on screen have their own references on the old surface.
+        LOG_DEBUG("Resizing render surface from %dx%d to %dx%d.\n", current_size.x, current_size.y, size.x, size.y);
+        surface_unref(CAST_SURFACE(window->render_surface));
+        window->render_surface = NULL;
+        replaced = true;
     }
 
     if (!has_size) {
         // Flutter wants a render surface, but hasn't told us the backing store dimensions yet.
         // Just make a good guess about the dimensions.
         LOG_DEBUG("Flutter requested render surface before supplying surface dimensions.\n");
-        size = VEC2I(window->kms.mode->hdisplay, window->kms.mode->vdisplay);
+        size = vec2f_round_to_integer(window->render_size);
     }
 
     enum pixfmt pixel_format;
@@ -1468,6 +2408,15 @@ static struct render_surface *kms_window_get_render_surface_internal(struct wind
             render_surface = NULL;
         } else {
             render_surface = CAST_RENDER_SURFACE(egl_surface);
+
+            // Flutter renders into the window surface that's current (FBO 0), and it made the old
+            // one current for this frame already.
+            if (replaced) {
+                gl_renderer_make_flutter_rendering_context_current(
+                    window->gl_renderer,
+                    egl_gbm_render_surface_get_egl_surface(egl_surface)
+                );
+            }
         }
 
 #else
@@ -1523,6 +2472,260 @@ static EGLSurface kms_window_get_egl_surface(struct window *window) {
 }
 #endif
 
+static int kms_window_get_last_vblank(struct window *window, uint64_t *last_vblank_ns_out) {
+    return drmdev_get_last_vblank(window->kms.drmdev, window->kms.crtc->id, last_vblank_ns_out);
+}
+
+static int
+kms_window_set_color_transform_locked(struct window *window, const double *gamma_lut, size_t n_gamma_lut_entries, const double *ctm) {
+    double *gamma_lut_copy, *old_gamma_lut, old_ctm[9];
+    size_t n_old_gamma_lut_entries;
+    bool had_ctm;
+    int ok;
+
+    gamma_lut_copy = NULL;
+    if (gamma_lut != NULL) {
+        gamma_lut_copy = memdup(gamma_lut, n_gamma_lut_entries * 3 * sizeof *gamma_lut);
+        if (gamma_lut_copy == NULL) {
+            return ENOMEM;
+        }
+    }
+
+    old_gamma_lut = window->kms.gamma_lut;
+    n_old_gamma_lut_entries = window->kms.n_gamma_lut_entries;
+    had_ctm = window->kms.has_ctm;
+    memcpy(old_ctm, window->kms.ctm, sizeof old_ctm);
+
+    window->kms.gamma_lut = gamma_lut_copy;
+    window->kms.n_gamma_lut_entries = gamma_lut != NULL ? n_gamma_lut_entries : 0;
+    window->kms.has_ctm = ctm != NULL;
+    if (ctm != NULL) {
+        memcpy(window->kms.ctm, ctm, sizeof window->kms.ctm);
+    }
+
+    ok = kms_window_apply_color_transform_locked(window, window->kms.crtc);
+    if (ok != 0) {
+        // The display controller rejected it. Keep the previous transform, so it's still the one
+        // that's applied to mirrors and after a modeset. The gamma LUT might've been accepted
+        // already though, so upload the previous one again.
+        free(gamma_lut_copy);
+        window->kms.gamma_lut = old_gamma_lut;
+        window->kms.n_gamma_lut_entries = n_old_gamma_lut_entries;
+        window->kms.has_ctm = had_ctm;
+        memcpy(window->kms.ctm, old_ctm, sizeof old_ctm);
+
+        kms_window_apply_color_transform_locked(window, window->kms.crtc);
+        return ok;
+    }
+
+    free(old_gamma_lut);
+
+    for (size_t i = 0; i < window->kms.n_mirrors; i++) {
+        ok = kms_window_apply_color_transform_locked(window, window->kms.mirrors[i].crtc);
+        if (ok != 0) {
+            LOG_ERROR(
+                "Couldn't apply the color transform to the display on connector %" PRIu32 ".\n",
+                window->kms.mirrors[i].connector->id
+            );
+        }
+    }
+
+    // The transform is committed with the next frame. Flutter won't necessarily render one
+    // (the UI might be idle), so show the last one again.
+    if (window->kms.connected && window->composition != NULL) {
+        ok = kms_window_push_composition_locked(window, window->composition);
+        if (ok != 0) {
+            LOG_ERROR("Couldn't present the last frame with the new color transform.\n");
+        }
+    }
+
+    return 0;
+}
+
+struct kms_capture {
+    int width, height;
+    enum pixfmt format;
+    uint32_t gem_handle, pitch, fb_id;
+    size_t size;
+
+    window_capture_cb_t callback;
+    void *userdata;
+};
+
+static void on_kms_capture_done(struct drmdev *drmdev, int status, void *userdata) {
+    struct kms_capture *capture;
+    void *map;
+
+    ASSERT_NOT_NULL(userdata);
+    capture = userdata;
+
+    map = NULL;
+    if (status == 0) {
+        map = drmdev_map_dumb_buffer(drmdev, capture->gem_handle, capture->size);
+        if (map == NULL) {
+            status = EIO;
+        }
+    }
+
+    if (status == 0) {
+        capture->callback(
+            &(const struct window_capture){
+                .pixels = map,
+                .width = capture->width,
+                .height = capture->height,
+                .stride = capture->pitch,
+                .format = capture->format,
+            },
+            0,
+            capture->userdata
+        );
+
+        drmdev_unmap_dumb_buffer(drmdev, map, capture->size);
+    } else {
+        LOG_ERROR("Couldn't capture the display. %s\n", strerror(status));
+        capture->callback(NULL, status, capture->userdata);
+    }
+
+    drmdev_rm_fb(drmdev, capture->fb_id);
+    drmdev_destroy_dumb_buffer(drmdev, capture->gem_handle);
+    free(capture);
+}
+
+static int kms_window_capture_locked(struct window *window, window_capture_cb_t callback, void *userdata) {
+    static const enum pixfmt formats[] = { PIXFMT_XRGB8888, PIXFMT_ARGB8888, PIXFMT_RGB565 };
+    struct kms_capture *capture;
+    enum pixfmt format;
+    bool found_format;
+    int ok;
+
+    if (!window->kms.connected) {
+        return ENODEV;
+    }
+
+    if (!drmdev_supports_dumb_buffers(window->kms.drmdev)) {
+        return EOPNOTSUPP;
+    }
+
+    found_format = false;
+    for (int i = 0; i < ARRAY_SIZE(formats); i++) {
+        if (drmdev_crtc_supports_writeback(window->kms.drmdev, window->kms.crtc->id, formats[i])) {
+            format = formats[i];
+            found_format = true;
+            break;
+        }
+    }
+
+    if (!found_format) {
+        return EOPNOTSUPP;
+    }
+
+    capture = malloc(sizeof *capture);
+    if (capture == NULL) {
+        return ENOMEM;
+    }
+
+    capture->width = window->kms.mode.hdisplay;
+    capture->height = window->kms.mode.vdisplay;
+    capture->format = format;
+    capture->callback = callback;
+    capture->userdata = userdata;
+
+    ok = drmdev_create_dumb_buffer(
+        window->kms.drmdev,
+        capture->width,
+        capture->height,
+        get_pixfmt_info(format)->bits_per_pixel,
+        &capture->gem_handle,
+        &capture->pitch,
+        &capture->size
+    );
+    if (ok != 0) {
+        goto fail_free_capture;
+    }
+
+    capture->fb_id = drmdev_add_fb(
+        window->kms.drmdev,
+        capture->width,
+        capture->height,
+        format,
+        capture->gem_handle,
+        capture->pitch,
+        0,
+        false,
+        0
+    );
+    if (capture->fb_id == 0) {
+        ok = EIO;
+        goto fail_destroy_dumb_buffer;
+    }
+
+    ok = drmdev_queue_writeback(window->kms.drmdev, window->kms.crtc->id, capture->fb_id, on_kms_capture_done, capture);
+    if (ok != 0) {
+        goto fail_rm_fb;
+    }
+
+    // The writeback is done with the next frame. Flutter won't necessarily render one
+    // (the UI might be idle), so show the last one again.
+    if (window->composition != NULL) {
+        ok = kms_window_push_composition_locked(window, window->composition);
+        if (ok != 0) {
+            LOG_ERROR("Couldn't present the last frame for capturing it.\n");
+        }
+    }
+
+    return 0;
+
+fail_rm_fb:
+    drmdev_rm_fb(window->kms.drmdev, capture->fb_id);
+
+fail_destroy_dumb_buffer:
+    drmdev_destroy_dumb_buffer(window->kms.drmdev, capture->gem_handle);
+
+fail_free_capture:
+    free(capture);
+    return ok;
+}
+
+static void *kms_window_cursor_thread(void *userdata) {
+    struct window *window;
+    uint32_t crtc_id;
+    int ok;
+
+    ASSERT_NOT_NULL(userdata);
+    window = userdata;
+    crtc_id = window->kms.crtc->id;
+
+    window_lock(window);
+    while (true) {
+        while (!window->kms.cursor_thread.dirty && !window->kms.cursor_thread.stop) {
+            pthread_cond_wait(&window->kms.cursor_thread.cond, &window->lock);
+        }
+
+        if (window->kms.cursor_thread.stop) {
+            break;
+        }
+
+        window->kms.cursor_thread.dirty = false;
+
+        // If the cursor couldn't get a cursor plane after all, the movement is applied with the next frame.
+        if (window->cursor_enabled && window->kms.cursor != NULL && window->kms.has_cursor_plane) {
+            drmdev_move_cursor(window->kms.drmdev, crtc_id, vec2i_sub(window->cursor_pos, window->kms.cursor->hotspot));
+        }
+
+        // Everything that arrives until the next vblank will be applied at once.
+        window_unlock(window);
+        ok = drmdev_wait_vblank(window->kms.drmdev, crtc_id);
+        if (ok != 0) {
+            // The CRTC is probably disabled. Don't spin.
+            usleep(1000000 / 60);
+        }
+        window_lock(window);
+    }
+    window_unlock(window);
+
+    return NULL;
+}
+
 static int kms_window_set_cursor_locked(
     // clang-format off
     struct window *window,
@@ -1558,14 +2761,14 @@ static int kms_window_set_cursor_locked(
 
     if (enabled) {
         if (cursor == NULL || icon != cursor->icon) {
-            cursor = cursor_buffer_new(window->kms.drmdev, window->kms.pointer_icon, window->rotation);
+            cursor = kms_window_get_cursor_buffer_locked(window, window->kms.pointer_icon, window->rotation);
             if (cursor == NULL) {
                 return EIO;
             }
 
             cursor_buffer_swap_ptrs(&window->kms.cursor, cursor);
 
-            // cursor is created with refcount 1. cursor_buffer_swap_ptrs
+            // we got a new reference from the cache. cursor_buffer_swap_ptrs
             // increases refcount by one. deref here so we don't leak a
             // reference.
             cursor_buffer_unrefp(&cursor);
@@ -1576,22 +2779,18 @@ static int kms_window_set_cursor_locked(
                 kms_window_push_composition_locked(window, window->composition);
             }
         } else if (has_pos) {
-            // apply the new cursor position using drmModeMoveCursor
             window->cursor_pos = pos;
 
-            // if we have a hardware cursor plane, just move the cursor.
-            // this is very fast and we can do that a lot of times per frame.
+            // Like mutter (GNOME's compositor), we have an extra KMS cursor thread for that purpose,
+            // so cursor movements don't need to wait for the next flutter frame, and don't wait for
+            // the vblank here. It moves the cursor plane once per vblank.
             //
-            // if we don't have a hardware cursor plane, we need to do a full commit.
-            // However, we can only do one commit per vsync, so if flutter also later
-            // wants to present a frame, we wouldn't be able to present it. Even later
-            // cursor movements in the same vsync interval we couldn't show on screen anymore.
-            //
-            // Mutter (GNOME's compositor) has an extra KMS cursor thread with high priority for that purpose.
-            if (window->kms.has_cursor_plane) {
+            // Without a cursor plane, the cursor is drawn at the new position with the next flutter frame.
+            if (window->kms.cursor_thread.running) {
+                window->kms.cursor_thread.dirty = true;
+                pthread_cond_signal(&window->kms.cursor_thread.cond);
+            } else if (window->kms.has_cursor_plane) {
                 drmdev_move_cursor(window->kms.drmdev, window->kms.crtc->id, vec2i_sub(pos, window->kms.cursor->hotspot));
-            } else {
-                // for now just don't do anything.
             }
         }
     } else {
@@ -1652,7 +2851,8 @@ MUST_CHECK struct window *dummy_window_new(
         size.x, size.y,
         has_explicit_dimensions, width_mm, height_mm,
         refresh_rate,
-        false, PIXFMT_RGB565
+        false, PIXFMT_RGB565,
+        1.0
         // clang-format on
     );
 
@@ -1825,3 +3025,378 @@ static int dummy_window_set_cursor_locked(
 
     return 0;
 }
+
+static int fbdev_window_push_composition(struct window *window, struct fl_layer_composition *composition);
+static struct render_surface *fbdev_window_get_render_surface(struct window *window, struct vec2i size);
+
+#ifdef HAVE_EGL_GLES2
+static bool fbdev_window_has_egl_surface(struct window *window);
+static EGLSurface fbdev_window_get_egl_surface(struct window *window);
+#endif
+
+static void fbdev_window_deinit(struct window *window);
+static int fbdev_window_set_cursor_locked(
+    // clang-format off
+    struct window *window,
+    bool has_enabled, bool enabled,
+    bool has_kind, enum pointer_kind kind,
+    bool has_pos, struct vec2i pos
+    // clang-format on
+);
+
+MUST_CHECK struct window *fbdev_window_new(
+    // clang-format off
+    struct tracer *tracer,
+    struct frame_scheduler *scheduler,
+    enum renderer_type renderer_type,
+    struct gl_renderer *gl_renderer,
+    struct vk_renderer *vk_renderer,
+    bool has_rotation, drm_plane_transform_t rotation,
+    bool has_orientation, enum device_orientation orientation,
+    bool has_explicit_dimensions, int width_mm, int height_mm,
+    bool has_forced_pixel_format, enum pixfmt forced_pixel_format,
+    struct fbdev *fbdev,
+    struct gbm_device *gbm_device
+    // clang-format on
+) {
+    struct window *window;
+    struct vec2i size;
+    bool has_dimensions;
+    int ok;
+
+    ASSERT_NOT_NULL(fbdev);
+    ASSERT_NOT_NULL(gbm_device);
+
+#if !defined(HAVE_VULKAN)
+    ASSUME(renderer_type != kVulkan_RendererType);
+#endif
+
+#if !defined(HAVE_EGL_GLES2)
+    ASSUME(renderer_type != kOpenGL_RendererType);
+#endif
+
+    // if opengl --> gl_renderer != NULL && vk_renderer == NULL
+    assert(renderer_type != kOpenGL_RendererType || (gl_renderer != NULL && vk_renderer == NULL));
+
+    // if vulkan --> vk_renderer != NULL && gl_renderer == NULL
+    assert(renderer_type != kVulkan_RendererType || (vk_renderer != NULL && gl_renderer == NULL));
+
+    window = malloc(sizeof *window);
+    if (window == NULL) {
+        return NULL;
+    }
+
+    size = fbdev_get_size(fbdev);
+
+    if (has_explicit_dimensions) {
+        has_dimensions = true;
+    } else {
+        has_dimensions = fbdev_get_physical_dimensions(fbdev, &width_mm, &height_mm);
+    }
+
+    ok = window_init(
+        // clang-format off
+        window,
+        tracer,
+        scheduler,
+        has_rotation, rotation,
+        has_orientation, orientation,
+        size.x, size.y,
+        has_dimensions, width_mm, height_mm,
+        fbdev_get_refresh_rate(fbdev),
+        has_forced_pixel_format, forced_pixel_format,
+        1.0
+        // clang-format on
+    );
+    if (ok != 0) {
+        free(window);
+        return NULL;
+    }
+
+    LOG_DEBUG_UNPREFIXED(
+        "display mode:\n"
+        "  resolution: %d x %d\n"
+        "  refresh rate: %fHz\n"
+        "  physical size: %dmm x %dmm\n"
+        "  flutter device pixel ratio: %f\n"
+        "  pixel format: %s\n",
+        size.x,
+        size.y,
+        fbdev_get_refresh_rate(fbdev),
+        width_mm,
+        height_mm,
+        window->pixel_ratio,
+        get_pixfmt_info(has_forced_pixel_format ? forced_pixel_format : fbdev_get_pixel_format(fbdev))->name
+    );
+
+    window->fbdev.fbdev = fbdev_ref(fbdev);
+    window->fbdev.gbm_device = gbm_device;
+    window->renderer_type = renderer_type;
+    if (gl_renderer != NULL) {
+#ifdef HAVE_EGL_GLES2
+        window->gl_renderer = gl_renderer_ref(gl_renderer);
+#else
+        UNREACHABLE();
+#endif
+    }
+    if (vk_renderer != NULL) {
+#ifdef HAVE_VULKAN
+        window->vk_renderer = vk_renderer_ref(vk_renderer);
+#else
+        UNREACHABLE();
+#endif
+    } else {
+        window->vk_renderer = NULL;
+    }
+    window->push_composition = fbdev_window_push_composition;
+    window->get_render_surface = fbdev_window_get_render_surface;
+#ifdef HAVE_EGL_GLES2
+    window->has_egl_surface = fbdev_window_has_egl_surface;
+    window->get_egl_surface = fbdev_window_get_egl_surface;
+#endif
+    window->deinit = fbdev_window_deinit;
+    window->set_cursor_locked = fbdev_window_set_cursor_locked;
+    return window;
+}
+
+static void fbdev_window_deinit(struct window *window) {
+    ASSERT_NOT_NULL(window);
+
+    if (window->render_surface != NULL) {
+        surface_unref(CAST_SURFACE(window->render_surface));
+    }
+
+    if (window->gl_renderer != NULL) {
+#ifdef HAVE_EGL_GLES2
+        gl_renderer_unref(window->gl_renderer);
+#else
+        UNREACHABLE();
+#endif
+    }
+
+    if (window->vk_renderer != NULL) {
+#ifdef HAVE_VULKAN
+        vk_renderer_unref(window->vk_renderer);
+#else
+        UNREACHABLE();
+#endif
+    }
+
+    fbdev_unref(window->fbdev.fbdev);
+    window_deinit(window);
+}
+
+struct fbdev_frame {
+    struct tracer *tracer;
+    struct fbdev_commit_builder *builder;
+};
+
+static void on_present_fbdev_frame(void *userdata) {
+    struct fbdev_frame *frame;
+    int ok;
+
+    ASSERT_NOT_NULL(userdata);
+
+    frame = userdata;
+
+    TRACER_BEGIN(frame->tracer, "fbdev_commit_builder_commit");
+    ok = fbdev_commit_builder_commit(frame->builder);
+    TRACER_END(frame->tracer, "fbdev_commit_builder_commit");
+
+    if (ok != 0) {
+        LOG_ERROR("Could not commit fbdev frame. fbdev_commit_builder_commit: %s\n", strerror(ok));
+    }
+
+    tracer_unref(frame->tracer);
+    fbdev_commit_builder_unref(frame->builder);
+    free(frame);
+}
+
+static void on_cancel_fbdev_frame(void *userdata) {
+    struct fbdev_frame *frame;
+    ASSERT_NOT_NULL(userdata);
+
+    frame = userdata;
+
+    tracer_unref(frame->tracer);
+    fbdev_commit_builder_unref(frame->builder);
+    free(frame);
+}
+
+static int fbdev_window_push_composition_locked(struct window *window, struct fl_layer_composition *composition) {
+    struct fbdev_commit_builder *builder;
+    struct fbdev_frame *frame;
+    int ok;
+
+    ASSERT_NOT_NULL(window);
+    ASSERT_NOT_NULL(composition);
+
+    fl_layer_composition_swap_ptrs(&window->composition, composition);
+
+    builder = fbdev_create_commit_builder(window->fbdev.fbdev);
+    if (builder == NULL) {
+        return ENOMEM;
+    }
+
+    for (size_t i = 0; i < fl_layer_composition_get_n_layers(composition); i++) {
+        struct fl_layer *layer = fl_layer_composition_peek_layer(composition, i);
+
+        ok = surface_present_fbdev(layer->surface, &layer->props, builder);
+        if (ok != 0) {
+            LOG_ERROR("Couldn't present flutter layer on screen. surface_present_fbdev: %s\n", strerror(ok));
+            goto fail_unref_builder;
+        }
+    }
+
+    frame = malloc(sizeof *frame);
+    if (frame == NULL) {
+        ok = ENOMEM;
+        goto fail_unref_builder;
+    }
+
+    frame->tracer = tracer_ref(window->tracer);
+    frame->builder = builder;
+
+    frame_scheduler_present_frame(window->frame_scheduler, on_present_fbdev_frame, frame, on_cancel_fbdev_frame);
+    return 0;
+
+fail_unref_builder:
+    fbdev_commit_builder_unref(builder);
+    return ok;
+}
+
+static int fbdev_window_push_composition(struct window *window, struct fl_layer_composition *composition) {
+    int ok;
+
+    window_lock(window);
+
+    ok = fbdev_window_push_composition_locked(window, composition);
+
+    window_unlock(window);
+
+    return ok;
+}
+
+static struct render_surface *fbdev_window_get_render_surface_internal(struct window *window, bool has_size, UNUSED struct vec2i size) {
+    struct render_surface *render_surface;
+    enum pixfmt pixel_format;
+
+    ASSERT_NOT_NULL(window);
+
+    if (window->render_surface != NULL) {
+        return window->render_surface;
+    }
+
+    if (!has_size) {
+        // Flutter wants a render surface, but hasn't told us the backing store dimensions yet.
+        // Just make a good guess about the dimensions.
+        LOG_DEBUG("Flutter requested render surface before supplying surface dimensions.\n");
+        size = vec2f_round_to_integer(window->display_size);
+    }
+
+    // We need to read back every rendered frame with the CPU, so the buffers need to be linear.
+    uint64_t allowed_modifiers[] = { DRM_FORMAT_MOD_LINEAR };
+
+    if (window->renderer_type == kOpenGL_RendererType) {
+        // opengl
+#ifdef HAVE_EGL_GLES2
+    // EGL_NO_CONFIG_KHR is defined by EGL_KHR_no_config_context.
+    #ifndef EGL_KHR_no_config_context
+        #error "EGL header definitions for extension EGL_KHR_no_config_context are required."
+    #endif
+
+        // If we render in the framebuffer pixel format, the copy into the framebuffer is a plain memcpy.
+        pixel_format = window->has_forced_pixel_format ? window->forced_pixel_format : fbdev_get_pixel_format(window->fbdev.fbdev);
+
+        struct egl_gbm_render_surface *egl_surface = egl_gbm_render_surface_new_with_egl_config(
+            window->tracer,
+            size,
+            gl_renderer_get_gbm_device(window->gl_renderer),
+            window->gl_renderer,
+            pixel_format,
+            EGL_NO_CONFIG_KHR,
+            allowed_modifiers,
+            ARRAY_SIZE(allowed_modifiers)
+        );
+        if (egl_surface == NULL) {
+            LOG_ERROR("Couldn't create EGL GBM rendering surface.\n");
+            render_surface = NULL;
+        } else {
+            render_surface = CAST_RENDER_SURFACE(egl_surface);
+        }
+
+#else
+        UNREACHABLE();
+#endif
+    } else {
+        ASSUME(window->renderer_type == kVulkan_RendererType);
+
+        // vulkan
+#ifdef HAVE_VULKAN
+        // Vulkan doesn't work with XRGB yet, so we need to use ARGB8888 here.
+        pixel_format = window->has_forced_pixel_format ? window->forced_pixel_format : PIXFMT_ARGB8888;
+
+        struct vk_gbm_render_surface *vk_surface =
+            vk_gbm_render_surface_new(window->tracer, size, window->fbdev.gbm_device, window->vk_renderer, pixel_format);
+        if (vk_surface == NULL) {
+            LOG_ERROR("Couldn't create Vulkan GBM rendering surface.\n");
+            render_surface = NULL;
+        } else {
+            render_surface = CAST_RENDER_SURFACE(vk_surface);
+        }
+#else
+        UNREACHABLE();
+#endif
+    }
+
+    window->render_surface = render_surface;
+    return render_surface;
+}
+
+static struct render_surface *fbdev_window_get_render_surface(struct window *window, struct vec2i size) {
+    ASSERT_NOT_NULL(window);
+    return fbdev_window_get_render_surface_internal(window, true, size);
+}
+
+#ifdef HAVE_EGL_GLES2
+static bool fbdev_window_has_egl_surface(struct window *window) {
+    ASSERT_NOT_NULL(window);
+
+    if (window->renderer_type == kOpenGL_RendererType) {
+        return window->render_surface != NULL;
+    } else {
+        return false;
+    }
+}
+
+static EGLSurface fbdev_window_get_egl_surface(struct window *window) {
+    ASSERT_NOT_NULL(window);
+
+    if (window->renderer_type == kOpenGL_RendererType) {
+        struct render_surface *render_surface = fbdev_window_get_render_surface_internal(window, false, VEC2I(0, 0));
+        return egl_gbm_render_surface_get_egl_surface(CAST_EGL_GBM_RENDER_SURFACE(render_surface));
+    } else {
+        return EGL_NO_SURFACE;
+    }
+}
+#endif
+
+static int fbdev_window_set_cursor_locked(
+    // clang-format off
+    struct window *window,
+    bool has_enabled, bool enabled,
+    bool has_kind, enum pointer_kind kind,
+    bool has_pos, struct vec2i pos
+    // clang-format on
+) {
+    ASSERT_NOT_NULL(window);
+    (void) has_enabled;
+    (void) enabled;
+    (void) has_kind;
+    (void) kind;
+    (void) has_pos;
+    (void) pos;
+
+    // fbdev has no cursor plane, and we don't draw a software cursor into the framebuffer.
+    return EOPNOTSUPP;
+}
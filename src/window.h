@@ -12,6 +12,7 @@
 
 #include "compositor_ng.h"
 #include "modesetting.h"
+#include "notifier_listener.h"
 #include "pixel_format.h"
 #include "util/refcounting.h"
 
@@ -19,14 +20,39 @@
 
 struct surface;
 struct window;
+struct fbdev;
+struct gbm_device;
 struct tracer;
 struct frame_scheduler;
 struct fl_layer_composition;
 
 struct view_geometry {
     struct vec2f view_size, display_size;
+
+    /**
+     * @brief The size of the buffers flutter renders into.
+     *
+     * Equals the display size, unless a render scale is used. In that case, flutter renders at a lower
+     * resolution and the display controller upscales the buffers to @ref display_size.
+     */
+    struct vec2f render_size;
+
+    /**
+     * @brief Transform between flutter view coordinates and display coordinates.
+     *
+     * Includes the rotation and the render scale. Use these for input events.
+     */
     struct mat3f display_to_view_transform;
     struct mat3f view_to_display_transform;
+
+    /**
+     * @brief Transform between flutter view coordinates and the coordinates of the buffers flutter renders into.
+     *
+     * Only includes the rotation. This is the root surface transformation flutter should apply.
+     */
+    struct mat3f render_to_view_transform;
+    struct mat3f view_to_render_transform;
+
     double device_pixel_ratio;
 };
 
@@ -51,6 +77,10 @@ DECLARE_REF_OPS(window)
  * @param forced_pixel_format
  * @param drmdev
  * @param desired_videomode
+ * @param mirror If true, show the same content on all other connected displays that support
+ *               a mode with the same resolution, each driven by its own CRTC.
+ * @param render_scale Flutter renders at the display resolution multiplied by this factor (0 < render_scale <= 1),
+ *                     the hardware planes then upscale the rendered frames to the display resolution.
  * @return struct window* The new KMS window.
  */
 struct window *kms_window_new(
@@ -65,10 +95,38 @@ struct window *kms_window_new(
     bool has_explicit_dimensions, int width_mm, int height_mm,
     bool has_forced_pixel_format, enum pixfmt forced_pixel_format,
     struct drmdev *drmdev,
-    const char *desired_videomode
+    const char *desired_videomode,
+    bool mirror,
+    double render_scale
     // clang-format on
 );
 
+/**
+ * @brief Returns the size flutter renders at for a display of @param display_size pixels and the given render scale.
+ */
+struct vec2i window_get_render_size(struct vec2i display_size, double render_scale);
+
+/**
+ * @brief Returns the transforms between display coordinates (for example, of touch events) and flutter view coordinates,
+ * for a display of @param display_size pixels that is rendered at @param render_scale and rotated by @param rotation.
+ */
+void window_get_display_view_transforms(
+    struct vec2i display_size,
+    double render_scale,
+    drm_plane_transform_t rotation,
+    struct mat3f *display_to_view_out,
+    struct mat3f *view_to_display_out
+);
+
+/**
+ * @brief Scales the geometry of a flutter layer rendered at @param render_size up to a display of @param display_size pixels.
+ *
+ * Planes presenting the resulting layer use the whole rendered buffer as the source rectangle and the scaled
+ * rectangle as the destination, so the display controller does the upscaling.
+ */
+struct fl_layer_props
+fl_layer_props_render_to_display(const struct fl_layer_props *props, struct vec2f render_size, struct vec2f display_size);
+
 /**
  * Creates a new dummy window.
  *
@@ -97,6 +155,46 @@ MUST_CHECK struct window *dummy_window_new(
     double refresh_rate
 );
 
+/**
+ * @brief Creates a new window that outputs to a linux framebuffer device.
+ *
+ * Flutter still renders using the GPU (into linear GBM buffers allocated on @param gbm_device),
+ * the rendered frames are then copied into the framebuffer memory.
+ *
+ * @param tracer The tracer object.
+ * @param scheduler The frame scheduler object.
+ * @param renderer_type The type of renderer.
+ * @param gl_renderer The GL renderer object.
+ * @param vk_renderer The Vulkan renderer object.
+ * @param has_rotation
+ * @param rotation
+ * @param has_orientation
+ * @param orientation
+ * @param has_explicit_dimensions Indicates if @param width_mm and @param height_mm should be used instead of the driver-reported dimensions.
+ * @param width_mm
+ * @param height_mm
+ * @param has_forced_pixel_format
+ * @param forced_pixel_format
+ * @param fbdev The framebuffer device to output to.
+ * @param gbm_device The GBM device render buffers should be allocated on.
+ * @return struct window* The new fbdev window.
+ */
+MUST_CHECK struct window *fbdev_window_new(
+    // clang-format off
+    struct tracer *tracer,
+    struct frame_scheduler *scheduler,
+    enum renderer_type renderer_type,
+    struct gl_renderer *gl_renderer,
+    struct vk_renderer *vk_renderer,
+    bool has_rotation, drm_plane_transform_t rotation,
+    bool has_orientation, enum device_orientation orientation,
+    bool has_explicit_dimensions, int width_mm, int height_mm,
+    bool has_forced_pixel_format, enum pixfmt forced_pixel_format,
+    struct fbdev *fbdev,
+    struct gbm_device *gbm_device
+    // clang-format on
+);
+
 /**
  * @brief Push a new flutter composition to the window, outputting a new frame.
  *
@@ -114,6 +212,17 @@ int window_push_composition(struct window *window, struct fl_layer_composition *
  */
 struct view_geometry window_get_view_geometry(struct window *window);
 
+/**
+ * @brief Call @param notify (with the window as the argument) when the view geometry of this window changed.
+ *
+ * For KMS windows, this happens when another display with a different resolution or physical size
+ * was connected. @param notify is called on the thread that handles the DRM events, without the window locked.
+ *
+ * @param window The window instance.
+ * @return The listener, or NULL on failure.
+ */
+struct listener *window_add_geometry_listener(struct window *window, listener_cb_t notify, void *userdata);
+
 /**
  * @brief Returns the vertical refresh rate of the chosen mode & display.
  *
@@ -156,4 +265,56 @@ int window_set_cursor(
     // clang-format on
 );
 
+/**
+ * @brief Sets a gamma LUT and a color transformation matrix that the display hardware applies
+ * to everything shown in this window, so effects like brightness, night mode or color calibration
+ * don't need an extra GPU pass per frame.
+ *
+ * See @ref drmdev_set_crtc_gamma_lut and @ref drmdev_set_crtc_ctm for the format.
+ * The last frame is shown again with the new transform, so it's visible right away.
+ *
+ * @param window The window instance.
+ * @param gamma_lut The gamma LUT, or NULL to reset it.
+ * @param n_gamma_lut_entries The number of red, green, blue triplets in @param gamma_lut.
+ * @param ctm The color transformation matrix, or NULL to reset it.
+ * @returns Zero if successful, EOPNOTSUPP if the window or display doesn't support
+ *          (one of) them, or another positive errno-style error on failure.
+ */
+int window_set_color_transform(struct window *window, const double *gamma_lut, size_t n_gamma_lut_entries, const double *ctm);
+
+/**
+ * @brief A frame that was captured using @ref window_capture.
+ */
+struct window_capture {
+    const void *pixels;
+    int width, height, stride;
+    enum pixfmt format;
+};
+
+/**
+ * @brief Called once a capture requested using @ref window_capture is done.
+ *
+ * @param capture The captured frame, only valid during the callback. NULL if capturing failed.
+ * @param status Zero if successful, a positive errno-style error code if capturing failed.
+ * @param userdata The userdata passed to @ref window_capture.
+ */
+typedef void (*window_capture_cb_t)(const struct window_capture *capture, int status, void *userdata);
+
+/**
+ * @brief Captures the next frame shown in this window, exactly as the display hardware scanned it out
+ * (including all hardware overlay planes and the cursor), without reading anything back from the GPU.
+ *
+ * The last frame is shown again, so the capture is done even if the UI is idle.
+ * @param callback is called on the thread handling the KMS events (the platform thread), or on the thread presenting
+ * the next frame if capturing fails there. It must not call any window functions.
+ *
+ * @param window The window instance.
+ * @param callback Called once the frame was captured. Only called if this function returns zero.
+ * @param userdata Passed to @param callback.
+ * @returns Zero if successful, EOPNOTSUPP if the window or display doesn't support capturing
+ *          (for KMS, this needs a writeback connector), ENODEV if there's no display connected right now,
+ *          EBUSY if there's already a capture in progress, or another positive errno-style error on failure.
+ */
+int window_capture(struct window *window, window_capture_cb_t callback, void *userdata);
+
 #endif  // _FLUTTERPI_SRC_WINDOW_H
@@ -0,0 +1,212 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+
+#include <event_loop.h>
+#include <unity.h>
+#include <util/collection.h>
+
+struct recorder {
+    struct evloop *loop;
+    int order[16];
+    int n;
+    int exit_after;
+};
+
+struct recorded_task {
+    struct recorder *recorder;
+    int value;
+};
+
+static void on_record(void *userdata) {
+    struct recorded_task *task = userdata;
+    struct recorder *recorder = task->recorder;
+
+    recorder->order[recorder->n++] = task->value;
+    if (task->value == recorder->exit_after) {
+        evloop_schedule_exit(recorder->loop);
+    }
+}
+
+static void on_record_and_post_next(void *userdata) {
+    struct recorded_task *task = userdata;
+
+    // posted before the exit is scheduled, but after the current batch was collected.
+    TEST_ASSERT_EQUAL_INT(0, evloop_post_task(task->recorder->loop, on_record, task + 1));
+    on_record(task);
+}
+
+static uint64_t now_usec(void) {
+    return get_monotonic_time() / 1000;
+}
+
+void setUp() {
+}
+
+void tearDown() {
+}
+
+void test_tasks_run_in_posting_order() {
+    struct recorder recorder = { .loop = evloop_new(), .n = 0, .exit_after = 3 };
+    struct recorded_task tasks[3] = { { &recorder, 1 }, { &recorder, 2 }, { &recorder, 3 } };
+
+    TEST_ASSERT_NOT_NULL(recorder.loop);
+
+    for (int i = 0; i < 3; i++) {
+        TEST_ASSERT_EQUAL_INT(0, evloop_post_task(recorder.loop, on_record, tasks + i));
+    }
+
+    TEST_ASSERT_EQUAL_INT(0, evloop_run(recorder.loop));
+    TEST_ASSERT_EQUAL_INT(3, recorder.n);
+    TEST_ASSERT_EQUAL_INT(1, recorder.order[0]);
+    TEST_ASSERT_EQUAL_INT(2, recorder.order[1]);
+    TEST_ASSERT_EQUAL_INT(3, recorder.order[2]);
+
+    evloop_unref(recorder.loop);
+}
+
+void test_queued_tasks_are_kept_after_exit() {
+    struct recorder recorder = { .loop = evloop_new(), .n = 0, .exit_after = 1 };
+    struct recorded_task tasks[2] = { { &recorder, 1 }, { &recorder, 2 } };
+
+    TEST_ASSERT_NOT_NULL(recorder.loop);
+    TEST_ASSERT_EQUAL_INT(0, evloop_post_task(recorder.loop, on_record_and_post_next, tasks + 0));
+
+    TEST_ASSERT_EQUAL_INT(0, evloop_run(recorder.loop));
+    TEST_ASSERT_EQUAL_INT(1, recorder.n);
+    TEST_ASSERT_EQUAL_INT(1, recorder.order[0]);
+
+    // the second task is still queued and runs on the next evloop_run.
+    recorder.exit_after = 2;
+    TEST_ASSERT_EQUAL_INT(0, evloop_run(recorder.loop));
+    TEST_ASSERT_EQUAL_INT(2, recorder.n);
+    TEST_ASSERT_EQUAL_INT(2, recorder.order[1]);
+
+    evloop_unref(recorder.loop);
+}
+
+void test_delayed_tasks_run_in_target_time_order() {
+    struct recorder recorder = { .loop = evloop_new(), .n = 0, .exit_after = 3 };
+    struct recorded_task tasks[3] = { { &recorder, 1 }, { &recorder, 2 }, { &recorder, 3 } };
+    uint64_t start = now_usec();
+
+    TEST_ASSERT_NOT_NULL(recorder.loop);
+
+    // posted out of order, and the immediate task should still run first.
+    TEST_ASSERT_EQUAL_INT(0, evloop_post_delayed_task(recorder.loop, on_record, tasks + 2, start + 30000));
+    TEST_ASSERT_EQUAL_INT(0, evloop_post_delayed_task(recorder.loop, on_record, tasks + 1, start + 10000));
+    TEST_ASSERT_EQUAL_INT(0, evloop_post_task(recorder.loop, on_record, tasks + 0));
+
+    TEST_ASSERT_EQUAL_INT(0, evloop_run(recorder.loop));
+    TEST_ASSERT_TRUE(now_usec() >= start + 30000);
+    TEST_ASSERT_EQUAL_INT(3, recorder.n);
+    TEST_ASSERT_EQUAL_INT(1, recorder.order[0]);
+    TEST_ASSERT_EQUAL_INT(2, recorder.order[1]);
+    TEST_ASSERT_EQUAL_INT(3, recorder.order[2]);
+
+    evloop_unref(recorder.loop);
+}
+
+static enum event_handler_return on_pipe_readable(int fd, uint32_t revents, void *userdata) {
+    struct recorder *recorder = userdata;
+    char c;
+
+    TEST_ASSERT_TRUE(revents & EPOLLIN);
+    TEST_ASSERT_EQUAL_INT(1, read(fd, &c, 1));
+
+    recorder->order[recorder->n++] = c;
+    evloop_schedule_exit(recorder->loop);
+
+    return kRemoveSrc_EventHandlerReturn;
+}
+
+static void *write_to_pipe(void *userdata) {
+    int *fd = userdata;
+
+    usleep(10000);
+    TEST_ASSERT_EQUAL_INT(1, write(*fd, "x", 1));
+    return NULL;
+}
+
+void test_io_from_other_thread_wakes_up_loop() {
+    struct recorder recorder = { .loop = evloop_new(), .n = 0, .exit_after = -1 };
+    pthread_t thread;
+    int fds[2];
+
+    TEST_ASSERT_NOT_NULL(recorder.loop);
+    TEST_ASSERT_EQUAL_INT(0, pipe(fds));
+
+    TEST_ASSERT_NOT_NULL(evloop_add_io(recorder.loop, fds[0], EPOLLIN, on_pipe_readable, &recorder));
+    TEST_ASSERT_EQUAL_INT(0, pthread_create(&thread, NULL, write_to_pipe, fds + 1));
+
+    TEST_ASSERT_EQUAL_INT(0, evloop_run(recorder.loop));
+    pthread_join(thread, NULL);
+
+    TEST_ASSERT_EQUAL_INT(1, recorder.n);
+    TEST_ASSERT_EQUAL_INT('x', recorder.order[0]);
+
+    close(fds[0]);
+    close(fds[1]);
+    evloop_unref(recorder.loop);
+}
+
+void test_low_priority_io_runs_after_tasks() {
+    struct recorder recorder = { .loop = evloop_new(), .n = 0, .exit_after = -1 };
+    struct recorded_task task = { &recorder, 1 };
+    struct evsrc *src;
+    int fds[2];
+
+    TEST_ASSERT_NOT_NULL(recorder.loop);
+    TEST_ASSERT_EQUAL_INT(0, pipe(fds));
+
+    src = evloop_add_io(recorder.loop, fds[0], EPOLLIN, on_pipe_readable, &recorder);
+    TEST_ASSERT_NOT_NULL(src);
+    evsrc_set_low_priority(src, true);
+
+    // both are ready in the first wakeup.
+    TEST_ASSERT_EQUAL_INT(1, write(fds[1], "x", 1));
+    TEST_ASSERT_EQUAL_INT(0, evloop_post_task(recorder.loop, on_record, &task));
+
+    TEST_ASSERT_EQUAL_INT(0, evloop_run(recorder.loop));
+    TEST_ASSERT_EQUAL_INT(2, recorder.n);
+    TEST_ASSERT_EQUAL_INT(1, recorder.order[0]);
+    TEST_ASSERT_EQUAL_INT('x', recorder.order[1]);
+
+    close(fds[0]);
+    close(fds[1]);
+    evloop_unref(recorder.loop);
+}
+
+void test_evthread_runs_posted_tasks() {
+    struct recorder recorder = { .n = 0, .exit_after = -1 };
+    struct recorded_task task = { &recorder, 5 };
+    struct evthread *thread;
+
+    thread = evthread_start();
+    TEST_ASSERT_NOT_NULL(thread);
+
+    recorder.loop = evthread_get_evloop(thread);
+    TEST_ASSERT_EQUAL_INT(0, evloop_post_task(recorder.loop, on_record, &task));
+
+    // the task was posted before evthread_join, so it has run once this returns.
+    evthread_join(thread);
+
+    TEST_ASSERT_EQUAL_INT(1, recorder.n);
+    TEST_ASSERT_EQUAL_INT(5, recorder.order[0]);
+}
+
+int main() {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_tasks_run_in_posting_order);
+    RUN_TEST(test_queued_tasks_are_kept_after_exit);
+    RUN_TEST(test_delayed_tasks_run_in_target_time_order);
+    RUN_TEST(test_io_from_other_thread_wakes_up_loop);
+    RUN_TEST(test_low_priority_io_runs_after_tasks);
+    RUN_TEST(test_evthread_runs_posted_tasks);
+
+    UNITY_END();
+}
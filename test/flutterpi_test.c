@@ -45,9 +45,22 @@ void expect_parsed_cmdline_args_matches(int argc, char **argv, bool expected_res
     }
     TEST_ASSERT_EQUAL_BOOL(expected.use_vulkan, actual.use_vulkan);
     TEST_ASSERT_EQUAL_STRING(expected.desired_videomode, actual.desired_videomode);
+    TEST_ASSERT_EQUAL_BOOL(expected.vrr, actual.vrr);
+    TEST_ASSERT_EQUAL_BOOL(expected.mirror, actual.mirror);
     TEST_ASSERT_EQUAL_BOOL(expected.dummy_display, actual.dummy_display);
     TEST_ASSERT_EQUAL_INT(expected.dummy_display_size.x, actual.dummy_display_size.x);
     TEST_ASSERT_EQUAL_INT(expected.dummy_display_size.y, actual.dummy_display_size.y);
+    TEST_ASSERT_EQUAL_BOOL(expected.coalesce_input, actual.coalesce_input);
+    TEST_ASSERT_EQUAL_BOOL(expected.resample_input, actual.resample_input);
+    TEST_ASSERT_EQUAL_INT(expected.keyevent_mode, actual.keyevent_mode);
+    TEST_ASSERT_EQUAL_INT(expected.n_barcode_scanners, actual.n_barcode_scanners);
+    for (int i = 0; i < expected.n_barcode_scanners; i++) {
+        TEST_ASSERT_EQUAL_STRING(expected.barcode_scanners[i], actual.barcode_scanners[i]);
+    }
+    TEST_ASSERT_EQUAL_BOOL(expected.startup_trace, actual.startup_trace);
+    TEST_ASSERT_EQUAL_BOOL(expected.prefetch_assets, actual.prefetch_assets);
+    TEST_ASSERT_EQUAL_INT(expected.record_asset_access_secs, actual.record_asset_access_secs);
+    TEST_ASSERT_EQUAL_DOUBLE(expected.render_scale, actual.render_scale);
 }
 
 static struct flutterpi_cmdline_args get_default_args() {
@@ -69,8 +82,18 @@ static struct flutterpi_cmdline_args get_default_args() {
         .engine_argv = engine_argv,
         .use_vulkan = false,
         .desired_videomode = NULL,
+        .vrr = false,
+        .mirror = false,
         .dummy_display = false,
         .dummy_display_size = { .x = 0, .y = 0 },
+        .coalesce_input = false,
+        .resample_input = false,
+        .keyevent_mode = kKeyeventModeLegacy,
+        .n_barcode_scanners = 0,
+        .startup_trace = false,
+        .prefetch_assets = false,
+        .record_asset_access_secs = 0,
+        .render_scale = 1.0,
     };
 }
 
@@ -227,6 +250,109 @@ void test_parse_desired_videomode_arg() {
     expect_parsed_cmdline_args_matches(4, (char *[]){ "flutter-pi", "--videomode", "1920x1080@60", BUNDLE_PATH }, true, expected);
 }
 
+void test_parse_vrr_arg() {
+    struct flutterpi_cmdline_args expected = get_default_args();
+
+    expected.vrr = true;
+    expect_parsed_cmdline_args_matches(3, (char *[]){ "flutter-pi", "--vrr", BUNDLE_PATH }, true, expected);
+}
+
+void test_parse_mirror_arg() {
+    struct flutterpi_cmdline_args expected = get_default_args();
+
+    expected.mirror = true;
+    expect_parsed_cmdline_args_matches(3, (char *[]){ "flutter-pi", "--mirror", BUNDLE_PATH }, true, expected);
+}
+
+void test_parse_input_coalescing_args() {
+    struct flutterpi_cmdline_args expected = get_default_args();
+
+    expected.coalesce_input = true;
+    expect_parsed_cmdline_args_matches(3, (char *[]){ "flutter-pi", "--input-coalescing", BUNDLE_PATH }, true, expected);
+
+    // resampling implies coalescing.
+    expected.resample_input = true;
+    expect_parsed_cmdline_args_matches(3, (char *[]){ "flutter-pi", "--input-resampling", BUNDLE_PATH }, true, expected);
+}
+
+void test_parse_keyevents_arg() {
+    struct flutterpi_cmdline_args expected = get_default_args();
+
+    expected.keyevent_mode = kKeyeventModeLegacy;
+    expect_parsed_cmdline_args_matches(4, (char *[]){ "flutter-pi", "--keyevents", "legacy", BUNDLE_PATH }, true, expected);
+
+    expected.keyevent_mode = kKeyeventModeEmbedder;
+    expect_parsed_cmdline_args_matches(4, (char *[]){ "flutter-pi", "--keyevents", "embedder", BUNDLE_PATH }, true, expected);
+
+    expected.keyevent_mode = kKeyeventModeBoth;
+    expect_parsed_cmdline_args_matches(4, (char *[]){ "flutter-pi", "--keyevents", "both", BUNDLE_PATH }, true, expected);
+
+    expected = get_default_args();
+    expected.bundle_path = NULL;
+    expected.engine_argc = 0;
+    expected.engine_argv = NULL;
+    expect_parsed_cmdline_args_matches(4, (char *[]){ "flutter-pi", "--keyevents", "none", BUNDLE_PATH }, false, expected);
+}
+
+void test_parse_barcode_scanner_arg() {
+    struct flutterpi_cmdline_args expected = get_default_args();
+
+    expected.n_barcode_scanners = 1;
+    expected.barcode_scanners[0] = "05e0:1200";
+    expect_parsed_cmdline_args_matches(4, (char *[]){ "flutter-pi", "--barcode-scanner", "05e0:1200", BUNDLE_PATH }, true, expected);
+
+    expected.n_barcode_scanners = 2;
+    expected.barcode_scanners[1] = "Symbol Bar Code Scanner";
+    expect_parsed_cmdline_args_matches(
+        6,
+        (char *[]){ "flutter-pi", "--barcode-scanner", "05e0:1200", "--barcode-scanner", "Symbol Bar Code Scanner", BUNDLE_PATH },
+        true,
+        expected
+    );
+}
+
+void test_parse_startup_trace_arg() {
+    struct flutterpi_cmdline_args expected = get_default_args();
+
+    expected.startup_trace = true;
+    expect_parsed_cmdline_args_matches(3, (char *[]){ "flutter-pi", "--startup-trace", BUNDLE_PATH }, true, expected);
+}
+
+void test_parse_prefetch_assets_arg() {
+    struct flutterpi_cmdline_args expected = get_default_args();
+
+    expected.prefetch_assets = true;
+    expect_parsed_cmdline_args_matches(3, (char *[]){ "flutter-pi", "--prefetch-assets", BUNDLE_PATH }, true, expected);
+}
+
+void test_parse_record_asset_access_arg() {
+    struct flutterpi_cmdline_args expected = get_default_args();
+
+    expected.record_asset_access_secs = 10;
+    expect_parsed_cmdline_args_matches(4, (char *[]){ "flutter-pi", "--record-asset-access", "10", BUNDLE_PATH }, true, expected);
+
+    expected = get_default_args();
+    expected.bundle_path = NULL;
+    expected.engine_argc = 0;
+    expected.engine_argv = NULL;
+    expect_parsed_cmdline_args_matches(4, (char *[]){ "flutter-pi", "--record-asset-access", "0", BUNDLE_PATH }, false, expected);
+    expect_parsed_cmdline_args_matches(4, (char *[]){ "flutter-pi", "--record-asset-access", "10s", BUNDLE_PATH }, false, expected);
+}
+
+void test_parse_render_scale_arg() {
+    struct flutterpi_cmdline_args expected = get_default_args();
+
+    expected.render_scale = 0.5;
+    expect_parsed_cmdline_args_matches(4, (char *[]){ "flutter-pi", "--render-scale", "0.5", BUNDLE_PATH }, true, expected);
+
+    expected = get_default_args();
+    expected.bundle_path = NULL;
+    expected.engine_argc = 0;
+    expected.engine_argv = NULL;
+    expect_parsed_cmdline_args_matches(4, (char *[]){ "flutter-pi", "--render-scale", "0", BUNDLE_PATH }, false, expected);
+    expect_parsed_cmdline_args_matches(4, (char *[]){ "flutter-pi", "--render-scale", "1.5", BUNDLE_PATH }, false, expected);
+}
+
 int main() {
     UNITY_BEGIN();
 
@@ -239,6 +365,15 @@ int main() {
     RUN_TEST(test_parse_engine_arg);
     RUN_TEST(test_parse_vulkan_arg);
     RUN_TEST(test_parse_desired_videomode_arg);
+    RUN_TEST(test_parse_vrr_arg);
+    RUN_TEST(test_parse_mirror_arg);
+    RUN_TEST(test_parse_input_coalescing_args);
+    RUN_TEST(test_parse_keyevents_arg);
+    RUN_TEST(test_parse_barcode_scanner_arg);
+    RUN_TEST(test_parse_startup_trace_arg);
+    RUN_TEST(test_parse_prefetch_assets_arg);
+    RUN_TEST(test_parse_record_asset_access_arg);
+    RUN_TEST(test_parse_render_scale_arg);
 
     UNITY_END();
 }
@@ -0,0 +1,184 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <modesetting.h>
+#include <unity.h>
+#include <xf86drm.h>
+
+static void make_edid(uint8_t edid[128]) {
+    static const uint8_t header[8] = { 0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00 };
+
+    memset(edid, 0, 128);
+    memcpy(edid, header, sizeof header);
+
+    // first descriptor is a detailed timing descriptor (non-zero pixel clock).
+    edid[54] = 0x02;
+    edid[55] = 0x3A;
+}
+
+static void add_range_descriptor(uint8_t edid[128], int slot, uint8_t offsets, uint8_t min_hz, uint8_t max_hz) {
+    uint8_t *desc = edid + 54 + slot * 18;
+
+    memset(desc, 0, 18);
+    desc[3] = 0xFD;
+    desc[4] = offsets;
+    desc[5] = min_hz;
+    desc[6] = max_hz;
+}
+
+void setUp() {
+}
+
+void tearDown() {
+}
+
+void test_parse_edid_refresh_range() {
+    uint32_t min_hz = 0, max_hz = 0;
+    uint8_t edid[128];
+
+    make_edid(edid);
+    add_range_descriptor(edid, 1, 0, 48, 75);
+
+    drm_parse_edid_refresh_range(edid, sizeof edid, &min_hz, &max_hz);
+    TEST_ASSERT_EQUAL_UINT32(48, min_hz);
+    TEST_ASSERT_EQUAL_UINT32(75, max_hz);
+}
+
+void test_parse_edid_refresh_range_with_offsets() {
+    uint32_t min_hz = 0, max_hz = 0;
+    uint8_t edid[128];
+
+    make_edid(edid);
+    add_range_descriptor(edid, 3, 0x02, 48, 45);
+
+    // only the max rate has the +255 offset.
+    drm_parse_edid_refresh_range(edid, sizeof edid, &min_hz, &max_hz);
+    TEST_ASSERT_EQUAL_UINT32(48, min_hz);
+    TEST_ASSERT_EQUAL_UINT32(300, max_hz);
+
+    add_range_descriptor(edid, 3, 0x03, 1, 45);
+
+    drm_parse_edid_refresh_range(edid, sizeof edid, &min_hz, &max_hz);
+    TEST_ASSERT_EQUAL_UINT32(256, min_hz);
+    TEST_ASSERT_EQUAL_UINT32(300, max_hz);
+}
+
+void test_parse_edid_without_range_descriptor() {
+    uint32_t min_hz = 60, max_hz = 60;
+    uint8_t edid[128];
+
+    make_edid(edid);
+
+    // a descriptor with another tag.
+    edid[72 + 3] = 0xFC;
+
+    drm_parse_edid_refresh_range(edid, sizeof edid, &min_hz, &max_hz);
+    TEST_ASSERT_EQUAL_UINT32(60, min_hz);
+    TEST_ASSERT_EQUAL_UINT32(60, max_hz);
+}
+
+void test_parse_invalid_edid() {
+    uint32_t min_hz = 60, max_hz = 60;
+    uint8_t edid[128];
+
+    make_edid(edid);
+    add_range_descriptor(edid, 1, 0, 48, 75);
+
+    // too short to contain the descriptors.
+    drm_parse_edid_refresh_range(edid, 127, &min_hz, &max_hz);
+    TEST_ASSERT_EQUAL_UINT32(60, min_hz);
+    TEST_ASSERT_EQUAL_UINT32(60, max_hz);
+
+    // wrong header.
+    edid[1] = 0x00;
+    drm_parse_edid_refresh_range(edid, sizeof edid, &min_hz, &max_hz);
+    TEST_ASSERT_EQUAL_UINT32(60, min_hz);
+    TEST_ASSERT_EQUAL_UINT32(60, max_hz);
+}
+
+static int on_drmdev_open(const char *path, int flags, void **fd_metadata_out, void *userdata) {
+    (void) userdata;
+
+    *fd_metadata_out = NULL;
+    return open(path, flags);
+}
+
+static void on_drmdev_close(int fd, void *fd_metadata, void *userdata) {
+    (void) fd_metadata;
+    (void) userdata;
+
+    close(fd);
+}
+
+static const struct drmdev_interface drmdev_interface = { .open = on_drmdev_open, .close = on_drmdev_close };
+
+void test_cached_fb_is_reused_for_resubmitted_dmabuf() {
+    struct drmdev *drmdev;
+    uint32_t handle, pitch, fb_id, fb_id2;
+    size_t size;
+    int ok, prime_fd;
+
+    drmdev = drmdev_new_from_path("/dev/dri/card0", &drmdev_interface, NULL);
+    if (drmdev == NULL || !drmdev_supports_dumb_buffers(drmdev)) {
+        if (drmdev != NULL) {
+            drmdev_unref(drmdev);
+        }
+        TEST_IGNORE_MESSAGE("No KMS device with dumb buffer support available.");
+    }
+
+    ok = drmdev_create_dumb_buffer(drmdev, 64, 64, 32, &handle, &pitch, &size);
+    TEST_ASSERT_EQUAL_INT(0, ok);
+
+    ok = drmPrimeHandleToFD(drmdev_get_fd(drmdev), handle, DRM_CLOEXEC, &prime_fd);
+    TEST_ASSERT_EQUAL_INT(0, ok);
+
+    fb_id = drmdev_add_cached_fb_from_dmabuf(
+        drmdev,
+        64,
+        64,
+        PIXFMT_XRGB8888,
+        (const int[4]){ prime_fd, -1, -1, -1 },
+        (const uint32_t[4]){ pitch, 0 },
+        (const uint32_t[4]){ 0 },
+        false,
+        (const uint64_t[4]){ 0 }
+    );
+    TEST_ASSERT_NOT_EQUAL(0, fb_id);
+
+    // The buffer is not on screen anymore, but the decoder will push it again.
+    drmdev_release_cached_fb(drmdev, fb_id);
+
+    fb_id2 = drmdev_add_cached_fb_from_dmabuf(
+        drmdev,
+        64,
+        64,
+        PIXFMT_XRGB8888,
+        (const int[4]){ prime_fd, -1, -1, -1 },
+        (const uint32_t[4]){ pitch, 0 },
+        (const uint32_t[4]){ 0 },
+        false,
+        (const uint64_t[4]){ 0 }
+    );
+    TEST_ASSERT_EQUAL_UINT32(fb_id, fb_id2);
+
+    drmdev_release_cached_fb(drmdev, fb_id2);
+    drmdev_evict_cached_fbs(drmdev);
+
+    close(prime_fd);
+    drmdev_destroy_dumb_buffer(drmdev, handle);
+    drmdev_unref(drmdev);
+}
+
+int main() {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_parse_edid_refresh_range);
+    RUN_TEST(test_parse_edid_refresh_range_with_offsets);
+    RUN_TEST(test_parse_edid_without_range_descriptor);
+    RUN_TEST(test_parse_invalid_edid);
+    RUN_TEST(test_cached_fb_is_reused_for_resubmitted_dmabuf);
+
+    return UNITY_END();
+}
@@ -0,0 +1,239 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pixel_format.h>
+#include <pixel_format_conversion.h>
+#include <unity.h>
+
+// Not a multiple of any SIMD width, so the scalar tail loops are exercised too.
+#define N_PIXELS 1003
+
+static uint32_t random_state;
+
+static uint32_t random_u32(void) {
+    // xorshift32, so the tests are deterministic.
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+
+static void fill_random(void *buffer, size_t size) {
+    uint8_t *bytes = buffer;
+
+    for (size_t i = 0; i < size; i++) {
+        bytes[i] = (uint8_t) random_u32();
+    }
+}
+
+static void fill_random_premultiplied(uint32_t *pixels, int n) {
+    for (int i = 0; i < n; i++) {
+        uint32_t a = random_u32() & 0xFF;
+
+        // Some fully opaque & fully transparent pixels too.
+        if (i % 7 == 0) {
+            a = 0xFF;
+        } else if (i % 11 == 0) {
+            a = 0;
+        }
+
+        pixels[i] = a << 24 | (random_u32() % (a + 1)) << 16 | (random_u32() % (a + 1)) << 8 | (random_u32() % (a + 1));
+    }
+}
+
+void setUp() {
+    random_state = 0x12345678;
+}
+
+void tearDown() {
+    pixfmt_conversion_set_kernels(NULL);
+}
+
+void test_convert_known_values() {
+    uint32_t argb = 0xFF123456, argb_out;
+    uint16_t rgb565;
+
+    pixfmt_convert_row(&rgb565, PIXFMT_RGB565, &argb, PIXFMT_ARGB8888, 1);
+    TEST_ASSERT_EQUAL_HEX16(0x11AA, rgb565);
+
+    rgb565 = 0xF800;
+    pixfmt_convert_row(&argb_out, PIXFMT_ARGB8888, &rgb565, PIXFMT_RGB565, 1);
+    TEST_ASSERT_EQUAL_HEX32(0xFFFF0000, argb_out);
+
+    argb = 0x80112233;
+    pixfmt_convert_row(&argb_out, PIXFMT_BGRA8888, &argb, PIXFMT_ARGB8888, 1);
+    TEST_ASSERT_EQUAL_HEX32(0x33221180, argb_out);
+
+    pixfmt_convert_row(&argb_out, PIXFMT_RGBA8888, &argb, PIXFMT_ARGB8888, 1);
+    TEST_ASSERT_EQUAL_HEX32(0x11223380, argb_out);
+
+    argb = 0x00112233;
+    pixfmt_convert_row(&argb_out, PIXFMT_ARGB8888, &argb, PIXFMT_XRGB8888, 1);
+    TEST_ASSERT_EQUAL_HEX32(0xFF112233, argb_out);
+
+    argb = 0x00112233;
+    pixfmt_convert_row(&argb_out, PIXFMT_BGRA8888, &argb, PIXFMT_XRGB8888, 1);
+    TEST_ASSERT_EQUAL_HEX32(0x332211FF, argb_out);
+
+    argb = 0x80FF4000;
+    pixfmt_premultiply_row(&argb_out, &argb, 1);
+    TEST_ASSERT_EQUAL_HEX32(0x80802000, argb_out);
+
+    argb = 0x80804020;
+    argb_out = 0xFF0000FF;
+    pixfmt_blend_row(&argb_out, &argb, 1);
+    TEST_ASSERT_EQUAL_HEX32(0xFF80409F, argb_out);
+}
+
+void test_simd_kernels_match_scalar_kernels() {
+    const struct pixfmt_conversion_kernels *scalar, *simd;
+    uint32_t src[N_PIXELS], dst_scalar[N_PIXELS], dst_simd[N_PIXELS];
+
+    scalar = pixfmt_conversion_get_scalar_kernels();
+    simd = pixfmt_conversion_get_simd_kernels();
+    if (simd == NULL) {
+        TEST_IGNORE_MESSAGE("SIMD kernels are not supported on this platform.");
+    }
+
+    for (enum pixfmt src_format = 0; src_format < PIXFMT_COUNT; src_format++) {
+        for (enum pixfmt dst_format = 0; dst_format < PIXFMT_COUNT; dst_format++) {
+            fill_random(src, sizeof(src));
+            memset(dst_scalar, 0, sizeof(dst_scalar));
+            memset(dst_simd, 0, sizeof(dst_simd));
+
+            pixfmt_conversion_set_kernels(scalar);
+            pixfmt_convert_row(dst_scalar, dst_format, src, src_format, N_PIXELS);
+
+            pixfmt_conversion_set_kernels(simd);
+            pixfmt_convert_row(dst_simd, dst_format, src, src_format, N_PIXELS);
+
+            TEST_ASSERT_EQUAL_HEX8_ARRAY(dst_scalar, dst_simd, sizeof(dst_scalar));
+        }
+    }
+
+    fill_random(src, sizeof(src));
+
+    pixfmt_conversion_set_kernels(scalar);
+    pixfmt_premultiply_row(dst_scalar, src, N_PIXELS);
+    pixfmt_conversion_set_kernels(simd);
+    pixfmt_premultiply_row(dst_simd, src, N_PIXELS);
+    TEST_ASSERT_EQUAL_HEX32_ARRAY(dst_scalar, dst_simd, N_PIXELS);
+
+    fill_random_premultiplied(src, N_PIXELS);
+    fill_random(dst_scalar, sizeof(dst_scalar));
+    for (int i = 0; i < N_PIXELS; i++) {
+        // the destination needs to be valid premultiplied ARGB too.
+        dst_scalar[i] |= 0xFF000000;
+    }
+    memcpy(dst_simd, dst_scalar, sizeof(dst_simd));
+
+    pixfmt_conversion_set_kernels(scalar);
+    pixfmt_blend_row(dst_scalar, src, N_PIXELS);
+    pixfmt_conversion_set_kernels(simd);
+    pixfmt_blend_row(dst_simd, src, N_PIXELS);
+    TEST_ASSERT_EQUAL_HEX32_ARRAY(dst_scalar, dst_simd, N_PIXELS);
+}
+
+void test_premultiply_roundtrip() {
+    uint32_t src[N_PIXELS], premultiplied[N_PIXELS], dst[N_PIXELS];
+
+    fill_random(src, sizeof(src));
+    for (int i = 0; i < N_PIXELS; i++) {
+        src[i] |= 0xFF000000;
+    }
+
+    pixfmt_premultiply_row(premultiplied, src, N_PIXELS);
+    TEST_ASSERT_EQUAL_HEX32_ARRAY(src, premultiplied, N_PIXELS);
+
+    pixfmt_unpremultiply_row(dst, premultiplied, N_PIXELS);
+    TEST_ASSERT_EQUAL_HEX32_ARRAY(src, dst, N_PIXELS);
+}
+
+static void expect_transformed_image_matches(enum pixfmt dst_format, enum pixfmt src_format, int width, int height, enum pixfmt_transform transform) {
+    int src_bpp, dst_bpp, dst_width, dst_height, src_pitch, dst_pitch;
+    uint8_t *src, *dst, *expected;
+    bool swap;
+
+    src_bpp = get_pixfmt_info(src_format)->bits_per_pixel / 8;
+    dst_bpp = get_pixfmt_info(dst_format)->bits_per_pixel / 8;
+
+    swap = (transform & PIXFMT_TRANSFORM_ROTATION_MASK) == PIXFMT_TRANSFORM_ROTATE_90 ||
+           (transform & PIXFMT_TRANSFORM_ROTATION_MASK) == PIXFMT_TRANSFORM_ROTATE_270;
+    dst_width = swap ? height : width;
+    dst_height = swap ? width : height;
+
+    // add some padding to the pitches, to make sure they're respected.
+    src_pitch = width * src_bpp + 12;
+    dst_pitch = dst_width * dst_bpp + 20;
+
+    src = malloc((size_t) src_pitch * height);
+    dst = calloc(1, (size_t) dst_pitch * dst_height);
+    expected = calloc(1, (size_t) dst_pitch * dst_height);
+    TEST_ASSERT_NOT_NULL(src);
+    TEST_ASSERT_NOT_NULL(dst);
+    TEST_ASSERT_NOT_NULL(expected);
+
+    fill_random(src, (size_t) src_pitch * height);
+
+    // naive reference: look up the source pixel for each destination pixel.
+    for (int y = 0; y < dst_height; y++) {
+        for (int x = 0; x < dst_width; x++) {
+            int fx = transform & PIXFMT_TRANSFORM_FLIP_X ? dst_width - 1 - x : x;
+            int fy = transform & PIXFMT_TRANSFORM_FLIP_Y ? dst_height - 1 - y : y;
+            int sx, sy;
+
+            switch (transform & PIXFMT_TRANSFORM_ROTATION_MASK) {
+                case PIXFMT_TRANSFORM_ROTATE_0:
+                    sx = fx;
+                    sy = fy;
+                    break;
+                case PIXFMT_TRANSFORM_ROTATE_90:
+                    sx = fy;
+                    sy = height - 1 - fx;
+                    break;
+                case PIXFMT_TRANSFORM_ROTATE_180:
+                    sx = width - 1 - fx;
+                    sy = height - 1 - fy;
+                    break;
+                default:
+                    sx = width - 1 - fy;
+                    sy = fx;
+                    break;
+            }
+
+            pixfmt_convert_row(expected + y * dst_pitch + x * dst_bpp, dst_format, src + sy * src_pitch + sx * src_bpp, src_format, 1);
+        }
+    }
+
+    pixfmt_convert_image(dst, dst_format, dst_pitch, src, src_format, src_pitch, width, height, transform);
+
+    for (int y = 0; y < dst_height; y++) {
+        TEST_ASSERT_EQUAL_HEX8_ARRAY(expected + y * dst_pitch, dst + y * dst_pitch, dst_width * dst_bpp);
+    }
+
+    free(expected);
+    free(dst);
+    free(src);
+}
+
+void test_convert_image_transforms() {
+    for (int transform = 0; transform < 16; transform++) {
+        // odd sizes that aren't multiples of the tile size.
+        expect_transformed_image_matches(PIXFMT_ARGB8888, PIXFMT_ARGB8888, 37, 70, transform);
+        expect_transformed_image_matches(PIXFMT_RGB565, PIXFMT_ARGB8888, 37, 70, transform);
+        expect_transformed_image_matches(PIXFMT_BGRA8888, PIXFMT_RGB565, 70, 37, transform);
+        expect_transformed_image_matches(PIXFMT_XRGB8888, PIXFMT_ARGB8888, 1, 5, transform);
+    }
+}
+
+int main() {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_convert_known_values);
+    RUN_TEST(test_simd_kernels_match_scalar_kernels);
+    RUN_TEST(test_premultiply_roundtrip);
+    RUN_TEST(test_convert_image_transforms);
+
+    UNITY_END();
+}
@@ -1346,6 +1346,115 @@ void test_raw_std_map_find() {
 void test_raw_std_map_find_str() {
 }
 
+void test_raw_std_map_index() {
+    struct std_map_index index;
+    int ok;
+
+    // clang-format off
+    const struct raw_std_value *map = RAW_STD_BUF(
+        kStdMap, 4,
+        kStdString, 1, 'a', kStdTrue,
+        kStdString, 2, 'b', 'c', kStdFalse,
+        kStdNull, kStdTrue,
+        kStdString, 1, 'a', kStdNull,
+    );
+    // clang-format on
+
+    ok = raw_std_map_index_init(&index, map);
+    TEST_ASSERT_EQUAL_INT(0, ok);
+
+    TEST_ASSERT_EQUAL_PTR(raw_std_map_find_str(map, "a"), raw_std_map_index_find_str(&index, "a"));
+    TEST_ASSERT_TRUE(raw_std_value_is_true(raw_std_map_index_find_str(&index, "a")));
+    TEST_ASSERT_TRUE(raw_std_value_is_false(raw_std_map_index_find_str(&index, "bc")));
+    TEST_ASSERT_NULL(raw_std_map_index_find_str(&index, "b"));
+    TEST_ASSERT_NULL(raw_std_map_index_find_str(&index, ""));
+
+    std_map_index_deinit(&index);
+
+    // enough entries that the index doesn't fit into the inline buckets anymore.
+    uint8_t buffer[2 + 40 * 5];
+    size_t offset = 0;
+
+    buffer[offset++] = kStdMap;
+    buffer[offset++] = 40;
+    for (int i = 0; i < 40; i++) {
+        buffer[offset++] = kStdString;
+        buffer[offset++] = 2;
+        buffer[offset++] = 'k';
+        buffer[offset++] = '0' + i;
+        buffer[offset++] = i % 2 ? kStdTrue : kStdFalse;
+    }
+
+    ok = raw_std_map_index_init(&index, AS_RAW_STD_VALUE(buffer));
+    TEST_ASSERT_EQUAL_INT(0, ok);
+
+    for (int i = 0; i < 40; i++) {
+        char key[] = { 'k', '0' + i, '\0' };
+        TEST_ASSERT_EQUAL_PTR(raw_std_map_find_str(AS_RAW_STD_VALUE(buffer), key), raw_std_map_index_find_str(&index, key));
+    }
+    TEST_ASSERT_NULL(raw_std_map_index_find_str(&index, "k"));
+
+    std_map_index_deinit(&index);
+}
+
+void test_raw_std_map_extract() {
+    struct test_fields {
+        const struct raw_std_value *a;
+        const struct raw_std_value *bc;
+        const struct raw_std_value *missing;
+    } out;
+    int ok;
+
+    // clang-format off
+    static const struct std_map_field fields[] = {
+        STD_MAP_FIELD(struct test_fields, a, "a"),
+        STD_MAP_FIELD(struct test_fields, bc, "bc"),
+        STD_MAP_FIELD(struct test_fields, missing, "missing"),
+    };
+
+    const struct raw_std_value *map = RAW_STD_BUF(
+        kStdMap, 2,
+        kStdString, 2, 'b', 'c', kStdFalse,
+        kStdString, 1, 'a', kStdTrue,
+    );
+    // clang-format on
+
+    ok = raw_std_map_extract(map, fields, ARRAY_SIZE(fields), &out);
+    TEST_ASSERT_EQUAL_INT(0, ok);
+
+    TEST_ASSERT_TRUE(raw_std_value_is_true(out.a));
+    TEST_ASSERT_TRUE(raw_std_value_is_false(out.bc));
+    TEST_ASSERT_NULL(out.missing);
+}
+
+void test_stdmap_extract() {
+    struct test_fields {
+        struct std_value *a;
+        struct std_value *bc;
+        struct std_value *missing;
+    } out;
+    int ok;
+
+    // clang-format off
+    static const struct std_map_field fields[] = {
+        STD_MAP_FIELD(struct test_fields, a, "a"),
+        STD_MAP_FIELD(struct test_fields, bc, "bc"),
+        STD_MAP_FIELD(struct test_fields, missing, "missing"),
+    };
+    // clang-format on
+
+    struct std_value map = STDMAP2(STDSTRING("bc"), STDINT32(2), STDSTRING("a"), STDINT32(1));
+
+    ok = stdmap_extract(&map, fields, ARRAY_SIZE(fields), &out);
+    TEST_ASSERT_EQUAL_INT(0, ok);
+
+    TEST_ASSERT_NOT_NULL(out.a);
+    TEST_ASSERT_EQUAL_INT32(1, STDVALUE_AS_INT(*out.a));
+    TEST_ASSERT_NOT_NULL(out.bc);
+    TEST_ASSERT_EQUAL_INT32(2, STDVALUE_AS_INT(*out.bc));
+    TEST_ASSERT_NULL(out.missing);
+}
+
 void test_raw_std_value_check() {
 }
 
@@ -1408,6 +1517,9 @@ int main(void) {
     RUN_TEST(test_raw_std_map_get_first_key);
     RUN_TEST(test_raw_std_map_find);
     RUN_TEST(test_raw_std_map_find_str);
+    RUN_TEST(test_raw_std_map_index);
+    RUN_TEST(test_raw_std_map_extract);
+    RUN_TEST(test_stdmap_extract);
     RUN_TEST(test_raw_std_value_check);
     RUN_TEST(test_raw_std_method_call_check);
     RUN_TEST(test_raw_std_method_call_response_check);
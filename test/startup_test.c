@@ -0,0 +1,157 @@
+#include <errno.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <startup.h>
+#include <unity.h>
+
+struct rendezvous {
+    sem_t main_ran, task_ran;
+    atomic_bool finished;
+    int result;
+};
+
+static int wait_with_timeout(sem_t *sem) {
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += 5;
+
+    return sem_timedwait(sem, &deadline) == 0 ? 0 : errno;
+}
+
+static int on_rendezvous(void *userdata) {
+    struct rendezvous *r = userdata;
+    int ok;
+
+    // only completes if the main thread can run its step while this task is still running.
+    sem_post(&r->task_ran);
+    ok = wait_with_timeout(&r->main_ran);
+
+    atomic_store(&r->finished, true);
+    return ok;
+}
+
+static int on_finish_slowly(void *userdata) {
+    struct rendezvous *r = userdata;
+
+    usleep(10000);
+    atomic_store(&r->finished, true);
+    return r->result;
+}
+
+void setUp() {
+}
+
+void tearDown() {
+}
+
+void test_tasks_run_concurrently_with_steps() {
+    struct rendezvous r = { .finished = false };
+    struct startup_task *task;
+    struct startup *startup;
+    int step;
+
+    sem_init(&r.main_ran, 0, 0);
+    sem_init(&r.task_ran, 0, 0);
+
+    startup = startup_new(true);
+    TEST_ASSERT_NOT_NULL(startup);
+
+    task = startup_start_task(startup, "rendezvous", on_rendezvous, &r);
+    TEST_ASSERT_NOT_NULL(task);
+
+    step = startup_begin_step(startup, "main step");
+    TEST_ASSERT_EQUAL_INT(0, wait_with_timeout(&r.task_ran));
+    TEST_ASSERT_FALSE(atomic_load(&r.finished));
+    sem_post(&r.main_ran);
+    startup_end_step(startup, step);
+
+    TEST_ASSERT_EQUAL_INT(0, startup_join_task(startup, task));
+    TEST_ASSERT_TRUE(atomic_load(&r.finished));
+
+    startup_print_trace(startup);
+    startup_destroy(startup);
+
+    sem_destroy(&r.main_ran);
+    sem_destroy(&r.task_ran);
+}
+
+void test_join_waits_for_task_and_returns_its_result() {
+    struct rendezvous r = { .finished = false, .result = 42 };
+    struct startup_task *task;
+    struct startup *startup;
+
+    startup = startup_new(false);
+    TEST_ASSERT_NOT_NULL(startup);
+
+    task = startup_start_task(startup, "slow", on_finish_slowly, &r);
+    TEST_ASSERT_NOT_NULL(task);
+
+    TEST_ASSERT_EQUAL_INT(42, startup_join_task(startup, task));
+    TEST_ASSERT_TRUE(atomic_load(&r.finished));
+
+    startup_destroy(startup);
+}
+
+void test_tasks_can_be_joined_in_any_order() {
+    struct rendezvous r[3] = {
+        { .finished = false, .result = 1 },
+        { .finished = false, .result = 2 },
+        { .finished = false, .result = 3 },
+    };
+    struct startup_task *tasks[3];
+    struct startup *startup;
+
+    startup = startup_new(true);
+    TEST_ASSERT_NOT_NULL(startup);
+
+    for (int i = 0; i < 3; i++) {
+        tasks[i] = startup_start_task(startup, "slow", on_finish_slowly, r + i);
+        TEST_ASSERT_NOT_NULL(tasks[i]);
+    }
+
+    for (int i = 2; i >= 0; i--) {
+        TEST_ASSERT_EQUAL_INT(i + 1, startup_join_task(startup, tasks[i]));
+        TEST_ASSERT_TRUE(atomic_load(&r[i].finished));
+    }
+
+    startup_destroy(startup);
+}
+
+void test_steps_beyond_the_trace_limit_are_ignored() {
+    struct startup *startup;
+    int step;
+
+    startup = startup_new(true);
+    TEST_ASSERT_NOT_NULL(startup);
+
+    for (int i = 0; i < 1000; i++) {
+        step = startup_begin_step(startup, "step");
+        startup_end_step(startup, step);
+    }
+
+    // the last ones didn't fit in the timeline anymore.
+    TEST_ASSERT_EQUAL_INT(-1, step);
+
+    startup_destroy(startup);
+
+    startup = startup_new(false);
+    TEST_ASSERT_NOT_NULL(startup);
+    TEST_ASSERT_EQUAL_INT(-1, startup_begin_step(startup, "untraced"));
+    startup_print_trace(startup);
+    startup_destroy(startup);
+}
+
+int main() {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_tasks_run_concurrently_with_steps);
+    RUN_TEST(test_join_waits_for_task_and_returns_its_result);
+    RUN_TEST(test_tasks_can_be_joined_in_any_order);
+    RUN_TEST(test_steps_beyond_the_trace_limit_are_ignored);
+
+    return UNITY_END();
+}
@@ -0,0 +1,112 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <thread_pool.h>
+#include <unity.h>
+
+struct counter {
+    struct thread_pool *pool;
+    atomic_int n_run;
+    int n_children;
+};
+
+static void on_count(void *userdata) {
+    struct counter *counter = userdata;
+
+    atomic_fetch_add(&counter->n_run, 1);
+}
+
+static void on_count_slowly(void *userdata) {
+    struct counter *counter = userdata;
+
+    usleep(1000);
+    atomic_fetch_add(&counter->n_run, 1);
+}
+
+static void on_spawn_children(void *userdata) {
+    struct counter *counter = userdata;
+
+    for (int i = 0; i < counter->n_children; i++) {
+        TEST_ASSERT_EQUAL_INT(0, thread_pool_submit(counter->pool, on_count, counter));
+    }
+
+    atomic_fetch_add(&counter->n_run, 1);
+}
+
+void setUp() {
+}
+
+void tearDown() {
+}
+
+void test_all_jobs_run_before_destroy_returns() {
+    struct counter counter = { .pool = thread_pool_new(4), .n_run = 0 };
+
+    TEST_ASSERT_NOT_NULL(counter.pool);
+    TEST_ASSERT_EQUAL_INT(4, thread_pool_get_n_queues(counter.pool));
+
+    for (int i = 0; i < 1000; i++) {
+        TEST_ASSERT_EQUAL_INT(0, thread_pool_submit(counter.pool, on_count, &counter));
+    }
+
+    thread_pool_destroy(counter.pool);
+    TEST_ASSERT_EQUAL_INT(1000, atomic_load(&counter.n_run));
+}
+
+void test_jobs_can_submit_jobs() {
+    struct counter counter = { .pool = thread_pool_new(2), .n_run = 0, .n_children = 10 };
+
+    TEST_ASSERT_NOT_NULL(counter.pool);
+
+    for (int i = 0; i < 10; i++) {
+        TEST_ASSERT_EQUAL_INT(0, thread_pool_submit(counter.pool, on_spawn_children, &counter));
+    }
+
+    thread_pool_destroy(counter.pool);
+    TEST_ASSERT_EQUAL_INT(10 + 10 * 10, atomic_load(&counter.n_run));
+}
+
+void test_queue_stats_add_up() {
+    struct thread_pool_queue_stats stats;
+    struct counter counter = { .pool = thread_pool_new(3), .n_run = 0 };
+    uint64_t n_submitted = 0, n_done = 0;
+
+    TEST_ASSERT_NOT_NULL(counter.pool);
+
+    for (int i = 0; i < 30; i++) {
+        TEST_ASSERT_EQUAL_INT(0, thread_pool_submit(counter.pool, on_count_slowly, &counter));
+    }
+
+    thread_pool_wait_idle(counter.pool);
+    TEST_ASSERT_EQUAL_INT(30, atomic_load(&counter.n_run));
+
+    for (int i = 0; i < thread_pool_get_n_queues(counter.pool); i++) {
+        thread_pool_get_queue_stats(counter.pool, i, &stats);
+
+        // submissions from outside the pool are distributed round-robin.
+        TEST_ASSERT_EQUAL_UINT64(10, stats.n_submitted);
+        TEST_ASSERT_EQUAL_UINT(0, stats.depth);
+        TEST_ASSERT_TRUE(stats.max_depth >= 1);
+        TEST_ASSERT_TRUE(stats.total_run_time_ns > 0);
+
+        n_submitted += stats.n_submitted;
+        n_done += stats.n_executed + stats.n_stolen;
+    }
+
+    TEST_ASSERT_EQUAL_UINT64(30, n_submitted);
+    TEST_ASSERT_EQUAL_UINT64(30, n_done);
+
+    thread_pool_destroy(counter.pool);
+}
+
+int main() {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_all_jobs_run_before_destroy_returns);
+    RUN_TEST(test_jobs_can_submit_jobs);
+    RUN_TEST(test_queue_stats_add_up);
+
+    UNITY_END();
+}
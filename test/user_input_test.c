@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <user_input.h>
+#include <unity.h>
+
+void setUp() {
+}
+
+void tearDown() {
+}
+
+static FlutterPointerEvent pointer_event(FlutterPointerPhase phase, size_t timestamp, double x, double y, int32_t device, int64_t buttons) {
+    return (FlutterPointerEvent){
+        .struct_size = sizeof(FlutterPointerEvent),
+        .phase = phase,
+        .timestamp = timestamp,
+        .x = x,
+        .y = y,
+        .device = device,
+        .signal_kind = kFlutterPointerSignalKindNone,
+        .buttons = buttons,
+    };
+}
+
+#define MOVE(timestamp, x, device) pointer_event(kMove, (timestamp), (x), 0.0, (device), kFlutterPointerButtonMousePrimary)
+
+void test_coalesce_keeps_last_move_of_each_pointer() {
+    FlutterPointerEvent events[] = {
+        MOVE(1000, 1.0, 0), MOVE(2000, 10.0, 1), MOVE(3000, 2.0, 0), MOVE(4000, 20.0, 1), MOVE(5000, 3.0, 0),
+    };
+    size_t n_events;
+
+    n_events = user_input_coalesce_pointer_events(events, 5, false, 0);
+
+    TEST_ASSERT_EQUAL_UINT(2, n_events);
+    TEST_ASSERT_EQUAL_INT32(1, events[0].device);
+    TEST_ASSERT_EQUAL_DOUBLE(20.0, events[0].x);
+    TEST_ASSERT_EQUAL_INT32(0, events[1].device);
+    TEST_ASSERT_EQUAL_DOUBLE(3.0, events[1].x);
+    TEST_ASSERT_EQUAL_UINT64(5000, events[1].timestamp);
+}
+
+void test_coalesce_doesnt_move_across_other_events() {
+    FlutterPointerEvent events[] = {
+        pointer_event(kHover, 1000, 1.0, 0.0, 0, 0),
+        pointer_event(kDown, 2000, 1.0, 0.0, 0, kFlutterPointerButtonMousePrimary),
+        MOVE(3000, 2.0, 0),
+        MOVE(4000, 3.0, 0),
+        pointer_event(kUp, 5000, 3.0, 0.0, 0, 0),
+    };
+    size_t n_events;
+
+    n_events = user_input_coalesce_pointer_events(events, 5, false, 0);
+
+    TEST_ASSERT_EQUAL_UINT(4, n_events);
+    TEST_ASSERT_EQUAL(kHover, events[0].phase);
+    TEST_ASSERT_EQUAL(kDown, events[1].phase);
+    TEST_ASSERT_EQUAL(kMove, events[2].phase);
+    TEST_ASSERT_EQUAL_DOUBLE(3.0, events[2].x);
+    TEST_ASSERT_EQUAL(kUp, events[3].phase);
+}
+
+void test_coalesce_keeps_moves_with_different_buttons() {
+    FlutterPointerEvent events[] = {
+        pointer_event(kMove, 1000, 1.0, 0.0, 0, kFlutterPointerButtonMousePrimary),
+        pointer_event(kMove, 2000, 2.0, 0.0, 0, kFlutterPointerButtonMousePrimary | kFlutterPointerButtonMouseSecondary),
+    };
+
+    TEST_ASSERT_EQUAL_UINT(2, user_input_coalesce_pointer_events(events, 2, false, 0));
+}
+
+void test_resample_interpolates_to_frame_time() {
+    FlutterPointerEvent events[] = { MOVE(10000, 0.0, 0), MOVE(20000, 100.0, 0) };
+    size_t n_events;
+
+    // The resampling target is 5ms before the frame time, which is between the two samples.
+    n_events = user_input_coalesce_pointer_events(events, 2, true, 22000);
+
+    TEST_ASSERT_EQUAL_UINT(1, n_events);
+    TEST_ASSERT_EQUAL_UINT64(17000, events[0].timestamp);
+    TEST_ASSERT_DOUBLE_WITHIN(0.001, 70.0, events[0].x);
+}
+
+void test_resample_limits_prediction() {
+    FlutterPointerEvent events[] = { MOVE(10000, 0.0, 0), MOVE(20000, 100.0, 0) };
+
+    // Only predicts half the sample interval into the future.
+    user_input_coalesce_pointer_events(events, 2, true, 40000);
+
+    TEST_ASSERT_EQUAL_UINT64(25000, events[0].timestamp);
+    TEST_ASSERT_DOUBLE_WITHIN(0.001, 150.0, events[0].x);
+}
+
+void test_resample_skips_close_samples() {
+    FlutterPointerEvent events[] = { MOVE(10000, 0.0, 0), MOVE(11000, 100.0, 0) };
+
+    user_input_coalesce_pointer_events(events, 2, true, 30000);
+
+    TEST_ASSERT_EQUAL_UINT64(11000, events[0].timestamp);
+    TEST_ASSERT_EQUAL_DOUBLE(100.0, events[0].x);
+}
+
+struct scans {
+    int n_scans;
+    char last[MAX_BARCODE_LENGTH + 1];
+};
+
+static void on_scan(void *userdata, const char *text) {
+    struct scans *scans = userdata;
+
+    scans->n_scans++;
+    snprintf(scans->last, sizeof scans->last, "%s", text);
+}
+
+static void type_text(struct barcode_buffer *buffer, uint64_t *timestamp_us, const char *text) {
+    for (const char *c = text; *c != '\0'; c++) {
+        char character[2] = { *c, '\0' };
+
+        barcode_buffer_on_key(buffer, *timestamp_us, (xkb_keysym_t) *c, character, true);
+        barcode_buffer_on_key(buffer, *timestamp_us + 100, (xkb_keysym_t) *c, character, false);
+        *timestamp_us += 1000;
+    }
+}
+
+void test_barcode_scan_ends_with_enter() {
+    struct barcode_buffer buffer;
+    struct scans scans = { 0 };
+    uint64_t timestamp_us = 1000000, deadline_us;
+
+    TEST_ASSERT_EQUAL_INT(0, barcode_buffer_init(&buffer, on_scan, &scans));
+
+    type_text(&buffer, &timestamp_us, "4006381333931");
+
+    // modifier keys don't produce any text.
+    barcode_buffer_on_key(&buffer, timestamp_us, XKB_KEY_Shift_L, "", true);
+    TEST_ASSERT_EQUAL_INT(0, scans.n_scans);
+
+    barcode_buffer_on_key(&buffer, timestamp_us, XKB_KEY_Return, "", true);
+    TEST_ASSERT_EQUAL_INT(1, scans.n_scans);
+    TEST_ASSERT_EQUAL_STRING("4006381333931", scans.last);
+
+    // Nothing left to deliver.
+    TEST_ASSERT_FALSE(barcode_buffer_get_deadline(&buffer, &deadline_us));
+    barcode_buffer_flush(&buffer);
+    TEST_ASSERT_EQUAL_INT(1, scans.n_scans);
+
+    barcode_buffer_deinit(&buffer);
+}
+
+void test_barcode_scan_times_out() {
+    struct barcode_buffer buffer;
+    struct scans scans = { 0 };
+    uint64_t timestamp_us = 1000000, deadline_us;
+
+    TEST_ASSERT_EQUAL_INT(0, barcode_buffer_init(&buffer, on_scan, &scans));
+
+    type_text(&buffer, &timestamp_us, "ABC");
+
+    // The last key was pressed 1ms before timestamp_us.
+    TEST_ASSERT_TRUE(barcode_buffer_get_deadline(&buffer, &deadline_us));
+    TEST_ASSERT_EQUAL_UINT64(timestamp_us - 1000 + BARCODE_BURST_TIMEOUT_US, deadline_us);
+
+    barcode_buffer_flush_if_timed_out(&buffer, deadline_us - 1);
+    TEST_ASSERT_EQUAL_INT(0, scans.n_scans);
+
+    barcode_buffer_flush_if_timed_out(&buffer, deadline_us);
+    TEST_ASSERT_EQUAL_INT(1, scans.n_scans);
+    TEST_ASSERT_EQUAL_STRING("ABC", scans.last);
+
+    barcode_buffer_deinit(&buffer);
+}
+
+void test_barcode_pause_starts_new_scan() {
+    struct barcode_buffer buffer;
+    struct scans scans = { 0 };
+    uint64_t timestamp_us = 1000000;
+
+    TEST_ASSERT_EQUAL_INT(0, barcode_buffer_init(&buffer, on_scan, &scans));
+
+    type_text(&buffer, &timestamp_us, "123");
+
+    // The first key after the pause delivers the previous scan, even if nobody flushed it in time.
+    timestamp_us += BARCODE_BURST_TIMEOUT_US;
+    type_text(&buffer, &timestamp_us, "45");
+    TEST_ASSERT_EQUAL_INT(1, scans.n_scans);
+    TEST_ASSERT_EQUAL_STRING("123", scans.last);
+
+    barcode_buffer_flush(&buffer);
+    TEST_ASSERT_EQUAL_INT(2, scans.n_scans);
+    TEST_ASSERT_EQUAL_STRING("45", scans.last);
+
+    barcode_buffer_deinit(&buffer);
+}
+
+void test_long_barcode_scan_is_split() {
+    struct barcode_buffer buffer;
+    struct scans scans = { 0 };
+    uint64_t timestamp_us = 1000000;
+
+    TEST_ASSERT_EQUAL_INT(0, barcode_buffer_init(&buffer, on_scan, &scans));
+
+    for (int i = 0; i < MAX_BARCODE_LENGTH + 1; i++) {
+        barcode_buffer_on_key(&buffer, timestamp_us++, XKB_KEY_x, "x", true);
+    }
+
+    TEST_ASSERT_EQUAL_INT(1, scans.n_scans);
+    TEST_ASSERT_EQUAL_UINT(MAX_BARCODE_LENGTH, strlen(scans.last));
+
+    barcode_buffer_flush(&buffer);
+    TEST_ASSERT_EQUAL_INT(2, scans.n_scans);
+    TEST_ASSERT_EQUAL_STRING("x", scans.last);
+
+    barcode_buffer_deinit(&buffer);
+}
+
+int main() {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_coalesce_keeps_last_move_of_each_pointer);
+    RUN_TEST(test_coalesce_doesnt_move_across_other_events);
+    RUN_TEST(test_coalesce_keeps_moves_with_different_buttons);
+    RUN_TEST(test_resample_interpolates_to_frame_time);
+    RUN_TEST(test_resample_limits_prediction);
+    RUN_TEST(test_resample_skips_close_samples);
+    RUN_TEST(test_barcode_scan_ends_with_enter);
+    RUN_TEST(test_barcode_scan_times_out);
+    RUN_TEST(test_barcode_pause_starts_new_scan);
+    RUN_TEST(test_long_barcode_scan_is_split);
+
+    UNITY_END();
+}
@@ -0,0 +1,156 @@
+#include <compositor_ng.h>
+#include <util/geometry.h>
+#include <window.h>
+#include <unity.h>
+
+void setUp() {
+}
+
+void tearDown() {
+}
+
+static struct fl_layer_props layer_props_for_rect(struct aa_rect rect) {
+    return (struct fl_layer_props){
+        .is_aa_rect = true,
+        .aa_rect = rect,
+        .quad = get_quad(rect),
+        .opacity = 1.0,
+        .rotation = 0.0,
+    };
+}
+
+static void expect_aa_rect(struct aa_rect expected, struct aa_rect actual) {
+    TEST_ASSERT_EQUAL_DOUBLE(expected.offset.x, actual.offset.x);
+    TEST_ASSERT_EQUAL_DOUBLE(expected.offset.y, actual.offset.y);
+    TEST_ASSERT_EQUAL_DOUBLE(expected.size.x, actual.size.x);
+    TEST_ASSERT_EQUAL_DOUBLE(expected.size.y, actual.size.y);
+}
+
+void test_render_size() {
+    struct vec2i size;
+
+    size = window_get_render_size(VEC2I(1920, 1080), 1.0);
+    TEST_ASSERT_EQUAL_INT(1920, size.x);
+    TEST_ASSERT_EQUAL_INT(1080, size.y);
+
+    size = window_get_render_size(VEC2I(1920, 1080), 0.5);
+    TEST_ASSERT_EQUAL_INT(960, size.x);
+    TEST_ASSERT_EQUAL_INT(540, size.y);
+
+    // 1366 * 0.75 = 1024.5, rounded.
+    size = window_get_render_size(VEC2I(1366, 768), 0.75);
+    TEST_ASSERT_EQUAL_INT(1025, size.x);
+    TEST_ASSERT_EQUAL_INT(576, size.y);
+
+    // Never renders at zero size.
+    size = window_get_render_size(VEC2I(2, 2), 0.1);
+    TEST_ASSERT_EQUAL_INT(1, size.x);
+    TEST_ASSERT_EQUAL_INT(1, size.y);
+}
+
+void test_fullscreen_layer_covers_display() {
+    struct fl_layer_props props, display_props;
+
+    // The source rectangle is the whole rendered buffer, the destination the whole display.
+    props = layer_props_for_rect(AA_RECT_FROM_COORDS(0, 0, 960, 540));
+    display_props = fl_layer_props_render_to_display(&props, VEC2F(960, 540), VEC2F(1920, 1080));
+    expect_aa_rect(AA_RECT_FROM_COORDS(0, 0, 1920, 1080), display_props.aa_rect);
+
+    // Also when the render size isn't an exact fraction of the display size.
+    props = layer_props_for_rect(AA_RECT_FROM_COORDS(0, 0, 1025, 576));
+    display_props = fl_layer_props_render_to_display(&props, VEC2F(1025, 576), VEC2F(1366, 768));
+    TEST_ASSERT_DOUBLE_WITHIN(0.001, 0.0, display_props.aa_rect.offset.x);
+    TEST_ASSERT_DOUBLE_WITHIN(0.001, 0.0, display_props.aa_rect.offset.y);
+    TEST_ASSERT_DOUBLE_WITHIN(0.001, 1366.0, display_props.aa_rect.size.x);
+    TEST_ASSERT_DOUBLE_WITHIN(0.001, 768.0, display_props.aa_rect.size.y);
+}
+
+void test_platform_view_rect_is_scaled() {
+    struct fl_layer_props props, display_props;
+
+    props = layer_props_for_rect(AA_RECT_FROM_COORDS(100, 50, 200, 100));
+    display_props = fl_layer_props_render_to_display(&props, VEC2F(960, 540), VEC2F(1920, 1080));
+
+    expect_aa_rect(AA_RECT_FROM_COORDS(200, 100, 400, 200), display_props.aa_rect);
+    TEST_ASSERT_EQUAL_DOUBLE(200, display_props.quad.top_left.x);
+    TEST_ASSERT_EQUAL_DOUBLE(100, display_props.quad.top_left.y);
+    TEST_ASSERT_EQUAL_DOUBLE(600, display_props.quad.bottom_right.x);
+    TEST_ASSERT_EQUAL_DOUBLE(300, display_props.quad.bottom_right.y);
+
+    // Everything else is kept.
+    TEST_ASSERT_TRUE(display_props.is_aa_rect);
+    TEST_ASSERT_EQUAL_DOUBLE(1.0, display_props.opacity);
+}
+
+void test_non_uniform_scale() {
+    struct fl_layer_props props, display_props;
+
+    props = layer_props_for_rect(AA_RECT_FROM_COORDS(10, 10, 20, 20));
+    display_props = fl_layer_props_render_to_display(&props, VEC2F(400, 300), VEC2F(800, 900));
+
+    expect_aa_rect(AA_RECT_FROM_COORDS(20, 30, 40, 60), display_props.aa_rect);
+}
+
+static void expect_point(struct vec2f expected, struct vec2f actual) {
+    TEST_ASSERT_DOUBLE_WITHIN(0.001, expected.x, actual.x);
+    TEST_ASSERT_DOUBLE_WITHIN(0.001, expected.y, actual.y);
+}
+
+void test_touch_is_scaled_to_view() {
+    struct mat3f display_to_view, view_to_display;
+
+    window_get_display_view_transforms(VEC2I(1920, 1080), 0.5, PLANE_TRANSFORM_ROTATE_0, &display_to_view, &view_to_display);
+
+    // Touch events are in display coordinates, flutter expects them in the coordinates of the rendered view.
+    expect_point(VEC2F(0, 0), transform_point(display_to_view, VEC2F(0, 0)));
+    expect_point(VEC2F(50, 25), transform_point(display_to_view, VEC2F(100, 50)));
+    expect_point(VEC2F(960, 540), transform_point(display_to_view, VEC2F(1920, 1080)));
+
+    expect_point(VEC2F(1920, 1080), transform_point(view_to_display, VEC2F(960, 540)));
+}
+
+void test_touch_is_scaled_and_rotated_to_view() {
+    struct mat3f display_to_view, view_to_display;
+
+    // Rendered at 960x540, the view is 540x960.
+    window_get_display_view_transforms(VEC2I(1920, 1080), 0.5, PLANE_TRANSFORM_ROTATE_90, &display_to_view, &view_to_display);
+
+    expect_point(VEC2F(0, 960), transform_point(display_to_view, VEC2F(0, 0)));
+    expect_point(VEC2F(0, 0), transform_point(display_to_view, VEC2F(1920, 0)));
+    expect_point(VEC2F(25, 910), transform_point(display_to_view, VEC2F(100, 50)));
+    expect_point(VEC2F(540, 960), transform_point(display_to_view, VEC2F(0, 1080)));
+
+    expect_point(VEC2F(100, 50), transform_point(view_to_display, VEC2F(25, 910)));
+}
+
+void test_view_to_display_is_inverse() {
+    static const drm_plane_transform_t rotations[] = {
+        PLANE_TRANSFORM_ROTATE_0,
+        PLANE_TRANSFORM_ROTATE_90,
+        PLANE_TRANSFORM_ROTATE_180,
+        PLANE_TRANSFORM_ROTATE_270,
+    };
+    struct mat3f display_to_view, view_to_display;
+
+    for (int i = 0; i < 4; i++) {
+        window_get_display_view_transforms(VEC2I(1366, 768), 0.75, rotations[i], &display_to_view, &view_to_display);
+
+        expect_point(VEC2F(0, 0), transform_point(view_to_display, transform_point(display_to_view, VEC2F(0, 0))));
+        expect_point(VEC2F(123, 456), transform_point(view_to_display, transform_point(display_to_view, VEC2F(123, 456))));
+        expect_point(VEC2F(1366, 768), transform_point(view_to_display, transform_point(display_to_view, VEC2F(1366, 768))));
+    }
+}
+
+int main() {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_render_size);
+    RUN_TEST(test_fullscreen_layer_covers_display);
+    RUN_TEST(test_platform_view_rect_is_scaled);
+    RUN_TEST(test_non_uniform_scale);
+    RUN_TEST(test_touch_is_scaled_to_view);
+    RUN_TEST(test_touch_is_scaled_and_rotated_to_view);
+    RUN_TEST(test_view_to_display_is_inverse);
+
+    UNITY_END();
+}